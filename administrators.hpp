@@ -0,0 +1,35 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_ADMINISTRATORS_HPP
+#define HX2A_ZAMBEZI_ADMINISTRATORS_HPP
+
+#include <unordered_set>
+
+#include "hx2a/components/user.hpp"
+
+using namespace hx2a;
+
+namespace zambezi::administrators {
+
+  // Users allowed to call the administrative services: the repairs, the passes run on demand, and the other
+  // services acting on all the tenants at once or costing much more than a request. There are none by default,
+  // these services are then refused to everybody.
+
+  inline std::unordered_set<doc_id>& users(){
+    static std::unordered_set<doc_id> u;
+    return u;
+  }
+
+  // To be called before the first request.
+  inline void configure(std::unordered_set<doc_id> ids){ users() = std::move(ids); }
+
+  inline bool contains(const user_p& u){
+    return u != nullptr && users().find(u->get_id()) != users().end();
+  }
+
+} // End namespace zambezi::administrators.
+
+#endif
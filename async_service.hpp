@@ -0,0 +1,110 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_ASYNC_SERVICE_HPP
+#define HX2A_ZAMBEZI_ASYNC_SERVICE_HPP
+
+#include <string>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <type_traits>
+
+#include "hx2a/basic_service.hpp"
+#include "hx2a/zambezi/coroutine.hpp"
+#include "hx2a/zambezi/partitions.hpp"
+
+using namespace hx2a;
+
+namespace zambezi::async {
+
+  // Database operations as awaitables. Each one runs in the pool with a connector of its own, and documents never
+  // leave the pool thread: only what the projection (or the mutation) returns does. A projection receives a null
+  // pointer when the document does not exist.
+
+  template <typename T, typename Projection>
+  task<std::invoke_result_t<Projection&, ptr<T>>> get(std::string database, doc_id id, Projection p){
+    co_return co_await offload([&]{
+      partitions::connector c(database);
+      return p(T::get(id));
+    });
+  }
+
+  // Several documents of the same type, in the same order as the identifiers. Identifiers are grouped by chunks, a
+  // chunk is read sequentially by one pool thread, and the chunks are read concurrently.
+  template <typename T, typename Projection>
+  task<std::vector<std::invoke_result_t<Projection&, ptr<T>>>> get_many(std::string database, std::vector<doc_id> ids, Projection p, size_t chunk = 16){
+    using value_type = std::invoke_result_t<Projection&, ptr<T>>;
+    std::vector<task<std::vector<value_type>>> chunks;
+    chunk = std::max<size_t>(chunk, 1);
+
+    for (size_t first = 0; first < ids.size(); first += chunk){
+      chunks.push_back([](const std::string& database, std::vector<doc_id> part, Projection& p) -> task<std::vector<value_type>> {
+	co_return co_await offload([&]{
+	  partitions::connector c(database);
+	  std::vector<value_type> r;
+	  r.reserve(part.size());
+
+	  for (const doc_id& id: part){
+	    r.push_back(p(T::get(id)));
+	  }
+
+	  return r;
+	});
+      }(database, std::vector<doc_id>(ids.cbegin() + first, ids.cbegin() + std::min(first + chunk, ids.size())), p));
+    }
+
+    std::vector<value_type> r;
+    r.reserve(ids.size());
+
+    for (std::vector<value_type>& part: co_await when_all(std::move(chunks))){
+      std::move(part.begin(), part.end(), std::back_inserter(r));
+    }
+
+    co_return r;
+  }
+
+  // Loads a document and changes it. The change is saved when the connector is released, before the awaiting
+  // coroutine is resumed.
+  template <typename T, typename Mutation>
+  task<std::invoke_result_t<Mutation&, ptr<T>>> update(std::string database, doc_id id, Mutation m){
+    co_return co_await offload([&]{
+      partitions::connector c(database);
+      return m(T::get(id));
+    });
+  }
+
+  // Service whose handler is a coroutine.
+  //
+  // The handler awaits the operations above, and overlaps the independent ones with when_all, instead of keeping
+  // its thread blocked on each database round trip in turn.
+  //
+  // This is not asynchronous execution of the services. The Web server's dispatch is synchronous and offers no
+  // event loop to return to, so the request thread still waits for the whole handler, driving its coroutines (see
+  // sync_wait), and the number of requests served concurrently is still the number of request threads. What is
+  // gained is the latency of the requests doing independent round trips, and a bounded number of threads doing
+  // database work for all the requests. Serving many requests with a few threads needs an asynchronous dispatch
+  // from the server first.
+  //
+  // The same handlers run the operations one after the other on the request thread when the pool size is 0 (see
+  // pool::set_size), which is the synchronous path. The cart scenario of tools/replay.cpp, run against a server
+  // configured each way, compares the two.
+  template <tag_t Name, typename Query>
+  class async_service: public basic_service<Name, Query>
+  {
+  protected:
+
+    virtual task<reply_p> co_call(http_request& req, const session_info* si, const organization_p& o, const user_p& u, const rfr<Query>& q) = 0;
+
+  private:
+
+    reply_p call(http_request& req, const session_info* si, const organization_p& o, const user_p& u, const rfr<Query>& q) final override {
+      return sync_wait(co_call(req, si, o, u, q));
+    }
+  };
+
+} // End namespace zambezi::async.
+
+#endif
@@ -7,22 +7,200 @@
 #define HX2A_CART_HPP
 
 #include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <iterator>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <string_view>
+#include <span>
+#include <vector>
+#include <limits>
+#include <optional>
+#include <concepts>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "hx2a/link.hpp"
 #include "hx2a/slot.hpp"
 #include "hx2a/own.hpp"
 #include "hx2a/own_list.hpp"
 
+#include "hx2a/zambezi/fixed_money.hpp"
+
 namespace hx2a::zambezi {
 
+  // Merge mode.
+  //
+  // Carts can be edited concurrently from several replicas (e.g. the phone and the desktop of a shopper), and the
+  // versions merged on the server without conflict, whatever the order of the merges.
+  //
+  // The count of a line is a PN-counter: each replica records its own increments and decrements, the count is the
+  // sum of the increments minus the sum of the decrements, and joining two versions of a line takes the maximum of
+  // each for every replica. A line whose count goes down to 0 leaves a tombstone with its counters, so that merging
+  // a version which has not seen the removal does not bring it back, while increments made concurrently on another
+  // replica still do.
+  //
+  // Folders form an add-wins set. Each addition of a folder is tagged by a unique dot, and a removal records the
+  // dots it observed. A folder disappears from a merge only if all its dots were observed removed, so a concurrent
+  // addition wins over a removal. Folders added outside of merge mode get a dot of the anonymous replica.
+  //
+  // Lines created outside of merge mode have no counters. The count of such a line is taken as the increments of
+  // the anonymous replica (the empty string). Folders of carts saved before the folders got dots have none, and
+  // are never removed by a merge.
+
+  namespace detail {
+
+    // Sets of tokens are stored as space-separated strings, they are expected to stay small.
+
+    template <typename F>
+    void for_each_token(std::string_view set, F&& f){
+      size_t b = 0;
+
+      while (b < set.size()){
+	size_t e = set.find(' ', b);
+
+	if (e == std::string_view::npos){
+	  e = set.size();
+	}
+
+	if (e != b){
+	  f(set.substr(b, e - b));
+	}
+
+	b = e + 1;
+      }
+    }
+
+    // Sets of dots grow with the edits, lookups in the larger set are hashed.
+    inline std::unordered_set<std::string_view> token_index(std::string_view set){
+      std::unordered_set<std::string_view> r;
+      for_each_token(set, [&r](std::string_view t){ r.insert(t); });
+      return r;
+    }
+
+    inline std::string add_tokens(std::string set, std::string_view tokens){
+      std::string added;
+
+      {
+	std::unordered_set<std::string_view> index = token_index(set);
+
+	for_each_token(tokens, [&](std::string_view t){
+	  if (index.insert(t).second){
+	    added += ' ';
+	    added += t;
+	  }
+	});
+      }
+
+      if (added.empty()){
+	return set;
+      }
+
+      return set.empty() ? added.substr(1) : set + added;
+    }
+
+    // True if there is at least one token, and all are in the set.
+    inline bool all_tokens_in(std::string_view tokens, std::string_view set){
+      if (tokens.find_first_not_of(' ') == std::string_view::npos){
+	return false;
+      }
+
+      std::unordered_set<std::string_view> index = token_index(set);
+      bool all = true;
+      for_each_token(tokens, [&](std::string_view t){ all = all && index.count(t); });
+      return all;
+    }
+
+    // Unique tag of an addition made on a replica. The sequence tells apart the additions made at the same time.
+    inline std::string make_dot(std::string_view replica){
+      static std::atomic<uint64_t> sequence{0};
+      std::string dot(replica);
+      std::replace(dot.begin(), dot.end(), ' ', '_');
+      dot += '@';
+      dot += std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+      dot += '.';
+      dot += std::to_string(sequence.fetch_add(1, std::memory_order_relaxed));
+      return dot;
+    }
+
+  } // End namespace detail.
+
+  constexpr tag_t DefaultReplicaCounterTypeTag = {"zambezi:rcounter"};
+
+  // Increments and decrements of a line count made on one replica.
+  template <tag_t Tag = DefaultReplicaCounterTypeTag>
+  class replica_counter: public element<>
+  {
+    HX2A_ELEMENT(replica_counter, Tag, element);
+
+  public:
+
+    replica_counter(reserved_t):
+      hx2a_base(reserved),
+      _replica(*this),
+      _increments(*this, 0),
+      _decrements(*this, 0)
+    {
+    }
+
+    replica_counter(std::string_view replica, uint64_t increments, uint64_t decrements):
+      hx2a_base(standard),
+      _replica(*this, replica),
+      _increments(*this, increments),
+      _decrements(*this, decrements)
+    {
+    }
+
+    const string& get_replica() const { return _replica; }
+    uint64_t get_increments() const { return _increments; }
+    uint64_t get_decrements() const { return _decrements; }
+
+    void add(int64_t delta){
+      if (delta > 0){
+	_increments = _increments + delta;
+      }
+      else{
+	_decrements = _decrements - delta;
+      }
+    }
+
+    void join(uint64_t increments, uint64_t decrements){
+      if (increments > _increments){
+	_increments = increments;
+      }
+
+      if (decrements > _decrements){
+	_decrements = decrements;
+      }
+    }
+
+  private:
+
+    slot<string, "r"> _replica;
+    slot<uint64_t, "p"> _increments;
+    slot<uint64_t, "n"> _decrements;
+  };
+
+  struct counter_state
+  {
+    std::string replica;
+    uint64_t increments;
+    uint64_t decrements;
+  };
+
   constexpr tag_t DefaultItemTag = {"i"};
   constexpr tag_t DefaultCountTag = {"c"};
+  constexpr tag_t DefaultCountersTag = {"k"};
   
   template <
     typename Item, // Item type to put in the cart.
     tag_t Tag, // Type tag for the cart line type.
     tag_t ItemTag = DefaultItemTag, // Tag for the item link.
-    tag_t CountTag = DefaultCountTag // Tag for the count.
+    tag_t CountTag = DefaultCountTag, // Tag for the count.
+    tag_t CounterTypeTag = DefaultReplicaCounterTypeTag, // Type tag for the replica counters (merge mode).
+    tag_t CountersTag = DefaultCountersTag // Tag for the replica counters (merge mode).
     >
   class cart_line: public element<>
   {
@@ -30,20 +208,26 @@ namespace hx2a::zambezi {
 
   public:
 
+    using item_type = Item;
     using ItemP = ptr<Item>;
     using ItemR = rfr<Item>;
+
+    using counter = replica_counter<CounterTypeTag>;
+    using counter_p = ptr<counter>;
     
     cart_line(reserved_t):
       hx2a_base(reserved),
       _item(*this),
-      _count(*this, 0)
+      _count(*this, 0),
+      _counters(*this)
     {
     }
 
     cart_line(const ItemR& item, uint32_t count = 1):
       hx2a_base(standard),
       _item(*this, &item),
-      _count(*this, count)
+      _count(*this, count),
+      _counters(*this)
     {
       if (!count){
 	throw count_is_null();
@@ -60,8 +244,17 @@ namespace hx2a::zambezi {
       return _count;
     }
 
+    // Outside of merge mode the changes are attributed to the anonymous replica, so that the counters, if any,
+    // stay consistent with the count.
+
     void increment_count() {
       HX2A_ASSERT(_count);
+
+      if (_counters.size()){
+	add_count({}, 1);
+	return;
+      }
+
       _count = _count + 1;
     }
 
@@ -72,6 +265,11 @@ namespace hx2a::zambezi {
 	throw count_is_null();
       }
 
+      if (_counters.size()){
+	add_count({}, -1);
+	return;
+      }
+
       _count = _count - 1;
     }
 
@@ -82,15 +280,566 @@ namespace hx2a::zambezi {
 	throw count_is_null();
       }
 
+      if (_counters.size()){
+	add_count({}, static_cast<int64_t>(count) - _count.get());
+	return;
+      }
+
       _count = count;
     }
+
+    // Merge mode.
+
+    // Changes the count on behalf of a replica. Returns the new count. The count does not go below 0, when it reaches
+    // it the caller removes the line.
+    uint32_t add_count(std::string_view replica, int64_t delta){
+      seed();
+      auto e = _counters.cend();
+      auto fi = std::find_if(_counters.cbegin(), e, [&](const counter_p& c){ return c->get_replica() == replica; });
+
+      if (fi == e){
+	_counters.push_front(make_rfr<counter>(replica, 0, 0));
+	fi = _counters.cbegin();
+      }
+
+      (*fi)->add(delta);
+      return recount();
+    }
+
+    // True once the line was edited in merge mode.
+    bool has_counters() const { return _counters.size(); }
+
+    std::vector<counter_state> get_counters() const {
+      std::vector<counter_state> r;
+
+      if (!_counters.size()){
+	r.push_back(counter_state{{}, _count.get(), 0});
+	return r;
+      }
+
+      std::for_each(_counters.cbegin(), _counters.cend(), [&r](const counter_p& c){
+	r.push_back(counter_state{c->get_replica(), c->get_increments(), c->get_decrements()});
+      });
+
+      return r;
+    }
+
+    // Takes into account the changes made on another version of the same line. Returns the new count.
+    uint32_t join(const std::vector<counter_state>& counters){
+      seed();
+
+      for (const counter_state& cs: counters){
+	auto e = _counters.cend();
+	auto fi = std::find_if(_counters.cbegin(), e, [&](const counter_p& c){ return c->get_replica() == cs.replica; });
+
+	if (fi == e){
+	  _counters.push_front(make_rfr<counter>(cs.replica, cs.increments, cs.decrements));
+	}
+	else{
+	  (*fi)->join(cs.increments, cs.decrements);
+	}
+      }
+
+      return recount();
+    }
+
+    // Only on a line just created, with the count the counters give.
+    void assign_counters(const std::vector<counter_state>& counters){
+      HX2A_ASSERT(!_counters.size());
+
+      for (const counter_state& cs: counters){
+	_counters.push_front(make_rfr<counter>(cs.replica, cs.increments, cs.decrements));
+      }
+
+      recount();
+    }
       
   private:
 
+    // The count of a line never edited in merge mode goes to the anonymous replica.
+    void seed(){
+      if (!_counters.size() && _count.get()){
+	_counters.push_front(make_rfr<counter>(std::string_view(), _count.get(), 0));
+      }
+    }
+
+    uint32_t recount(){
+      int64_t total = 0;
+      std::for_each(_counters.cbegin(), _counters.cend(), [&total](const counter_p& c){ total += c->get_increments() - c->get_decrements(); });
+      uint32_t count = static_cast<uint32_t>(std::clamp<int64_t>(total, 0, std::numeric_limits<uint32_t>::max()));
+      _count = count;
+      return count;
+    }
+
     link<Item, ItemTag> _item;
     slot<uint32_t, CountTag> _count;
+    // Empty unless the line was edited in merge mode.
+    own_list<counter, CountersTag> _counters;
+  };
+
+  // How gen_cart::merge_from sets the count of an item present in both carts.
+  enum class merge_policy
+  {
+    sum, // The two counts are added.
+    max, // The larger count is kept.
+    keep // The count of the cart merged into is kept.
+  };
+
+  // A line of a cart to be priced, see gen_cart::cart_total.
+  struct line_to_price
+  {
+    // Empty at top level.
+    std::string folder;
+    doc_id item;
+    uint32_t count;
   };
 
+  // Amounts of a cart, see gen_cart::cart_total.
+  struct cart_totals
+  {
+    // Whole cart.
+    ::zambezi::fixed_money total;
+    // Lines at top level.
+    ::zambezi::fixed_money top_level;
+    // Per folder, in the order of the folders.
+    std::vector<std::pair<std::string, ::zambezi::fixed_money>> folders;
+    // Lines without price, left out of the amounts.
+    size_t unpriced = 0;
+  };
+
+  namespace detail {
+
+    // Cold representation of carts (see gen_cart::to_cold): one record per line feed, fields separated by tabs,
+    // with backslash escapes in the fields. The first field tells the record: "L" a line (item, then replica,
+    // increments and decrements of every counter), "S" the snapshot of the line before, "F" a folder (name, dots,
+    // tombstones) whose lines follow, "R" the dots of the removed folders, "T" the tombstones of the lines at top
+    // level, "D" the ones of the removed folders.
+
+    // Snapshots with a cold form: a string, and a static from_cold making a snapshot from it.
+    template <typename Snapshot>
+    concept cold_snapshot = requires (const Snapshot& s, std::string_view cold){
+      { s.to_cold() } -> std::convertible_to<std::string>;
+      { Snapshot::from_cold(cold) } -> std::convertible_to<ptr<Snapshot>>;
+    };
+
+    inline void append_field(std::string& out, std::string_view field){
+      out += '\t';
+
+      for (char c: field){
+	switch (c){
+	case '\\': out += "\\\\"; break;
+	case '\t': out += "\\t"; break;
+	case '\n': out += "\\n"; break;
+	default: out += c;
+	}
+      }
+    }
+
+    inline std::vector<std::string> split_fields(std::string_view record){
+      std::vector<std::string> r(1);
+
+      for (size_t i = 0; i != record.size(); ++i){
+	char c = record[i];
+
+	if (c == '\t'){
+	  r.emplace_back();
+	}
+	else if (c == '\\' && i + 1 != record.size()){
+	  c = record[++i];
+	  r.back() += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+	}
+	else{
+	  r.back() += c;
+	}
+      }
+
+      return r;
+    }
+
+    inline void append_cold_record(std::string& out, std::string_view item, const std::vector<counter_state>& counters){
+      out += 'L';
+      append_field(out, item);
+
+      for (const counter_state& cs: counters){
+	append_field(out, cs.replica);
+	append_field(out, std::to_string(cs.increments));
+	append_field(out, std::to_string(cs.decrements));
+      }
+
+      out += '\n';
+    }
+
+    template <typename Line>
+    void append_cold_line(std::string& out, const ptr<Line>& l, bool snapshots){
+      append_cold_record(out, l->item()->get_id().to_string(), l->get_counters());
+
+      if constexpr (requires { l->get_cold_snapshot(); }){
+	if (!snapshots){
+	  return;
+	}
+
+	if (std::optional<std::string> snapshot = l->get_cold_snapshot()){
+	  out += 'S';
+	  append_field(out, *snapshot);
+	  out += '\n';
+	}
+      }
+    }
+
+    struct cold_line
+    {
+      std::string item;
+      std::vector<counter_state> counters;
+      // Cold form of the snapshot of the line, if any.
+      std::optional<std::string> snapshot;
+    };
+
+    inline bool parse_cold_line(const std::vector<std::string>& fields, cold_line& l){
+      if (fields.size() < 2 || (fields.size() - 2) % 3){
+	return false;
+      }
+
+      l.item = fields[1];
+
+      for (size_t i = 2; i != fields.size(); i += 3){
+	counter_state cs{fields[i], 0, 0};
+	const std::string& p = fields[i + 1];
+	const std::string& n = fields[i + 2];
+
+	if (std::from_chars(p.data(), p.data() + p.size(), cs.increments).ec != std::errc() ||
+	    std::from_chars(n.data(), n.data() + n.size(), cs.decrements).ec != std::errc()){
+	  return false;
+	}
+
+	l.counters.push_back(std::move(cs));
+      }
+
+      return true;
+    }
+
+    inline int64_t net_count(const std::vector<counter_state>& counters){
+      int64_t total = 0;
+
+      for (const counter_state& cs: counters){
+	total += static_cast<int64_t>(cs.increments - cs.decrements);
+      }
+
+      return total;
+    }
+
+    inline uint32_t clamp_count(int64_t total){
+      return static_cast<uint32_t>(std::clamp<int64_t>(total, 0, std::numeric_limits<uint32_t>::max()));
+    }
+
+    // In the order of the representation, the lines being pushed to the front.
+    template <typename Line, typename Lines, typename Resolve>
+    void restore_lines(Lines& lines, const std::vector<cold_line>& cold, Resolve& resolve){
+      for (auto c = cold.crbegin(); c != cold.crend(); ++c){
+	int64_t total = net_count(c->counters);
+	auto item = resolve(doc_id(c->item));
+
+	if (item == nullptr || total <= 0){
+	  continue;
+	}
+
+	rfr<Line> l = [&]{
+	  if constexpr (requires { requires Line::cold_snapshots; }){
+	    if (c->snapshot){
+	      return make_rfr<Line>(*item, clamp_count(total), std::string_view(*c->snapshot));
+	    }
+	  }
+
+	  return make_rfr<Line>(*item, clamp_count(total));
+	}();
+
+	// A line never edited in merge mode only has the anonymous replica, and stays without counters.
+	if (c->counters.size() != 1 || !c->counters.front().replica.empty() || c->counters.front().decrements){
+	  l->assign_counters(c->counters);
+	}
+
+	lines.push_front(l);
+      }
+    }
+
+    // Tombstones (merge mode): the counters of the lines whose count went down to 0, kept in the format of the cold
+    // representation, so that a version which has not seen the removal does not bring the line back with its old
+    // counts. A line added again starts from the counters of its tombstone. Like the dots of the removed folders,
+    // they are kept as long as the cart.
+
+    inline std::vector<cold_line> parse_tombstones(std::string_view text){
+      std::vector<cold_line> r;
+
+      for (size_t begin = 0; begin < text.size();){
+	size_t end = std::min(text.find('\n', begin), text.size());
+	cold_line l;
+
+	if (parse_cold_line(split_fields(text.substr(begin, end - begin)), l)){
+	  r.push_back(std::move(l));
+	}
+
+	begin = end + 1;
+      }
+
+      return r;
+    }
+
+    inline std::string format_tombstones(const std::vector<cold_line>& tombstones){
+      std::string r;
+
+      for (const cold_line& t: tombstones){
+	append_cold_record(r, t.item, t.counters);
+      }
+
+      return r;
+    }
+
+    inline void add_to_counters(std::vector<counter_state>& counters, std::string_view replica, int64_t delta){
+      auto i = std::find_if(counters.begin(), counters.end(), [&](const counter_state& cs){ return cs.replica == replica; });
+
+      if (i == counters.end()){
+	counters.push_back(counter_state{std::string(replica), 0, 0});
+	i = counters.end() - 1;
+      }
+
+      if (delta > 0){
+	i->increments += delta;
+      }
+      else{
+	i->decrements -= delta;
+      }
+    }
+
+    inline void join_counters(std::vector<counter_state>& ours, const std::vector<counter_state>& theirs){
+      for (const counter_state& t: theirs){
+	auto i = std::find_if(ours.begin(), ours.end(), [&](const counter_state& cs){ return cs.replica == t.replica; });
+
+	if (i == ours.end()){
+	  ours.push_back(t);
+	}
+	else{
+	  i->increments = std::max(i->increments, t.increments);
+	  i->decrements = std::max(i->decrements, t.decrements);
+	}
+      }
+    }
+
+    // Takes the tombstone of the item out, and returns its counters, empty if there is none.
+    inline std::vector<counter_state> exhume(std::vector<cold_line>& tombstones, std::string_view item){
+      auto i = std::find_if(tombstones.begin(), tombstones.end(), [&](const cold_line& t){ return t.item == item; });
+
+      if (i == tombstones.end()){
+	return {};
+      }
+
+      std::vector<counter_state> r = std::move(i->counters);
+      tombstones.erase(i);
+      return r;
+    }
+
+    inline void bury(std::vector<cold_line>& tombstones, std::string_view item, const std::vector<counter_state>& counters){
+      auto i = std::find_if(tombstones.begin(), tombstones.end(), [&](const cold_line& t){ return t.item == item; });
+
+      if (i == tombstones.end()){
+	tombstones.push_back(cold_line{std::string(item), counters});
+      }
+      else{
+	join_counters(i->counters, counters);
+      }
+    }
+
+    // Tombstones of the lines of removed folders, per folder name: an "F" record (name) followed by the "L" records
+    // of its lines. A folder added again with the same name starts from them, so that the counters of the replicas
+    // never go back.
+    using folder_tombstones = std::vector<std::pair<std::string, std::vector<cold_line>>>;
+
+    inline folder_tombstones parse_folder_tombstones(std::string_view text){
+      folder_tombstones r;
+
+      for (size_t begin = 0; begin < text.size();){
+	size_t end = std::min(text.find('\n', begin), text.size());
+	std::vector<std::string> fields = split_fields(text.substr(begin, end - begin));
+	cold_line l;
+
+	if (fields[0] == "F" && fields.size() == 2){
+	  r.emplace_back(std::move(fields[1]), std::vector<cold_line>());
+	}
+	else if (!r.empty() && parse_cold_line(fields, l)){
+	  r.back().second.push_back(std::move(l));
+	}
+
+	begin = end + 1;
+      }
+
+      return r;
+    }
+
+    inline std::string format_folder_tombstones(const folder_tombstones& folders){
+      std::string r;
+
+      for (const auto& [name, tombstones]: folders){
+	r += 'F';
+	append_field(r, name);
+	r += '\n';
+	r += format_tombstones(tombstones);
+      }
+
+      return r;
+    }
+
+    // A line created from counters, or their tombstone when they do not count any item.
+    template <typename Line, typename Lines, typename ItemR>
+    void revive(Lines& lines, std::vector<cold_line>& tombstones, const ItemR& item, const std::vector<counter_state>& counters){
+      int64_t total = net_count(counters);
+
+      if (total <= 0){
+	bury(tombstones, item->get_id().to_string(), counters);
+	return;
+      }
+
+      rfr<Line> l = make_rfr<Line>(item, clamp_count(total));
+      l->assign_counters(counters);
+      lines.push_front(l);
+    }
+
+    // Lines with counters removed outside of merge mode leave a tombstone as well, the removal being attributed to
+    // the anonymous replica. Lines never edited in merge mode do not.
+    template <typename Line, typename Removed>
+    void bury_line(Removed& removed, const ptr<Line>& l){
+      if (!l->has_counters()){
+	return;
+      }
+
+      std::vector<counter_state> counters = l->get_counters();
+      add_to_counters(counters, {}, -static_cast<int64_t>(l->count()));
+      std::vector<cold_line> tombstones = parse_tombstones(removed.get());
+      bury(tombstones, l->item()->get_id().to_string(), counters);
+      removed = format_tombstones(tombstones);
+    }
+
+    // Merge mode operations on a list of lines and its tombstones, shared by the cart and its folders.
+
+    template <typename Line, typename Lines, typename Removed, typename ItemR>
+    void add_count(Lines& lines, Removed& removed, std::string_view replica, const ItemR& item, int64_t delta){
+      auto e = lines.cend();
+      auto fi = std::find_if(lines.cbegin(), e, [&](const ptr<Line>& l){ return l->item() == item; });
+
+      if (fi != e){
+	if (!(*fi)->add_count(replica, delta)){
+	  std::vector<cold_line> tombstones = parse_tombstones(removed.get());
+	  bury(tombstones, item->get_id().to_string(), (*fi)->get_counters());
+	  removed = format_tombstones(tombstones);
+	  lines.erase(fi);
+	}
+
+	return;
+      }
+
+      std::vector<cold_line> tombstones = parse_tombstones(removed.get());
+      std::vector<counter_state> counters = exhume(tombstones, item->get_id().to_string());
+
+      // Nothing to remove, and nothing to remember.
+      if (counters.empty() && delta <= 0){
+	return;
+      }
+
+      add_to_counters(counters, replica, delta);
+      revive<Line>(lines, tombstones, item, counters);
+      removed = format_tombstones(tombstones);
+    }
+
+    // Tombstones of another version, lines removed there. When the counters of both versions together count items
+    // again, the line comes back, if its item still exists.
+    template <typename Line, typename Lines>
+    void join_tombstones(Lines& ours, std::vector<cold_line>& tombstones, const std::vector<cold_line>& theirs){
+      for (const cold_line& t: theirs){
+	auto e = ours.cend();
+	auto fi = std::find_if(ours.cbegin(), e, [&](const ptr<Line>& l){ return l->item()->get_id().to_string() == t.item; });
+
+	if (fi == e){
+	  std::vector<counter_state> counters = exhume(tombstones, t.item);
+	  join_counters(counters, t.counters);
+	  typename Line::ItemP item;
+
+	  if (net_count(counters) > 0){
+	    item = Line::item_type::get(doc_id(t.item));
+	  }
+
+	  if (item == nullptr){
+	    bury(tombstones, t.item, counters);
+	  }
+	  else{
+	    revive<Line>(ours, tombstones, *item, counters);
+	  }
+	}
+	else if (!(*fi)->join(t.counters)){
+	  bury(tombstones, t.item, (*fi)->get_counters());
+	  ours.erase(fi);
+	}
+      }
+    }
+
+    template <typename Line, typename Lines, typename Removed>
+    void join_lines(Lines& ours, Removed& our_removed, const Lines& theirs, std::string_view their_removed){
+      std::vector<cold_line> tombstones = parse_tombstones(our_removed.get());
+
+      std::for_each(theirs.cbegin(), theirs.cend(), [&](const ptr<Line>& t){
+	auto e = ours.cend();
+	auto fi = std::find_if(ours.cbegin(), e, [&](const ptr<Line>& l){ return l->item() == t->item(); });
+
+	if (fi == e){
+	  std::vector<counter_state> counters = exhume(tombstones, t->item()->get_id().to_string());
+	  join_counters(counters, t->get_counters());
+	  revive<Line>(ours, tombstones, t->item(), counters);
+	}
+	else if (!(*fi)->join(t->get_counters())){
+	  bury(tombstones, t->item()->get_id().to_string(), (*fi)->get_counters());
+	  ours.erase(fi);
+	}
+      });
+
+      join_tombstones<Line>(ours, tombstones, parse_tombstones(their_removed));
+      our_removed = format_tombstones(tombstones);
+    }
+
+    // Hash join on the item identifiers: linear in the sizes of both lists, instead of a lookup in ours for every
+    // line of theirs.
+    template <typename Line, typename Lines>
+    void merge_lines_from(Lines& ours, const Lines& theirs, merge_policy policy){
+      if (!theirs.size()){
+	return;
+      }
+
+      std::unordered_map<doc_id, ptr<Line>> index;
+      index.reserve(ours.size());
+      std::for_each(ours.cbegin(), ours.cend(), [&index](const ptr<Line>& l){ index.emplace(l->item()->get_id(), l); });
+
+      std::for_each(theirs.cbegin(), theirs.cend(), [&](const ptr<Line>& t){
+	auto i = index.find(t->item()->get_id());
+
+	if (i == index.end()){
+	  ours.push_front(make_rfr<Line>(t->item(), t->count()));
+	  return;
+	}
+
+	const ptr<Line>& l = i->second;
+
+	switch (policy){
+	case merge_policy::sum:
+	  l->update_count(static_cast<uint32_t>(std::min<uint64_t>(static_cast<uint64_t>(l->count()) + t->count(), std::numeric_limits<uint32_t>::max())));
+	  break;
+	case merge_policy::max:
+	  if (t->count() > l->count()){
+	    l->update_count(t->count());
+	  }
+	  break;
+	case merge_policy::keep:
+	  break;
+	}
+      });
+    }
+
+  } // End namespace detail.
+
   constexpr tag_t DefaultSnapshotTag = {"s"};
   
   template <
@@ -123,13 +872,36 @@ namespace hx2a::zambezi {
     {
     }
 
+    // Whether the snapshots are kept in the cold representation of the cart (see gen_cart::to_cold).
+    static constexpr bool cold_snapshots = detail::cold_snapshot<Snapshot>;
+
     cart_line_with_snapshot(const ItemR& item, uint32_t count = 1):
       hx2a_base(item, count),
       _snapshot(*this, TakeSnapshot(item))
     {
     }
 
+    // Restored from the cold representation, with the snapshot taken before the compaction.
+    cart_line_with_snapshot(const ItemR& item, uint32_t count, std::string_view cold) requires cold_snapshots:
+      hx2a_base(item, count),
+      _snapshot(*this, Snapshot::from_cold(cold))
+    {
+    }
+
     SnapshotP get_snapshot() const { return _snapshot; }
+
+    // Empty without snapshot, or when the snapshots have no cold form.
+    std::optional<std::string> get_cold_snapshot() const {
+      if constexpr (cold_snapshots){
+	SnapshotP s = _snapshot;
+
+	if (s != nullptr){
+	  return s->to_cold();
+	}
+      }
+
+      return {};
+    }
       
   private:
 
@@ -137,10 +909,113 @@ namespace hx2a::zambezi {
   };
 
   constexpr tag_t DefaultCartLinesTag = {"n"};
+
+  // Container policies for the lines of carts and folders.
+  //
+  // A policy exposes a container template taking the line type and the lines tag. The container must own its
+  // elements and persist them, and offer what own_list offers to the cart: push_front, erase of a const iterator,
+  // size, and the forward and reverse iterators, const or not. The iterator typedefs of the cart and of the folder
+  // are taken from it, so code using them is unaffected by the policy.
+  struct list_lines
+  {
+    template <typename Line, tag_t Tag>
+    using container = own_list<Line, Tag>;
+  };
+
+  // Lines owned and persisted by an own_list, and walked through a vector of their handles, for carts mostly
+  // read (rendering, totals, availability): iterations and lookups scan contiguous handles instead of hopping
+  // from node to node. The handles are kept in the reverse order of the list, so that adding a line in front, the
+  // cart's only insertion, appends. They are rebuilt from the list when both sizes differ, which is the case after
+  // the framework loaded the lines, or removed some following the removal of their items.
+  //
+  // Invariant: the list is only changed through the wrapper, except by the framework, which loads it whole or
+  // removes lines, and in both cases changes its size. Code changing the list otherwise, replacing a line with
+  // another one for instance, leaves stale handles, and must not be written. Erasing walks the list from its
+  // nearer end, the own_list having no random access, so it stays linear.
+  template <typename Line, tag_t Tag>
+  class flat_lines
+  {
+    using handles = std::vector<ptr<Line>>;
+
+  public:
+
+    using iterator = typename handles::reverse_iterator;
+    using const_iterator = typename handles::const_reverse_iterator;
+    using reverse_iterator = typename handles::iterator;
+    using const_reverse_iterator = typename handles::const_iterator;
+
+    template <typename Owner>
+    explicit flat_lines(Owner& owner):
+      _list(owner)
+    {
+    }
+
+    void push_front(const rfr<Line>& l){
+      sync();
+      _list.push_front(l);
+      _handles.push_back(l);
+    }
+
+    void erase(const_iterator i){
+      // Position in the list.
+      auto position = i - cbegin();
+      auto n = static_cast<decltype(position)>(_list.size());
+
+      if (position < n / 2){
+	auto li = _list.cbegin();
+	std::advance(li, position);
+	_list.erase(li);
+      }
+      else{
+	auto li = _list.crbegin();
+	std::advance(li, n - 1 - position);
+	_list.erase(std::next(li).base());
+      }
+
+      _handles.erase(std::next(i).base());
+    }
+
+    size_t size() const { return _list.size(); }
+
+    iterator begin(){ return sync().rbegin(); }
+    iterator end(){ return sync().rend(); }
+    const_iterator begin() const { return sync().crbegin(); }
+    const_iterator end() const { return sync().crend(); }
+    const_iterator cbegin() const { return sync().crbegin(); }
+    const_iterator cend() const { return sync().crend(); }
+
+    reverse_iterator rbegin(){ return sync().begin(); }
+    reverse_iterator rend(){ return sync().end(); }
+    const_reverse_iterator crbegin() const { return sync().cbegin(); }
+    const_reverse_iterator crend() const { return sync().cend(); }
+
+  private:
+
+    handles& sync() const {
+      if (_handles.size() != _list.size()){
+	_handles.assign(_list.crbegin(), _list.crend());
+      }
+
+      return _handles;
+    }
+
+    own_list<Line, Tag> _list;
+    mutable handles _handles;
+  };
+
+  struct vector_lines
+  {
+    template <typename Line, tag_t Tag>
+    using container = flat_lines<Line, Tag>;
+  };
   
   constexpr tag_t DefaultFolderNameTag = {"l"};
+
+  constexpr tag_t DefaultFolderDotsTag = {"d"};
+
+  constexpr tag_t DefaultRemovedLinesTag = {"y"};
   
-  template <typename Item, tag_t Tag, typename CartLine, tag_t NameTag = DefaultFolderNameTag, tag_t LinesTag = DefaultCartLinesTag>
+  template <typename Item, tag_t Tag, typename CartLine, tag_t NameTag = DefaultFolderNameTag, tag_t LinesTag = DefaultCartLinesTag, tag_t DotsTag = DefaultFolderDotsTag, typename LinesPolicy = list_lines>
   class folder: public element<>
   {
     HX2A_ELEMENT(folder, Tag, element);
@@ -154,7 +1029,7 @@ namespace hx2a::zambezi {
     using line_p = ptr<line>;
     using line_r = rfr<line>;
 
-    using lines = own_list<line, LinesTag>;
+    using lines = typename LinesPolicy::template container<line, LinesTag>;
     using lines_iterator = typename lines::iterator;
     using lines_const_iterator = typename lines::const_iterator;
     using lines_reverse_iterator = typename lines::reverse_iterator;
@@ -163,18 +1038,70 @@ namespace hx2a::zambezi {
     folder(reserved_t):
       hx2a_base(reserved),
       _name(*this),
-      _lines(*this)
+      _lines(*this),
+      _dots(*this),
+      _removed_lines(*this)
     {
     }
 
-    folder(std::string_view name):
+    folder(std::string_view name, std::string_view dots, std::string_view removed_lines = {}):
       hx2a_base(standard),
       _name(*this, name),
-      _lines(*this)
+      _lines(*this),
+      _dots(*this, dots),
+      _removed_lines(*this, removed_lines)
     {
     }
 
     const string& get_name() const { return _name; }
+
+    // Merge mode, the dots of the additions of the folder.
+    const string& get_dots() const { return _dots; }
+
+    // Merge mode, the tombstones of the lines of the folder.
+    const string& get_removed_lines() const { return _removed_lines; }
+
+    // Merge mode.
+    void add_item(std::string_view replica, const ItemR& item, int64_t delta = 1){
+      detail::add_count<line>(_lines, _removed_lines, replica, item, delta);
+    }
+
+    // Merge mode.
+    void add_dots(std::string_view dots){
+      _dots = detail::add_tokens(_dots, dots);
+    }
+
+    // See gen_cart::merge_from.
+    void merge_from(const ptr<folder>& other, merge_policy policy){
+      detail::merge_lines_from<line>(_lines, other->_lines, policy);
+    }
+
+    // Merge mode, takes into account the changes made on another version of the same folder.
+    void join(const ptr<folder>& other){
+      add_dots(other->_dots.get());
+      detail::join_lines<line>(_lines, _removed_lines, other->_lines, other->_removed_lines.get());
+    }
+
+    // Merge mode, takes into account the tombstones of the lines of the folder removed on another version.
+    void join_tombstones(const std::vector<detail::cold_line>& theirs){
+      std::vector<detail::cold_line> tombstones = detail::parse_tombstones(_removed_lines.get());
+      detail::join_tombstones<line>(_lines, tombstones, theirs);
+      _removed_lines = detail::format_tombstones(tombstones);
+    }
+
+    // For the removal of the folder, the tombstones of all its lines, the removal of the live ones being a change of
+    // the anonymous replica.
+    std::vector<detail::cold_line> get_tombstones() const {
+      std::vector<detail::cold_line> r = detail::parse_tombstones(_removed_lines.get());
+
+      std::for_each(_lines.cbegin(), _lines.cend(), [&r](const line_p& l){
+	std::vector<counter_state> counters = l->get_counters();
+	detail::add_to_counters(counters, {}, -static_cast<int64_t>(l->count()));
+	detail::bury(r, l->item()->get_id().to_string(), counters);
+      });
+
+      return r;
+    }
     
     size_t lines_size() const { return _lines.size(); }
 
@@ -211,6 +1138,7 @@ namespace hx2a::zambezi {
       }
       else{
 	// Last item, we remove the line.
+	detail::bury_line(_removed_lines, *fi);
 	_lines.erase(fi);
       }
       
@@ -222,6 +1150,7 @@ namespace hx2a::zambezi {
       auto fi = std::find_if(_lines.cbegin(), e, [&](const line_p& i){return i->item() == item;});
 
       if (fi != e){
+	detail::bury_line(_removed_lines, *fi);
 	_lines.erase(fi);
 	return true;
       }
@@ -244,6 +1173,7 @@ namespace hx2a::zambezi {
       }
 
       if (!count){
+	detail::bury_line(_removed_lines, *fi);
 	_lines.erase(fi);
 	return;
       }
@@ -272,14 +1202,37 @@ namespace hx2a::zambezi {
     lines_const_reverse_iterator lines_crbegin() const { return _lines.crbegin(); }
     lines_const_reverse_iterator lines_crend() const { return _lines.crend(); }
 
+    // See gen_cart::to_cold.
+    void append_cold(std::string& out, bool snapshots) const {
+      out += 'F';
+      detail::append_field(out, _name.get());
+      detail::append_field(out, _dots.get());
+      detail::append_field(out, _removed_lines.get());
+      out += '\n';
+      std::for_each(_lines.cbegin(), _lines.cend(), [&](const line_p& l){ detail::append_cold_line(out, l, snapshots); });
+    }
+
+    // See gen_cart::from_cold.
+    template <typename Resolve>
+    void restore_cold(const std::vector<detail::cold_line>& cold, Resolve& resolve){
+      detail::restore_lines<line>(_lines, cold, resolve);
+    }
+
   private:
 
     slot<string, NameTag> _name;
     lines _lines;
+    slot<string, DotsTag> _dots;
+    // Tombstones of the lines (merge mode).
+    slot<string, DefaultRemovedLinesTag> _removed_lines;
   };
   
   constexpr tag_t DefaultFoldersTag = {"f"};
 
+  constexpr tag_t DefaultRemovedFoldersTag = {"x"};
+
+  constexpr tag_t DefaultRemovedFolderLinesTag = {"z"};
+
   struct TopLevel{};
   struct IncludingFolders{};
 
@@ -297,7 +1250,9 @@ namespace hx2a::zambezi {
     typename CartLine = cart_line<Item, LineTypeTag, LineItemTag, LineCountTag>, // Cart line type.
     tag_t LinesTag = DefaultCartLinesTag, // Tag for the lines in the cart.
     tag_t FoldersTag = DefaultFoldersTag, // Tag for the folders in the cart.
-    tag_t FolderNameTag = DefaultFolderNameTag // Tag for the folder name in the folder type.
+    tag_t FolderNameTag = DefaultFolderNameTag, // Tag for the folder name in the folder type.
+    tag_t RemovedFoldersTag = DefaultRemovedFoldersTag, // Tag for the dots of the removed folders (merge mode).
+    typename LinesPolicy = list_lines // Container policy for the lines, in the cart and in the folders.
     >
   class gen_cart: public element<>
   {
@@ -312,13 +1267,13 @@ namespace hx2a::zambezi {
     using line_p = ptr<line>;
     using line_r = rfr<line>;
 
-    using lines = own_list<line, LinesTag>;
+    using lines = typename LinesPolicy::template container<line, LinesTag>;
     using lines_iterator = typename lines::iterator;
     using lines_const_iterator = typename lines::const_iterator;
     using lines_reverse_iterator = typename lines::reverse_iterator;
     using lines_const_reverse_iterator = typename lines::const_reverse_iterator;
 
-    using folder_type = folder<Item, FolderTypeTag, line, FolderNameTag, LinesTag>;
+    using folder_type = folder<Item, FolderTypeTag, line, FolderNameTag, LinesTag, DefaultFolderDotsTag, LinesPolicy>;
     using folder_p = ptr<folder_type>;
     using folder_r = rfr<folder_type>;
     
@@ -331,14 +1286,20 @@ namespace hx2a::zambezi {
     gen_cart(reserved_t):
       hx2a_base(reserved),
       _lines(*this),
-      _folders(*this)
+      _folders(*this),
+      _removed_folders(*this),
+      _removed_lines(*this),
+      _removed_folder_lines(*this)
     {
     }
 
     gen_cart():
       hx2a_base(standard),
       _lines(*this),
-      _folders(*this)
+      _folders(*this),
+      _removed_folders(*this),
+      _removed_lines(*this),
+      _removed_folder_lines(*this)
     {
     }
 
@@ -388,6 +1349,7 @@ namespace hx2a::zambezi {
       }
       else{
 	// Last item, we remove the line.
+	detail::bury_line(_removed_lines, *fi);
 	_lines.erase(fi);
       }
       
@@ -400,6 +1362,7 @@ namespace hx2a::zambezi {
       auto fi = std::find_if(_lines.cbegin(), e, [&](const line_p& i){return i->item() == item;});
 
       if (fi != e){
+	detail::bury_line(_removed_lines, *fi);
 	_lines.erase(fi);
 	return true;
       }
@@ -423,6 +1386,7 @@ namespace hx2a::zambezi {
       }
 
       if (!count){
+	detail::bury_line(_removed_lines, *fi);
 	_lines.erase(fi);
 	return;
       }
@@ -443,18 +1407,21 @@ namespace hx2a::zambezi {
     }
 
     // Will return true if no homonymous folder has been found and the folder was created and added.
-    // Will return false otherwise.
+    // Will return false otherwise. The addition is tagged by a dot of the anonymous replica, so that a merge with a
+    // version which removed the folder removes it.
     bool add_folder(std::string_view name){
       folder_p f = find_folder(name);
 
       if (!f){
-	_lines.push_front(make_rfr<folder_type>(name));
+	_folders.push_front(new_folder(name, detail::make_dot({})));
 	return true;
       }
 
       return false;
     }
 
+    // The dots of the folder, if any, are recorded, so that a merge with a version which has not seen the removal
+    // does not bring it back, unless that version added it again.
     bool remove_folder(std::string_view name){
       auto e = _folders.cend();
       auto fi = std::find_if(_folders.cbegin(), e, [&](const folder_p& l){return l->get_name() == name;});
@@ -463,7 +1430,8 @@ namespace hx2a::zambezi {
 	return false;
       }
 
-      _lines.erase(fi);
+      _removed_folders = detail::add_tokens(_removed_folders, (*fi)->get_dots());
+      retire(fi);
       return true;
     }
 
@@ -498,10 +1466,379 @@ namespace hx2a::zambezi {
     folders_const_reverse_iterator folders_crbegin() const { return _folders.crbegin(); }
     folders_const_reverse_iterator folders_crend() const { return _folders.crend(); }
 
+    // Amounts of the cart in a currency, per folder and overall. The pricer is called once with all the lines, and
+    // returns their unit prices in the same order (std::vector<double>), so that it can price them in parallel and
+    // memoize them. Unit prices are rounded to the minor unit of the currency, then the amounts are exact: a line
+    // amounts to its count times its unit price, computed with the batch operations of fixed_money. A line priced
+    // NaN is left out and counted as unpriced. The pricer must return all the prices in the currency given, a real
+    // one, so that they can be summed.
+    template <typename Pricer>
+    cart_totals cart_total(currency::code cc, Pricer&& pricer) const {
+      using ::zambezi::fixed_money;
+      std::vector<line_to_price> lines;
+      // Name and index of the first line of every folder.
+      std::vector<std::pair<std::string, size_t>> folder_begins;
+
+      std::for_each(_lines.cbegin(), _lines.cend(), [&](const line_p& l){ lines.push_back(line_to_price{{}, l->item()->get_id(), l->count()}); });
+      std::for_each(_folders.cbegin(), _folders.cend(), [&](const folder_p& f){
+	folder_begins.emplace_back(f->get_name(), lines.size());
+	std::for_each(f->lines_cbegin(), f->lines_cend(), [&](const line_p& l){ lines.push_back(line_to_price{f->get_name(), l->item()->get_id(), l->count()}); });
+      });
+
+      std::vector<double> prices = pricer(static_cast<const std::vector<line_to_price>&>(lines));
+      cart_totals r;
+      // In minor units.
+      std::vector<int64_t> units(lines.size());
+      std::vector<int64_t> counts(lines.size());
+      std::vector<int64_t> amounts(lines.size());
+
+      for (size_t i = 0; i != lines.size(); ++i){
+	if (std::isnan(prices[i])){
+	  ++r.unpriced;
+	}
+	else{
+	  units[i] = fixed_money::from_amount(prices[i], cc).get_minor();
+	  counts[i] = lines[i].count;
+	}
+      }
+
+      fixed_money::multiply(units, counts, amounts);
+
+      auto amount = [&](size_t begin, size_t end){
+	return fixed_money(fixed_money::sum(std::span<const int64_t>(amounts).subspan(begin, end - begin)), cc);
+      };
+
+      r.top_level = amount(0, folder_begins.empty() ? lines.size() : folder_begins.front().second);
+      r.total = r.top_level;
+
+      for (size_t f = 0; f != folder_begins.size(); ++f){
+	fixed_money a = amount(folder_begins[f].second, f + 1 != folder_begins.size() ? folder_begins[f + 1].second : lines.size());
+	r.folders.emplace_back(folder_begins[f].first, a);
+	r.total += a;
+      }
+
+      return r;
+    }
+
+    // Adds the lines and the folders of another cart, typically the one a guest filled before logging in. Lines are
+    // matched by item and folders by name, using hash tables, so the time is linear in the sizes of both carts. The
+    // policy sets the count of an item present in both. The cart is modified in memory only, so the result is
+    // saved in a single write with the document owning it. The other cart is left unchanged.
+    void merge_from(const gen_cart& other, merge_policy policy = merge_policy::sum){
+      detail::merge_lines_from<line>(_lines, other._lines, policy);
+
+      if (!other._folders.size()){
+	return;
+      }
+
+      std::unordered_map<std::string, folder_p> index;
+      index.reserve(_folders.size());
+      std::for_each(_folders.cbegin(), _folders.cend(), [&index](const folder_p& f){ index.emplace(f->get_name(), f); });
+
+      std::for_each(other._folders.cbegin(), other._folders.cend(), [&](const folder_p& theirs){
+	auto i = index.find(theirs->get_name());
+
+	if (i == index.end()){
+	  _folders.push_front(new_folder(theirs->get_name(), detail::make_dot({})));
+	  i = index.emplace(theirs->get_name(), *_folders.cbegin()).first;
+	}
+
+	i->second->merge_from(theirs, policy);
+      });
+    }
+
+    // Merge mode.
+    //
+    // The replica is an identifier of the device or session making the change, stable across its edits. Changes
+    // made this way can be merged with the ones of other replicas.
+
+    // Adds (or removes, when negative) delta items at top level.
+    void add_item(std::string_view replica, const ItemR& item, int64_t delta = 1){
+      detail::add_count<line>(_lines, _removed_lines, replica, item, delta);
+    }
+
+    // Operates only at top level.
+    void update_item_count(std::string_view replica, const ItemR& item, uint32_t count){
+      line_p l = find_item(item);
+      add_item(replica, item, static_cast<int64_t>(count) - (l ? l->count() : 0));
+    }
+
+    // Adds a folder, or tags an existing one with a new addition, so that it survives a concurrent removal.
+    void add_folder(std::string_view replica, std::string_view name){
+      std::string dot = detail::make_dot(replica);
+      folder_p f = find_folder(name);
+
+      if (!f){
+	_folders.push_front(new_folder(name, dot));
+	return;
+      }
+
+      f->add_dots(dot);
+    }
+
+    // Removes all the lines and folders, merge mode state included.
+    void clear(){
+      while (_lines.size()){
+	_lines.erase(_lines.cbegin());
+      }
+
+      while (_folders.size()){
+	_folders.erase(_folders.cbegin());
+      }
+
+      _removed_folders = std::string();
+      _removed_lines = std::string();
+      _removed_folder_lines = std::string();
+    }
+
+    // Number of lines holding a snapshot, for carts whose lines take snapshots.
+    size_t snapshots_count() const {
+      size_t n = 0;
+
+      if constexpr (requires (const line& l){ l.get_snapshot(); }){
+	for_each_line([&n](const line_p& l){ n += l->get_snapshot() != nullptr; });
+      }
+
+      return n;
+    }
+
+    // At top level and in the folders.
+    size_t lines_count() const {
+      size_t n = 0;
+      for_each_line([&n](const line_p&){ ++n; });
+      return n;
+    }
+
+    // Lines, folders and snapshots, for the statistics of the cold representation.
+    size_t elements_count() const { return lines_count() + _folders.size() + snapshots_count(); }
+
+    // Merge mode, the dots of the removed folders, and the tombstones of the lines at top level and of the lines of
+    // the removed folders.
+    const string& get_removed_folders() const { return _removed_folders; }
+    const string& get_removed_lines() const { return _removed_lines; }
+    const string& get_removed_folder_lines() const { return _removed_folder_lines; }
+
+    // Whether the snapshots of the lines, if any, are kept in the cold representation.
+    static constexpr bool cold_snapshots = requires { requires line::cold_snapshots; };
+
+    // Cold representation of the cart, for carts nobody looks at any more: the lines and folders, merge mode state
+    // included, as compact text instead of elements. The snapshots are represented when their type has a cold form
+    // (see detail::cold_snapshot, and cold_snapshots) and snapshots is true, restored lines otherwise take new ones.
+    std::string to_cold(bool snapshots = true) const {
+      std::string r = "zc1\n";
+
+      if (!_removed_folders.get().empty()){
+	r += 'R';
+	detail::append_field(r, _removed_folders.get());
+	r += '\n';
+      }
+
+      if (!_removed_lines.get().empty()){
+	r += 'T';
+	detail::append_field(r, _removed_lines.get());
+	r += '\n';
+      }
+
+      if (!_removed_folder_lines.get().empty()){
+	r += 'D';
+	detail::append_field(r, _removed_folder_lines.get());
+	r += '\n';
+      }
+
+      std::for_each(_lines.cbegin(), _lines.cend(), [&](const line_p& l){ detail::append_cold_line(r, l, snapshots); });
+      std::for_each(_folders.cbegin(), _folders.cend(), [&](const folder_p& f){ f->append_cold(r, snapshots); });
+      return r;
+    }
+
+    // Restores a cold representation into an empty cart. Resolve gives the item pointer of an identifier, null for
+    // an item which no longer exists, whose lines are dropped. Returns false, without changing anything, for a
+    // representation which is not understood.
+    template <typename Resolve>
+    bool from_cold(std::string_view cold, Resolve&& resolve){
+      struct cold_folder
+      {
+	std::string name;
+	std::string dots;
+	std::string removed_lines;
+	std::vector<detail::cold_line> lines;
+      };
+
+      std::vector<detail::cold_line> top;
+      std::vector<cold_folder> folders;
+      std::string removed;
+      std::string removed_lines;
+      std::string removed_folder_lines;
+      size_t end = cold.find('\n');
+
+      if (end == std::string_view::npos || cold.substr(0, end) != "zc1"){
+	return false;
+      }
+
+      for (size_t begin = end + 1; begin < cold.size(); begin = end + 1){
+	end = cold.find('\n', begin);
+
+	if (end == std::string_view::npos){
+	  return false;
+	}
+
+	std::vector<std::string> fields = detail::split_fields(cold.substr(begin, end - begin));
+
+	if (fields[0] == "L"){
+	  detail::cold_line l;
+
+	  if (!detail::parse_cold_line(fields, l)){
+	    return false;
+	  }
+
+	  (folders.empty() ? top : folders.back().lines).push_back(std::move(l));
+	}
+	else if (fields[0] == "S" && fields.size() == 2){
+	  std::vector<detail::cold_line>& lines = folders.empty() ? top : folders.back().lines;
+
+	  if (lines.empty() || lines.back().snapshot){
+	    return false;
+	  }
+
+	  lines.back().snapshot = std::move(fields[1]);
+	}
+	else if (fields[0] == "F" && (fields.size() == 3 || fields.size() == 4)){
+	  folders.push_back(cold_folder{std::move(fields[1]), std::move(fields[2]), fields.size() == 4 ? std::move(fields[3]) : std::string(), {}});
+	}
+	else if (fields[0] == "R" && fields.size() == 2 && folders.empty() && top.empty()){
+	  removed = std::move(fields[1]);
+	}
+	else if (fields[0] == "T" && fields.size() == 2 && folders.empty() && top.empty()){
+	  removed_lines = std::move(fields[1]);
+	}
+	else if (fields[0] == "D" && fields.size() == 2 && folders.empty() && top.empty()){
+	  removed_folder_lines = std::move(fields[1]);
+	}
+	else{
+	  return false;
+	}
+      }
+
+      detail::restore_lines<line>(_lines, top, resolve);
+
+      for (auto f = folders.crbegin(); f != folders.crend(); ++f){
+	folder_r fr = make_rfr<folder_type>(f->name, f->dots, f->removed_lines);
+	fr->restore_cold(f->lines, resolve);
+	_folders.push_front(fr);
+      }
+
+      _removed_folders = removed;
+      _removed_lines = removed_lines;
+      _removed_folder_lines = removed_folder_lines;
+      return true;
+    }
+
+    // Takes into account the changes made on another version of the cart. Merges commute and are idempotent, so
+    // versions can be merged in any order, any number of times, and converge. Lines coming from the other version
+    // take a new snapshot, if any.
+    void merge(const gen_cart& other){
+      detail::join_lines<line>(_lines, _removed_lines, other._lines, other._removed_lines.get());
+      _removed_folders = detail::add_tokens(_removed_folders, other._removed_folders.get());
+      const string& removed = _removed_folders;
+
+      // Lines of the folders removed on the other version.
+      detail::folder_tombstones buried = detail::parse_folder_tombstones(_removed_folder_lines.get());
+
+      for (const auto& [name, tombstones]: detail::parse_folder_tombstones(other._removed_folder_lines.get())){
+	if (folder_p f = find_folder(name)){
+	  f->join_tombstones(tombstones);
+	}
+	else{
+	  bury_folder(buried, name, tombstones);
+	}
+      }
+
+      _removed_folder_lines = detail::format_folder_tombstones(buried);
+
+      // Our folders removed on the other version.
+      for (auto fi = _folders.cbegin(); fi != _folders.cend();){
+	if (detail::all_tokens_in((*fi)->get_dots(), removed)){
+	  retire(fi);
+	  fi = _folders.cbegin();
+	}
+	else{
+	  ++fi;
+	}
+      }
+
+      std::for_each(other._folders.cbegin(), other._folders.cend(), [&](const folder_p& theirs){
+	if (detail::all_tokens_in(theirs->get_dots(), removed)){
+	  return;
+	}
+
+	folder_p ours = find_folder(theirs->get_name());
+
+	if (!ours){
+	  _folders.push_front(new_folder(theirs->get_name(), {}));
+	  ours = find_folder(theirs->get_name());
+	}
+
+	ours->join(theirs);
+      });
+    }
+
   private:
 
+    static void bury_folder(detail::folder_tombstones& buried, std::string_view name, const std::vector<detail::cold_line>& tombstones){
+      auto i = std::find_if(buried.begin(), buried.end(), [&](const auto& b){ return b.first == name; });
+
+      if (i == buried.end()){
+	buried.emplace_back(std::string(name), tombstones);
+	return;
+      }
+
+      for (const detail::cold_line& t: tombstones){
+	detail::bury(i->second, t.item, t.counters);
+      }
+    }
+
+    // Merge mode, a removed folder leaves the tombstones of its lines.
+    void retire(folders_const_iterator fi){
+      detail::folder_tombstones buried = detail::parse_folder_tombstones(_removed_folder_lines.get());
+      bury_folder(buried, (*fi)->get_name(), (*fi)->get_tombstones());
+      _removed_folder_lines = detail::format_folder_tombstones(buried);
+      _folders.erase(fi);
+    }
+
+    // A folder added again starts from the tombstones of the lines of the removed one.
+    folder_r new_folder(std::string_view name, std::string_view dots){
+      if (_removed_folder_lines.get().empty()){
+	return make_rfr<folder_type>(name, dots);
+      }
+
+      detail::folder_tombstones buried = detail::parse_folder_tombstones(_removed_folder_lines.get());
+      auto i = std::find_if(buried.begin(), buried.end(), [&](const auto& b){ return b.first == name; });
+
+      if (i == buried.end()){
+	return make_rfr<folder_type>(name, dots);
+      }
+
+      folder_r f = make_rfr<folder_type>(name, dots);
+      f->join_tombstones(i->second);
+      buried.erase(i);
+      _removed_folder_lines = detail::format_folder_tombstones(buried);
+      return f;
+    }
+
+    // At top level and in the folders.
+    template <typename F>
+    void for_each_line(F&& f) const {
+      std::for_each(_lines.cbegin(), _lines.cend(), f);
+      std::for_each(_folders.cbegin(), _folders.cend(), [&f](const folder_p& fo){ std::for_each(fo->lines_cbegin(), fo->lines_cend(), f); });
+    }
+
     lines _lines;
     folders _folders;
+    // Space-separated dots (merge mode).
+    slot<string, RemovedFoldersTag> _removed_folders;
+    // Tombstones of the lines at top level (merge mode).
+    slot<string, DefaultRemovedLinesTag> _removed_lines;
+    // Tombstones of the lines of the removed folders (merge mode).
+    slot<string, DefaultRemovedFolderLinesTag> _removed_folder_lines;
   };
 
   template <
@@ -513,7 +1850,8 @@ namespace hx2a::zambezi {
     tag_t FoldersTag = DefaultFoldersTag, // Tag for the folders in the cart.
     tag_t LineItemTag = DefaultItemTag, // Tag for the line link to the item in the line type.
     tag_t LineCountTag = DefaultCountTag, // Tag for the line count in the line type.
-    tag_t FolderNameTag = DefaultFolderNameTag // Tag for the folder name in the folder type.
+    tag_t FolderNameTag = DefaultFolderNameTag, // Tag for the folder name in the folder type.
+    typename LinesPolicy = list_lines // Container policy for the lines, in the cart and in the folders.
    >
   using cart =
     gen_cart<
@@ -526,7 +1864,9 @@ namespace hx2a::zambezi {
     cart_line<Item, LineTypeTag, LineItemTag, LineCountTag>,
     LinesTag,
     FoldersTag,
-    FolderNameTag
+    FolderNameTag,
+    DefaultRemovedFoldersTag,
+    LinesPolicy
     >;
 
   template <
@@ -542,7 +1882,8 @@ namespace hx2a::zambezi {
     tag_t LineItemTag = DefaultItemTag, // Tag for the line link to the item in the line type.
     tag_t LineCountTag = DefaultCountTag, // Tag for the line count in the line type.
     tag_t LineSnapshotTag = DefaultSnapshotTag, // Tag for the snapshot ownership in the line type.
-    tag_t FolderNameTag = DefaultFolderNameTag // Tag for the folder name in the folder type. 
+    tag_t FolderNameTag = DefaultFolderNameTag, // Tag for the folder name in the folder type.
+    typename LinesPolicy = list_lines // Container policy for the lines, in the cart and in the folders.
     >
   using cart_with_snapshots =
     gen_cart<
@@ -555,7 +1896,9 @@ namespace hx2a::zambezi {
     cart_line_with_snapshot<Item, LineWithSnapshotTypeTag, LineBaseTypeTag, Snapshot, TakeSnapshot, LineItemTag, LineCountTag, LineSnapshotTag>,
     LinesTag,
     FoldersTag,
-    FolderNameTag
+    FolderNameTag,
+    DefaultRemovedFoldersTag,
+    LinesPolicy
     >;
 
 }
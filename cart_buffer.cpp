@@ -0,0 +1,509 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#include <fstream>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#include "hx2a/server.hpp"
+
+#include "hx2a/zambezi/cart_buffer.hpp"
+#include "hx2a/zambezi/partitions.hpp"
+#include "hx2a/zambezi/diagnostics.hpp"
+
+using namespace hx2a;
+
+namespace zambezi {
+
+  cart_buffer& cart_buffer::instance(){
+    static cart_buffer b;
+    return b;
+  }
+
+  std::mutex& cart_buffer::lock(const doc_id& persona){
+    static std::mutex stripes[64];
+    return stripes[std::hash<doc_id>()(persona) % 64];
+  }
+
+  namespace {
+
+    // One line per count: '#' and its sequence number, then '@' and the database, persona, item, count and folder,
+    // separated by tabs. The folder comes last, it can contain anything but a line feed.
+    std::string journal_line(const std::string& database, const doc_id& persona, std::string_view folder, const doc_id& item, uint32_t count, uint64_t sequence){
+      std::string line = '#' + std::to_string(sequence);
+      line += "\t@";
+      line += database;
+      line += '\t';
+      line += persona.to_string();
+      line += '\t';
+      line += item.to_string();
+      line += '\t';
+      line += std::to_string(count);
+      line += '\t';
+      line += folder;
+      std::replace(line.begin(), line.end(), '\n', ' ');
+      line += '\n';
+      return line;
+    }
+
+  } // End of anonymous namespace.
+
+  cart_buffer::~cart_buffer(){
+    {
+      std::lock_guard l(_mutex);
+      _stop = true;
+    }
+
+    _wake.notify_all();
+
+    for (std::thread& t: _threads){
+      t.join();
+    }
+
+    // What is still waiting is in the journal, if any, and written after the restart.
+    if (_journal){
+      std::fclose(_journal);
+    }
+
+    if (_journal_lock >= 0){
+      ::close(_journal_lock);
+    }
+  }
+
+  // Threads are started and the journal replayed on first use, not when the module is loaded.
+  void cart_buffer::start(){
+    std::call_once(_started, [this]{
+      if (_settings.mode != durability::memory){
+	std::lock_guard l(_mutex);
+	claim();
+	recover(_journal_path);
+	// The journal shared by all the processes before they had their own.
+	bool shared = _journal_path == _settings.journal_path + ".0" && recover(_settings.journal_path);
+	// The replayed counts are the first of the new journal.
+	checkpoint();
+
+	if (!_journal){
+	  throw std::runtime_error("cannot open the cart buffer journal " + _journal_path);
+	}
+
+	if (shared){
+	  std::remove(_settings.journal_path.c_str());
+	}
+      }
+
+      for (size_t i = 0; i != std::max<size_t>(_settings.threads, 1); ++i){
+	_threads.emplace_back([this]{ run(); });
+      }
+    });
+  }
+
+  void cart_buffer::claim(){
+    for (unsigned n = 0; _journal_lock < 0; ++n){
+      if (n == 1024){
+	throw std::runtime_error("no cart buffer journal is free");
+      }
+
+      std::string path = _settings.journal_path + '.' + std::to_string(n);
+      int fd = ::open((path + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+      if (fd < 0){
+	throw std::runtime_error("cannot open the cart buffer journal lock " + path + ".lock");
+      }
+
+      // Held by a running process. The lock goes away with the process.
+      if (::flock(fd, LOCK_EX | LOCK_NB)){
+	::close(fd);
+	continue;
+      }
+
+      _journal_lock = fd;
+      _journal_path = path;
+    }
+  }
+
+  // Lines of journals written before the sequence numbers have none, and lines written before the partitioning
+  // have no database either, their personas are in the shared one. Both are always replayed. The applied marks
+  // are '!' and the sequence number, then the persona.
+  bool cart_buffer::recover(const std::string& path){
+    std::ifstream in(path);
+
+    if (!in){
+      return false;
+    }
+
+    struct replayed
+    {
+      std::string database;
+      doc_id persona;
+      std::string folder;
+      doc_id item;
+      uint32_t count;
+      uint64_t sequence;
+    };
+
+    std::vector<replayed> counts;
+    std::unordered_map<doc_id, uint64_t> applied;
+    std::string line;
+
+    while (std::getline(in, line)){
+      uint64_t sequence = 0;
+
+      if (!line.empty() && (line.front() == '!' || line.front() == '#')){
+	size_t t = line.find('\t');
+
+	if (t == std::string::npos){
+	  continue;
+	}
+
+	try{
+	  sequence = std::stoull(line.substr(1, t - 1));
+	}
+	catch (const std::exception&){
+	  continue;
+	}
+
+	if (line.front() == '!'){
+	  uint64_t& a = applied[doc_id(line.substr(t + 1))];
+	  a = std::max(a, sequence);
+	  continue;
+	}
+
+	line.erase(0, t + 1);
+      }
+
+      std::string database = partitions::database(doc_id());
+
+      if (!line.empty() && line.front() == '@'){
+	size_t t = line.find('\t');
+
+	if (t == std::string::npos){
+	  continue;
+	}
+
+	database = line.substr(1, t - 1);
+	line.erase(0, t + 1);
+      }
+
+      size_t t1 = line.find('\t');
+      size_t t2 = t1 == std::string::npos ? t1 : line.find('\t', t1 + 1);
+      size_t t3 = t2 == std::string::npos ? t2 : line.find('\t', t2 + 1);
+
+      // The last line can be truncated by a crash.
+      if (t3 == std::string::npos){
+	continue;
+      }
+
+      try{
+	uint32_t count = static_cast<uint32_t>(std::stoul(line.substr(t2 + 1, t3 - t2 - 1)));
+	counts.push_back(replayed{database, doc_id(line.substr(0, t1)), line.substr(t3 + 1), doc_id(line.substr(t1 + 1, t2 - t1 - 1)), count, sequence});
+      }
+      catch (const std::exception&){
+      }
+    }
+
+    for (const replayed& r: counts){
+      auto a = applied.find(r.persona);
+
+      // Written before the process stopped, replaying it could undo later writes.
+      if (r.sequence && a != applied.end() && r.sequence <= a->second){
+	continue;
+      }
+
+      record(r.database, r.persona, r.folder, r.item, buffered{r.count, ++_sequence}, 0);
+      ++_statistics.recovered;
+    }
+
+    return true;
+  }
+
+  void cart_buffer::append(const std::string& line){
+    // Reopened by a checkpoint, if it failed before.
+    if (!_journal){
+      checkpoint();
+    }
+
+    if (!_journal){
+      throw std::runtime_error("the cart buffer journal is not open");
+    }
+
+    if (std::fwrite(line.data(), 1, line.size(), _journal) != line.size() || std::fflush(_journal)){
+      throw std::runtime_error("cannot write the cart buffer journal");
+    }
+
+    if (_settings.mode == durability::synced_journal && ::fsync(::fileno(_journal))){
+      throw std::runtime_error("cannot sync the cart buffer journal");
+    }
+
+    _journal_size += line.size();
+  }
+
+  void cart_buffer::journal(const std::string& database, const doc_id& persona, std::string_view folder, const doc_id& item, uint32_t count, uint64_t sequence){
+    append(journal_line(database, persona, folder, item, count, sequence));
+  }
+
+  // All the counts of the entry, and the older ones of the persona, are written.
+  void cart_buffer::applied(const doc_id& persona, const entry& e){
+    uint64_t sequence = 0;
+
+    for (const auto& [key, b]: e.updates){
+      sequence = std::max(sequence, b.sequence);
+    }
+
+    append('!' + std::to_string(sequence) + '\t' + persona.to_string() + '\n');
+  }
+
+  // Written aside and renamed, a crash leaves either journal whole. On failure the current journal is kept.
+  void cart_buffer::checkpoint(){
+    std::string path = _journal_path + ".checkpoint";
+    std::FILE* f = std::fopen(path.c_str(), "w");
+
+    if (!f){
+      diagnostics::report("cannot create the cart buffer journal %s", path.c_str());
+      return;
+    }
+
+    size_t size = 0;
+    bool written = true;
+
+    auto dump = [&](const std::unordered_map<doc_id, entry>& entries){
+      for (const auto& [persona, e]: entries){
+	for (const auto& [key, b]: e.updates){
+	  std::string line = journal_line(e.database, persona, key.first, key.second, b.count, b.sequence);
+	  written = written && std::fwrite(line.data(), 1, line.size(), f) == line.size();
+	  size += line.size();
+	}
+      }
+    };
+
+    // The counts waiting are more recent than the ones being written, and replace them when replayed.
+    dump(_writing);
+    dump(_pending);
+    written = written && !std::fflush(f) && !::fsync(::fileno(f));
+    written = !std::fclose(f) && written;
+
+    if (!written || std::rename(path.c_str(), _journal_path.c_str())){
+      diagnostics::report("cannot checkpoint the cart buffer journal %s", _journal_path.c_str());
+      std::remove(path.c_str());
+      return;
+    }
+
+    if (_journal){
+      std::fclose(_journal);
+    }
+
+    _journal = std::fopen(_journal_path.c_str(), "a");
+    _journal_size = size;
+    ++_statistics.checkpoints;
+
+    // Counts are refused until a checkpoint succeeds.
+    if (!_journal){
+      diagnostics::report("cannot open the cart buffer journal %s", _journal_path.c_str());
+    }
+  }
+
+  void cart_buffer::record(const std::string& database, const doc_id& persona, std::string_view folder, const doc_id& item, buffered b, unsigned retries){
+    auto [i, inserted] = _pending.try_emplace(persona, entry{database, {}, clock::now() + _settings.window, retries});
+
+    if (inserted){
+      _due.push_back(persona);
+    }
+
+    auto [j, added] = i->second.updates.insert_or_assign({std::string(folder), item}, b);
+
+    if (!added){
+      ++_statistics.replaced;
+    }
+  }
+
+  void cart_buffer::update_item_count(const std::string& database, const doc_id& persona, std::string_view folder, const doc_id& item, uint32_t count){
+    start();
+
+    {
+      std::lock_guard l(_mutex);
+      uint64_t sequence = ++_sequence;
+
+      // Journaled first, a count which could not be journaled is refused.
+      if (_settings.mode != durability::memory){
+	journal(database, persona, folder, item, count, sequence);
+      }
+
+      ++_statistics.updates;
+      record(database, persona, folder, item, buffered{count, sequence}, 0);
+    }
+
+    _wake.notify_one();
+  }
+
+  std::vector<cart_buffer::line_update> cart_buffer::pending(const doc_id& persona){
+    std::vector<line_update> r;
+    std::lock_guard l(_mutex);
+    auto i = _pending.find(persona);
+
+    if (i != _pending.end()){
+      for (const auto& [key, b]: i->second.updates){
+	r.push_back(line_update{key.first, key.second, b.count});
+      }
+    }
+
+    return r;
+  }
+
+  void cart_buffer::flush(const doc_id& persona){
+    start();
+    write(persona);
+  }
+
+  cart_buffer::statistics cart_buffer::get_statistics(){
+    std::lock_guard l(_mutex);
+    return _statistics;
+  }
+
+  void cart_buffer::run(){
+    std::unique_lock l(_mutex);
+
+    for (;;){
+      _wake.wait(l, [this]{ return _stop || !_due.empty(); });
+
+      if (_stop){
+	return;
+      }
+
+      auto i = _pending.find(_due.front());
+
+      // Flushed in the meantime.
+      if (i == _pending.end()){
+	_due.pop_front();
+	continue;
+      }
+
+      // All entries have the same window, the front one is due first. Retried ones are pushed back with a new one.
+      clock::time_point due = i->second.due;
+
+      if (clock::now() < due){
+	_wake.wait_until(l, due, [this]{ return _stop; });
+	continue;
+      }
+
+      doc_id id = _due.front();
+      _due.pop_front();
+      l.unlock();
+      write(id);
+      l.lock();
+    }
+  }
+
+  // The counts are taken under the persona's lock, so that two writes of the same persona, from a worker and from
+  // a flush, cannot be reordered.
+  void cart_buffer::write(const doc_id& id){
+    std::lock_guard pl(lock(id));
+    entry e;
+
+    {
+      std::lock_guard l(_mutex);
+      auto i = _pending.find(id);
+
+      if (i == _pending.end()){
+	return;
+      }
+
+      e = std::move(i->second);
+      _pending.erase(i);
+      _writing.emplace(id, e);
+    }
+
+    bool written = false;
+
+    try{
+      partitions::connector c(e.database);
+      persona_p p = persona::get(id);
+
+      // A persona removed in the meantime has nothing to update.
+      if (p != nullptr){
+	persona::mycart_r cart = p->edit_cart();
+
+	for (const auto& [key, b]: e.updates){
+	  inventory_p inv = inventory::get(key.second);
+
+	  if (inv == nullptr){
+	    continue;
+	  }
+
+	  if (key.first.empty()){
+	    cart->update_item_count(*inv, b.count);
+	    continue;
+	  }
+
+	  auto f = cart->find_folder(key.first);
+
+	  if (f == nullptr){
+	    if (!b.count){
+	      continue;
+	    }
+
+	    cart->add_folder(key.first);
+	    f = cart->find_folder(key.first);
+	  }
+
+	  f->update_item_count(*inv, b.count);
+	}
+      }
+
+      // The persona is saved here, written is only set once it is.
+      c.close();
+      written = true;
+    }
+    catch (const std::exception& x){
+      diagnostics::report("cannot write the cart of persona %s: %s", id.to_string().c_str(), x.what());
+    }
+
+    std::lock_guard l(_mutex);
+    _writing.erase(id);
+
+    if (written){
+      ++_statistics.writes;
+      _statistics.lines_written += e.updates.size();
+
+      if (_settings.mode != durability::memory){
+	try{
+	  applied(id, e);
+	}
+	catch (const std::exception& x){
+	  // Replayed after a restart, a count not marked applied only repeats what was written.
+	  diagnostics::report("%s", x.what());
+	}
+      }
+    }
+    else{
+      ++_statistics.failed;
+
+      // Counts received since are more recent and are kept.
+      if (e.retries < _settings.max_retries){
+	for (const auto& [key, b]: e.updates){
+	  auto i = _pending.find(id);
+
+	  if (i == _pending.end() || !i->second.updates.count(key)){
+	    record(e.database, id, key.first, key.second, b, e.retries + 1);
+	  }
+	}
+
+	_wake.notify_one();
+      }
+      else{
+	_statistics.dropped += e.updates.size();
+	diagnostics::report("dropping %zu cart counts of persona %s after %u retries", e.updates.size(), id.to_string().c_str(), e.retries);
+      }
+    }
+
+    // Everything journaled has been written, or the journal has grown too much.
+    if (_settings.mode != durability::memory && ((_pending.empty() && _writing.empty()) || _journal_size > _settings.journal_checkpoint)){
+      checkpoint();
+    }
+  }
+
+} // End namespace zambezi.
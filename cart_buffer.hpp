@@ -0,0 +1,189 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_CART_BUFFER_HPP
+#define HX2A_ZAMBEZI_CART_BUFFER_HPP
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include <utility>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "hx2a/zambezi/ontology.hpp"
+
+namespace zambezi {
+
+  // Write-behind buffer of cart line counts, opt-in.
+  //
+  // Quantity steppers send a new count for the same line several times a second, and saving the persona every
+  // time rewrites the whole document. Counts sent through the buffer are kept in memory and written after a short
+  // window, a later count for a line replacing the earlier one, so that a burst costs a single save of the
+  // persona. Reads see the buffered counts through pending() (read-your-writes in this process), and flows which
+  // need the stored cart to be up to date, such as the checkout, call flush() first.
+  //
+  // Durability, chosen by the settings:
+  // - memory: counts accepted in the last window are lost if the process stops abruptly.
+  // - journal: counts are appended to a local journal before being accepted, and replayed when the process
+  //   restarts. They are lost only if the operating system crashes too.
+  // - synced_journal: the journal is synced to the disk before a count is accepted, they survive the crash of the
+  //   operating system too, at the price of a disk sync per count.
+  // Durability covers the stops of the process, not the refusals of the database: counts still failing to be
+  // written after the retries are dropped, counted and reported (see diagnostics.hpp).
+  //
+  // Every process takes its own journal, the first of <journal path>.0, .1 etc. no other process holds (the lock
+  // is on the file next to it, ending in .lock). A process restarting takes one left by a stopped process, and
+  // replays it. Counts written are marked applied in the journal by the sequence number of the last one, and are
+  // not replayed. The journal is rewritten with the counts still waiting, its checkpoint, when it outgrows the
+  // configured size, and truncated every time the buffer is empty.
+  //
+  // Only this process knows the buffered counts: carts of a persona are to be updated through one process (e.g.
+  // with sticky sessions) for the reads to see them.
+  class cart_buffer
+  {
+  public:
+
+    enum class durability { memory, journal, synced_journal };
+
+    struct settings
+    {
+      std::chrono::milliseconds window{500};
+      durability mode = durability::journal;
+      // Prefix of the journals of the processes.
+      std::string journal_path = "zambezi_cart_buffer.journal";
+      // The journal is checkpointed beyond that size.
+      size_t journal_checkpoint = 4 << 20;
+      size_t threads = 1;
+      unsigned max_retries = 3;
+    };
+
+    struct statistics
+    {
+      // Counts received.
+      uint64_t updates = 0;
+      // Counts replacing one still waiting for the same line.
+      uint64_t replaced = 0;
+      // Saves of personas, and lines they carried.
+      uint64_t writes = 0;
+      uint64_t lines_written = 0;
+      // Saves which failed, their lines are retried.
+      uint64_t failed = 0;
+      // Lines given up after the retries.
+      uint64_t dropped = 0;
+      // Rewritings of the journal, and counts replayed from journals when starting.
+      uint64_t checkpoints = 0;
+      uint64_t recovered = 0;
+
+      // Saves avoided per save done, relative to saving the persona for every count.
+      double write_amplification_saved() const { return writes ? static_cast<double>(updates) / writes : 0; }
+    };
+
+    struct line_update
+    {
+      // Empty at top level.
+      std::string folder;
+      doc_id item;
+      // 0 removes the line.
+      uint32_t count;
+    };
+
+    static cart_buffer& instance();
+
+    // To be called before the first use.
+    void configure(const settings& s){ _settings = s; }
+
+    // Serializes the writes of the cart of a persona in this process, buffered or not.
+    static std::mutex& lock(const doc_id& persona);
+
+    // The database is the one of the persona (see partitions.hpp).
+    void update_item_count(const std::string& database, const doc_id& persona, std::string_view folder, const doc_id& item, uint32_t count);
+
+    // The counts of the persona's cart still waiting to be written.
+    std::vector<line_update> pending(const doc_id& persona);
+
+    // Writes the counts waiting for the persona's cart right away.
+    void flush(const doc_id& persona);
+
+    statistics get_statistics();
+
+    ~cart_buffer();
+
+  private:
+
+    using clock = std::chrono::steady_clock;
+
+    struct buffered
+    {
+      uint32_t count;
+      // In the journal.
+      uint64_t sequence;
+    };
+
+    using lines = std::map<std::pair<std::string, doc_id>, buffered>;
+
+    struct entry
+    {
+      std::string database;
+      lines updates;
+      clock::time_point due;
+      unsigned retries;
+    };
+
+    cart_buffer() = default;
+
+    void start();
+
+    // Takes a journal no other process holds.
+    void claim();
+
+    // Replays a journal left by a process, returns true if there was one.
+    bool recover(const std::string& path);
+
+    // Requires the lock, as all the functions below.
+    void journal(const std::string& database, const doc_id& persona, std::string_view folder, const doc_id& item, uint32_t count, uint64_t sequence);
+
+    void applied(const doc_id& persona, const entry& e);
+
+    void append(const std::string& line);
+
+    // Rewrites the journal with the counts waiting and being written.
+    void checkpoint();
+
+    void record(const std::string& database, const doc_id& persona, std::string_view folder, const doc_id& item, buffered b, unsigned retries);
+
+    void run();
+
+    void write(const doc_id& persona);
+
+    settings _settings;
+    std::once_flag _started;
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    // Personas waiting, and the order in which they are due. Both have the same identifiers.
+    std::unordered_map<doc_id, entry> _pending;
+    std::deque<doc_id> _due;
+    // Personas being written, with their counts, so that a checkpoint keeps them.
+    std::unordered_map<doc_id, entry> _writing;
+    std::string _journal_path;
+    int _journal_lock = -1;
+    std::FILE* _journal = nullptr;
+    size_t _journal_size = 0;
+    uint64_t _sequence = 0;
+    statistics _statistics;
+    bool _stop = false;
+  };
+
+} // End namespace zambezi.
+
+#endif
@@ -0,0 +1,175 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <exception>
+
+#include "hx2a/server.hpp"
+#include "hx2a/cursor.hpp"
+
+#include "hx2a/zambezi/cart_lifecycle.hpp"
+#include "hx2a/zambezi/cart_buffer.hpp"
+#include "hx2a/zambezi/partitions.hpp"
+
+using namespace hx2a;
+
+namespace zambezi {
+
+  cart_lifecycle& cart_lifecycle::instance(){
+    static cart_lifecycle l;
+    return l;
+  }
+
+  cart_lifecycle::~cart_lifecycle(){
+    if (_thread.joinable()){
+      {
+	std::lock_guard l(_mutex);
+	_stop = true;
+      }
+
+      _wake.notify_one();
+      _thread.join();
+    }
+  }
+
+  void cart_lifecycle::configure(const settings& s){
+    _settings = s;
+    persona::set_cart_activity_resolution(std::min<std::chrono::seconds>(std::chrono::hours(1), s.inactivity / 24));
+    persona::set_cart_process(s.process);
+  }
+
+  void cart_lifecycle::start(){
+    std::call_once(_started, [this]{ _thread = std::thread([this]{ loop(); }); });
+  }
+
+  void cart_lifecycle::loop(){
+    for (;;){
+      {
+	std::unique_lock l(_mutex);
+	_wake.wait_for(l, _settings.interval, [this]{ return _stop; });
+
+	if (_stop){
+	  return;
+	}
+      }
+
+      try{
+	run();
+      }
+      catch (const std::exception&){
+	// The carts not reached are compacted by the next pass.
+      }
+    }
+  }
+
+  cart_lifecycle::statistics cart_lifecycle::run(){
+    std::lock_guard pass(_pass);
+    statistics s;
+    int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    int64_t deadline = now - _settings.inactivity.count();
+
+    for (const std::string& database: partitions::databases()){
+      std::vector<doc_id> ids;
+
+      {
+	partitions::connector c(database);
+
+	for (cursor<persona> cur; cur; ++cur){
+	  ids.push_back(cur.get_id());
+	}
+      }
+
+      // A connector per persona, so that it is saved under the persona's lock, like the writes of the buffer.
+      for (const doc_id& id: ids){
+	std::lock_guard pl(cart_buffer::lock(id));
+	++s.scanned;
+
+	// Being edited.
+	if (!cart_buffer::instance().pending(id).empty()){
+	  continue;
+	}
+
+	partitions::connector c(database);
+	persona_p p = persona::get(id);
+
+	if (p == nullptr || p->is_cart_cold()){
+	  _unknown_activity.erase(id);
+	  continue;
+	}
+
+	int64_t activity = p->get_cart_activity();
+
+	// Carts not changed since the activity is recorded are observed from the first pass reaching them, outside of
+	// the personas, so that the passes write nothing for the carts they leave as they are.
+	if (!activity){
+	  activity = _unknown_activity.try_emplace(id, now).first->second;
+	}
+	else{
+	  _unknown_activity.erase(id);
+	}
+
+	if (activity > deadline){
+	  continue;
+	}
+
+	// Only the inactive carts without recorded process are claimed, the claim being the only write of the pass
+	// before their compaction.
+	if (!_settings.process.empty() && p->get_cart_process() != _settings.process){
+	  if (p->get_cart_process().empty()){
+	    p->claim_cart();
+	  }
+	  else{
+	    ++s.kept_for_process;
+	  }
+
+	  continue;
+	}
+
+	if (!_settings.drop_snapshots && !persona::mycart::cold_snapshots && p->cart_has_snapshots()){
+	  ++s.kept_for_snapshots;
+	  continue;
+	}
+
+	std::optional<persona::compaction> r = p->compact_cart(_settings.drop_snapshots);
+
+	// Empty.
+	if (!r){
+	  continue;
+	}
+
+	_unknown_activity.erase(id);
+	++s.compacted;
+	s.lines_compacted += r->lines;
+	s.snapshots_dropped += r->snapshots_dropped;
+	s.bytes_before += r->bytes_before;
+	s.bytes_after += r->bytes_after;
+      }
+    }
+
+    std::lock_guard l(_mutex);
+    ++_statistics.passes;
+    _statistics.scanned += s.scanned;
+    _statistics.compacted += s.compacted;
+    _statistics.kept_for_snapshots += s.kept_for_snapshots;
+    _statistics.kept_for_process += s.kept_for_process;
+    _statistics.snapshots_dropped += s.snapshots_dropped;
+    _statistics.lines_compacted += s.lines_compacted;
+    _statistics.bytes_before += s.bytes_before;
+    _statistics.bytes_after += s.bytes_after;
+    s.passes = 1;
+    s.rehydrated = persona::get_rehydrated_carts();
+    return s;
+  }
+
+  cart_lifecycle::statistics cart_lifecycle::get_statistics(){
+    std::lock_guard l(_mutex);
+    statistics s = _statistics;
+    s.rehydrated = persona::get_rehydrated_carts();
+    return s;
+  }
+
+} // End namespace zambezi.
@@ -0,0 +1,115 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_CART_LIFECYCLE_HPP
+#define HX2A_ZAMBEZI_CART_LIFECYCLE_HPP
+
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <chrono>
+#include <condition_variable>
+
+#include "hx2a/zambezi/ontology.hpp"
+
+namespace zambezi {
+
+  // Background compaction of abandoned carts, opt-in.
+  //
+  // Most carts are abandoned, and stay in the personas as lines, folders and snapshots nobody reads. A periodic
+  // pass over the personas of all the databases (see partitions.hpp) replaces the carts inactive for longer than
+  // the configured period by their compact cold representation (see persona::compact_cart). The first access to
+  // the cart afterwards restores it, transparently for the services.
+  //
+  // The snapshots of the lines are kept in the cold representation when their type has a cold form (see
+  // gen_cart::to_cold), as the persona's do, unless the settings drop them. Carts with other snapshots are only
+  // compacted if the settings allow dropping the snapshots, restored lines then take new ones. Carts with counts
+  // still waiting in the write-behind buffer (see cart_buffer.hpp) are left for the next pass.
+  //
+  // The activity and the process of a cart are recorded when it is changed (see persona::edit_cart), reading it
+  // records nothing. A pass writes only the carts it compacts, and the inactive carts it claims.
+  //
+  // A compaction is saved under the lock of the persona in this process, which other processes do not take: a
+  // cart written by another process between the read of the persona by the pass and its save would lose the
+  // write. With several processes, each one is given a name (see settings::process), recorded in the personas
+  // whose carts it accesses, and a pass only compacts the carts of its process. As the carts of a persona are
+  // updated through one process anyway (see cart_buffer.hpp), the carts a pass compacts are only written under
+  // its locks. Inactive carts without recorded process are claimed by the first pass reaching them, and compacted
+  // by a later one if no other process changed them in between.
+  class cart_lifecycle
+  {
+  public:
+
+    struct settings
+    {
+      // Carts not changed for that long are compacted.
+      std::chrono::seconds inactivity{std::chrono::hours(24 * 30)};
+      std::chrono::seconds interval{std::chrono::hours(6)};
+      bool drop_snapshots = false;
+      // Name of the process, unique among the processes sharing the databases and kept across restarts (host and
+      // port for instance). Empty, the default, compacts all the carts, for a single process.
+      std::string process;
+    };
+
+    struct statistics
+    {
+      uint64_t passes = 0;
+      uint64_t scanned = 0;
+      uint64_t compacted = 0;
+      // Inactive carts left hot because of snapshots without cold form.
+      uint64_t kept_for_snapshots = 0;
+      // Carts changed last by another process, left to it.
+      uint64_t kept_for_process = 0;
+      uint64_t snapshots_dropped = 0;
+      uint64_t lines_compacted = 0;
+      // Since the process started, see persona::get_rehydrated_carts.
+      uint64_t rehydrated = 0;
+      // Size of the compacted carts as JSON before (see persona::compaction), and size of their cold
+      // representations.
+      uint64_t bytes_before = 0;
+      uint64_t bytes_after = 0;
+
+      uint64_t bytes_reclaimed() const { return bytes_before - bytes_after; }
+    };
+
+    static cart_lifecycle& instance();
+
+    // To be called before start. The activity resolution of the personas is kept well below the inactivity.
+    void configure(const settings& s);
+
+    // Starts the background thread, which runs a pass every interval. Can be called any number of times.
+    void start();
+
+    // Runs a pass right away, in the calling thread. Must be called without connector.
+    statistics run();
+
+    statistics get_statistics();
+
+    ~cart_lifecycle();
+
+  private:
+
+    cart_lifecycle() = default;
+
+    void loop();
+
+    settings _settings;
+    std::once_flag _started;
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    // Serializes the passes.
+    std::mutex _pass;
+    statistics _statistics;
+    // First pass which saw the carts without recorded activity, under the pass lock. Lost at restart, the carts are
+    // then observed again.
+    std::unordered_map<doc_id, int64_t> _unknown_activity;
+    bool _stop = false;
+  };
+
+} // End namespace zambezi.
+
+#endif
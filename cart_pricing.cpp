@@ -0,0 +1,228 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#include <latch>
+#include <limits>
+#include <algorithm>
+#include <exception>
+
+#include "hx2a/server.hpp"
+
+#include "hx2a/zambezi/cart_pricing.hpp"
+#include "hx2a/zambezi/partitions.hpp"
+
+using namespace hx2a;
+
+namespace zambezi {
+
+  size_t cart_pricing::key_hash::operator()(const key& k) const {
+    size_t h = std::hash<doc_id>()(k.inventory);
+
+    for (uint64_t v: {uint64_t(k.inputs_version), uint64_t(k.policy_revision), uint64_t(k.count), uint64_t(k.currency), uint64_t(std::hash<doc_id>()(k.user)),
+		      uint64_t(std::hash<std::string>()(k.postal_code)), uint64_t(std::hash<std::string>()(k.region)), uint64_t(k.country)}){
+      h ^= std::hash<uint64_t>()(v) + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+    }
+
+    return h;
+  }
+
+  cart_pricing& cart_pricing::instance(){
+    static cart_pricing p;
+    return p;
+  }
+
+  cart_pricing::~cart_pricing(){
+    {
+      std::lock_guard l(_mutex);
+      _stop = true;
+    }
+
+    _wake.notify_all();
+
+    for (std::thread& t: _threads){
+      t.join();
+    }
+  }
+
+  // Workers are started on first use, not when the module is loaded.
+  void cart_pricing::start(){
+    std::call_once(_started, [this]{
+      for (size_t i = 0; i != _settings.threads; ++i){
+	_threads.emplace_back([this]{ run(); });
+      }
+    });
+  }
+
+  void cart_pricing::run(){
+    for (;;){
+      std::function<void()> chunk;
+
+      {
+	std::unique_lock l(_mutex);
+	_wake.wait(l, [this]{ return _stop || !_chunks.empty(); });
+
+	if (_chunks.empty()){
+	  return;
+	}
+
+	chunk = std::move(_chunks.front());
+	_chunks.pop_front();
+      }
+
+      chunk();
+    }
+  }
+
+  std::vector<double> cart_pricing::price(const std::vector<line_to_price>& lines, currency::code currency_code, const doc_id& user){
+    start();
+
+    // A distinct item and count is priced once.
+    std::vector<line_to_price> distinct;
+    std::vector<size_t> positions(lines.size());
+    std::unordered_map<key, size_t, key_hash> seen;
+
+    for (size_t i = 0; i != lines.size(); ++i){
+      auto [j, inserted] = seen.try_emplace(key{lines[i].item, 0, 0, lines[i].count, 0, doc_id(), {}, {}, 0}, distinct.size());
+
+      if (inserted){
+	distinct.push_back(lines[i]);
+      }
+
+      positions[i] = j->second;
+    }
+
+    size_t n = distinct.size();
+    size_t chunk = std::max<size_t>(_settings.lines_per_chunk, 1);
+    size_t offloaded = 0;
+    std::vector<double> prices(n, std::numeric_limits<double>::quiet_NaN());
+
+    if (_settings.threads && n >= _settings.min_parallel_lines && n > chunk){
+      const std::string& database = partitions::current();
+      offloaded = (n - 1) / chunk;
+      std::latch done(static_cast<std::ptrdiff_t>(offloaded));
+      std::exception_ptr error;
+      std::mutex error_mutex;
+
+      {
+	std::lock_guard l(_mutex);
+
+	for (size_t b = chunk; b < n; b += chunk){
+	  _chunks.push_back([&, b]{
+	    try{
+	      partitions::connector c(database);
+	      price_chunk(distinct, b, std::min(b + chunk, n), currency_code, user, prices);
+	    }
+	    catch (...){
+	      std::lock_guard el(error_mutex);
+
+	      if (!error){
+		error = std::current_exception();
+	      }
+	    }
+
+	    done.count_down();
+	  });
+	}
+      }
+
+      _wake.notify_all();
+
+      // The chunks refer to the locals, they must be done before leaving, even on error.
+      try{
+	price_chunk(distinct, 0, chunk, currency_code, user, prices);
+      }
+      catch (...){
+	done.wait();
+	throw;
+      }
+
+      done.wait();
+
+      if (error){
+	std::rethrow_exception(error);
+      }
+    }
+    else{
+      price_chunk(distinct, 0, n, currency_code, user, prices);
+    }
+
+    {
+      std::lock_guard l(_mutex);
+      _statistics.lines += lines.size();
+      _statistics.duplicates += lines.size() - n;
+      _statistics.chunks_offloaded += offloaded;
+    }
+
+    std::vector<double> r(lines.size());
+
+    for (size_t i = 0; i != lines.size(); ++i){
+      r[i] = prices[positions[i]];
+    }
+
+    return r;
+  }
+
+  void cart_pricing::price_chunk(const std::vector<line_to_price>& lines, size_t begin, size_t end, currency::code currency_code, const doc_id& user, std::vector<double>& prices){
+    user_p u = user.is_null() ? user_p() : user::get(user);
+    address_p a = u != nullptr ? u->get_address() : address_p();
+    std::string postal_code = a != nullptr ? std::string(a->get_postal_code()) : std::string();
+    std::string region = a != nullptr ? std::string(a->get_region()) : std::string();
+    uint32_t country = a != nullptr ? static_cast<uint32_t>(a->get_country()) : 0;
+    size_t shard_capacity = _settings.capacity / shards + 1;
+    uint64_t memoized_count = 0;
+    uint64_t evaluated = 0;
+
+    for (size_t i = begin; i != end; ++i){
+      inventory_p inv = inventory::get(lines[i].item);
+
+      if (inv == nullptr){
+	continue;
+      }
+
+      currency::code cc = static_cast<uint32_t>(currency_code) ? currency_code : inv->get_reference_currency();
+      pricing_policy_p pp = inv->get_pricing_policy();
+      uint32_t revision = inv->get_copied_policy_revision();
+      // What the policy reads is only known for its current source, the copied one may be older.
+      bool reads_user = pp != nullptr && (revision != pp->get_revision() || (pp->get_read_variables() & (pricing_policy::user_read | pricing_policy::other_read)));
+      key k{inv->get_id(), inv->get_price_inputs_version(), revision, lines[i].count, static_cast<uint32_t>(cc), reads_user ? user : doc_id(), postal_code, region, country};
+      shard& s = _shards[key_hash()(k) % shards];
+
+      if (_settings.capacity){
+	std::lock_guard l(s.mutex);
+	auto m = s.prices.find(k);
+
+	if (m != s.prices.end() && clock::now() - m->second.at <= _settings.ttl){
+	  prices[i] = m->second.price;
+	  ++memoized_count;
+	  continue;
+	}
+      }
+
+      double price = inv->calculate_price(lines[i].count, cc, u);
+      prices[i] = price;
+      ++evaluated;
+
+      if (_settings.capacity){
+	std::lock_guard l(s.mutex);
+
+	if (s.prices.size() >= shard_capacity){
+	  s.prices.clear();
+	}
+
+	s.prices[k] = memoized{price, clock::now()};
+      }
+    }
+
+    std::lock_guard l(_mutex);
+    _statistics.memoized += memoized_count;
+    _statistics.evaluated += evaluated;
+  }
+
+  cart_pricing::statistics cart_pricing::get_statistics(){
+    std::lock_guard l(_mutex);
+    return _statistics;
+  }
+
+} // End namespace zambezi.
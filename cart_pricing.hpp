@@ -0,0 +1,139 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_CART_PRICING_HPP
+#define HX2A_ZAMBEZI_CART_PRICING_HPP
+
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "hx2a/zambezi/ontology.hpp"
+
+namespace zambezi {
+
+  // Pricer of cart lines, for gen_cart::cart_total.
+  //
+  // Every line costs a load of its inventory and a run of the pricing policy. Lines with the same item and count
+  // are priced once per request. Large carts are split into chunks priced in parallel by workers, each with its own
+  // connector, the calling thread pricing the first chunk.
+  //
+  // Unit prices are memoized across requests, keyed by the inventory, the version of its price inputs, the
+  // revision of the pricing policy source it runs, the count, the currency and the address of the user. The user
+  // is part of the key only for the policies reading it (see pricing_policy::get_read_variables), so that the
+  // users with the same address share the prices. A cart priced again only runs the policies of the lines which
+  // changed since.
+  //
+  // A chunk failing fails the whole pricing, with the first error.
+  class cart_pricing
+  {
+  public:
+
+    using line_to_price = hx2a::zambezi::line_to_price;
+
+    struct settings
+    {
+      size_t threads = 4;
+      // Carts with fewer distinct lines are priced by the calling thread only.
+      size_t min_parallel_lines = 16;
+      size_t lines_per_chunk = 8;
+      // Memoized prices, 0 disables the memoization.
+      size_t capacity = 65536;
+      std::chrono::milliseconds ttl{60000};
+    };
+
+    struct statistics
+    {
+      uint64_t lines = 0;
+      // Lines with the same item and count as another line of the same cart.
+      uint64_t duplicates = 0;
+      uint64_t memoized = 0;
+      uint64_t evaluated = 0;
+      uint64_t chunks_offloaded = 0;
+    };
+
+    static cart_pricing& instance();
+
+    // To be called before the first use.
+    void configure(const settings& s){ _settings = s; }
+
+    // Unit prices of the lines in the currency given, 0 for the reference currency of each inventory, for the user
+    // (null for none). NaN for a line whose inventory is not found. To be called with a connector open, the threads
+    // open the same database (see partitions.hpp).
+    std::vector<double> price(const std::vector<line_to_price>& lines, currency::code currency_code, const doc_id& user);
+
+    statistics get_statistics();
+
+    ~cart_pricing();
+
+  private:
+
+    using clock = std::chrono::steady_clock;
+
+    struct key
+    {
+      doc_id inventory;
+      uint32_t inputs_version;
+      uint32_t policy_revision;
+      uint32_t count;
+      uint32_t currency;
+      // Null when the policy does not read it.
+      doc_id user;
+      // Of the address of the user, empty without one.
+      std::string postal_code;
+      std::string region;
+      uint32_t country;
+
+      bool operator==(const key&) const = default;
+    };
+
+    struct key_hash
+    {
+      size_t operator()(const key& k) const;
+    };
+
+    struct memoized
+    {
+      double price;
+      clock::time_point at;
+    };
+
+    static constexpr size_t shards = 16;
+
+    struct shard
+    {
+      std::mutex mutex;
+      std::unordered_map<key, memoized, key_hash> prices;
+    };
+
+    cart_pricing() = default;
+
+    void start();
+
+    void run();
+
+    // Prices the distinct lines [begin, end) in the connector of the calling thread.
+    void price_chunk(const std::vector<line_to_price>& lines, size_t begin, size_t end, currency::code currency_code, const doc_id& user, std::vector<double>& prices);
+
+    settings _settings;
+    std::once_flag _started;
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::deque<std::function<void()>> _chunks;
+    shard _shards[shards];
+    statistics _statistics;
+    bool _stop = false;
+  };
+
+} // End namespace zambezi.
+
+#endif
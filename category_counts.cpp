@@ -0,0 +1,310 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "hx2a/server.hpp"
+#include "hx2a/cursor.hpp"
+
+#include "hx2a/zambezi/category_counts.hpp"
+#include "hx2a/zambezi/category_tree.hpp"
+#include "hx2a/zambezi/partitions.hpp"
+#include "hx2a/zambezi/diagnostics.hpp"
+
+using namespace hx2a;
+
+namespace zambezi {
+
+  namespace {
+
+    // Calls f(i) for every i in [0, n), spread over the threads, each with its own connector to the database.
+    template <typename F>
+    void parallel_for(const std::string& database, size_t n, size_t threads, F&& f){
+      std::atomic<size_t> next{0};
+      std::vector<std::thread> workers;
+
+      for (size_t t = 0; t != std::max<size_t>(std::min(threads, n), 1); ++t){
+	workers.emplace_back([&]{
+	  partitions::connector c(database);
+
+	  for (size_t i; (i = next.fetch_add(1)) < n; ){
+	    f(i);
+	  }
+	});
+      }
+
+      for (std::thread& w: workers){
+	w.join();
+      }
+    }
+
+    // The category followed by its ancestors, from the tree when it is whole, else following the parents.
+    std::vector<doc_id> with_ancestors(const product_category& pc){
+      std::vector<doc_id> r{pc.get_id()};
+      category_tree::snapshot_p tree = category_tree::instance().get_complete();
+
+      if (tree != nullptr && tree->contains(pc.get_id())){
+	std::vector<doc_id> a = tree->get_ancestors(pc.get_id());
+	r.insert(r.end(), a.cbegin(), a.cend());
+	return r;
+      }
+
+      for (product_category_p a = pc.get_parent(); a != nullptr; a = a->get_parent()){
+	r.push_back(a->get_id());
+      }
+
+      return r;
+    }
+
+    // Never below 0.
+    count_type add(count_type v, int64_t d, uint64_t& clamped){
+      if (d < 0 && static_cast<count_type>(-d) > v){
+	++clamped;
+	return 0;
+      }
+
+      return v + d;
+    }
+
+  }
+
+  category_counter& category_counter::instance(){
+    static category_counter c;
+    return c;
+  }
+
+  category_counter::~category_counter(){
+    {
+      std::lock_guard l(_mutex);
+      _stop = true;
+    }
+
+    _wake.notify_all();
+
+    if (_thread.joinable()){
+      _thread.join();
+    }
+  }
+
+  void category_counter::add_products(const product_category& pc, int64_t delta){
+    record(with_ancestors(pc), delta, delta);
+  }
+
+  void category_counter::move(const product_category& pc, const product_category_p& parent){
+    std::vector<doc_id> from = with_ancestors(pc);
+    std::vector<doc_id> to;
+
+    if (parent != nullptr){
+      to = with_ancestors(*parent);
+    }
+
+    // The products of the subtree, including the deltas recorded and not written yet, which go to the old ancestors.
+    int64_t moved = static_cast<int64_t>(pc.get_subtree_product_count());
+
+    {
+      std::lock_guard l(_mutex);
+      auto d = _pending.find(partitions::current());
+
+      if (d != _pending.end()){
+	auto i = d->second.find(pc.get_id());
+	moved += i != d->second.end() ? i->second.subtree : 0;
+      }
+    }
+
+    // Not the category itself, which keeps its subtree.
+    from.erase(from.begin());
+    record(std::move(from), 0, -moved);
+    record(std::move(to), 0, moved);
+  }
+
+  void category_counter::remove(const product_category& pc){
+    move(pc, nullptr);
+  }
+
+  void category_counter::record(std::vector<doc_id> categories, int64_t direct, int64_t subtree){
+    if (categories.empty() || (!direct && !subtree)){
+      return;
+    }
+
+    // Threads are started on first use, not when the module is loaded.
+    std::call_once(_started, [this]{
+      _thread = std::thread([this]{ run(); });
+    });
+
+    partitions::after_commit([this, database = partitions::current(), categories = std::move(categories), direct, subtree]{
+      {
+	std::lock_guard l(_mutex);
+	++_statistics.requested;
+	std::unordered_map<doc_id, delta>& d = _pending[database];
+	d[categories.front()].direct += direct;
+
+	for (const doc_id& id: categories){
+	  d[id].subtree += subtree;
+	}
+      }
+
+      _wake.notify_all();
+    });
+  }
+
+  void category_counter::run(){
+    std::unique_lock l(_mutex);
+
+    for (;;){
+      _wake.wait(l, [this]{ return _stop || !_pending.empty(); });
+
+      if (_stop){
+	return;
+      }
+
+      // The deltas following this one within the window are written with it.
+      if (_wake.wait_for(l, _settings.window, [this]{ return _stop; })){
+	return;
+      }
+
+      deltas d;
+      d.swap(_pending);
+      l.unlock();
+      write(std::move(d));
+      l.lock();
+    }
+  }
+
+  void category_counter::flush(){
+    deltas d;
+
+    {
+      std::lock_guard l(_mutex);
+      d.swap(_pending);
+    }
+
+    write(std::move(d));
+  }
+
+  void category_counter::write(deltas d){
+    std::lock_guard wl(_write_mutex);
+    statistics s;
+
+    for (const auto& [database, categories]: d){
+      try{
+	partitions::connector c(database);
+
+	for (const auto& [id, v]: categories){
+	  if (!v.direct && !v.subtree){
+	    continue;
+	  }
+
+	  product_category_p pc = product_category::get(id);
+
+	  if (pc == nullptr){
+	    ++s.dropped;
+	    continue;
+	  }
+
+	  pc->set_product_counts(add(pc->get_direct_product_count(), v.direct, s.clamped), add(pc->get_subtree_product_count(), v.subtree, s.clamped));
+	  ++s.written;
+	}
+      }
+      catch (const std::exception& e){
+	++s.failed;
+	diagnostics::report("product counts of %s not written: %s", database.c_str(), e.what());
+      }
+    }
+
+    std::lock_guard l(_mutex);
+    _statistics.written += s.written;
+    _statistics.clamped += s.clamped;
+    _statistics.dropped += s.dropped;
+    _statistics.failed += s.failed;
+  }
+
+  category_counter::statistics category_counter::get_statistics(){
+    std::lock_guard l(_mutex);
+    return _statistics;
+  }
+
+  category_counts_repair::statistics category_counts_repair::run(size_t threads){
+    category_counter::instance().flush();
+    category_tree& tree = category_tree::instance();
+    tree.reload();
+    category_tree::snapshot_p s = tree.get();
+    statistics r;
+
+    for (const std::string& database: partitions::databases()){
+      statistics d = run(*s, database, threads);
+      r.categories += d.categories;
+      r.products += d.products;
+      r.fixed += d.fixed;
+    }
+
+    return r;
+  }
+
+  category_counts_repair::statistics category_counts_repair::run(const category_tree::snapshot& s, const std::string& database, size_t threads){
+    // Depth first, every category comes after its ancestors.
+    std::vector<doc_id> ids;
+
+    for (const doc_id& root: s.get_roots(database)){
+      std::span<const doc_id> subtree = s.get_subtree(root);
+      ids.insert(ids.end(), subtree.begin(), subtree.end());
+    }
+
+    std::vector<count_type> direct(ids.size());
+
+    parallel_for(database, ids.size(), threads, [&](size_t i){
+      count_type n = 0;
+
+      for (cursor<product, "category"> c(ids[i]); c; ++c){
+	++n;
+      }
+
+      direct[i] = n;
+    });
+
+    std::unordered_map<doc_id, size_t> position;
+    position.reserve(ids.size());
+
+    for (size_t i = 0; i != ids.size(); ++i){
+      position.emplace(ids[i], i);
+    }
+
+    std::vector<count_type> subtree(direct);
+
+    for (size_t i = ids.size(); i--; ){
+      doc_id parent = s.get_parent(ids[i]);
+
+      if (!parent.is_null()){
+	subtree[position[parent]] += subtree[i];
+      }
+    }
+
+    std::atomic<uint64_t> fixed{0};
+
+    parallel_for(database, ids.size(), threads, [&](size_t i){
+      product_category_p pc = product_category::get(ids[i]);
+
+      if (pc != nullptr && (pc->get_direct_product_count() != direct[i] || pc->get_subtree_product_count() != subtree[i])){
+	pc->set_product_counts(direct[i], subtree[i]);
+	fixed.fetch_add(1, std::memory_order_relaxed);
+      }
+    });
+
+    statistics r;
+    r.categories = ids.size();
+
+    for (count_type n: direct){
+      r.products += n;
+    }
+
+    r.fixed = fixed;
+    return r;
+  }
+
+} // End namespace zambezi.
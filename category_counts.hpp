@@ -0,0 +1,146 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_CATEGORY_COUNTS_HPP
+#define HX2A_ZAMBEZI_CATEGORY_COUNTS_HPP
+
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "hx2a/zambezi/ontology.hpp"
+#include "hx2a/zambezi/category_tree.hpp"
+
+namespace zambezi {
+
+  // Asynchronous maintenance of the product counts of the categories (see product_category::get_direct_product_count).
+  //
+  // Requests do not write the counts: creating, moving or removing a product, and moving or removing a category,
+  // record deltas here once their connector committed, each one for a category and each of its ancestors at that
+  // time. Deltas are additions, they are summed per category whatever their order. A background thread writes
+  // them every window, each category once, so that the categories near the roots are written once per window and
+  // not once per product, and the writes of concurrent requests are not lost. The counts therefore lag by up to
+  // the window.
+  //
+  // A count going below 0 stays at 0 and is counted as clamped, it tells that the counts drifted (changes made by
+  // other processes at the same time, products changed by other means, deltas pending when a process stopped),
+  // which the repair below fixes.
+  class category_counter
+  {
+  public:
+
+    struct settings
+    {
+      std::chrono::milliseconds window{1000};
+    };
+
+    struct statistics
+    {
+      // Deltas recorded.
+      uint64_t requested = 0;
+      // Categories written.
+      uint64_t written = 0;
+      // Counts which would have gone below 0.
+      uint64_t clamped = 0;
+      // Deltas of categories removed in the meantime.
+      uint64_t dropped = 0;
+      // Windows whose writes failed, their deltas are lost.
+      uint64_t failed = 0;
+    };
+
+    static category_counter& instance();
+
+    // To be called before the first change.
+    void configure(const settings& s){ _settings = s; }
+
+    // Adds delta products directly in the category. The category is in the current database of the calling thread
+    // (see partitions.hpp), as are all the functions below.
+    void add_products(const product_category& pc, int64_t delta);
+
+    // Moves the products of the subtree of the category from its ancestors to the new parent and its ancestors. To
+    // be called before the parent changes.
+    void move(const product_category& pc, const product_category_p& parent);
+
+    // Takes the products of the subtree of the category out of the counts of its ancestors. To be called before it
+    // is removed.
+    void remove(const product_category& pc);
+
+    // Writes the deltas recorded so far, right away.
+    void flush();
+
+    statistics get_statistics();
+
+    ~category_counter();
+
+  private:
+
+    struct delta
+    {
+      int64_t direct = 0;
+      int64_t subtree = 0;
+    };
+
+    // Per database, then per category.
+    using deltas = std::unordered_map<std::string, std::unordered_map<doc_id, delta>>;
+
+    category_counter() = default;
+
+    void run();
+
+    // Adds direct to the direct count of the first category, and subtree to the subtree counts of all of them, once
+    // the connector of the calling thread committed.
+    void record(std::vector<doc_id> categories, int64_t direct, int64_t subtree);
+
+    void write(deltas d);
+
+    settings _settings;
+    std::once_flag _started;
+    std::thread _thread;
+    // Windows are written one at a time.
+    std::mutex _write_mutex;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    deltas _pending;
+    statistics _statistics;
+    bool _stop = false;
+  };
+
+  // Rebuilds from scratch the product counts of all the categories (see product_category::get_direct_product_count),
+  // for instance after products were imported without the product functions, or to check the deltas.
+  //
+  // The tree is reloaded (see category_tree.hpp), then the products directly in every category are counted on the
+  // index, the categories being spread over the threads, each with its own connector. The subtree counts are summed
+  // in memory, bottom up, and the categories whose counts differ are updated, in parallel again. The databases of
+  // the tenants (see partitions.hpp) are repaired one after the other. Products created,
+  // moved or removed during the repair can be missed, it is meant to be run when the catalog is quiet. The deltas
+  // pending in the counter of the process are written first.
+  //
+  // It opens its own connectors, it is not meant to be called with a connector open.
+  struct category_counts_repair
+  {
+    struct statistics
+    {
+      uint64_t categories = 0;
+      uint64_t products = 0;
+      // Categories whose counts were wrong.
+      uint64_t fixed = 0;
+    };
+
+    static statistics run(size_t threads = 4);
+
+  private:
+
+    // The categories of one database.
+    static statistics run(const category_tree::snapshot& s, const std::string& database, size_t threads);
+  };
+
+} // End namespace zambezi.
+
+#endif
@@ -0,0 +1,397 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#include <algorithm>
+#include <exception>
+
+#include "hx2a/server.hpp"
+#include "hx2a/cursor.hpp"
+
+#include "hx2a/zambezi/category_tree.hpp"
+#include "hx2a/zambezi/partitions.hpp"
+#include "hx2a/zambezi/diagnostics.hpp"
+
+using namespace hx2a;
+
+namespace zambezi {
+
+  namespace {
+
+    // Observing categories from the start, so that no change is missed.
+    [[maybe_unused]] category_tree& registration = category_tree::instance();
+
+    // Erases the categories given and all their descendants.
+    void erase_subtrees(std::unordered_map<doc_id, doc_id>& parents, std::unordered_map<doc_id, std::string>& databases, std::unordered_set<doc_id> removed){
+      for (bool more = true; more; ){
+	more = false;
+
+	for (const auto& [id, parent]: parents){
+	  if (!parent.is_null() && removed.find(parent) != removed.end() && removed.insert(id).second){
+	    more = true;
+	  }
+	}
+      }
+
+      for (const doc_id& id: removed){
+	parents.erase(id);
+	databases.erase(id);
+      }
+    }
+
+  }
+
+  doc_id category_tree::snapshot::get_parent(const doc_id& id) const {
+    std::optional<uint32_t> i = find(id);
+
+    if (!i || _parent[*i] == none){
+      return {};
+    }
+
+    return _ids[_parent[*i]];
+  }
+
+  std::optional<size_t> category_tree::snapshot::get_depth(const doc_id& id) const {
+    std::optional<uint32_t> i = find(id);
+
+    if (!i){
+      return {};
+    }
+
+    return _depth[*i];
+  }
+
+  std::vector<doc_id> category_tree::snapshot::get_ancestors(const doc_id& id) const {
+    std::vector<doc_id> r;
+    std::optional<uint32_t> i = find(id);
+
+    if (!i){
+      return r;
+    }
+
+    r.reserve(_depth[*i]);
+
+    for (uint32_t p = _parent[*i]; p != none; p = _parent[p]){
+      r.push_back(_ids[p]);
+    }
+
+    return r;
+  }
+
+  std::span<const doc_id> category_tree::snapshot::get_children(const doc_id& id) const {
+    std::optional<uint32_t> i = find(id);
+
+    if (!i){
+      return {};
+    }
+
+    return {_children.data() + _children_begin[*i], _children_begin[*i + 1] - _children_begin[*i]};
+  }
+
+  std::span<const doc_id> category_tree::snapshot::get_subtree(const doc_id& id) const {
+    std::optional<uint32_t> i = find(id);
+
+    if (!i){
+      return {};
+    }
+
+    return {_ids.data() + *i, _subtree_end[*i] - *i};
+  }
+
+  bool category_tree::snapshot::is_in_subtree(const doc_id& id, const doc_id& ancestor) const {
+    std::optional<uint32_t> i = find(id);
+    std::optional<uint32_t> a = find(ancestor);
+    return i && a && *a <= *i && *i < _subtree_end[*a];
+  }
+
+  category_tree& category_tree::instance(){
+    static category_tree t;
+    return t;
+  }
+
+  category_tree::category_tree():
+    _snapshot(std::make_shared<const snapshot>())
+  {
+    product_category::add_observer([this](product_category& pc, const doc_id&){
+      product_category_p parent = pc.get_parent();
+      changed(pc.get_id(), parent != nullptr ? parent->get_id() : doc_id());
+    });
+
+    product_category::add_removal_observer([this](const doc_id& id){ removed(id); });
+  }
+
+  category_tree::~category_tree(){
+    {
+      std::lock_guard l(_mutex);
+      _stop = true;
+    }
+
+    _wake.notify_all();
+
+    if (_worker.joinable()){
+      _worker.join();
+    }
+  }
+
+  // The tree is loaded on first use, not when the module is loaded.
+  void category_tree::start(){
+    std::call_once(_started, [this]{
+      _worker = std::thread([this]{ run(); });
+    });
+  }
+
+  category_tree::snapshot_p category_tree::get(){
+    start();
+    return _snapshot.load();
+  }
+
+  category_tree::snapshot_p category_tree::get_complete(){
+    snapshot_p s = get();
+    return s->_loaded && s->_changes == _changes.load() ? s : nullptr;
+  }
+
+  void category_tree::reload(){
+    start();
+    load();
+  }
+
+  void category_tree::run(){
+    load();
+    std::unique_lock l(_mutex);
+    clock::time_point next_load = clock::now() + _settings.reload_interval;
+    auto woken = [this]{ return _stop || _dirty; };
+
+    for (;;){
+      if (_settings.reload_interval.count()){
+	_wake.wait_until(l, next_load, woken);
+      }
+      else{
+	_wake.wait(l, woken);
+      }
+
+      if (_stop){
+	return;
+      }
+
+      if (_dirty){
+	// The changes following this one within the delay are published with it.
+	if (_wake.wait_for(l, _settings.publish_delay, [this]{ return _stop; })){
+	  return;
+	}
+
+	l.unlock();
+	publish();
+	l.lock();
+      }
+      else if (clock::now() >= next_load){
+	l.unlock();
+	load();
+	l.lock();
+	next_load = clock::now() + _settings.reload_interval;
+      }
+    }
+  }
+
+  void category_tree::load(){
+    std::lock_guard ll(_load_mutex);
+
+    {
+      std::lock_guard l(_mutex);
+      _loading = true;
+      _changed_while_loading.clear();
+      _removed_while_loading.clear();
+    }
+
+    std::unordered_map<doc_id, doc_id> parents;
+    std::unordered_map<doc_id, std::string> databases;
+
+    try{
+      for (const std::string& database: partitions::databases()){
+	partitions::connector c(database);
+
+	for (cursor<product_category> cur; cur; ++cur){
+	  product_category_p pc = product_category::get(cur.get_id());
+
+	  if (pc != nullptr){
+	    product_category_p parent = pc->get_parent();
+	    parents[pc->get_id()] = parent != nullptr ? parent->get_id() : doc_id();
+	    databases[pc->get_id()] = database;
+	  }
+	}
+      }
+    }
+    catch (const std::exception& e){
+      // Keeping what is known, the next load will tell.
+      diagnostics::report("category tree not loaded: %s", e.what());
+      std::lock_guard l(_mutex);
+      _loading = false;
+      return;
+    }
+
+    {
+      std::lock_guard l(_mutex);
+
+      for (const doc_id& id: _changed_while_loading){
+	auto i = _parents.find(id);
+
+	if (i != _parents.end()){
+	  parents[id] = i->second;
+	  databases[id] = _databases[id];
+	}
+      }
+
+      // With the descendants the load found.
+      erase_subtrees(parents, databases, _removed_while_loading);
+      _parents.swap(parents);
+      _databases.swap(databases);
+      _loading = false;
+      _loaded = true;
+      _changed_while_loading.clear();
+      _removed_while_loading.clear();
+    }
+
+    publish();
+  }
+
+  void category_tree::changed(const doc_id& id, const doc_id& parent){
+    {
+      std::lock_guard l(_mutex);
+      _parents[id] = parent;
+      // Changes are made with the category's database open.
+      _databases[id] = partitions::current();
+
+      if (_loading){
+	_changed_while_loading.insert(id);
+      }
+
+      ++_changes;
+      _dirty = true;
+    }
+
+    _wake.notify_all();
+  }
+
+  void category_tree::removed(const doc_id& id){
+    {
+      std::lock_guard l(_mutex);
+      erase_subtrees(_parents, _databases, {id});
+
+      if (_loading){
+	_removed_while_loading.insert(id);
+      }
+
+      ++_changes;
+      _dirty = true;
+    }
+
+    _wake.notify_all();
+  }
+
+  void category_tree::publish(){
+    std::lock_guard pl(_publish_mutex);
+    auto s = std::make_shared<snapshot>();
+    std::unordered_map<doc_id, doc_id> parents;
+    std::unordered_map<doc_id, std::string> databases;
+
+    // Building from a copy, changes go on meanwhile.
+    {
+      std::lock_guard l(_mutex);
+      parents = _parents;
+      databases = _databases;
+      s->_version = ++_version;
+      s->_loaded = _loaded;
+      s->_changes = _changes;
+      _dirty = false;
+    }
+
+    build(*s, parents, databases);
+    _snapshot.store(std::move(s));
+  }
+
+  void category_tree::build(snapshot& s, const std::unordered_map<doc_id, doc_id>& parents, const std::unordered_map<doc_id, std::string>& databases){
+    // A category whose parent is unknown is taken as a root. Categories in a cycle, which the callers of
+    // product_category::set_parent prevent, are unreachable and left out.
+    std::unordered_map<doc_id, std::vector<doc_id>> children;
+
+    for (const auto& [id, parent]: parents){
+      if (parent.is_null() || parents.find(parent) == parents.end()){
+	s._roots.push_back(id);
+      }
+      else{
+	children[parent].push_back(id);
+      }
+    }
+
+    std::sort(s._roots.begin(), s._roots.end());
+
+    for (const doc_id& id: s._roots){
+      s._database_roots[databases.at(id)].push_back(id);
+    }
+
+    for (auto& [id, c]: children){
+      std::sort(c.begin(), c.end());
+    }
+
+    size_t n = parents.size();
+    s._ids.reserve(n);
+    s._parent.reserve(n);
+    s._depth.reserve(n);
+    s._index.reserve(n);
+
+    struct visit
+    {
+      doc_id id;
+      uint32_t parent;
+      uint32_t depth;
+    };
+
+    std::vector<visit> stack;
+
+    for (auto i = s._roots.crbegin(); i != s._roots.crend(); ++i){
+      stack.push_back(visit{*i, snapshot::none, 0});
+    }
+
+    while (!stack.empty()){
+      visit v = stack.back();
+      stack.pop_back();
+      uint32_t i = static_cast<uint32_t>(s._ids.size());
+      s._ids.push_back(v.id);
+      s._parent.push_back(v.parent);
+      s._depth.push_back(v.depth);
+      s._index.emplace(v.id, i);
+      auto c = children.find(v.id);
+
+      if (c != children.end()){
+	for (auto j = c->second.crbegin(); j != c->second.crend(); ++j){
+	  stack.push_back(visit{*j, i, v.depth + 1});
+	}
+      }
+    }
+
+    // Subtrees are contiguous in depth-first order, each one ends where the last of its descendants ends.
+    s._subtree_end.resize(s._ids.size());
+
+    for (uint32_t i = static_cast<uint32_t>(s._ids.size()); i--; ){
+      s._subtree_end[i] = std::max(s._subtree_end[i], i + 1);
+
+      if (s._parent[i] != snapshot::none){
+	s._subtree_end[s._parent[i]] = std::max(s._subtree_end[s._parent[i]], s._subtree_end[i]);
+      }
+    }
+
+    s._children_begin.reserve(s._ids.size() + 1);
+
+    for (const doc_id& id: s._ids){
+      s._children_begin.push_back(static_cast<uint32_t>(s._children.size()));
+      auto c = children.find(id);
+
+      if (c != children.end()){
+	s._children.insert(s._children.end(), c->second.cbegin(), c->second.cend());
+      }
+    }
+
+    s._children_begin.push_back(static_cast<uint32_t>(s._children.size()));
+  }
+
+} // End namespace zambezi.
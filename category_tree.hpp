@@ -0,0 +1,193 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_CATEGORY_TREE_HPP
+#define HX2A_ZAMBEZI_CATEGORY_TREE_HPP
+
+#include <span>
+#include <mutex>
+#include <string>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <condition_variable>
+
+#include "hx2a/zambezi/ontology.hpp"
+
+namespace zambezi {
+
+  // Process-wide copy of the category tree, for breadcrumbs, menus and validations which otherwise load the
+  // categories one at a time following their parents.
+  //
+  // Readers get an immutable snapshot and never lock nor wait. Every change of a category in the process (see
+  // product_category::add_observer and add_removal_observer) is applied to the parent map kept by the tree. A
+  // background thread then builds a new snapshot from the map, without loading anything, and swaps it in. It
+  // waits for the publishing delay after a change first, so that a burst of changes (categories created in bulk,
+  // for instance) gives one snapshot. The snapshots being read stay alive until their last reader drops them.
+  //
+  // The tree holds the categories of all the tenants, every one in the database of its tenant (see
+  // partitions.hpp), a tree being whole in one database. The roots are also known per database.
+  //
+  // The whole tree is loaded by the background thread, started on first use, then loaded again periodically for
+  // the changes made by other processes. Until the first load is done, for the changes of this process not
+  // published yet, and for the changes of other processes until the next load, the snapshot is not whole: callers
+  // needing the exact tree use get_complete, and read the database when it is null. A change is applied when it
+  // is made in memory, a change whose document fails to be saved afterwards is reflected anyway, until the next
+  // load. Categories removed by other means than product_category::remove stay in the snapshots until the next
+  // load too.
+  class category_tree
+  {
+  public:
+
+    class snapshot
+    {
+    public:
+
+      // Bumped at every snapshot built.
+      uint64_t get_version() const { return _version; }
+
+      size_t size() const { return _ids.size(); }
+
+      bool contains(const doc_id& id) const { return _index.find(id) != _index.end(); }
+
+      // Null for a root, and for an unknown category.
+      doc_id get_parent(const doc_id& id) const;
+
+      // 0 for a root, empty for an unknown category.
+      std::optional<size_t> get_depth(const doc_id& id) const;
+
+      // From the parent up to the root.
+      std::vector<doc_id> get_ancestors(const doc_id& id) const;
+
+      // The direct sub-categories, in identifier order.
+      std::span<const doc_id> get_children(const doc_id& id) const;
+
+      // The category followed by all its descendants, depth first.
+      std::span<const doc_id> get_subtree(const doc_id& id) const;
+
+      // True when ancestor is the category itself or one of its ancestors.
+      bool is_in_subtree(const doc_id& id, const doc_id& ancestor) const;
+
+      std::span<const doc_id> get_roots() const { return {_roots.data(), _roots.size()}; }
+
+      std::span<const doc_id> get_roots(const std::string& database) const {
+	auto i = _database_roots.find(database);
+	return i == _database_roots.end() ? std::span<const doc_id>() : std::span<const doc_id>(i->second.data(), i->second.size());
+      }
+
+    private:
+
+      friend class category_tree;
+
+      static constexpr uint32_t none = UINT32_MAX;
+
+      std::optional<uint32_t> find(const doc_id& id) const {
+	auto i = _index.find(id);
+	return i == _index.end() ? std::optional<uint32_t>() : i->second;
+      }
+
+      uint64_t _version = 0;
+      // Built after a load succeeded, and from the changes counted so far.
+      bool _loaded = false;
+      uint64_t _changes = 0;
+      // Categories in depth-first order, the subtree of category i is [i, _subtree_end[i]).
+      std::vector<doc_id> _ids;
+      std::vector<uint32_t> _parent;
+      std::vector<uint32_t> _depth;
+      std::vector<uint32_t> _subtree_end;
+      // The children of category i are _children[_children_begin[i], _children_begin[i + 1]).
+      std::vector<uint32_t> _children_begin;
+      std::vector<doc_id> _children;
+      std::vector<doc_id> _roots;
+      std::unordered_map<std::string, std::vector<doc_id>> _database_roots;
+      std::unordered_map<doc_id, uint32_t> _index;
+    };
+
+    using snapshot_p = std::shared_ptr<const snapshot>;
+
+    struct settings
+    {
+      // Between a change and the snapshot showing it.
+      std::chrono::milliseconds publish_delay{50};
+      // Between two loads of the whole tree, 0 for none after the first one.
+      std::chrono::seconds reload_interval{600};
+    };
+
+    static category_tree& instance();
+
+    // To be called before the first use.
+    void configure(const settings& s){ _settings = s; }
+
+    // Never null.
+    snapshot_p get();
+
+    // The snapshot if the tree was loaded and all the changes made in this process since are in it, else null.
+    // Changes made by other processes since the last load are still missing.
+    snapshot_p get_complete();
+
+    // Loads the whole tree again from the database, for instance after changes made by other processes, and
+    // publishes it. The changes notified in the meantime are kept. It opens its own connector, it is not meant to
+    // be called from a service.
+    void reload();
+
+    ~category_tree();
+
+  private:
+
+    using clock = std::chrono::steady_clock;
+
+    category_tree();
+
+    void start();
+
+    // The background thread.
+    void run();
+
+    void load();
+
+    void changed(const doc_id& id, const doc_id& parent);
+
+    // With its subtree.
+    void removed(const doc_id& id);
+
+    // Builds a snapshot from the parent map and swaps it in.
+    void publish();
+
+    static void build(snapshot& s, const std::unordered_map<doc_id, doc_id>& parents, const std::unordered_map<doc_id, std::string>& databases);
+
+    settings _settings;
+    std::once_flag _started;
+    std::thread _worker;
+    // Loads are done one at a time, and so are publications.
+    std::mutex _load_mutex;
+    std::mutex _publish_mutex;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    // Parent of every category known, null for the roots, and its database.
+    std::unordered_map<doc_id, doc_id> _parents;
+    std::unordered_map<doc_id, std::string> _databases;
+    // Categories changed or removed while the tree is being loaded, which the load may have read before.
+    std::unordered_set<doc_id> _changed_while_loading;
+    std::unordered_set<doc_id> _removed_while_loading;
+    bool _loading = false;
+    bool _loaded = false;
+    // Changes not published yet.
+    bool _dirty = false;
+    bool _stop = false;
+    uint64_t _version = 0;
+    // Changes applied to the parent map, counted under the lock.
+    std::atomic<uint64_t> _changes{0};
+    std::atomic<snapshot_p> _snapshot;
+  };
+
+} // End namespace zambezi.
+
+#endif
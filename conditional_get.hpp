@@ -0,0 +1,216 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_CONDITIONAL_GET_HPP
+#define HX2A_ZAMBEZI_CONDITIONAL_GET_HPP
+
+#include <mutex>
+#include <cstdio>
+#include <cstdint>
+#include <chrono>
+#include <string>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+
+#include "hx2a/basic_service.hpp"
+#include "hx2a/services/query_id.hpp"
+
+#include "hx2a/zambezi/json_stream.hpp"
+
+using namespace hx2a;
+
+namespace zambezi {
+
+  // Get service answering conditional requests.
+  //
+  // The reply carries an ETag derived from the identifier and the revision of the document (an FNV-1a hash of
+  // both, telling neither), and a request whose If-None-Match matches it is answered with 304 Not Modified,
+  // without serializing the document. T must expose uint32_t get_revision() const, bumped at every change visible
+  // in its serialization (pricing policies do). Writer is called as Writer()(json_stream&, const T&) to write the
+  // document, which is loaded once and written as loaded, the ETag matching the body.
+  //
+  // It is a plain service, the checks of the session and of the user the framework makes before calling any
+  // service are made before a 304 as before a 200. The documents served are not restricted further, as with the
+  // generic get service, it is meant for shared ones such as the pricing policies.
+  //
+  // Revisions read are remembered in the process. When the remembered revision is recent enough (see
+  // set_revision_ttl) the 304 is answered without reading the database either. This is disabled by default: the
+  // services changing or removing the documents in this process call forget, but a change made by another
+  // process goes unnoticed for up to the TTL. At most set_revision_capacity revisions are remembered.
+  template <tag_t Name, typename T, tag_t Database, typename Writer>
+  class conditional_get_service: public basic_service<Name, query_id>
+  {
+  public:
+
+    // To be called before the first request. 0 disables the skipping of the database read.
+    static void set_revision_ttl(std::chrono::milliseconds ttl){ revision_ttl() = ttl; }
+
+    static void set_revision_capacity(size_t capacity){ revision_capacity() = capacity; }
+
+    // To be called when the document changes or is removed.
+    static void forget(const doc_id& id){
+      std::lock_guard l(cache_mutex());
+      cache().erase(id);
+    }
+
+    static std::string etag(const doc_id& id, uint32_t revision){
+      uint64_t h = 14695981039346656037ull;
+
+      auto add = [&h](std::string_view s){
+	for (char c: s){
+	  h ^= static_cast<unsigned char>(c);
+	  h *= 1099511628211ull;
+	}
+      };
+
+      add(id.to_string());
+      add("-");
+      add(std::to_string(revision));
+      char r[20];
+      std::snprintf(r, sizeof(r), "\"%016llx\"", static_cast<unsigned long long>(h));
+      return r;
+    }
+
+    reply_p call(http_request& req, const session_info*, const organization_p&, const user_p&, const rfr<query_id>& q) override {
+      doc_id id = q->get_id();
+      std::string_view if_none_match = req.get_header("If-None-Match");
+
+      if (std::optional<uint32_t> revision = remembered(id)){
+	std::string tag = etag(id, *revision);
+
+	if (matches(if_none_match, tag)){
+	  req.set_header("ETag", tag);
+	  req.set_status(304);
+	  return {};
+	}
+      }
+
+      db::connector c(Database);
+      ptr<T> d = T::get(id);
+
+      if (d == nullptr){
+	forget(id);
+	return {};
+      }
+
+      uint32_t revision = d->get_revision();
+      remember(id, revision);
+      std::string tag = etag(id, revision);
+      req.set_header("ETag", tag);
+
+      if (matches(if_none_match, tag)){
+	req.set_status(304);
+	return {};
+      }
+
+      json_stream out([&req](std::string_view s){ req.write(s); });
+      Writer()(out, *d);
+      out.flush();
+      return {};
+    }
+
+  private:
+
+    using clock = std::chrono::steady_clock;
+
+    struct known
+    {
+      uint32_t revision;
+      clock::time_point at;
+    };
+
+    static std::chrono::milliseconds& revision_ttl(){
+      static std::chrono::milliseconds ttl{0};
+      return ttl;
+    }
+
+    static size_t& revision_capacity(){
+      static size_t capacity = 65536;
+      return capacity;
+    }
+
+    static std::mutex& cache_mutex(){
+      static std::mutex m;
+      return m;
+    }
+
+    static std::unordered_map<doc_id, known>& cache(){
+      static std::unordered_map<doc_id, known> c;
+      return c;
+    }
+
+    static std::optional<uint32_t> remembered(const doc_id& id){
+      if (!revision_ttl().count()){
+	return {};
+      }
+
+      std::lock_guard l(cache_mutex());
+      auto i = cache().find(id);
+
+      if (i == cache().end() || clock::now() - i->second.at > revision_ttl()){
+	return {};
+      }
+
+      return i->second.revision;
+    }
+
+    static void remember(const doc_id& id, uint32_t revision){
+      if (!revision_ttl().count()){
+	return;
+      }
+
+      std::lock_guard l(cache_mutex());
+      auto& c = cache();
+      clock::time_point now = clock::now();
+
+      // Expired revisions go first, everything if that is not enough.
+      if (c.size() >= revision_capacity() && !c.count(id)){
+	std::erase_if(c, [now](const auto& e){ return now - e.second.at > revision_ttl(); });
+
+	if (c.size() >= revision_capacity()){
+	  c.clear();
+	}
+      }
+
+      c[id] = known{revision, now};
+    }
+
+    // If-None-Match holds a comma-separated list of ETags, possibly weak, or *.
+    static bool matches(std::string_view header, std::string_view tag){
+      while (!header.empty()){
+	size_t comma = header.find(',');
+	std::string_view t = header.substr(0, comma);
+
+	while (!t.empty() && t.front() == ' '){
+	  t.remove_prefix(1);
+	}
+
+	while (!t.empty() && t.back() == ' '){
+	  t.remove_suffix(1);
+	}
+
+	if (t.substr(0, 2) == "W/"){
+	  t.remove_prefix(2);
+	}
+
+	if (t == "*" || t == tag){
+	  return true;
+	}
+
+	if (comma == std::string_view::npos){
+	  break;
+	}
+
+	header.remove_prefix(comma + 1);
+      }
+
+      return false;
+    }
+  };
+
+} // End namespace zambezi.
+
+#endif
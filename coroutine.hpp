@@ -0,0 +1,529 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_COROUTINE_HPP
+#define HX2A_ZAMBEZI_COROUTINE_HPP
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <condition_variable>
+#include <algorithm>
+#include <type_traits>
+#include <optional>
+#include <utility>
+#include <variant>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <tuple>
+#include <mutex>
+
+namespace zambezi::async {
+
+  // C++20 coroutine support for service handlers.
+  //
+  // A handler is a coroutine returning a task. Blocking operations, such as database round trips, are offloaded to
+  // a shared pool of threads, and the coroutine is suspended meanwhile. Independent operations can be awaited
+  // together with when_all, so that they overlap.
+  //
+  // All the code of the coroutines of a request runs on the thread driving the request (see sync_wait), never on
+  // the pool threads: completions are posted back to the request's loop. This preserves whatever the framework
+  // keeps per thread.
+
+  // Run queue of the coroutines of a request.
+  class loop
+  {
+  public:
+
+    // Notifying under the lock: once the last coroutine is posted, the loop can be destroyed as soon as the lock is
+    // released.
+    void post(std::coroutine_handle<> h){
+      std::lock_guard l(_mutex);
+      _ready.push_back(h);
+      _wake.notify_one();
+    }
+
+    // Resumes the next coroutine ready, waiting for one if needed.
+    void run_one(){
+      std::coroutine_handle<> h;
+
+      {
+	std::unique_lock l(_mutex);
+	_wake.wait(l, [this]{ return !_ready.empty(); });
+	h = _ready.front();
+	_ready.pop_front();
+      }
+
+      h.resume();
+    }
+
+    // The loop of the request running on the current thread, if any.
+    static loop*& current(){
+      thread_local loop* l = nullptr;
+      return l;
+    }
+
+  private:
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::deque<std::coroutine_handle<>> _ready;
+  };
+
+  // Fixed-size pool of threads running the blocking operations. Shared by all requests.
+  class pool
+  {
+  public:
+
+    // To be called before the first use, the default is 16 threads. With 0, the operations are run inline by the
+    // thread driving the request, one after the other, which is the synchronous path the pool is measured against.
+    static void set_size(size_t n){ size() = n; }
+
+    static bool is_inline(){ return !size(); }
+
+    static pool& instance(){
+      static pool p(size());
+      return p;
+    }
+
+    void post(std::function<void()> f){
+      {
+	std::lock_guard l(_mutex);
+	_queue.push_back(std::move(f));
+      }
+
+      _wake.notify_one();
+    }
+
+    ~pool(){
+      {
+	std::lock_guard l(_mutex);
+	_stop = true;
+      }
+
+      _wake.notify_all();
+
+      for (std::thread& t: _threads){
+	t.join();
+      }
+    }
+
+  private:
+
+    static size_t& size(){
+      static size_t s = 16;
+      return s;
+    }
+
+    pool(size_t n){
+      for (size_t i = 0; i != std::max<size_t>(n, 1); ++i){
+	_threads.emplace_back([this]{ run(); });
+      }
+    }
+
+    void run(){
+      for (;;){
+	std::function<void()> f;
+
+	{
+	  std::unique_lock l(_mutex);
+	  _wake.wait(l, [this]{ return _stop || !_queue.empty(); });
+
+	  if (_queue.empty()){
+	    return;
+	  }
+
+	  f = std::move(_queue.front());
+	  _queue.pop_front();
+	}
+
+	f();
+      }
+    }
+
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::deque<std::function<void()>> _queue;
+    std::vector<std::thread> _threads;
+    bool _stop = false;
+  };
+
+  template <typename T>
+  class task;
+
+  namespace detail {
+
+    template <typename T>
+    struct result
+    {
+      void set_exception(std::exception_ptr e){ _value.template emplace<2>(e); }
+
+      template <typename U>
+      void set_value(U&& v){ _value.template emplace<1>(std::forward<U>(v)); }
+
+      T get(){
+	if (_value.index() == 2){
+	  std::rethrow_exception(std::get<2>(_value));
+	}
+
+	return std::move(std::get<1>(_value));
+      }
+
+      std::variant<std::monostate, T, std::exception_ptr> _value;
+    };
+
+    template <>
+    struct result<void>
+    {
+      void set_exception(std::exception_ptr e){ _error = e; }
+
+      void set_value(){}
+
+      void get(){
+	if (_error){
+	  std::rethrow_exception(_error);
+	}
+      }
+
+      std::exception_ptr _error;
+    };
+
+    template <typename T>
+    struct promise_base: result<T>
+    {
+      std::suspend_always initial_suspend() noexcept { return {}; }
+
+      // Resuming the awaiting coroutine directly.
+      struct final_awaiter
+      {
+	bool await_ready() noexcept { return false; }
+
+	template <typename Promise>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+	  std::coroutine_handle<> c = h.promise()._continuation;
+	  return c ? c : std::noop_coroutine();
+	}
+
+	void await_resume() noexcept {}
+      };
+
+      final_awaiter final_suspend() noexcept { return {}; }
+
+      void unhandled_exception(){ this->set_exception(std::current_exception()); }
+
+      std::coroutine_handle<> _continuation;
+    };
+
+    template <typename T>
+    struct promise: promise_base<T>
+    {
+      task<T> get_return_object();
+
+      template <typename U>
+      void return_value(U&& v){ this->set_value(std::forward<U>(v)); }
+    };
+
+    template <>
+    struct promise<void>: promise_base<void>
+    {
+      task<void> get_return_object();
+
+      void return_void(){}
+    };
+
+    // Eagerly started, self-destroying coroutine, used to start tasks without awaiting them right away.
+    struct detached
+    {
+      struct promise_type
+      {
+	detached get_return_object(){ return {}; }
+	std::suspend_never initial_suspend() noexcept { return {}; }
+	std::suspend_never final_suspend() noexcept { return {}; }
+	void return_void(){}
+	void unhandled_exception(){ std::terminate(); }
+      };
+    };
+
+  } // End namespace detail.
+
+  // Lazy coroutine, started when awaited.
+  template <typename T = void>
+  class [[nodiscard]] task
+  {
+  public:
+
+    using promise_type = detail::promise<T>;
+    using value_type = T;
+
+    task(task&& t) noexcept:
+      _handle(std::exchange(t._handle, {}))
+    {
+    }
+
+    task& operator=(task&& t) noexcept {
+      if (this != &t){
+	destroy();
+	_handle = std::exchange(t._handle, {});
+      }
+
+      return *this;
+    }
+
+    ~task(){ destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+      _handle.promise()._continuation = awaiting;
+      return _handle;
+    }
+
+    T await_resume(){ return _handle.promise().get(); }
+
+  private:
+
+    friend struct detail::promise<T>;
+
+    explicit task(std::coroutine_handle<promise_type> h):
+      _handle(h)
+    {
+    }
+
+    void destroy(){
+      if (_handle){
+	_handle.destroy();
+	_handle = {};
+      }
+    }
+
+    std::coroutine_handle<promise_type> _handle;
+  };
+
+  namespace detail {
+
+    template <typename T>
+    task<T> promise<T>::get_return_object(){ return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this)); }
+
+    inline task<void> promise<void>::get_return_object(){ return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this)); }
+
+    template <typename F>
+    using offloaded_result = std::invoke_result_t<F&>;
+
+  } // End namespace detail.
+
+  // Awaitable running f in the pool. The awaiting coroutine is resumed on its request's loop afterwards. Only to be
+  // awaited from a task driven by sync_wait.
+  template <typename F>
+  class offloaded
+  {
+  public:
+
+    using value_type = detail::offloaded_result<F>;
+
+    explicit offloaded(F f):
+      _f(std::move(f))
+    {
+    }
+
+    bool await_ready() const noexcept { return pool::is_inline(); }
+
+    void await_suspend(std::coroutine_handle<> h){
+      loop* l = loop::current();
+
+      pool::instance().post([this, h, l]{
+	try{
+	  if constexpr (std::is_void_v<value_type>){
+	    _f();
+	    _result.set_value();
+	  }
+	  else{
+	    _result.set_value(_f());
+	  }
+	}
+	catch (...){
+	  _result.set_exception(std::current_exception());
+	}
+
+	l->post(h);
+      });
+    }
+
+    value_type await_resume(){
+      if (pool::is_inline()){
+	return _f();
+      }
+
+      return _result.get();
+    }
+
+  private:
+    F _f;
+    detail::result<value_type> _result;
+  };
+
+  template <typename F>
+  offloaded<F> offload(F f){ return offloaded<F>(std::move(f)); }
+
+  namespace detail {
+
+    // Counts the tasks still running, and resumes the awaiting coroutine when the last one completes. The awaiting
+    // coroutine counts as one, so that tasks completing while others are being started do not resume it early.
+    struct barrier
+    {
+      bool await_ready() const noexcept { return false; }
+
+      bool await_suspend(std::coroutine_handle<> h) noexcept {
+	_awaiting = h;
+	return --_count != 0;
+      }
+
+      void await_resume() const noexcept {}
+
+      void arrive(){
+	if (--_count == 0){
+	  _awaiting.resume();
+	}
+      }
+
+      size_t _count;
+      std::coroutine_handle<> _awaiting;
+    };
+
+    template <typename T, typename Store>
+    detached run_into(task<T> t, barrier& b, Store store){
+      try{
+	if constexpr (std::is_void_v<T>){
+	  co_await std::move(t);
+	  store();
+	}
+	else{
+	  store(co_await std::move(t));
+	}
+      }
+      catch (...){
+	store.fail(std::current_exception());
+      }
+
+      b.arrive();
+    }
+
+    template <typename T>
+    struct store_at
+    {
+      void operator()(T v){ slots[i].emplace(std::move(v)); }
+      void fail(std::exception_ptr e){ if (!*error){ *error = e; } }
+
+      std::vector<std::optional<T>>& slots;
+      size_t i;
+      std::exception_ptr* error;
+    };
+
+    template <typename Tuple, size_t I>
+    struct store_in_tuple
+    {
+      template <typename V>
+      void operator()(V&& v){ std::get<I>(slots).emplace(std::forward<V>(v)); }
+      void operator()(){ std::get<I>(slots).emplace(std::monostate()); }
+      void fail(std::exception_ptr e){ if (!*error){ *error = e; } }
+
+      Tuple& slots;
+      std::exception_ptr* error;
+    };
+
+    template <typename T>
+    using when_all_value = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+  } // End namespace detail.
+
+  // Runs the tasks concurrently, and returns their results in the same order. If any fails, the first exception
+  // is rethrown once all are done. T cannot be void, use the heterogeneous version below for that.
+  template <typename T>
+  task<std::vector<T>> when_all(std::vector<task<T>> tasks){
+    std::vector<std::optional<T>> slots(tasks.size());
+    std::exception_ptr error;
+    detail::barrier b{tasks.size() + 1, {}};
+
+    for (size_t i = 0; i != tasks.size(); ++i){
+      detail::run_into(std::move(tasks[i]), b, detail::store_at<T>{slots, i, &error});
+    }
+
+    co_await b;
+
+    if (error){
+      std::rethrow_exception(error);
+    }
+
+    std::vector<T> r;
+    r.reserve(slots.size());
+
+    for (std::optional<T>& s: slots){
+      r.push_back(std::move(*s));
+    }
+
+    co_return r;
+  }
+
+  // Heterogeneous version. Void tasks give std::monostate.
+  template <typename... Ts>
+  task<std::tuple<detail::when_all_value<Ts>...>> when_all(task<Ts>... tasks){
+    using slots_type = std::tuple<std::optional<detail::when_all_value<Ts>>...>;
+    slots_type slots;
+    std::exception_ptr error;
+    detail::barrier b{sizeof...(Ts) + 1, {}};
+
+    [&]<size_t... Is>(std::index_sequence<Is...>){
+      (detail::run_into(std::move(tasks), b, detail::store_in_tuple<slots_type, Is>{slots, &error}), ...);
+    }(std::index_sequence_for<Ts...>());
+
+    co_await b;
+
+    if (error){
+      std::rethrow_exception(error);
+    }
+
+    co_return std::apply([](auto&... s){ return std::tuple<detail::when_all_value<Ts>...>(std::move(*s)...); }, slots);
+  }
+
+  // Runs a task to completion on the current thread, which becomes its loop.
+  template <typename T>
+  T sync_wait(task<T> t){
+    loop l;
+    loop* previous = std::exchange(loop::current(), &l);
+    bool finished = false;
+    detail::result<T> r;
+
+    struct restore
+    {
+      ~restore(){ loop::current() = previous; }
+      loop* previous;
+    } restore_previous{previous};
+
+    [](task<T> t, bool& finished, detail::result<T>& r) -> detail::detached {
+      try{
+	if constexpr (std::is_void_v<T>){
+	  co_await std::move(t);
+	  r.set_value();
+	}
+	else{
+	  r.set_value(co_await std::move(t));
+	}
+      }
+      catch (...){
+	r.set_exception(std::current_exception());
+      }
+
+      finished = true;
+    }(std::move(t), finished, r);
+
+    while (!finished){
+      l.run_one();
+    }
+
+    return r.get();
+  }
+
+} // End namespace zambezi::async.
+
+#endif
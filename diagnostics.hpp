@@ -0,0 +1,49 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_DIAGNOSTICS_HPP
+#define HX2A_ZAMBEZI_DIAGNOSTICS_HPP
+
+#include <cstdio>
+#include <cstdarg>
+#include <functional>
+#include <string_view>
+
+namespace zambezi::diagnostics {
+
+  // Failures of the background work of the module (writes retried or dropped, jobs failing, deferred work
+  // throwing), which have no request to be reported to. They are counted in the statistics of their classes, and
+  // described to the handler, if any. There is none by default, the module writes nothing by itself.
+
+  using handler = std::function<void(std::string_view message)>;
+
+  inline handler& current_handler(){
+    static handler h;
+    return h;
+  }
+
+  // To be called before the first request.
+  inline void set_handler(handler h){ current_handler() = std::move(h); }
+
+  // Formats like printf.
+  __attribute__((format(printf, 1, 2)))
+  inline void report(const char* format, ...){
+    const handler& h = current_handler();
+
+    if (!h){
+      return;
+    }
+
+    char message[512];
+    va_list args;
+    va_start(args, format);
+    std::vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    h(message);
+  }
+
+} // End namespace zambezi::diagnostics.
+
+#endif
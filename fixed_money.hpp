@@ -0,0 +1,165 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_FIXED_MONEY_HPP
+#define HX2A_ZAMBEZI_FIXED_MONEY_HPP
+
+#include <span>
+#include <cmath>
+#include <compare>
+#include <cstdint>
+#include <stdexcept>
+
+#include "hx2a/components/money.hpp"
+
+using namespace hx2a;
+
+namespace zambezi {
+
+  // Amount of money as an integer number of minor units of an ISO 4217 currency (cents of USD, yens, fils of
+  // KWD...), 16 bytes, meant to be stored inline in documents as two slots instead of an owned money element.
+  //
+  // Additions, subtractions and multiplications by integers are exact, and throw std::overflow_error instead of
+  // wrapping. Mixing currencies throws std::invalid_argument. Conversions from floating point amounts and scalings
+  // round once, to the nearest minor unit, halves away from zero.
+  class fixed_money
+  {
+  public:
+
+    constexpr fixed_money() = default;
+
+    constexpr fixed_money(int64_t minor, currency::code cc):
+      _minor(minor),
+      _currency(static_cast<uint32_t>(cc))
+    {
+    }
+
+    static fixed_money from_amount(double amount, currency::code cc){
+      return fixed_money(round(amount * minor_per_major(cc)), cc);
+    }
+
+    // Digits of the minor unit of a currency, 2 for most.
+    static constexpr int minor_digits(currency::code cc){
+      switch (static_cast<uint32_t>(cc)){
+      case 108: case 152: case 174: case 262: case 324: case 352: case 392: case 410: case 548: case 600: case 646:
+      case 704: case 800: case 940: case 950: case 952: case 953:
+	return 0;
+      case 48: case 368: case 400: case 414: case 434: case 512: case 788:
+	return 3;
+      case 927: case 990:
+	return 4;
+      default:
+	return 2;
+      }
+    }
+
+    // Minor units per major unit.
+    static constexpr double minor_per_major(currency::code cc){
+      double s = 1;
+
+      for (int i = 0; i != minor_digits(cc); ++i){
+	s *= 10;
+      }
+
+      return s;
+    }
+
+    int64_t get_minor() const { return _minor; }
+    currency::code get_currency() const { return static_cast<currency::code>(_currency); }
+
+    // Null currency, for the default constructed value.
+    bool is_null() const { return !_currency; }
+
+    double get_amount() const { return _minor / minor_per_major(get_currency()); }
+
+    fixed_money operator+(const fixed_money& m) const {
+      int64_t r;
+
+      if (__builtin_add_overflow(_minor, m.same(*this)._minor, &r)){
+	throw std::overflow_error("money overflow");
+      }
+
+      return fixed_money(r, get_currency());
+    }
+
+    fixed_money operator-(const fixed_money& m) const {
+      int64_t r;
+
+      if (__builtin_sub_overflow(_minor, m.same(*this)._minor, &r)){
+	throw std::overflow_error("money overflow");
+      }
+
+      return fixed_money(r, get_currency());
+    }
+
+    fixed_money operator*(int64_t n) const {
+      int64_t r;
+
+      if (__builtin_mul_overflow(_minor, n, &r)){
+	throw std::overflow_error("money overflow");
+      }
+
+      return fixed_money(r, get_currency());
+    }
+
+    fixed_money& operator+=(const fixed_money& m){ return *this = *this + m; }
+    fixed_money& operator-=(const fixed_money& m){ return *this = *this - m; }
+
+    // Rounded to the minor unit.
+    fixed_money scaled(double factor) const { return fixed_money(round(_minor * factor), get_currency()); }
+
+    bool operator==(const fixed_money&) const = default;
+
+    // Only meaningful between amounts of the same currency.
+    std::strong_ordering operator<=>(const fixed_money& m) const {
+      return _minor <=> m.same(*this)._minor;
+    }
+
+    // Batch operations on minor units of one currency, written as plain loops over contiguous arrays for the
+    // compiler to vectorize (see gen_cart::cart_total). They do not check for overflows, amounts are expected far
+    // from the limits (a total of 2^63 cents is about 10^17 dollars).
+
+    // out[i] = a[i] * n[i], for line amounts from unit prices and counts.
+    static void multiply(std::span<const int64_t> a, std::span<const int64_t> n, std::span<int64_t> out){
+      for (size_t i = 0; i != out.size(); ++i){
+	out[i] = a[i] * n[i];
+      }
+    }
+
+    static int64_t sum(std::span<const int64_t> a){
+      int64_t s = 0;
+
+      for (int64_t v: a){
+	s += v;
+      }
+
+      return s;
+    }
+
+  private:
+
+    static int64_t round(double minor){
+      if (!(std::fabs(minor) < 9.2e18)){
+	throw std::overflow_error("money overflow");
+      }
+
+      return std::llround(minor);
+    }
+
+    const fixed_money& same(const fixed_money& m) const {
+      if (_currency != m._currency){
+	throw std::invalid_argument("money currencies differ");
+      }
+
+      return *this;
+    }
+
+    int64_t _minor = 0;
+    uint32_t _currency = 0;
+  };
+
+} // End namespace zambezi.
+
+#endif
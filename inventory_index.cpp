@@ -0,0 +1,226 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#include <exception>
+
+#include "hx2a/server.hpp"
+#include "hx2a/cursor.hpp"
+
+#include "hx2a/zambezi/inventory_index.hpp"
+#include "hx2a/zambezi/partitions.hpp"
+
+using namespace hx2a;
+
+namespace zambezi {
+
+  inventory_index& inventory_index::instance(){
+    static inventory_index i;
+    return i;
+  }
+
+  inventory_index::inventory_index():
+    _currencies{static_cast<currency::code>(840) /* USD */, static_cast<currency::code>(978) /* EUR */}
+  {
+    inventory::add_observer([this](inventory& inv){ mark(inv); });
+  }
+
+  inventory_index::~inventory_index(){
+    if (_thread.joinable()){
+      {
+	std::lock_guard l(_changed_mutex);
+	_stop = true;
+      }
+
+      _wake.notify_one();
+      _thread.join();
+    }
+  }
+
+  void inventory_index::set_currencies(std::vector<currency::code> currencies){
+    std::unique_lock l(_mutex);
+    _currencies = std::move(currencies);
+  }
+
+  inventory_index::coordinates inventory_index::point_of(inventory& inv, currency::code cc){
+    coordinates c;
+    c[price_dimension] = inv.calculate_price(1, cc, nullptr);
+    c[rating_dimension] = inv.get_rating();
+    c[count_dimension] = static_cast<double>(inv.get_count());
+    return c;
+  }
+
+  void inventory_index::rebuild(){
+    std::lock_guard m(_maintenance);
+    std::map<tree_key, std::vector<tree::point>> points;
+    std::vector<currency::code> currencies;
+
+    {
+      std::shared_lock l(_mutex);
+      currencies = _currencies;
+    }
+
+    {
+      // Changes from now on are read again after the scan, which might have read their inventories before them.
+      std::lock_guard l(_changed_mutex);
+      _active = true;
+    }
+
+    // Prices are computed outside of the lock, the scan is the expensive part.
+    for (const std::string& database: partitions::databases()){
+      partitions::connector c(database);
+
+      for (cursor<inventory> cur; cur; ++cur){
+	inventory_p inv = inventory::get(cur.get_id());
+
+	if (inv == nullptr){
+	  continue;
+	}
+
+	for (currency::code cc: currencies){
+	  points[tree_key{database, cc}].push_back(tree::point{inv->get_id(), point_of(*inv, cc)});
+	}
+      }
+    }
+
+    std::unique_lock l(_mutex);
+    _trees.clear();
+
+    for (auto& [k, p]: points){
+      _trees[k].assign(std::move(p));
+    }
+  }
+
+  void inventory_index::ensure_built(){
+    std::call_once(_built, [this]{
+      rebuild();
+      _thread = std::thread([this]{ run(); });
+    });
+  }
+
+  void inventory_index::mark(inventory& inv){
+    std::lock_guard l(_changed_mutex);
+
+    // Before the first scan, the scan will pick the change up.
+    if (_active){
+      _changed.emplace(partitions::current(), inv.get_id());
+    }
+  }
+
+  void inventory_index::refresh(){
+    std::lock_guard m(_maintenance);
+    std::set<std::pair<std::string, doc_id>> changed;
+    std::vector<currency::code> currencies;
+
+    {
+      std::lock_guard l(_changed_mutex);
+      changed.swap(_changed);
+    }
+
+    if (changed.empty()){
+      return;
+    }
+
+    {
+      std::shared_lock l(_mutex);
+      currencies = _currencies;
+    }
+
+    // Sorted by database, one connector per database.
+    for (auto i = changed.cbegin(); i != changed.cend();){
+      const std::string& database = i->first;
+      std::vector<std::pair<doc_id, std::vector<coordinates>>> points;
+
+      {
+	partitions::connector c(database);
+
+	for (; i != changed.cend() && i->first == database; ++i){
+	  inventory_p inv = inventory::get(i->second);
+	  std::vector<coordinates> p;
+
+	  // Removed, no points.
+	  if (inv != nullptr){
+	    for (currency::code cc: currencies){
+	      p.push_back(point_of(*inv, cc));
+	    }
+	  }
+
+	  points.emplace_back(i->second, std::move(p));
+	}
+      }
+
+      std::unique_lock l(_mutex);
+
+      for (const auto& [id, p]: points){
+	for (size_t k = 0; k != currencies.size(); ++k){
+	  tree& t = _trees[tree_key{database, currencies[k]}];
+
+	  if (p.empty()){
+	    t.erase(id);
+	  }
+	  else{
+	    t.insert_or_update(id, p[k]);
+	  }
+	}
+      }
+    }
+  }
+
+  void inventory_index::run(){
+    using clock = std::chrono::steady_clock;
+    clock::time_point rebuilt = clock::now();
+
+    for (;;){
+      {
+	std::unique_lock l(_changed_mutex);
+	_wake.wait_for(l, _settings.refresh_interval, [this]{ return _stop; });
+
+	if (_stop){
+	  return;
+	}
+      }
+
+      try{
+	if (_settings.rebuild_interval.count() && clock::now() - rebuilt >= _settings.rebuild_interval){
+	  rebuild();
+	  rebuilt = clock::now();
+	}
+
+	refresh();
+      }
+      catch (const std::exception&){
+	// The changes not applied are caught up by the next rebuild.
+      }
+    }
+  }
+
+  std::vector<doc_id> inventory_index::range(const std::string& database, currency::code cc, const box& b){
+    ensure_built();
+    std::vector<doc_id> r;
+    std::shared_lock l(_mutex);
+    auto i = _trees.find(tree_key{database, cc});
+
+    if (i != _trees.end()){
+      i->second.range(b, [&r](const doc_id& id, const coordinates&){ r.push_back(id); });
+    }
+
+    return r;
+  }
+
+  std::vector<doc_id> inventory_index::nearest(const std::string& database, currency::code cc, const coordinates& target, const coordinates& weights, size_t k, const box& b){
+    ensure_built();
+    std::vector<doc_id> r;
+    std::shared_lock l(_mutex);
+    auto i = _trees.find(tree_key{database, cc});
+
+    if (i != _trees.end()){
+      for (const tree::point& p: i->second.nearest(target, weights, k, b)){
+	r.push_back(p.id);
+      }
+    }
+
+    return r;
+  }
+
+} // End namespace zambezi.
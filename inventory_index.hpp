@@ -0,0 +1,125 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_INVENTORY_INDEX_HPP
+#define HX2A_ZAMBEZI_INVENTORY_INDEX_HPP
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <utility>
+#include <shared_mutex>
+#include <condition_variable>
+
+#include "hx2a/zambezi/ontology.hpp"
+#include "hx2a/zambezi/kd_tree.hpp"
+
+namespace zambezi {
+
+  // Process-wide in-memory multidimensional index over inventories, on the computed price, the rating and the
+  // count, with one tree per database (see partitions.hpp) and indexed currency, so that a tenant only finds its
+  // own inventories.
+  //
+  // The computed price is the price of a single item, with no user context. Prices depending on the user are
+  // therefore not represented faithfully, the index is meant to preselect candidates, not to quote.
+  //
+  // The index is built from a scan of all inventories on first use. Afterwards the inventory observers only mark
+  // the inventories changed, and a background thread reads them again shortly after, once their changes are
+  // saved, to update their points, or to drop the ones which no longer exist. Nothing is priced on the path of
+  // the writes. The index is also rebuilt periodically, which picks up the changes made by other processes and the
+  // inventories removed without notification. In between, callers loading the identifiers returned must expect
+  // null documents.
+  //
+  // Queries take a shared lock and do not touch the database.
+  class inventory_index
+  {
+  public:
+
+    struct settings
+    {
+      // Delay after which the inventories marked changed are read again.
+      std::chrono::milliseconds refresh_interval{1000};
+      // 0 for no periodic rebuild.
+      std::chrono::seconds rebuild_interval{std::chrono::hours(1)};
+    };
+
+    enum dimension: size_t { price_dimension, rating_dimension, count_dimension, dimensions };
+
+    using tree = kd_tree<doc_id, dimensions>;
+    using coordinates = tree::coordinates;
+    using box = tree::box;
+
+    static inventory_index& instance();
+
+    // To be called before the first query.
+    void configure(const settings& s){ _settings = s; }
+
+    // The currencies in which prices are indexed. To be called before the first query, typically from the
+    // module's initialization. Defaults to USD and EUR.
+    void set_currencies(std::vector<currency::code> currencies);
+
+    // Inventories of the database inside the box, for the given currency. Nothing is returned for a currency which
+    // is not indexed.
+    std::vector<doc_id> range(const std::string& database, currency::code cc, const box& b);
+
+    // The k inventories inside the box whose price, rating and count are the closest to the target, closest
+    // first. Weights scale each dimension, a null weight ignores it.
+    std::vector<doc_id> nearest(const std::string& database, currency::code cc, const coordinates& target, const coordinates& weights, size_t k, const box& b = box());
+
+    // Convenience box for the usual "in stock, rated at least r, under p" query.
+    static box make_box(double max_price, float min_rating = 0, count_type min_count = 1){
+      box b;
+      b.max[price_dimension] = max_price;
+      b.min[rating_dimension] = min_rating;
+      b.min[count_dimension] = static_cast<double>(min_count);
+      return b;
+    }
+
+    // Rebuilds everything from a scan of all the inventories of all the databases (see partitions.hpp).
+    void rebuild();
+
+    ~inventory_index();
+
+  private:
+
+    inventory_index();
+
+    // Builds the index and starts the background thread, once.
+    void ensure_built();
+
+    coordinates point_of(inventory& inv, currency::code cc);
+
+    // Changes are made with the inventory's database open.
+    void mark(inventory& inv);
+
+    // Reads again the inventories marked changed.
+    void refresh();
+
+    void run();
+
+    using tree_key = std::pair<std::string, currency::code>;
+
+    settings _settings;
+    std::shared_mutex _mutex;
+    std::once_flag _built;
+    std::vector<currency::code> _currencies;
+    std::map<tree_key, tree> _trees;
+    // Serializes the rebuilds and the refreshes.
+    std::mutex _maintenance;
+    std::thread _thread;
+    std::mutex _changed_mutex;
+    std::condition_variable _wake;
+    // Database and identifier of the inventories marked changed. Not tracked before the first scan starts.
+    std::set<std::pair<std::string, doc_id>> _changed;
+    bool _active = false;
+    bool _stop = false;
+  };
+
+} // End namespace zambezi.
+
+#endif
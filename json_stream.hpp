@@ -0,0 +1,199 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_JSON_STREAM_HPP
+#define HX2A_ZAMBEZI_JSON_STREAM_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+
+namespace zambezi {
+
+  // Minimal JSON writer emitting text incrementally to a sink, so that a reply can be sent while it is being
+  // produced instead of being built entirely as an element first. Text is buffered and handed to the sink in
+  // chunks of roughly chunk_size bytes. The writer does not validate the structure, the caller is expected to
+  // open and close what it writes.
+  class json_stream
+  {
+  public:
+
+    using sink_type = std::function<void(std::string_view)>;
+
+    json_stream(sink_type sink, size_t chunk_size = 16384):
+      _sink(std::move(sink)),
+      _chunk_size(chunk_size)
+    {
+      _buffer.reserve(chunk_size + 256);
+    }
+
+    json_stream(const json_stream&) = delete;
+    json_stream& operator=(const json_stream&) = delete;
+
+    ~json_stream(){
+      flush();
+    }
+
+    json_stream& begin_object(){
+      separate();
+      _buffer += '{';
+      _first.push_back(true);
+      return *this;
+    }
+
+    json_stream& end_object(){
+      _buffer += '}';
+      _first.pop_back();
+      chunk();
+      return *this;
+    }
+
+    json_stream& begin_array(){
+      separate();
+      _buffer += '[';
+      _first.push_back(true);
+      return *this;
+    }
+
+    json_stream& end_array(){
+      _buffer += ']';
+      _first.pop_back();
+      chunk();
+      return *this;
+    }
+
+    // Writes an object member name. The value must follow.
+    json_stream& key(std::string_view k){
+      separate();
+      quote(k);
+      _buffer += ':';
+      _after_key = true;
+      return *this;
+    }
+
+    json_stream& value(std::string_view s){
+      separate();
+      quote(s);
+      return *this;
+    }
+
+    json_stream& value(const char* s){
+      return value(std::string_view(s));
+    }
+
+    json_stream& value(bool b){
+      separate();
+      _buffer += b ? "true" : "false";
+      return *this;
+    }
+
+    json_stream& value(uint64_t n){
+      separate();
+      _buffer += std::to_string(n);
+      return *this;
+    }
+
+    json_stream& value(int64_t n){
+      separate();
+      _buffer += std::to_string(n);
+      return *this;
+    }
+
+    json_stream& value(double d){
+      separate();
+
+      // JSON has no representation for infinities and NaN.
+      if (!std::isfinite(d)){
+	_buffer += "null";
+	return *this;
+      }
+
+      char b[32];
+      int n = std::snprintf(b, sizeof(b), "%.17g", d);
+      _buffer.append(b, n);
+      return *this;
+    }
+
+    json_stream& null(){
+      separate();
+      _buffer += "null";
+      return *this;
+    }
+
+    // Hands over everything buffered to the sink.
+    void flush(){
+      if (!_buffer.empty()){
+	_sink(_buffer);
+	_buffer.clear();
+      }
+    }
+
+  private:
+
+    // Inserts the comma between consecutive values of an array or members of an object.
+    void separate(){
+      if (_after_key){
+	_after_key = false;
+	return;
+      }
+
+      if (!_first.empty()){
+	if (_first.back()){
+	  _first.back() = false;
+	}
+	else{
+	  _buffer += ',';
+	}
+      }
+    }
+
+    void quote(std::string_view s){
+      _buffer += '"';
+
+      for (char c: s){
+	switch (c){
+	case '"': _buffer += "\\\""; break;
+	case '\\': _buffer += "\\\\"; break;
+	case '\b': _buffer += "\\b"; break;
+	case '\f': _buffer += "\\f"; break;
+	case '\n': _buffer += "\\n"; break;
+	case '\r': _buffer += "\\r"; break;
+	case '\t': _buffer += "\\t"; break;
+	default:
+	  if (static_cast<unsigned char>(c) < 0x20){
+	    char b[8];
+	    std::snprintf(b, sizeof(b), "\\u%04x", static_cast<unsigned int>(c));
+	    _buffer += b;
+	  }
+	  else{
+	    _buffer += c;
+	  }
+	}
+      }
+
+      _buffer += '"';
+    }
+
+    void chunk(){
+      if (_buffer.size() >= _chunk_size){
+	flush();
+      }
+    }
+
+    sink_type _sink;
+    size_t _chunk_size;
+    std::string _buffer;
+    // One entry per open array or object, true until its first value is written.
+    std::vector<bool> _first;
+    bool _after_key = false;
+  };
+
+} // End namespace zambezi.
+
+#endif
@@ -0,0 +1,285 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_KD_TREE_HPP
+#define HX2A_ZAMBEZI_KD_TREE_HPP
+
+#include <array>
+#include <vector>
+#include <queue>
+#include <limits>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace zambezi {
+
+  // In-memory k-dimensional tree of identifiers, answering box (range) queries and k nearest neighbours queries.
+  //
+  // The tree is implicit: points are stored in a single vector, arranged so that in every range [b, e) the median
+  // point at (b + e) / 2 splits the range on dimension depth % Dims. There are no nodes, no pointers, and a
+  // query walks contiguous memory.
+  //
+  // Updates do not restructure the tree. An updated or removed point is tombstoned in the tree, and new
+  // positions go to a small unordered overflow, scanned linearly by queries. The tree is rebuilt when the
+  // overflow or the tombstones grow beyond a fraction of its size, which keeps the amortized update cost low.
+  //
+  // Not thread-safe, the owner synchronizes.
+  template <typename Id, size_t Dims, typename Hash = std::hash<Id>>
+  class kd_tree
+  {
+  public:
+
+    using coordinates = std::array<double, Dims>;
+
+    struct point
+    {
+      Id id;
+      coordinates c;
+    };
+
+    // Inclusive bounds on every dimension. Unbounded by default.
+    struct box
+    {
+      box(){
+	min.fill(-std::numeric_limits<double>::infinity());
+	max.fill(std::numeric_limits<double>::infinity());
+      }
+
+      bool contains(const coordinates& c) const {
+	for (size_t d = 0; d != Dims; ++d){
+	  if (c[d] < min[d] || c[d] > max[d]){
+	    return false;
+	  }
+	}
+
+	return true;
+      }
+
+      coordinates min;
+      coordinates max;
+    };
+
+    // Ranges smaller than this are scanned instead of being split.
+    static constexpr size_t leaf_size = 16;
+
+    kd_tree() = default;
+
+    // Bulk loading, replacing the whole content.
+    void assign(std::vector<point> points){
+      _tree = std::move(points);
+      _overflow.clear();
+      _tombstones.clear();
+      build(0, _tree.size(), 0);
+    }
+
+    void insert_or_update(const Id& id, const coordinates& c){
+      _tombstones.insert(id);
+      _overflow[id] = c;
+      maybe_rebuild();
+    }
+
+    void erase(const Id& id){
+      _tombstones.insert(id);
+      _overflow.erase(id);
+      maybe_rebuild();
+    }
+
+    // Approximate, tombstoned points still count until the next rebuild.
+    size_t size() const { return _tree.size() + _overflow.size(); }
+
+    // Calls f(id, coordinates) for every point inside the box.
+    template <typename F>
+    void range(const box& b, F&& f) const {
+      range(b, f, 0, _tree.size(), 0);
+
+      for (const auto& [id, c]: _overflow){
+	if (b.contains(c)){
+	  f(id, c);
+	}
+      }
+    }
+
+    // The k points inside the box which are the closest to the target, using the squared euclidean distance
+    // with a weight per dimension. Closest first.
+    std::vector<point> nearest(const coordinates& target, const coordinates& weights, size_t k, const box& b = box()) const {
+      candidates heap;
+
+      if (k){
+	nearest(target, weights, k, b, heap, 0, _tree.size(), 0);
+
+	for (const auto& [id, c]: _overflow){
+	  if (b.contains(c)){
+	    offer(heap, k, distance(target, weights, c), point{id, c});
+	  }
+	}
+      }
+
+      std::vector<point> r(heap.size());
+
+      for (size_t i = heap.size(); i; --i){
+	r[i - 1] = heap.top().second;
+	heap.pop();
+      }
+
+      return r;
+    }
+
+  private:
+
+    struct farthest_first
+    {
+      bool operator()(const std::pair<double, point>& l, const std::pair<double, point>& r) const {
+	return l.first < r.first;
+      }
+    };
+
+    using candidates = std::priority_queue<std::pair<double, point>, std::vector<std::pair<double, point>>, farthest_first>;
+
+    void build(size_t b, size_t e, size_t depth){
+      if (e - b <= leaf_size){
+	return;
+      }
+
+      size_t m = b + (e - b) / 2;
+      size_t d = depth % Dims;
+      std::nth_element(_tree.begin() + b, _tree.begin() + m, _tree.begin() + e, [d](const point& l, const point& r){ return l.c[d] < r.c[d]; });
+      build(b, m, depth + 1);
+      build(m + 1, e, depth + 1);
+    }
+
+    void maybe_rebuild(){
+      size_t threshold = 64 + _tree.size() / 8;
+
+      if (_overflow.size() <= threshold && _tombstones.size() <= threshold){
+	return;
+      }
+
+      std::vector<point> points;
+      points.reserve(_tree.size() + _overflow.size());
+
+      for (const point& p: _tree){
+	if (!_tombstones.count(p.id)){
+	  points.push_back(p);
+	}
+      }
+
+      for (const auto& [id, c]: _overflow){
+	points.push_back(point{id, c});
+      }
+
+      assign(std::move(points));
+    }
+
+    bool alive(const point& p) const {
+      return _tombstones.empty() || !_tombstones.count(p.id);
+    }
+
+    template <typename F>
+    void range(const box& b, F& f, size_t first, size_t last, size_t depth) const {
+      if (last - first <= leaf_size){
+	for (size_t i = first; i != last; ++i){
+	  const point& p = _tree[i];
+
+	  if (b.contains(p.c) && alive(p)){
+	    f(p.id, p.c);
+	  }
+	}
+
+	return;
+      }
+
+      size_t m = first + (last - first) / 2;
+      size_t d = depth % Dims;
+      const point& p = _tree[m];
+
+      if (b.min[d] <= p.c[d]){
+	range(b, f, first, m, depth + 1);
+      }
+
+      if (b.contains(p.c) && alive(p)){
+	f(p.id, p.c);
+      }
+
+      if (b.max[d] >= p.c[d]){
+	range(b, f, m + 1, last, depth + 1);
+      }
+    }
+
+    static double distance(const coordinates& t, const coordinates& w, const coordinates& c){
+      double r = 0;
+
+      for (size_t d = 0; d != Dims; ++d){
+	double delta = c[d] - t[d];
+	r += w[d] * delta * delta;
+      }
+
+      return r;
+    }
+
+    static void offer(candidates& heap, size_t k, double dist, const point& p){
+      if (heap.size() < k){
+	heap.emplace(dist, p);
+      }
+      else if (dist < heap.top().first){
+	heap.pop();
+	heap.emplace(dist, p);
+      }
+    }
+
+    void nearest(const coordinates& t, const coordinates& w, size_t k, const box& b, candidates& heap, size_t first, size_t last, size_t depth) const {
+      if (last - first <= leaf_size){
+	for (size_t i = first; i != last; ++i){
+	  const point& p = _tree[i];
+
+	  if (b.contains(p.c) && alive(p)){
+	    offer(heap, k, distance(t, w, p.c), p);
+	  }
+	}
+
+	return;
+      }
+
+      size_t m = first + (last - first) / 2;
+      size_t d = depth % Dims;
+      const point& p = _tree[m];
+
+      if (b.contains(p.c) && alive(p)){
+	offer(heap, k, distance(t, w, p.c), p);
+      }
+
+      // Visiting the side of the target first, the other side only if the splitting plane is closer than the
+      // current k-th candidate, and if the box reaches it.
+      double delta = t[d] - p.c[d];
+      bool left_first = delta <= 0;
+      bool left_possible = b.min[d] <= p.c[d];
+      bool right_possible = b.max[d] >= p.c[d];
+
+      auto visit = [&](bool left){
+	if (left ? left_possible : right_possible){
+	  if (left){
+	    nearest(t, w, k, b, heap, first, m, depth + 1);
+	  }
+	  else{
+	    nearest(t, w, k, b, heap, m + 1, last, depth + 1);
+	  }
+	}
+      };
+
+      visit(left_first);
+
+      if (heap.size() < k || w[d] * delta * delta < heap.top().first){
+	visit(!left_first);
+      }
+    }
+
+    std::vector<point> _tree;
+    std::unordered_map<Id, coordinates, Hash> _overflow;
+    std::unordered_set<Id, Hash> _tombstones;
+  };
+
+} // End namespace zambezi.
+
+#endif
@@ -8,16 +8,869 @@
 // curl http://localhost:8080/service_name -d '{..JSON payload...}'
 // ...JSON response...
 
+#include <cmath>
+#include <cctype>
+#include <limits>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <algorithm>
+#include <unordered_map>
+
 #include "hx2a/server.hpp"
+#include "hx2a/cursor.hpp"
 
 #include "hx2a/zambezi/ontology.hpp"
+#include "hx2a/zambezi/partitions.hpp"
+#include "hx2a/zambezi/category_tree.hpp"
+#include "hx2a/zambezi/category_counts.hpp"
+#include "hx2a/zambezi/diagnostics.hpp"
+#include "hx2a/zambezi/json_stream.hpp"
 
 using namespace hx2a;
 
 namespace zambezi {
 
+  namespace {
+
+    // Memoized prices independent from the user context, see inventory::set_quote_cache_capacity.
+
+    struct quote_key
+    {
+      doc_id policy;
+      uint32_t revision;
+      count_type available;
+      unsigned int count;
+      uint32_t currency;
+      bool overdraft;
+      double price;
+      float rating;
+
+      bool operator==(const quote_key& k) const {
+	return policy == k.policy && revision == k.revision && available == k.available && count == k.count && currency == k.currency &&
+	  overdraft == k.overdraft && !std::memcmp(&price, &k.price, sizeof(price)) && !std::memcmp(&rating, &k.rating, sizeof(rating));
+      }
+    };
+
+    struct quote_key_hash
+    {
+      size_t operator()(const quote_key& k) const {
+	uint64_t price_bits;
+	uint32_t rating_bits;
+	std::memcpy(&price_bits, &k.price, sizeof(price_bits));
+	std::memcpy(&rating_bits, &k.rating, sizeof(rating_bits));
+	size_t h = std::hash<doc_id>()(k.policy);
+
+	for (uint64_t v: {uint64_t(k.revision), uint64_t(k.available), uint64_t(k.count), uint64_t(k.currency), uint64_t(k.overdraft), price_bits, uint64_t(rating_bits)}){
+	  h ^= std::hash<uint64_t>()(v) + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+	}
+
+	return h;
+      }
+    };
+
+    std::atomic<size_t> quote_cache_capacity{0};
+    std::atomic<uint64_t> quote_hits{0};
+    std::atomic<uint64_t> quote_misses{0};
+    std::atomic<uint64_t> quote_recycles{0};
+
+    std::unordered_map<quote_key, double, quote_key_hash>& quote_cache(){
+      thread_local std::unordered_map<quote_key, double, quote_key_hash> c;
+      return c;
+    }
+
+    // Tokens of a policy source: identifiers, with a flag telling whether they follow a dot (property names), and
+    // numbers. Comments and string literals are skipped. Computed property accesses and template literals, which
+    // reach identifiers through strings or hold code, are reported as opaque.
+    template <typename Identifier, typename Number, typename Opaque>
+    void scan_source(std::string_view s, Identifier&& identifier, Number&& number, Opaque&& opaque){
+      size_t i = 0;
+      bool after_dot = false;
+
+      auto is_start = [](char c){ return std::isalpha(static_cast<unsigned char>(c)) || c == '_' || c == '$'; };
+      auto is_part = [&](char c){ return is_start(c) || std::isdigit(static_cast<unsigned char>(c)); };
+
+      while (i < s.size()){
+	char c = s[i];
+
+	if (c == '/' && i + 1 < s.size() && s[i + 1] == '/'){
+	  i = s.find('\n', i);
+	  i = i == std::string_view::npos ? s.size() : i;
+	}
+	else if (c == '/' && i + 1 < s.size() && s[i + 1] == '*'){
+	  i = s.find("*/", i + 2);
+	  i = i == std::string_view::npos ? s.size() : i + 2;
+	}
+	else if (c == '"' || c == '\'' || c == '`'){
+	  if (c == '`'){
+	    opaque();
+	  }
+
+	  for (++i; i < s.size() && s[i] != c; ++i){
+	    if (s[i] == '\\'){
+	      ++i;
+	    }
+	  }
+
+	  ++i;
+	  after_dot = false;
+	}
+	else if (is_start(c)){
+	  size_t b = i;
+
+	  while (i < s.size() && is_part(s[i])){
+	    ++i;
+	  }
+
+	  identifier(s.substr(b, i - b), after_dot);
+	  after_dot = false;
+	}
+	else if (std::isdigit(static_cast<unsigned char>(c)) || (c == '.' && i + 1 < s.size() && std::isdigit(static_cast<unsigned char>(s[i + 1])))){
+	  std::string text(s.substr(i, 32));
+	  char* end;
+	  double v = std::strtod(text.c_str(), &end);
+	  i += std::max<size_t>(end - text.c_str(), 1);
+
+	  while (i < s.size() && is_part(s[i])){
+	    ++i;
+	  }
+
+	  number(v);
+	  after_dot = false;
+	}
+	else{
+	  if (c == '['){
+	    opaque();
+	  }
+
+	  if (!std::isspace(static_cast<unsigned char>(c))){
+	    after_dot = c == '.';
+	  }
+
+	  ++i;
+	}
+      }
+    }
+
+    // Identifiers which do not make a policy depend on anything else than its variables.
+    bool is_pure_identifier(std::string_view name, bool property){
+      // The functions and constants of Math which depend on their arguments only. Any other property could reach
+      // anything else, for instance through constructor.
+      static const std::string_view pure_properties[] = {
+	"abs", "ceil", "E", "exp", "floor", "LN10", "LN2", "log", "log10", "log2", "max", "min", "PI", "pow", "round", "sign",
+	"sqrt", "trunc"
+      };
+      static const std::string_view allowed[] = {
+	"break", "case", "const", "default", "else", "false", "if", "Infinity", "let", "Math", "NaN", "null", "return",
+	"switch", "true", "undefined", "var"
+      };
+
+      if (property){
+	return std::find(std::begin(pure_properties), std::end(pure_properties), name) != std::end(pure_properties);
+      }
+
+      return std::find(std::begin(allowed), std::end(allowed), name) != std::end(allowed);
+    }
+
+    bool close_enough(double x, double y){
+      return std::isfinite(x) && std::isfinite(y) && std::fabs(x - y) <= 1e-9 * std::max(1.0, std::fabs(y));
+    }
+
+    // Defines the prologue of a policy source, with all the available variables, and runs it.
+    template <typename Js>
+    double run_source(Js& js, const user_p& u, count_type available, unsigned int count, currency::code currency_code, bool overdraft, double price, float rating){
+      // Removing the previous JavaScript prologue.
+      js.reset_prologue();
+
+      if (u != nullptr){
+	js <<
+	  js_variable("user", json::value(u->get_id()))
+	  ;
+
+	address_p a = u->get_address();
+
+	if (a != nullptr){
+	  js <<
+	    js_variable("user_pc", json::value(a->get_postal_code())) <<
+	    js_variable("user_region", json::value(a->get_region())) << 
+	    js_variable("user_country", json::value(a->get_country()))
+	    ;
+	}
+	else{
+	  js <<
+	    js_variable("user_pc", json::value::null()) <<
+	    js_variable("user_region", json::value::null()) << 
+	    js_variable("user_country", json::value::null())
+	    ;
+	}
+      }
+      else{
+	js <<
+	  js_variable("user", json::value::null()) << 
+	  js_variable("user_pc", json::value::null()) <<
+	  js_variable("user_region", json::value::null()) << 
+	  js_variable("user_country", json::value::null())
+	  ;
+      }
+    
+      js <<
+	js_variable("available_count", available) <<
+	js_variable("count", count) <<
+	js_variable("currency", currency_code) <<
+	js_variable("overdraft", overdraft) <<
+	js_variable("price", price) <<
+	js_variable("rating", rating)
+	;
+      return js.run()->number();
+    }
+
+    // Runs a policy source while it is tabulated. It is never attached to a document, so it is never saved.
+    class policy_runner: public element<>
+    {
+    public:
+      HX2A_ELEMENT(policy_runner, "ecom:prunner", element);
+
+      policy_runner(reserved_t):
+	element(reserved),
+	_js(*this)
+      {
+      }
+
+      policy_runner(const string& source):
+	element(standard),
+	_js(*this, source)
+      {
+      }
+
+      double run(unsigned int count, currency::code currency_code, double price){
+	return run_source(_js, nullptr, 0, count, currency_code, false, price, 0);
+      }
+
+    private:
+      slot_js<"j"> _js;
+    };
+
+    // Tokens of a policy source, for the analysis of the policies which can be tabulated.
+    struct token
+    {
+      enum kind_t { identifier, number, punctuator } kind;
+      std::string_view text;
+      double value;
+    };
+
+    // Empty when the source has anything the analysis does not cover: string and template literals, properties,
+    // assignments, increments, exponentiations, remainders, bitwise operators, and numbers not written in decimal
+    // or hexadecimal.
+    std::optional<std::vector<token>> tokenize(std::string_view s){
+      // The longest first.
+      static const std::string_view punctuators[] = {
+	"===", "!==", "==", "!=", "<=", ">=", "&&", "||", "+", "-", "*", "/", "(", ")", "?", ":", ";", "{", "}", ",", "<", ">", "!"
+      };
+
+      std::vector<token> r;
+      size_t i = 0;
+
+      auto is_start = [](char c){ return std::isalpha(static_cast<unsigned char>(c)) || c == '_' || c == '$'; };
+      auto is_part = [&](char c){ return is_start(c) || std::isdigit(static_cast<unsigned char>(c)); };
+      auto is_digit = [&](size_t k){ return k < s.size() && std::isdigit(static_cast<unsigned char>(s[k])); };
+
+      while (i < s.size()){
+	char c = s[i];
+
+	if (std::isspace(static_cast<unsigned char>(c))){
+	  ++i;
+	}
+	else if (c == '/' && i + 1 < s.size() && s[i + 1] == '/'){
+	  i = s.find('\n', i);
+	  i = i == std::string_view::npos ? s.size() : i;
+	}
+	else if (c == '/' && i + 1 < s.size() && s[i + 1] == '*'){
+	  i = s.find("*/", i + 2);
+	  i = i == std::string_view::npos ? s.size() : i + 2;
+	}
+	else if (is_start(c)){
+	  size_t b = i;
+
+	  while (i < s.size() && is_part(s[i])){
+	    ++i;
+	  }
+
+	  r.push_back(token{token::identifier, s.substr(b, i - b), 0});
+	}
+	else if (is_digit(i) || (c == '.' && is_digit(i + 1))){
+	  // Legacy octal numbers.
+	  if (c == '0' && is_digit(i + 1)){
+	    return {};
+	  }
+
+	  std::string text(s.substr(i, 64));
+	  char* end;
+	  double v = std::strtod(text.c_str(), &end);
+	  size_t b = i;
+	  i += end - text.c_str();
+
+	  // Numeric separators, big integers, binary and octal numbers.
+	  if (i < s.size() && (is_part(s[i]) || s[i] == '.')){
+	    return {};
+	  }
+
+	  r.push_back(token{token::number, s.substr(b, i - b), v});
+	}
+	else{
+	  auto e = std::end(punctuators);
+	  auto fi = std::find_if(std::begin(punctuators), e, [&](std::string_view p){ return s.substr(i, p.size()) == p; });
+
+	  if (fi == e){
+	    return {};
+	  }
+
+	  // Increments, decrements and exponentiations.
+	  if (fi->size() == 1 && (c == '+' || c == '-' || c == '*') && i + 1 < s.size() && s[i + 1] == c){
+	    return {};
+	  }
+
+	  r.push_back(token{token::punctuator, *fi, 0});
+	  i += fi->size();
+	}
+      }
+
+      return r;
+    }
+
+    // What the tabulation of a source needs to know, see pricing_policy::tabulate.
+    struct table_shape
+    {
+      // Counts from which the comparisons of the count can have other results, 0 included.
+      std::vector<uint32_t> bounds{0};
+      // Integers of the source which can be ISO 4217 currency codes.
+      std::vector<uint32_t> codes;
+      // Occurrences of the count and of the price outside of comparisons.
+      unsigned count_degree = 0;
+      unsigned price_degree = 0;
+    };
+
+    // Empty when the source is not covered by the analysis.
+    std::optional<table_shape> get_table_shape(std::string_view source){
+      std::optional<std::vector<token>> tokens = tokenize(source);
+
+      if (!tokens){
+	return {};
+      }
+
+      const std::vector<token>& t = *tokens;
+      ptrdiff_t n = static_cast<ptrdiff_t>(t.size());
+      table_shape r;
+
+      static const std::string_view statements[] = {"break", "case", "default", "else", "if", "return", "switch"};
+      static const std::string_view operands[] = {"count", "currency", "false", "Infinity", "NaN", "null", "price", "true", "undefined"};
+      static const std::string_view comparisons[] = {"<", ">", "<=", ">=", "==", "!=", "===", "!=="};
+
+      auto is = [&](ptrdiff_t k, std::string_view text){ return k >= 0 && k < n && t[k].kind != token::number && t[k].text == text; };
+      auto is_one_of = [&](ptrdiff_t k, const auto& texts){
+	return k >= 0 && k < n && t[k].kind != token::number && std::find(std::begin(texts), std::end(texts), t[k].text) != std::end(texts);
+      };
+
+      // Matching parentheses and braces.
+      std::vector<ptrdiff_t> match(n, -1);
+      std::vector<ptrdiff_t> open;
+
+      for (ptrdiff_t k = 0; k != n; ++k){
+	if (t[k].kind == token::identifier && !is_one_of(k, statements) && !is_one_of(k, operands)){
+	  return {};
+	}
+
+	if (is(k, "(") || is(k, "{")){
+	  open.push_back(k);
+	}
+	else if (is(k, ")") || is(k, "}")){
+	  if (open.empty() || is(open.back(), "(") != is(k, ")")){
+	    return {};
+	  }
+
+	  match[k] = open.back();
+	  match[open.back()] = k;
+	  open.pop_back();
+	}
+      }
+
+      if (!open.empty()){
+	return {};
+      }
+
+      auto is_operand = [&](ptrdiff_t k){
+	return t[k].kind == token::number || is_one_of(k, operands) || is(k, "+") || is(k, "-") || is(k, "*") || is(k, "/");
+      };
+
+      // Parentheses holding the condition of an if or a switch.
+      auto is_condition = [&](ptrdiff_t k){ return is(k - 1, "if") || is(k - 1, "switch"); };
+
+      auto is_unary = [&](ptrdiff_t k){
+	return !k || !(t[k - 1].kind == token::number || is_one_of(k - 1, operands) || (is(k - 1, ")") && !is_condition(match[k - 1])));
+      };
+
+      // Where an occurrence of a variable ends up: the tokens around the largest arithmetic expression containing it.
+      struct context
+      {
+	ptrdiff_t left;
+	ptrdiff_t right;
+	// The expression is the variable alone, possibly in parentheses.
+	bool alone = true;
+	bool divisor = false;
+	// The expression is the condition of an if or a switch.
+	bool condition = false;
+      };
+
+      auto context_of = [&](ptrdiff_t i){
+	context c;
+	ptrdiff_t b = i;
+	ptrdiff_t e = i;
+
+	for (;;){
+	  ptrdiff_t k = b - 1;
+
+	  while ((is(k, "+") || is(k, "-")) && is_unary(k)){
+	    --k;
+	  }
+
+	  c.divisor = c.divisor || is(k, "/");
+	  ptrdiff_t l = b - 1;
+
+	  while (l >= 0 && (is_operand(l) || (is(l, ")") && !is_condition(match[l])))){
+	    l = is(l, ")") ? match[l] - 1 : l - 1;
+	  }
+
+	  ptrdiff_t r = e + 1;
+
+	  while (r < n && (is_operand(r) || is(r, "("))){
+	    r = is(r, "(") ? match[r] + 1 : r + 1;
+	  }
+
+	  c.alone = c.alone && l == b - 1 && r == e + 1;
+	  c.left = l;
+	  c.right = r;
+
+	  if (!is(l, "(") || match[l] != r){
+	    return c;
+	  }
+
+	  if (is_condition(l)){
+	    c.condition = true;
+	    return c;
+	  }
+
+	  b = l;
+	  e = r;
+	}
+      };
+
+      // Where a comparison ends, on the left (step -1) or on the right (step 1) of it.
+      auto is_boundary = [&](ptrdiff_t k, ptrdiff_t step){
+	return k < 0 || k >= n || !(is_operand(k) || is(k, step < 0 ? ")" : "(") || is(k, "!") || is_one_of(k, comparisons));
+      };
+
+      auto add_bound = [&](double x){
+	// The result of a comparison with x can only change between floor(x) and floor(x) + 1.
+	if (x >= 0 && x < std::numeric_limits<uint32_t>::max()){
+	  uint32_t f = static_cast<uint32_t>(x);
+	  r.bounds.push_back(f);
+	  r.bounds.push_back(f + 1);
+	}
+      };
+
+      // The number compared with the count, from the comparison operator, when nothing else is compared.
+      auto compared_number = [&](ptrdiff_t op, ptrdiff_t step) -> std::optional<double> {
+	ptrdiff_t k = op + step;
+	bool negative = false;
+
+	if (step > 0 && is(k, "-")){
+	  negative = true;
+	  k += step;
+	}
+
+	if (k < 0 || k >= n || t[k].kind != token::number){
+	  return {};
+	}
+
+	if (step < 0 && is(k - 1, "-") && is_unary(k - 1)){
+	  negative = true;
+	  --k;
+	}
+
+	if (!is_boundary(k + step, step)){
+	  return {};
+	}
+
+	return negative ? -t[k].value : t[k].value;
+      };
+
+      bool count_switch = false;
+
+      for (ptrdiff_t i = 0; i != n; ++i){
+	if (t[i].kind == token::number){
+	  double v = t[i].value;
+
+	  if (v == std::floor(v) && v >= 1 && v <= 999){
+	    r.codes.push_back(static_cast<uint32_t>(v));
+	  }
+
+	  continue;
+	}
+
+	bool count = is(i, "count");
+
+	if (!count && !is(i, "price")){
+	  continue;
+	}
+
+	context c = context_of(i);
+	bool compared = is_one_of(c.left, comparisons) || is_one_of(c.right, comparisons);
+	bool logical = is(c.left, "!") || is(c.left, "&&") || is(c.left, "||") || is(c.right, "&&") || is(c.right, "||") || is(c.right, "?");
+
+	if (c.divisor || is(c.left, "case")){
+	  return {};
+	}
+
+	if (!count){
+	  if (compared || logical || c.condition){
+	    return {};
+	  }
+
+	  ++r.price_degree;
+	}
+	else if (c.condition){
+	  if (!c.alone){
+	    return {};
+	  }
+
+	  if (is(c.left - 1, "switch")){
+	    count_switch = true;
+	  }
+	  else{
+	    add_bound(0);
+	  }
+	}
+	else if (compared){
+	  if (!c.alone || logical){
+	    return {};
+	  }
+
+	  bool right = is_one_of(c.right, comparisons);
+	  std::optional<double> x = right ? compared_number(c.right, 1) : compared_number(c.left, -1);
+
+	  if (!x || !(right ? is_boundary(c.left, -1) : is_boundary(c.right, 1))){
+	    return {};
+	  }
+
+	  add_bound(*x);
+	}
+	else{
+	  // The truth of the count changes at 1, and the count can also be the value of a logical operation.
+	  if (logical){
+	    if (!c.alone){
+	      return {};
+	    }
+
+	    add_bound(0);
+	  }
+
+	  ++r.count_degree;
+	}
+      }
+
+      // Every label of a switch on the count is then a number it is compared with.
+      if (count_switch){
+	for (ptrdiff_t k = 0; k != n; ++k){
+	  if (is(k, "case")){
+	    std::optional<double> x = compared_number(k, 1);
+
+	    if (!x || !is(k + (is(k + 1, "-") ? 3 : 2), ":")){
+	      return {};
+	    }
+
+	    add_bound(*x);
+	  }
+	}
+      }
+
+      std::sort(r.bounds.begin(), r.bounds.end());
+      r.bounds.erase(std::unique(r.bounds.begin(), r.bounds.end()), r.bounds.end());
+      return r;
+    }
+
+  }
+
   // Ontology functions.
   
+  unsigned pricing_policy::get_variables(std::string_view source){
+    static const std::pair<std::string_view, unsigned> variables[] = {
+      {"available_count", available_count_read},
+      {"count", count_read},
+      {"currency", currency_read},
+      {"overdraft", overdraft_read},
+      {"price", price_read},
+      {"rating", rating_read},
+      {"user", user_read},
+      {"user_country", user_country_read},
+      {"user_pc", user_pc_read},
+      {"user_region", user_region_read}
+    };
+
+    unsigned r = 0;
+
+    scan_source(source,
+		[&](std::string_view name, bool property){
+		  auto e = std::end(variables);
+		  auto fi = property ? e : std::find_if(std::begin(variables), e, [&](const auto& v){ return v.first == name; });
+
+		  if (fi != e){
+		    r |= fi->second;
+		  }
+		  else if (!is_pure_identifier(name, property)){
+		    r |= other_read;
+		  }
+		},
+		[](double){},
+		[&]{ r |= other_read; });
+
+    return r;
+  }
+
+  void pricing_policy::tabulate(const std::vector<currency::code>& currencies){
+    while (_table.size()){
+      _table.erase(_table.cbegin());
+    }
+
+    _table_revision = _revision.get();
+    unsigned variables = get_read_variables();
+
+    if (variables & ~(count_read | currency_read | price_read)){
+      return;
+    }
+
+    std::optional<table_shape> shape = get_table_shape(_source.get());
+
+    if (!shape || shape->count_degree > max_table_degree || shape->price_degree > max_table_degree){
+      return;
+    }
+
+    std::vector<uint32_t> codes;
+
+    if (variables & currency_read){
+      codes = shape->codes;
+
+      for (currency::code cc: currencies){
+	codes.push_back(static_cast<uint32_t>(cc));
+      }
+    }
+    else{
+      codes.assign(1, 0);
+    }
+
+    std::sort(codes.begin(), codes.end());
+    codes.erase(std::unique(codes.begin(), codes.end()), codes.end());
+    const std::vector<uint32_t>& bounds = shape->bounds;
+
+    if (bounds.size() * codes.size() > max_table_size){
+      return;
+    }
+
+    struct row
+    {
+      uint32_t currency;
+      uint32_t from_count;
+      double multiplier;
+      double offset;
+    };
+
+    rfr<policy_runner> runner = make_rfr<policy_runner>(_source.get());
+
+    auto e = [&](uint64_t count, currency::code cc, double price){
+      return runner->run(static_cast<unsigned int>(count), cc, price);
+    };
+
+    // Empty when a check fails.
+    auto compute = [&]() -> std::vector<row> {
+      std::vector<row> rows;
+
+      for (uint32_t code: codes){
+	currency::code cc = static_cast<currency::code>(code);
+
+	for (size_t b = 0; b != bounds.size(); ++b){
+	  uint64_t first = bounds[b];
+	  uint64_t last = b + 1 != bounds.size() ? bounds[b + 1] - 1 : std::numeric_limits<unsigned int>::max();
+	  double offset = e(first, cc, 0);
+	  double multiplier = e(first, cc, 1) - offset;
+
+	  // A polynomial of degree d matching a linear function at d + 1 points is that function.
+	  for (uint64_t count = first; count <= std::min<uint64_t>(last, first + shape->count_degree); ++count){
+	    for (unsigned price = 0; price <= std::max(shape->price_degree, 1u); ++price){
+	      if (!close_enough(multiplier * price + offset, e(count, cc, price))){
+		return {};
+	      }
+	    }
+	  }
+
+	  // Merging with the previous range when the formula is the same.
+	  if (!rows.empty() && rows.back().currency == code && rows.back().multiplier == multiplier && rows.back().offset == offset){
+	    continue;
+	  }
+
+	  rows.push_back(row{code, static_cast<uint32_t>(first), multiplier, offset});
+	}
+      }
+
+      return rows;
+    };
+
+    std::vector<row> rows;
+
+    try{
+      rows = compute();
+    }
+    catch (const std::exception& x){
+      // Evaluated instead, failing the same way.
+      diagnostics::report("pricing policy %s not tabulated: %s", get_id().to_string().c_str(), x.what());
+    }
+
+    for (const row& r: rows){
+      _table.push_front(make_rfr<price_segment>(r.currency, r.from_count, r.multiplier, r.offset));
+    }
+  }
+
+  std::optional<double> pricing_policy::get_tabulated_price(unsigned int count, currency::code currency_code, double price) const {
+    if (!is_tabulated()){
+      return {};
+    }
+
+    price_segment_p best;
+    uint32_t code = static_cast<uint32_t>(currency_code);
+
+    std::for_each(_table.cbegin(),
+		  _table.cend(),
+		  [&](const price_segment_p& s){
+		    if ((s->get_currency() == code || !s->get_currency()) && s->get_from_count() <= count &&
+			(best == nullptr || s->get_from_count() > best->get_from_count())){
+		      best = s;
+		    }
+		  });
+
+    if (best == nullptr){
+      return {};
+    }
+
+    return best->get_price(price);
+  }
+
+  std::vector<doc_id> product_category::get_children_ids(const doc_id& id){
+    trace::span index("index", "zambezi::product_category", "parent");
+    std::vector<doc_id> r;
+
+    for (cursor<product_category, "parent"> c(id); c; ++c){
+      r.push_back(c.get_id());
+    }
+
+    return r;
+  }
+
+  std::vector<doc_id> product_category::get_subtree_ids(const doc_id& id){
+    category_tree::snapshot_p tree = category_tree::instance().get_complete();
+
+    if (tree != nullptr && tree->contains(id)){
+      std::span<const doc_id> subtree = tree->get_subtree(id);
+      return {subtree.begin(), subtree.end()};
+    }
+
+    std::vector<doc_id> r{id};
+
+    for (size_t i = 0; i != r.size(); ++i){
+      std::vector<doc_id> children = get_children_ids(r[i]);
+      r.insert(r.end(), children.cbegin(), children.cend());
+    }
+
+    return r;
+  }
+
+  void product_category::set_parent(const product_category_p& parent){
+    product_category_p old_parent = _parent;
+    category_counter::instance().move(*this, parent);
+    _parent = parent;
+    notify(old_parent != nullptr ? old_parent->get_id() : doc_id());
+  }
+
+  void product_category::remove(){
+    category_counter::instance().remove(*this);
+    doc_id id = get_id();
+    unpublish();
+
+    for (const removal_observer& o: removal_observers()){
+      o(id);
+    }
+  }
+
+  void product_category::roll_back(const std::vector<doc_id>& ids){
+    // The children first.
+    for (auto i = ids.crbegin(); i != ids.crend(); ++i){
+      product_category_p pc = get(*i);
+
+      if (pc != nullptr){
+	pc->remove();
+	continue;
+      }
+
+      for (const removal_observer& o: removal_observers()){
+	o(*i);
+      }
+    }
+  }
+
+  void product_category::add_products(int64_t delta){
+    category_counter::instance().add_products(*this, delta);
+  }
+
+  void product::set_category(const product_category_r& category){
+    if (_category != nullptr){
+      _category->add_products(-1);
+    }
+
+    _category = &category;
+    category->add_products(1);
+  }
+
+  void product::remove(){
+    if (_category != nullptr){
+      _category->add_products(-1);
+    }
+
+    unpublish();
+  }
+
+  void product::roll_back(const std::vector<doc_id>& ids){
+    for (const doc_id& id: ids){
+      product_p p = get(id);
+
+      if (p != nullptr){
+	p->unpublish();
+      }
+    }
+  }
+
+  std::vector<doc_id> product::get_ids_in_category(const doc_id& category, const doc_id& after, size_t limit){
+    trace::span index("index", "zambezi::product", "category");
+    std::vector<doc_id> r;
+    // The limit can be far larger than what the category holds.
+    r.reserve(std::min<size_t>(limit, 1024));
+
+    // The cursor is positioned right after the keyset, it never scans what precedes it.
+    for (cursor<product, "category"> c(category, after); c && r.size() != limit; ++c){
+      r.push_back(c.get_id());
+    }
+
+    return r;
+  }
+
   void physical_inventory::set_inventory(const inventory_r& i){
     // Maintaining the mutual link.
     if (_inventory != nullptr){
@@ -28,63 +881,351 @@ namespace zambezi {
     i->add_physical_inventory(*this);
   }
   
+  void physical_inventory::set_count(count_type count){
+    count_type old_count = _count;
+    _count = count;
+
+    // The logical inventory count is a semantic attribute, it is already up to date.
+    if (_inventory != nullptr){
+      _inventory->notify();
+
+      if (count != old_count){
+	count_type total = _inventory->_count;
+	_inventory->notify_stock(get_id(), old_count, count);
+	_inventory->notify_stock(doc_id(), total - count + old_count, total);
+      }
+    }
+  }
+  
   void physical_inventory::disconnect(){
     _inventory->remove_physical_inventory(*this);
     _inventory = nullptr;
   }
   
-  double inventory::calculate_price(unsigned int count, currency::code currency_code){
-    pricing_policy_p policy = _pricing_policy;
+  pricing_policy_p inventory::get_current_policy() const {
+    trace::span load("load", "zambezi::pricing_policy", "pp");
+    return _pricing_policy;
+  }
+
+  pricing_policy_p inventory::copy_policy_source(){
+    pricing_policy_p policy = get_current_policy();
+
+    if (policy != nullptr && policy->get_revision() != _policy_revision){
+      _price = policy->get_source();
+      _policy_revision = policy->get_revision();
+    }
+
+    return policy;
+  }
+
+  bool inventory::migrate_reference_price(){
+    if (static_cast<uint32_t>(_reference_currency) || _legacy_reference_price == nullptr){
+      return false;
+    }
+
+    fixed_money p = get_reference_price();
+    _reference_minor = p.get_minor();
+    _reference_currency = static_cast<uint32_t>(p.get_currency());
+    _legacy_reference_price = nullptr;
+    return true;
+  }
+
+  double inventory::calculate_price(unsigned int count, currency::code currency_code, const user_p& u){
+    pricing_policy_p policy = get_current_policy();
+    double reference_price = get_reference_price().get_amount();
     
     if (policy == nullptr){
-      return _reference_price->get_amount();
+      return reference_price;
     }
-    
-    // Removing the previous JavaScript prologue.
-    _price.reset_prologue();
-    user_p u = get_current_user();
-    // Defining the prologue, with all the available variables.
-    
-    if (u != nullptr){
-      _price <<
-	js_variable("user", json::value(u->get_id()))
-	;
 
-      address_p a = u->get_address();
+    // A tabulated policy does not read the user variables, the price is the same for all users.
+    if (std::optional<double> tabulated = policy->get_tabulated_price(count, currency_code, reference_price)){
+      return *tabulated;
+    }
 
-      if (a != nullptr){
-	_price <<
-	  js_variable("user_pc", json::value(a->get_postal_code())) <<
-	  js_variable("user_region", json::value(a->get_region())) << 
-	  js_variable("user_country", json::value(a->get_country()))
-	  ;
+    size_t capacity = quote_cache_capacity.load(std::memory_order_relaxed);
+    std::optional<quote_key> key;
+
+    // The copied source is the one of the policy only when the inventory is up to date with it.
+    if (capacity && u == nullptr && _policy_revision == policy->get_revision() && policy->is_pure()){
+      key = quote_key{policy->get_id(), _policy_revision, _count, count, static_cast<uint32_t>(currency_code), _overdraft, reference_price, _rating};
+      auto& cache = quote_cache();
+      auto i = cache.find(*key);
+
+      if (i != cache.end()){
+	quote_hits.fetch_add(1, std::memory_order_relaxed);
+	return i->second;
       }
-      else{
-	_price <<
-	  js_variable("user_pc", json::value::null()) <<
-	  js_variable("user_region", json::value::null()) << 
-	  js_variable("user_country", json::value::null())
-	  ;
+
+      quote_misses.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    double price = evaluate(count, currency_code, reference_price, u);
+
+    if (key){
+      auto& cache = quote_cache();
+
+      if (cache.size() >= capacity){
+	cache.clear();
+	quote_recycles.fetch_add(1, std::memory_order_relaxed);
       }
+
+      cache.emplace(*key, price);
     }
-    else{
-      _price <<
-	js_variable("user", json::value::null()) << 
-	js_variable("user_pc", json::value::null()) <<
-	js_variable("user_region", json::value::null()) << 
-	js_variable("user_country", json::value::null())
-	;
+
+    return price;
+  }
+
+  double inventory::evaluate(unsigned int count, currency::code currency_code, double price, const user_p& u){
+    return run_source(_price, u, _count, count, currency_code, _overdraft, price, _rating);
+  }
+
+  void inventory::set_quote_cache_capacity(size_t capacity){
+    quote_cache_capacity = capacity;
+  }
+
+  inventory::quote_cache_statistics inventory::get_quote_cache_statistics(){
+    return {quote_hits.load(), quote_misses.load(), quote_recycles.load()};
+  }
+
+  bool inventory::refresh_price(){
+    // The inventory is saved anyway when something changed.
+    migrate_reference_price();
+    uint32_t revision = _policy_revision;
+    uint32_t version = _inputs_version;
+    bool changed = false;
+    copy_policy_source();
+
+    auto materialize = [&](currency::code cc){
+      double price = calculate_price(1, cc, nullptr);
+      auto e = _prices.cend();
+      auto fi = std::find_if(_prices.cbegin(), e, [&](const currency_price_p& p){ return p->get_currency() == cc; });
+
+      if (fi == e){
+	_prices.push_front(make_rfr<currency_price>(cc, price));
+	changed = true;
+      }
+      else if ((*fi)->get_price() != price){
+	(*fi)->set_price(price);
+	changed = true;
+      }
+    };
+
+    materialize(get_reference_currency());
+
+    for (currency::code cc: materialized_currencies()){
+      if (cc != get_reference_currency()){
+	materialize(cc);
+      }
     }
-    
-    _price <<
-      js_variable("available_count", _count) <<
-      js_variable("count", count) <<
-      js_variable("currency", currency_code) <<
-      js_variable("overdraft", _overdraft) <<
-      js_variable("price", _reference_price->get_amount()) <<
-      js_variable("rating", _rating)
-      ;
-    return _price.run()->number();
+
+    if (_prices_version != version){
+      _prices_version = version;
+      changed = true;
+    }
+
+    return changed || revision != _policy_revision;
+  }
+
+  inventory::materialized_price inventory::get_materialized_price(currency::code cc) const {
+    bool stale = _prices_version != _inputs_version;
+    auto e = _prices.cend();
+    auto fi = std::find_if(_prices.cbegin(), e, [&](const currency_price_p& p){ return p->get_currency() == cc; });
+
+    if (fi == e){
+      return {std::numeric_limits<double>::quiet_NaN(), true};
+    }
+
+    return {(*fi)->get_price(), stale};
+  }
+
+  inventory_p inventory::find(const product_r& prod){
+    trace::span index("index", "zambezi::inventory", "p");
+    cursor<inventoried_product, "p"> ip(prod->get_id());
+
+    if (!ip){
+      return {};
+    }
+
+    cursor<inventory, "p"> i(ip.get_id());
+
+    if (!i){
+      return {};
+    }
+
+    return trace::get<inventory>(i.get_id());
+  }
+
+  uint64_t inventory::migrate_reference_prices(){
+    uint64_t migrated = 0;
+
+    for (const std::string& database: partitions::databases()){
+      // The converted inventories are saved when the connector closes. The price is the same, they are not notified.
+      partitions::connector c(database);
+
+      for (cursor<inventory> cur; cur; ++cur){
+	inventory_p inv = inventory::get(cur.get_id());
+
+	if (inv != nullptr && inv->migrate_reference_price()){
+	  ++migrated;
+	}
+      }
+    }
+
+    return migrated;
+  }
+
+  namespace {
+
+    std::atomic<int64_t> cart_activity_resolution{3600};
+    std::atomic<uint64_t> rehydrated_carts{0};
+    // Set before the first request, only read afterwards.
+    std::string cart_process;
+
+    int64_t seconds_now(){
+      return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Size of a cart as JSON, with the tags of its elements and slots, for the statistics of the compaction. The
+    // framework does not tell the stored size of an element, this is the same content written the same way.
+    size_t stored_size(const persona::mycart& cart){
+      size_t n = 0;
+
+      {
+	json_stream out([&n](std::string_view s){ n += s.size(); });
+
+	auto lines = [&out](auto begin, auto end){
+	  out.key("n").begin_array();
+
+	  std::for_each(begin, end, [&out](const auto& l){
+	    out.begin_object()
+	      .key("type").value("ecom:cart_line")
+	      .key("i").value(l->item()->get_id().to_string())
+	      .key("c").value(static_cast<uint64_t>(l->count()));
+
+	    std::vector<hx2a::zambezi::counter_state> counters = l->get_counters();
+
+	    // Lines edited in merge mode.
+	    if (counters.size() != 1 || !counters.front().replica.empty() || counters.front().decrements){
+	      out.key("k").begin_array();
+
+	      for (const hx2a::zambezi::counter_state& cs: counters){
+		out.begin_object()
+		  .key("type").value("zambezi:rcounter")
+		  .key("r").value(std::string_view(cs.replica))
+		  .key("p").value(cs.increments)
+		  .key("n").value(cs.decrements)
+		  .end_object();
+	      }
+
+	      out.end_array();
+	    }
+
+	    if (l->get_snapshot() != nullptr){
+	      out.key("s").begin_object().key("type").value("ecom:invsnap").end_object();
+	    }
+
+	    out.end_object();
+	  });
+
+	  out.end_array();
+	};
+
+	out.begin_object().key("type").value("ecom:cart");
+	lines(cart.lines_cbegin(), cart.lines_cend());
+	out.key("f").begin_array();
+
+	std::for_each(cart.folders_cbegin(), cart.folders_cend(), [&](const auto& f){
+	  out.begin_object()
+	    .key("type").value("ecom:cart_folder")
+	    .key("l").value(std::string_view(f->get_name()))
+	    .key("d").value(std::string_view(f->get_dots()))
+	    .key("y").value(std::string_view(f->get_removed_lines()));
+	  lines(f->lines_cbegin(), f->lines_cend());
+	  out.end_object();
+	});
+
+	out.end_array()
+	  .key("x").value(std::string_view(cart.get_removed_folders()))
+	  .key("y").value(std::string_view(cart.get_removed_lines()))
+	  .key("z").value(std::string_view(cart.get_removed_folder_lines()))
+	  .end_object();
+      }
+
+      return n;
+    }
+
+  }
+
+  void persona::set_cart_activity_resolution(std::chrono::seconds resolution){
+    cart_activity_resolution = resolution.count();
+  }
+
+  void persona::set_cart_process(std::string name){
+    cart_process = std::move(name);
+  }
+
+  void persona::claim_cart(){
+    if (!cart_process.empty() && _cart_process.get() != cart_process){
+      _cart_process = cart_process;
+    }
+  }
+
+  uint64_t persona::get_rehydrated_carts(){
+    return rehydrated_carts;
+  }
+
+  persona::mycart_r persona::get_cart(){
+    if (is_cart_cold()){
+      // Lines of items removed since the compaction are dropped. A representation not understood is kept, the cart
+      // showing empty, rather than lost.
+      if (_cart->from_cold(_cold_cart.get(), [](const doc_id& id){ return inventory::get(id); })){
+	_cold_cart = std::string();
+	// Saved anyway, and keeps the cart from being compacted again by the next pass.
+	_cart_activity = seconds_now();
+	++rehydrated_carts;
+      }
+    }
+
+    return *_cart;
+  }
+
+  persona::mycart_r persona::edit_cart(){
+    mycart_r r = get_cart();
+    int64_t now = seconds_now();
+
+    if (now - _cart_activity.get() >= cart_activity_resolution){
+      _cart_activity = now;
+    }
+
+    claim_cart();
+    return r;
+  }
+
+  std::optional<persona::compaction> persona::compact_cart(bool drop_snapshots){
+    if (is_cart_cold() || !_cart->elements_count()){
+      return {};
+    }
+
+    if (!mycart::cold_snapshots && _cart->snapshots_count() && !drop_snapshots){
+      return {};
+    }
+
+    compaction r;
+    std::string cold = _cart->to_cold(!drop_snapshots);
+    r.lines = _cart->lines_count();
+    r.snapshots_dropped = drop_snapshots ? _cart->snapshots_count() : 0;
+    r.bytes_before = stored_size(*_cart);
+    r.bytes_after = cold.size();
+    _cart->clear();
+    _cold_cart = cold;
+    return r;
+  }
+
+  persona_p persona::find(const doc_id& user_id){
+    trace::span index("index", "zambezi::persona", "user");
+    cursor<persona, "user"> c(user_id);
+    return c ? trace::get<persona>(c.get_id()) : persona_p();
   }
   
 } // End namespace zambezi.
@@ -6,12 +6,19 @@
 #ifndef HX2A_ZAMBEZI_ONTOLOGY_HPP
 #define HX2A_ZAMBEZI_ONTOLOGY_HPP
 
+#include <chrono>
+#include <vector>
+#include <optional>
+#include <functional>
+#include <string_view>
+
 #include "hx2a/element.hpp"
 #include "hx2a/root.hpp"
 #include "hx2a/slot.hpp"
 #include "hx2a/slot_js.hpp"
 #include "hx2a/key_attribute.hpp"
 #include "hx2a/own.hpp"
+#include "hx2a/own_list.hpp"
 #include "hx2a/link.hpp"
 #include "hx2a/weak_link.hpp"
 #include "hx2a/weak_link_list.hpp"
@@ -20,6 +27,8 @@
 #include "hx2a/components/user.hpp"
 #include "hx2a/components/money.hpp"
 #include "hx2a/zambezi/cart.hpp"
+#include "hx2a/zambezi/trace.hpp"
+#include "hx2a/zambezi/fixed_money.hpp"
 
 using namespace hx2a;
 
@@ -55,6 +64,14 @@ namespace zambezi {
   using pricing_policy_p = ptr<pricing_policy>;
   using pricing_policy_r = rfr<pricing_policy>;
 
+  class price_segment;
+  using price_segment_p = ptr<price_segment>;
+  using price_segment_r = rfr<price_segment>;
+
+  class currency_price;
+  using currency_price_p = ptr<currency_price>;
+  using currency_price_r = rfr<currency_price>;
+
   class inventory;
   using inventory_p = ptr<inventory>;
   using inventory_r = rfr<inventory>;
@@ -74,26 +91,107 @@ namespace zambezi {
     // Reserved constructor.
     product_category(reserved_t, const doc_id& id):
       root(reserved, id),
-      _parent(*this)
+      _parent(*this),
+      _direct_count(*this),
+      _subtree_count(*this)
     {
     }
 
+    // Observers are notified after the creation of a category and after a change of its parent, with the previous
+    // parent (null at creation, or when the category was a root). They are meant for structures derived from the
+    // category tree, which register at startup (see category_tree.hpp). Registration is not thread-safe.
+    using observer = std::function<void(product_category&, const doc_id& old_parent)>;
+
+    static void add_observer(observer o){ observers().push_back(std::move(o)); }
+
+    // Observers notified after the removal of a category through remove, with its identifier. Its subtree is removed
+    // with it. Registration is not thread-safe.
+    using removal_observer = std::function<void(const doc_id&)>;
+
+    static void add_removal_observer(removal_observer o){ removal_observers().push_back(std::move(o)); }
+
     product_category():
       root(standard),
-      _parent(*this)
+      _parent(*this),
+      _direct_count(*this, 0),
+      _subtree_count(*this, 0)
     {
+      notify(doc_id());
     }
 
     product_category(product_category_r pc):
       root(standard),
-      _parent(*this, &pc)
+      _parent(*this, &pc),
+      _direct_count(*this, 0),
+      _subtree_count(*this, 0)
     {
+      notify(doc_id());
     }
 
     product_category_p get_parent() const { return _parent; }
 
+    // Moves the category and its subtree under another parent, or makes it a root when null. The caller makes sure
+    // that the new parent is not in the subtree. The products of the subtree are moved from the counts of the old
+    // ancestors to the ones of the new ancestors.
+    void set_parent(const product_category_p& parent);
+
+    // Removes the category, with its subtree and their products (see the parent link), and takes its products out of
+    // the counts of its ancestors. Do not use unpublish.
+    void remove();
+
+    // Removes the categories of a batch whose save failed, given in the order of their creation: the ones saved,
+    // and, from the observers, the ones notified but never saved.
+    static void roll_back(const std::vector<doc_id>& ids);
+
+    // Number of products directly in the category, and in the category and all its descendants. They are
+    // maintained by deltas along the parents when products are created, moved or removed, and when categories
+    // are moved or removed, so that menus do not count the products of whole subtrees. The deltas are written
+    // asynchronously (see category_counter in category_counts.hpp), the counts lag a little. Products created,
+    // moved or removed by other means than the product functions are not counted, the repair (see
+    // category_counts.hpp) rebuilds the counts from scratch.
+    count_type get_direct_product_count() const { return _direct_count; }
+    count_type get_subtree_product_count() const { return _subtree_count; }
+
+    // Adds delta products directly in the category.
+    void add_products(int64_t delta);
+
+    // For the counter and the repair only.
+    void set_product_counts(count_type direct, count_type subtree){
+      _direct_count = direct;
+      _subtree_count = subtree;
+    }
+
+    // Identifiers of the direct sub-categories, found by link inversion on the parent link. No category is
+    // loaded.
+    static std::vector<doc_id> get_children_ids(const doc_id& id);
+
+    // Identifiers of the category and of all its descendants. No category is loaded. They come from the category
+    // tree (see category_tree.hpp) when it is complete and knows the category, depth first, and else from link
+    // inversion, breadth first.
+    static std::vector<doc_id> get_subtree_ids(const doc_id& id);
+
   private:
+
+    static std::vector<observer>& observers(){
+      static std::vector<observer> o;
+      return o;
+    }
+
+    static std::vector<removal_observer>& removal_observers(){
+      static std::vector<removal_observer> o;
+      return o;
+    }
+
+    void notify(const doc_id& old_parent){
+      for (const observer& o: observers()){
+	o(*this, old_parent);
+      }
+    }
+
     link<product_category, "parent"> _parent;
+    // Not calculated attributes, which would count the products of the subtree again at every change.
+    slot<count_type, "dc"> _direct_count;
+    slot<count_type, "sc"> _subtree_count;
   };
   
   class product: public root<>
@@ -119,10 +217,26 @@ namespace zambezi {
       root(standard),
       _category(*this, &category)
     {
+      category->add_products(1);
     }
 
     product_category_r get_category() const { return *_category; }
 
+    // Moves the product to another category, maintaining the product counts.
+    void set_category(const product_category_r& category);
+
+    // Removes the product, maintaining the product counts. Do not use unpublish.
+    void remove();
+
+    // Removes the products of a batch whose save failed, saved or not. Their creation was not counted, the counts
+    // being written after the save (see category_counts.hpp), their removal is not either.
+    static void roll_back(const std::vector<doc_id>& ids);
+
+    // Identifiers of the products directly in a category, in ascending order, strictly greater than after (a null
+    // identifier starts from the first one), and at most limit of them. Only the index is read. This allows keyset
+    // pagination, without loading or skipping any product.
+    static std::vector<doc_id> get_ids_in_category(const doc_id& category, const doc_id& after, size_t limit);
+
   private:
     link<product_category, "category"> _category;
   };
@@ -142,6 +256,11 @@ namespace zambezi {
       element(standard)
     {
     }
+
+    // Cold form, for the compaction of the carts (see gen_cart::to_cold). It has no state of its own.
+    std::string to_cold() const { return {}; }
+
+    static ptr<inventory_snapshot> from_cold(std::string_view){ return make_ptr<inventory_snapshot>(); }
   };
 
   class persona: public root<>
@@ -164,27 +283,93 @@ namespace zambezi {
     using mycart_p = ptr<mycart>;
     using mycart_r = rfr<mycart>;
     
+    // What compacting a cart did, see compact_cart.
+    struct compaction
+    {
+      size_t lines = 0;
+      size_t snapshots_dropped = 0;
+      // Size of the cart as JSON, with the tags of its elements and slots, and size of its cold representation.
+      size_t bytes_before = 0;
+      size_t bytes_after = 0;
+    };
+
     // Reserved constructor.
     persona(reserved_t, const doc_id& id):
       root(reserved, id),
       _user(*this),
-      _cart(*this)
+      _cart(*this),
+      _cart_activity(*this),
+      _cold_cart(*this),
+      _cart_process(*this)
     {
     }
 
     persona(user_r u):
       root(standard),
       _user(*this, &u),
-      _cart(*this)
+      _cart(*this),
+      _cart_activity(*this, 0),
+      _cold_cart(*this),
+      _cart_process(*this)
     {
     }
 
     user_r get_user() const { return *_user; }
-    mycart_r get_cart() const { return *_cart; }
+
+    // For reading the cart. Rehydrates a compacted cart, which records the activity on it (see get_cart_activity)
+    // in the same save. Reading a hot cart changes nothing in the persona.
+    mycart_r get_cart();
+
+    // For changing the cart. Rehydrates a compacted cart, records the activity on it and claims it for this process
+    // (see set_cart_process).
+    mycart_r edit_cart();
+
+    // Takes into account a version of the cart edited elsewhere (see merge mode in cart.hpp).
+    void merge_cart(const mycart_r& other){ edit_cart()->merge(other.get()); }
+
+    // Adds the lines and folders of the cart of a guest who just logged in.
+    void merge_guest_cart(const mycart_r& guest, hx2a::zambezi::merge_policy policy){ edit_cart()->merge_from(guest.get(), policy); }
+
+    // Time of the last change to the cart, or of its rehydration, in seconds since the epoch, recorded at most once
+    // per resolution to spare saves of the persona. 0 when unknown (carts not changed since it is recorded).
+    int64_t get_cart_activity() const { return _cart_activity; }
+
+    static void set_cart_activity_resolution(std::chrono::seconds resolution);
+
+    // Name of this process, recorded in the personas whose carts it changes, so that only the process writing a
+    // cart compacts it (see cart_lifecycle.hpp). Empty, the default, records nothing. To be called before the first
+    // request.
+    static void set_cart_process(std::string name);
+
+    // The process which changed the cart last, empty when unknown.
+    std::string get_cart_process() const { return _cart_process.get(); }
+
+    // Records this process as the one accessing the cart, without recording an activity.
+    void claim_cart();
+
+    bool is_cart_cold() const { return !_cold_cart.get().empty(); }
+
+    // Without recording an activity.
+    bool cart_has_snapshots() const { return _cart->snapshots_count() != 0; }
+
+    // Replaces the cart's lines and folders by their cold representation (see gen_cart::to_cold), which the next
+    // get_cart restores. The snapshots are kept in it, unless drop_snapshots is true, restored lines then taking new
+    // ones. Nothing happens to an empty or already cold cart. Returns what was done, if anything.
+    std::optional<compaction> compact_cart(bool drop_snapshots);
+
+    // Carts rehydrated since the process started.
+    static uint64_t get_rehydrated_carts();
+
+    // The persona of a user, null if there is none.
+    static persona_p find(const doc_id& user_id);
     
   private:
     link<user, "user"> _user;
     own<mycart, "cart"> _cart;
+    slot<int64_t, "ca"> _cart_activity;
+    // Empty unless the cart is compacted.
+    slot<string, "cc"> _cold_cart;
+    slot<string, "cp"> _cart_process;
   };
 
   // Do not use unpublish if the inventory link is non null, it does not maintain the mutual link with the logical inventory.
@@ -220,6 +405,7 @@ namespace zambezi {
     
     warehouse_r get_warehouse() const { return *_warehouse; }
     count_type get_count() const { return _count; }
+    void set_count(count_type count);
 
     void disconnect();
 
@@ -261,6 +447,43 @@ namespace zambezi {
     link<product, "p"> _product;
   };
 
+  // A row of the precomputed table of a pricing policy: for the currency, and for the requested counts starting
+  // at the one given up to the next row of the same currency, the price is multiplier * price + offset.
+  class price_segment: public element<>
+  {
+  public:
+    HX2A_ELEMENT(price_segment, "ecom:pseg", element);
+
+    price_segment(reserved_t):
+      element(reserved),
+      _currency(*this),
+      _from_count(*this),
+      _multiplier(*this),
+      _offset(*this)
+    {
+    }
+
+    price_segment(uint32_t currency, uint32_t from_count, double multiplier, double offset):
+      element(standard),
+      _currency(*this, currency),
+      _from_count(*this, from_count),
+      _multiplier(*this, multiplier),
+      _offset(*this, offset)
+    {
+    }
+
+    // ISO 4217 code, 0 for all currencies when the policy ignores them.
+    uint32_t get_currency() const { return _currency; }
+    uint32_t get_from_count() const { return _from_count; }
+    double get_price(double price) const { return _multiplier * price + _offset; }
+
+  private:
+    slot<uint32_t, "c"> _currency;
+    slot<uint32_t, "f"> _from_count;
+    slot<double, "m"> _multiplier;
+    slot<double, "o"> _offset;
+  };
+
   class pricing_policy: public root<>
   {
     HX2A_ROOT(pricing_policy, "ecom:ppolicy", 1, root);
@@ -270,7 +493,12 @@ namespace zambezi {
     // Reserved constructor.
     pricing_policy(reserved_t, const doc_id& id):
       root(reserved, id),
-      _source(*this)
+      _source(*this),
+      _revision(*this),
+      _table(*this),
+      _table_revision(*this),
+      _variables(*this),
+      _variables_revision(*this)
     {
     }
 
@@ -297,6 +525,10 @@ namespace zambezi {
     // at every request. Just be careful about the one-to-many relationship between inventories and the
     // pricing policy. In case too many inventories have the same pricing policy, updating the pricing
     // policy should be done offline and not through a semantic attribute.
+    //
+    // This is what happens when the source of a policy is changed through the pricing_policy_update service: the
+    // revision of the policy is bumped, and a repricing task (see repricing.hpp) refreshes the dependent
+    // inventories in the background.
     
     // Examples of policies
     //
@@ -352,25 +584,154 @@ namespace zambezi {
     "}"
     */
     
-    pricing_policy(string source):
+    // Sources can be large, they are passed and returned by reference and copied only into the slots.
+    pricing_policy(const string& source):
       root(standard),
-      _source(*this, source)
+      _source(*this, source),
+      _revision(*this, 1),
+      _table(*this),
+      _table_revision(*this, 0),
+      _variables(*this, get_variables(source)),
+      _variables_revision(*this, 1)
     {
     }
 
-    string get_source() const { return _source; }
-    void set_source(string source) { _source = source; }
+    const string& get_source() const { return _source; }
+
+    void set_source(const string& source){
+      _source = source;
+      _revision = _revision + 1;
+      _variables = get_variables(source);
+      _variables_revision = _revision.get();
+    }
+
+    // Bumped at every change of the source. Inventories record the revision of the source they copied.
+    uint32_t get_revision() const { return _revision; }
+
+    // The documented variables read by a source, as a combination of the flags below. Identifiers are found
+    // outside of comments and string literals, so a variable mentioned in a comment is not read. Anything else
+    // the source could depend on (other identifiers such as this or eval, properties other than the pure functions
+    // and constants of Math, computed properties, template literals, the clock or randomness) is reported as
+    // other_read. The checks are in tools/policy_analysis_check.cpp.
+    enum variable: unsigned {
+      available_count_read = 1 << 0,
+      count_read = 1 << 1,
+      currency_read = 1 << 2,
+      overdraft_read = 1 << 3,
+      price_read = 1 << 4,
+      rating_read = 1 << 5,
+      user_read = 1 << 6,
+      user_country_read = 1 << 7,
+      user_pc_read = 1 << 8,
+      user_region_read = 1 << 9,
+      other_read = 1 << 10
+    };
+
+    static unsigned get_variables(std::string_view source);
+
+    // The variables read by the current source, recorded when it is set. Documents older than the record are
+    // scanned again.
+    unsigned get_read_variables() const {
+      return _variables_revision == _revision ? _variables.get() : get_variables(_source.get());
+    }
+
+    // True when the current source is a function of its variables only, with no clock, no randomness and nothing
+    // else. Its prices can then be memoized (see inventory::set_quote_cache_capacity).
+    bool is_pure() const { return !(get_read_variables() & other_read); }
+
+    // Policies reading only count, currency and price, and linear in price for a given count and currency (such as
+    // the examples above), are precomputed into a table of price segments stored with the policy. Calculating a
+    // price is then a lookup instead of running the JavaScript.
+    //
+    // Only sources the analysis covers are tabulated: arithmetic (no %, no exponentiation, no division by the count
+    // or the price), no comparison or logical operation on the price, the count only compared with numbers, no Math
+    // functions, no properties, no strings. For fixed results of its comparisons, such a source is a polynomial in
+    // the count and the price whose degree is at most the number of their occurrences. The counts are split at the
+    // numbers they are compared with, and the currencies are the ones given plus the ISO 4217 codes appearing in the
+    // source. Every segment is then checked at one more count and one more price than the degrees, which proves the
+    // source linear in the price and constant in the count over the whole segment. A source the analysis does not
+    // cover, failing a check, reading any other variable, of a higher degree than max_table_degree or needing more
+    // than max_table_size segments has an empty table and is evaluated.
+    static constexpr size_t max_table_size = 256;
+    static constexpr unsigned max_table_degree = 4;
+
+    // Computes the table for the current revision, running the current source. This is done once per revision, when
+    // the source is set by the services, and not by the inventories reading the policy.
+    void tabulate(const std::vector<currency::code>& currencies);
+
+    // True when the table matches the current revision, empty or not.
+    bool is_tabulated() const { return _table_revision == _revision; }
+
+    // Empty when the price is not in the table, the policy must then be evaluated.
+    std::optional<double> get_tabulated_price(unsigned int count, currency::code currency_code, double price) const;
 
   private:
     slot<string, "s"> _source;
+    slot<uint32_t, "v"> _revision;
+    own_list<price_segment, "t"> _table;
+    // Revision of the source the table was computed from.
+    slot<uint32_t, "tv"> _table_revision;
+    // Variables read by the source, and the revision of the source they were found in.
+    slot<uint32_t, "r"> _variables;
+    slot<uint32_t, "rv"> _variables_revision;
   };
   
+  // A price materialized for a currency.
+  class currency_price: public element<>
+  {
+  public:
+    HX2A_ELEMENT(currency_price, "ecom:curprice", element);
+
+    currency_price(reserved_t):
+      element(reserved),
+      _currency(*this),
+      _price(*this)
+    {
+    }
+
+    currency_price(currency::code cc, double price):
+      element(standard),
+      _currency(*this, static_cast<uint32_t>(cc)),
+      _price(*this, price)
+    {
+    }
+
+    currency::code get_currency() const { return static_cast<currency::code>(_currency.get()); }
+    double get_price() const { return _price; }
+    void set_price(double price){ _price = price; }
+
+  private:
+    // ISO 4217 code.
+    slot<uint32_t, "c"> _currency;
+    slot<double, "p"> _price;
+  };
+
   class inventory: public root<>
   {
     HX2A_ROOT(inventory, "ecom:inventory", 1, root);
+
+    friend class physical_inventory;
     
   public:
 
+    // Observers are notified after a change of anything contributing to the price or to the availability of an
+    // inventory (count, overdraft, rating, reference price, pricing policy). They are meant for structures derived
+    // from inventories, which register at startup. Registration is not thread-safe.
+    //
+    // Such a change also makes the materialized prices stale, until they are refreshed (see
+    // price_materializer.hpp).
+    using observer = std::function<void(inventory&)>;
+
+    static void add_observer(observer o){ observers().push_back(std::move(o)); }
+
+    // Stock observers are notified after a change of the count of one of the physical inventories, once with the
+    // identifier of the physical inventory and its old and new counts, then once with a null identifier and the old
+    // and new counts of the inventory (see stock_feed.hpp). Adding a physical inventory, and removing or
+    // disconnecting one, notify them too, as a change of its count from or to 0. Registration is not thread-safe.
+    using stock_observer = std::function<void(inventory&, const doc_id& physical_inventory, count_type old_count, count_type new_count)>;
+
+    static void add_stock_observer(stock_observer o){ stock_observers().push_back(std::move(o)); }
+
     // Reserved constructor.
     inventory(reserved_t, const doc_id& id):
       root(reserved, id),
@@ -378,24 +739,45 @@ namespace zambezi {
       _count(*this),
       _overdraft(*this),
       _rating(*this),
-      _reference_price(*this),
+      _reference_minor(*this),
+      _reference_currency(*this),
+      _legacy_reference_price(*this),
       _pricing_policy(*this),
       _price(*this),
+      _policy_revision(*this),
+      _prices(*this),
+      _inputs_version(*this),
+      _prices_version(*this),
       _physical_inventories(*this)
     {
     }
 
     inventory(const inventoried_product_r& iprod, currency::code cc, double reference_price):
+      inventory(iprod, fixed_money::from_amount(reference_price, cc))
+    {
+    }
+
+    inventory(const inventoried_product_r& iprod, const fixed_money& reference_price):
       root(standard),
       _product(*this, &iprod),
       _count(*this),
       _overdraft(*this, false),
       _rating(*this, 0),
-      _reference_price(*this, make_ptr<money>(reference_price, cc)),
+      _reference_minor(*this, reference_price.get_minor()),
+      _reference_currency(*this, static_cast<uint32_t>(reference_price.get_currency())),
+      _legacy_reference_price(*this),
       _pricing_policy(*this),
       _price(*this),
+      _policy_revision(*this, 0),
+      _prices(*this),
+      _inputs_version(*this, 0),
+      _prices_version(*this, 0),
       _physical_inventories(*this)
     {
+      // Without policy the reference price is the price, it is never stale.
+      _prices.push_front(make_rfr<currency_price>(reference_price.get_currency(), reference_price.get_amount()));
+      notify();
+      _prices_version = _inputs_version.get();
     }
 
     count_type get_count() /* cannot be const */ {
@@ -406,27 +788,59 @@ namespace zambezi {
 
     // When true, sales are allowed even when the count is null. The sale is marked as "back order".
     bool get_overdraft() const { return _overdraft; }
-    void set_overdraft(bool flag = true){ _overdraft = flag; }
+    void set_overdraft(bool flag = true){
+      _overdraft = flag;
+      notify();
+    }
+
+    float get_rating() const { return _rating; }
+
+    void set_rating(float rating){
+      _rating = rating;
+      notify();
+    }
 
     void add_physical_inventory(const physical_inventory_r& pi){
       // Establishing the mutual link.
       _physical_inventories.push_front(pi);
       pi->set_inventory(*this);
+      notify();
+      notify_stock_joined(pi->get_id(), 0, pi->get_count());
     }
 
     // The remove is done by the physical inventory itself to ensure that the mutual link is properly maintained.
     // Do not use the function below.
     void remove_physical_inventory(const physical_inventory_r& pi){
       _physical_inventories.remove(pi);
+      notify();
+      notify_stock_joined(pi->get_id(), pi->get_count(), 0);
     }
 
-    currency::code get_reference_currency() const { return _reference_price->get_currency(); }
-    
-    money_r get_reference_price() const { return *_reference_price; }
-    void set_reference_price(const money_r& p){ _reference_price = &p; }
+    currency::code get_reference_currency() const { return get_reference_price().get_currency(); }
+
+    // Inventories saved before the reference price was inlined own a money element instead. It is read as is, and
+    // converted at the first change or refresh of the prices, the connector then saving the inventory without it.
+    // Reads never convert. migrate_reference_prices converts all of them at once.
+    fixed_money get_reference_price() const {
+      if (!static_cast<uint32_t>(_reference_currency) && _legacy_reference_price != nullptr){
+	return fixed_money::from_amount(_legacy_reference_price->get_amount(), _legacy_reference_price->get_currency());
+      }
+
+      return fixed_money(_reference_minor, static_cast<currency::code>(static_cast<uint32_t>(_reference_currency)));
+    }
+
+    void set_reference_price(const fixed_money& p){
+      _legacy_reference_price = nullptr;
+      _reference_minor = p.get_minor();
+      _reference_currency = static_cast<uint32_t>(p.get_currency());
+      notify();
+    }
 
     // No pricing policy means returning the reference price.
     pricing_policy_p get_pricing_policy() const { return _pricing_policy; }
+
+    // Revision of the source of the pricing policy copied in the inventory, the one run (see refresh_price).
+    uint32_t get_copied_policy_revision() const { return _policy_revision; }
     
     void set_pricing_policy(const pricing_policy_p& pp){
       _pricing_policy = pp;
@@ -434,16 +848,133 @@ namespace zambezi {
       if (pp != nullptr){
 	// Assigning the policy source.
 	_price = _pricing_policy->get_source();
+	_policy_revision = _pricing_policy->get_revision();
       }
+
+      notify();
     }
 
-    double calculate_price(unsigned int requested_count, currency::code currency_code);
+    // Materialized prices are the prices of a single item without user context, cached in the inventory for the
+    // reference currency and for the currencies below. They are indexable.
+    static void set_materialized_currencies(std::vector<currency::code> currencies){ materialized_currencies() = std::move(currencies); }
+
+    static const std::vector<currency::code>& get_materialized_currencies(){ return materialized_currencies(); }
+
+    // Copies again the source of the pricing policy if it changed since it was copied, and recalculates the
+    // materialized prices. Returns true if the inventory changed. This is what the offline repricing calls on every
+    // inventory depending on a policy which changed, and what the price materializer calls after a change.
+    bool refresh_price();
+
+    struct materialized_price
+    {
+      // NaN when the price was never materialized for the currency.
+      double price;
+      // True when the inventory changed since the price was materialized, and the recalculation is pending. A
+      // change of the pricing policy source is not reflected here, it is covered by the offline repricing.
+      bool stale;
+    };
+
+    // The last materialized price, never calculated on the fly.
+    materialized_price get_materialized_price(currency::code cc) const;
+
+    // Bumped at every change of anything contributing to the price.
+    uint32_t get_price_inputs_version() const { return _inputs_version; }
+
+    // For the current user, if any.
+    double calculate_price(unsigned int requested_count, currency::code currency_code){
+      return calculate_price(requested_count, currency_code, get_current_user());
+    }
+
+    // For a given user, or for no user at all when null, which gives a price independent from the user context.
+    double calculate_price(unsigned int requested_count, currency::code currency_code, const user_p& u);
+
+    // Prices independent from the user context (the ones materialized, repriced and indexed) can be memoized per
+    // thread, keyed by the revision of the pricing policy and by the values of all the variables of the prologue.
+    // The JavaScript is then run once per distinct input instead of every time. Only the prices of pure policies
+    // (see pricing_policy::is_pure) are memoized, the others are evaluated every time. It is off by default. A
+    // thread's cache is emptied when it reaches the capacity. It does not make a single evaluation cheaper: pooling
+    // the JavaScript contexts would, and is left to the framework, which owns them (see slot_js). The gain is
+    // measured by tools/quote_bench.cpp.
+    struct quote_cache_statistics
+    {
+      uint64_t hits;
+      uint64_t misses;
+      // Caches emptied because they were full.
+      uint64_t recycles;
+    };
+
+    static void set_quote_cache_capacity(size_t capacity);
+
+    static quote_cache_statistics get_quote_cache_statistics();
+
+    // Finds the inventory of a product, if any, through the inventoried product.
+    static inventory_p find(const product_r& prod);
+
+    // Converts the reference prices of the inventories of all the tenants saved as money elements (see
+    // get_reference_price), for instance once after an upgrade. Returns the number of inventories converted. It opens
+    // its own connectors.
+    static uint64_t migrate_reference_prices();
 
   private:
+
+    static std::vector<observer>& observers(){
+      static std::vector<observer> o;
+      return o;
+    }
+
+    // Replaces the money element of an older document with the inline slots. Returns true if it did.
+    bool migrate_reference_price();
+
+    static std::vector<stock_observer>& stock_observers(){
+      static std::vector<stock_observer> o;
+      return o;
+    }
+
+    static std::vector<currency::code>& materialized_currencies(){
+      static std::vector<currency::code> c;
+      return c;
+    }
+
+    // Reads do not copy the source of a policy which changed since it was copied: until the offline repricing
+    // reaches the inventory, they run the copied source, unless the policy is tabulated for its new revision.
+    pricing_policy_p get_current_policy() const;
+
+    // Copies again the source of the pricing policy if it changed since it was copied.
+    pricing_policy_p copy_policy_source();
+
+    // Runs the copied source.
+    double evaluate(unsigned int count, currency::code currency_code, double price, const user_p& u);
+
+    void notify(){
+      migrate_reference_price();
+      _inputs_version = _inputs_version + 1;
+
+      for (const observer& o: observers()){
+	o(*this);
+      }
+    }
+
+    void notify_stock(const doc_id& physical_inventory, count_type old_count, count_type new_count){
+      for (const stock_observer& o: stock_observers()){
+	o(*this, physical_inventory, old_count, new_count);
+      }
+    }
+
+    // A physical inventory joined or left, its count is counted from now on, or not anymore.
+    void notify_stock_joined(const doc_id& physical_inventory, count_type old_count, count_type new_count){
+      if (old_count == new_count){
+	return;
+      }
+
+      count_type total = calculateCount(0);
+      notify_stock(physical_inventory, old_count, new_count);
+      notify_stock(doc_id(), total - new_count + old_count, total);
+    }
     
     link<inventoried_product, "p"> _product;
 
     count_type calculateCount(const count_type& /* ignored */) const {
+      trace::span walk("walk", "zambezi::physical_inventory", "i");
       count_type count = 0;
       
       std::for_each(_physical_inventories.cbegin(),
@@ -465,10 +996,20 @@ namespace zambezi {
     // eCommerce sites (weighted - with user characteristics/demographics, date of review, etc., and/or
     // removing outliers, etc.).
     slot<float, "r"> _rating;
-    own<money, "rp"> _reference_price;
+    // Reference price in minor units of its currency (see fixed_money.hpp).
+    slot<int64_t, "rpm"> _reference_minor;
+    slot<uint32_t, "rpc"> _reference_currency;
+    // Previous representation of the reference price, only read from older documents.
+    own<money, "rp"> _legacy_reference_price;
     // Weak link, the inventory still exists if the pricing policy is removed.
     weak_link<pricing_policy, "pp"> _pricing_policy;
     slot_js<"p"> _price;
+    // Revision of the pricing policy whose source was copied in the slot above.
+    slot<uint32_t, "pv"> _policy_revision;
+    own_list<currency_price, "mp"> _prices;
+    // The materialized prices are stale when these two differ.
+    slot<uint32_t, "iv"> _inputs_version;
+    slot<uint32_t, "mv"> _prices_version;
     // Weak link list and not a regular strong link list so that when an inventory is loaded the
     // physical inventories are loaded only if necessary.
     weak_link_list<physical_inventory, "i", infinite /* max size */, active> _physical_inventories;
@@ -0,0 +1,175 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
+#include <exception>
+#include <functional>
+
+#include "hx2a/zambezi/partitions.hpp"
+#include "hx2a/zambezi/diagnostics.hpp"
+
+namespace zambezi::partitions {
+
+  namespace {
+
+    struct state
+    {
+      settings s;
+      // Names of the partitions, by index.
+      std::vector<std::string> names;
+    };
+
+    state& current_state(){
+      static state s;
+      return s;
+    }
+
+    // FNV-1a of the textual identifier, the same in every process and build, unlike std::hash, so that all the
+    // processes route a tenant to the same partition.
+    uint64_t hash(const doc_id& tenant){
+      uint64_t h = 14695981039346656037ull;
+
+      for (char c: tenant.to_string()){
+	h ^= static_cast<unsigned char>(c);
+	h *= 1099511628211ull;
+      }
+
+      return h;
+    }
+
+    std::atomic<uint64_t> failed_saves{0};
+    std::atomic<uint64_t> failed_deferred{0};
+
+    thread_local const std::string* current_database = nullptr;
+    thread_local connector* current_connector = nullptr;
+
+  }
+
+  void configure(const settings& s){
+    state& st = current_state();
+    st.s = s;
+    st.names.clear();
+
+    for (uint32_t i = 0; i != s.partitions; ++i){
+      st.names.push_back(s.database + '_' + std::to_string(i));
+    }
+  }
+
+  const std::string& database(const doc_id& tenant){
+    const state& st = current_state();
+
+    if (tenant.is_null()){
+      return st.s.database;
+    }
+
+    auto i = st.s.dedicated.find(tenant);
+
+    if (i != st.s.dedicated.end()){
+      return i->second;
+    }
+
+    if (st.names.empty()){
+      return st.s.database;
+    }
+
+    return st.names[hash(tenant) % st.names.size()];
+  }
+
+  std::vector<std::string> databases(){
+    const state& st = current_state();
+    std::vector<std::string> r{st.s.database};
+    r.insert(r.end(), st.names.cbegin(), st.names.cend());
+
+    for (const auto& [tenant, name]: st.s.dedicated){
+      if (std::find(r.cbegin(), r.cend(), name) == r.cend()){
+	r.push_back(name);
+      }
+    }
+
+    return r;
+  }
+
+  const std::string& current(){
+    return current_database ? *current_database : current_state().s.database;
+  }
+
+  void after_commit(std::function<void()> f){
+    if (current_connector){
+      current_connector->_committed.push_back(std::move(f));
+    }
+    else{
+      f();
+    }
+  }
+
+  connector::connector(const std::string& database):
+    _database(database),
+    _previous(current_database),
+    _outer(current_connector),
+    _exceptions(std::uncaught_exceptions())
+  {
+    _connector.emplace(_database);
+    current_database = &_database;
+    current_connector = this;
+  }
+
+  void connector::close(){
+    if (!_connector){
+      return;
+    }
+
+    bool left = std::uncaught_exceptions() > _exceptions;
+
+    // The documents are saved with the database and the connector still current.
+    try{
+      _connector.reset();
+    }
+    catch (...){
+      current_database = _previous;
+      current_connector = _outer;
+      failed_saves.fetch_add(1, std::memory_order_relaxed);
+      throw;
+    }
+
+    current_database = _previous;
+    current_connector = _outer;
+
+    if (left){
+      return;
+    }
+
+    for (const std::function<void()>& f: _committed){
+      try{
+	f();
+      }
+      catch (const std::exception& e){
+	failed_deferred.fetch_add(1, std::memory_order_relaxed);
+	diagnostics::report("after commit: %s", e.what());
+      }
+    }
+  }
+
+  connector::~connector(){
+    try{
+      close();
+    }
+    catch (const std::exception& e){
+      diagnostics::report("documents of %s not saved: %s", _database.c_str(), e.what());
+    }
+    catch (...){
+      diagnostics::report("documents of %s not saved", _database.c_str());
+    }
+  }
+
+  statistics get_statistics(){
+    statistics s;
+    s.failed_saves = failed_saves.load(std::memory_order_relaxed);
+    s.failed_deferred = failed_deferred.load(std::memory_order_relaxed);
+    return s;
+  }
+
+} // End namespace zambezi::partitions.
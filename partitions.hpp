@@ -0,0 +1,118 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_PARTITIONS_HPP
+#define HX2A_ZAMBEZI_PARTITIONS_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <functional>
+#include <unordered_map>
+
+#include "hx2a/server.hpp"
+
+using namespace hx2a;
+
+namespace zambezi::partitions {
+
+  // Routing of the documents of the tenants to logical databases, for horizontal scaling.
+  //
+  // The tenant of a request is its organization. All the documents a tenant creates (categories, products,
+  // inventories, personas and their carts...) go to the logical database of the tenant, so that tenants are spread
+  // over databases which can be mapped to different physical databases or clusters in the configuration file.
+  // Requests without organization, and everything when partitioning is off (the default), use the shared
+  // database. Links between documents of different databases are followed and kept consistent by the framework,
+  // referential integrity does not depend on the partitioning.
+  //
+  // Tenants are spread over the partitions by a hash (FNV-1a) of their identifier, and large tenants can be given a
+  // partition of their own. Changing the settings of a running deployment moves tenants, their documents must
+  // then be moved accordingly.
+  //
+  // A locally testable multi-partition setup maps the names given by databases() to in-memory databases in the
+  // configuration file, and drives the services with sessions of several organizations (see tools/replay.cpp).
+  // tools/partitions_check.cpp is such a setup, checking the routing and the isolation of the partitions.
+  struct settings
+  {
+    // The shared database, and the prefix of the partitions, named "hx2a_0", "hx2a_1"...
+    std::string database = "hx2a";
+    // 0 keeps everything in the shared database.
+    uint32_t partitions = 0;
+    // Tenants with a database of their own, not counted in the partitions above.
+    std::unordered_map<doc_id, std::string> dedicated;
+  };
+
+  // To be called before the first request.
+  void configure(const settings& s);
+
+  // The database of the documents of a tenant, the shared one for a null tenant.
+  const std::string& database(const doc_id& tenant);
+
+  inline const std::string& database(const organization_p& tenant){
+    return database(tenant != nullptr ? tenant->get_id() : doc_id());
+  }
+
+  // All the databases, the shared one first, for the jobs scanning everything.
+  std::vector<std::string> databases();
+
+  // The database of the innermost connector below opened by the calling thread, the shared one if none. Work
+  // deferred to other threads (materialization, buffered writes...) records it to open the same database later.
+  const std::string& current();
+
+  // Runs f once the innermost connector below opened by the calling thread has saved its documents, right away if
+  // there is none. Dropped if the connector is left by an exception, or fails to save. For what other processes
+  // are told about changes, which must not tell them about changes never committed.
+  void after_commit(std::function<void()> f);
+
+  struct statistics
+  {
+    // Connectors whose documents could not be saved.
+    uint64_t failed_saves = 0;
+    // Deferred work which threw (see after_commit).
+    uint64_t failed_deferred = 0;
+  };
+
+  statistics get_statistics();
+
+  // Database connector which makes its database the current one of the thread for its lifetime.
+  class connector
+  {
+  public:
+
+    explicit connector(const std::string& database);
+
+    explicit connector(const organization_p& tenant):
+      connector(partitions::database(tenant))
+    {
+    }
+
+    connector(const connector&) = delete;
+    connector& operator=(const connector&) = delete;
+
+    // Saves the documents and stops being the current connector, then runs the work deferred with after_commit.
+    // Throws if the save fails, the deferred work being dropped. For callers which need to know whether the
+    // documents were saved. Does nothing the second time.
+    void close();
+
+    // Closes if not closed yet. A failure to save cannot be thrown from here, it is counted (see get_statistics)
+    // and reported (see diagnostics.hpp).
+    ~connector();
+
+  private:
+    friend void after_commit(std::function<void()> f);
+
+    std::string _database;
+    const std::string* _previous;
+    connector* _outer;
+    // Exceptions in flight when opened, more when closed means it is left by one.
+    int _exceptions;
+    std::vector<std::function<void()>> _committed;
+    std::optional<db::connector> _connector;
+  };
+
+} // End namespace zambezi::partitions.
+
+#endif
@@ -8,6 +8,8 @@
 
 #include "hx2a/element.hpp"
 #include "hx2a/slot.hpp"
+#include "hx2a/own.hpp"
+#include "hx2a/own_list.hpp"
 
 namespace zambezi {
   
@@ -39,6 +41,341 @@ namespace zambezi {
   using pricing_policy_with_id_payload_p = ptr<pricing_policy_with_id_payload>;
   using pricing_policy_with_id_payload_r = rfr<pricing_policy_with_id_payload>;
 
+  class product_list_payload;
+  using product_list_payload_p = ptr<product_list_payload>;
+  using product_list_payload_r = rfr<product_list_payload>;
+
+  class product_list_payload: public element<>
+  {
+  public:
+    HX2A_ELEMENT(product_list_payload, "ecom:plistpld", element);
+
+    product_list_payload(reserved_t):
+      element(reserved),
+      category(*this),
+      after(*this),
+      limit(*this),
+      with_inventory(*this),
+      currency_code(*this)
+    {
+    }
+
+    slot<doc_id, "category"> category;
+    // Identifier of the last product of the previous page, null for the first page.
+    slot<doc_id, "after"> after;
+    // Page size, 0 for the default one.
+    slot<uint32_t, "limit"> limit;
+    // When true, the count and the price of each product's inventory are attached.
+    slot<bool, "inventory"> with_inventory;
+    // ISO 4217 code of the currency of the prices, 0 for the reference currency of each inventory.
+    slot<uint32_t, "currency"> currency_code;
+  };
+
+  class inventory_search_payload;
+  using inventory_search_payload_p = ptr<inventory_search_payload>;
+  using inventory_search_payload_r = rfr<inventory_search_payload>;
+
+  class inventory_search_payload: public element<>
+  {
+  public:
+    HX2A_ELEMENT(inventory_search_payload, "ecom:isearchpld", element);
+
+    inventory_search_payload(reserved_t):
+      element(reserved),
+      currency_code(*this),
+      min_price(*this),
+      max_price(*this),
+      min_rating(*this),
+      min_count(*this),
+      limit(*this),
+      nearest(*this),
+      price(*this),
+      rating(*this),
+      rating_weight(*this)
+    {
+    }
+
+    // ISO 4217 code of the currency of the prices.
+    slot<uint32_t, "currency"> currency_code;
+    slot<double, "min_price"> min_price;
+    // 0 for no maximum.
+    slot<double, "max_price"> max_price;
+    slot<float, "min_rating"> min_rating;
+    slot<count_type, "min_count"> min_count;
+    // Maximum number of inventories returned, 0 for the default one.
+    slot<uint32_t, "limit"> limit;
+    // When true, the inventories returned are the closest ones to the target price and rating, closest first.
+    slot<bool, "nearest"> nearest;
+    slot<double, "price"> price;
+    slot<float, "rating"> rating;
+    // Weight of the rating distance relative to the price distance.
+    slot<double, "rating_weight"> rating_weight;
+  };
+
+  class inventory_top_payload;
+  using inventory_top_payload_p = ptr<inventory_top_payload>;
+  using inventory_top_payload_r = rfr<inventory_top_payload>;
+
+  class inventory_top_payload: public element<>
+  {
+  public:
+    HX2A_ELEMENT(inventory_top_payload, "ecom:itoppld", element);
+
+    inventory_top_payload(reserved_t):
+      element(reserved),
+      category(*this),
+      currency_code(*this),
+      k(*this),
+      with_facets(*this),
+      price_step(*this),
+      price_buckets(*this)
+    {
+    }
+
+    // The products of the category and of all its sub-categories are searched.
+    slot<doc_id, "category"> category;
+    // ISO 4217 code of the currency of the prices.
+    slot<uint32_t, "currency"> currency_code;
+    // Number of cheapest inventories returned, 0 for the default one.
+    slot<uint32_t, "k"> k;
+    slot<bool, "facets"> with_facets;
+    // Price facet buckets are [0, step), [step, 2 * step)... up to price_buckets buckets, the last one being open.
+    slot<double, "price_step"> price_step;
+    slot<uint32_t, "price_buckets"> price_buckets;
+  };
+
+  class cart_merge_payload;
+  using cart_merge_payload_p = ptr<cart_merge_payload>;
+  using cart_merge_payload_r = rfr<cart_merge_payload>;
+
+  class cart_merge_payload: public element<>
+  {
+  public:
+    HX2A_ELEMENT(cart_merge_payload, "ecom:cmergepld", element);
+
+    cart_merge_payload(reserved_t):
+      element(reserved),
+      cart(*this)
+    {
+    }
+
+    // The version of the cart of the user logged in, as edited on a replica in merge mode.
+    own<persona::mycart, "cart"> cart;
+  };
+
+  class cart_guest_merge_payload;
+  using cart_guest_merge_payload_p = ptr<cart_guest_merge_payload>;
+  using cart_guest_merge_payload_r = rfr<cart_guest_merge_payload>;
+
+  class cart_guest_merge_payload: public element<>
+  {
+  public:
+    HX2A_ELEMENT(cart_guest_merge_payload, "ecom:cgmergepld", element);
+
+    cart_guest_merge_payload(reserved_t):
+      element(reserved),
+      cart(*this),
+      policy(*this)
+    {
+    }
+
+    // The cart filled by the guest before logging in.
+    own<persona::mycart, "cart"> cart;
+    // Count of an item in both carts: "sum" (default), "max", or "keep" for the one of the user.
+    slot<string, "policy"> policy;
+  };
+
+  class cart_item_count_payload;
+  using cart_item_count_payload_p = ptr<cart_item_count_payload>;
+  using cart_item_count_payload_r = rfr<cart_item_count_payload>;
+
+  class cart_item_count_payload: public element<>
+  {
+  public:
+    HX2A_ELEMENT(cart_item_count_payload, "ecom:cicpld", element);
+
+    cart_item_count_payload(reserved_t):
+      element(reserved),
+      folder(*this),
+      item(*this),
+      count(*this),
+      buffered(*this)
+    {
+    }
+
+    // Empty for the top level.
+    slot<string, "folder"> folder;
+    // Inventory.
+    slot<doc_id, "item"> item;
+    // 0 removes the line.
+    slot<uint32_t, "count"> count;
+    // Whether the update goes through the write-behind buffer.
+    slot<bool, "buffered"> buffered;
+  };
+
+  class stock_changes_payload;
+  using stock_changes_payload_p = ptr<stock_changes_payload>;
+  using stock_changes_payload_r = rfr<stock_changes_payload>;
+
+  class stock_changes_payload: public element<>
+  {
+  public:
+    HX2A_ELEMENT(stock_changes_payload, "ecom:stockchgpld", element);
+
+    stock_changes_payload(reserved_t):
+      element(reserved),
+      after(*this),
+      limit(*this),
+      wait(*this)
+    {
+    }
+
+    // Position returned by the previous reply (see stock_changes), 0 for the beginning.
+    slot<uint64_t, "after"> after;
+    // Maximum number of events returned, 0 for the default one.
+    slot<uint32_t, "limit"> limit;
+    // Milliseconds to wait for an event when there is none yet.
+    slot<uint32_t, "wait"> wait;
+  };
+
+  class category_move_payload;
+  using category_move_payload_p = ptr<category_move_payload>;
+  using category_move_payload_r = rfr<category_move_payload>;
+
+  class category_move_payload: public element<>
+  {
+  public:
+    HX2A_ELEMENT(category_move_payload, "ecom:catmovepld", element);
+
+    category_move_payload(reserved_t):
+      element(reserved),
+      category(*this),
+      parent(*this)
+    {
+    }
+
+    slot<doc_id, "category"> category;
+    // Null to make the category a root.
+    slot<doc_id, "parent"> parent;
+  };
+
+  class product_move_payload;
+  using product_move_payload_p = ptr<product_move_payload>;
+  using product_move_payload_r = rfr<product_move_payload>;
+
+  class product_move_payload: public element<>
+  {
+  public:
+    HX2A_ELEMENT(product_move_payload, "ecom:pmovepld", element);
+
+    product_move_payload(reserved_t):
+      element(reserved),
+      product(*this),
+      category(*this)
+    {
+    }
+
+    slot<doc_id, "product"> product;
+    slot<doc_id, "category"> category;
+  };
+
+  class category_create_entry;
+  using category_create_entry_p = ptr<category_create_entry>;
+  using category_create_entry_r = rfr<category_create_entry>;
+
+  class category_create_entry: public element<>
+  {
+  public:
+    HX2A_ELEMENT(category_create_entry, "ecom:catcrtent", element);
+
+    category_create_entry(reserved_t):
+      element(reserved),
+      parent(*this),
+      local_parent(*this)
+    {
+    }
+
+    // Existing parent, null for a root or a local parent.
+    slot<doc_id, "parent"> parent;
+    // Parent created by the same request: 1-based position of an earlier entry, 0 for none. Nested trees are given
+    // parents first.
+    slot<uint32_t, "local"> local_parent;
+  };
+
+  class category_create_many_payload;
+  using category_create_many_payload_p = ptr<category_create_many_payload>;
+  using category_create_many_payload_r = rfr<category_create_many_payload>;
+
+  class category_create_many_payload: public element<>
+  {
+  public:
+    HX2A_ELEMENT(category_create_many_payload, "ecom:catcrtmanypld", element);
+
+    category_create_many_payload(reserved_t):
+      element(reserved),
+      categories(*this)
+    {
+    }
+
+    own_list<category_create_entry, "categories"> categories;
+  };
+
+  class product_create_entry;
+  using product_create_entry_p = ptr<product_create_entry>;
+  using product_create_entry_r = rfr<product_create_entry>;
+
+  class product_create_entry: public element<>
+  {
+  public:
+    HX2A_ELEMENT(product_create_entry, "ecom:pcrtent", element);
+
+    product_create_entry(reserved_t):
+      element(reserved),
+      category(*this)
+    {
+    }
+
+    // Null for a product without category.
+    slot<doc_id, "category"> category;
+  };
+
+  class product_create_many_payload;
+  using product_create_many_payload_p = ptr<product_create_many_payload>;
+  using product_create_many_payload_r = rfr<product_create_many_payload>;
+
+  class product_create_many_payload: public element<>
+  {
+  public:
+    HX2A_ELEMENT(product_create_many_payload, "ecom:pcrtmanypld", element);
+
+    product_create_many_payload(reserved_t):
+      element(reserved),
+      products(*this)
+    {
+    }
+
+    own_list<product_create_entry, "products"> products;
+  };
+
+  class cart_total_payload;
+  using cart_total_payload_p = ptr<cart_total_payload>;
+  using cart_total_payload_r = rfr<cart_total_payload>;
+
+  class cart_total_payload: public element<>
+  {
+  public:
+    HX2A_ELEMENT(cart_total_payload, "ecom:ctotalpld", element);
+
+    cart_total_payload(reserved_t):
+      element(reserved),
+      currency_code(*this)
+    {
+    }
+
+    // ISO 4217 code of the currency of the amounts. It is required, there is no reply for 0.
+    slot<uint32_t, "currency"> currency_code;
+  };
+
 }
 
 #endif
@@ -0,0 +1,146 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#include <algorithm>
+#include <exception>
+
+#include "hx2a/server.hpp"
+
+#include "hx2a/zambezi/price_materializer.hpp"
+#include "hx2a/zambezi/partitions.hpp"
+#include "hx2a/zambezi/diagnostics.hpp"
+
+using namespace hx2a;
+
+namespace zambezi {
+
+  namespace {
+
+    // Observing inventories from the start, so that no change is missed.
+    [[maybe_unused]] price_materializer& registration = price_materializer::instance();
+
+  }
+
+  price_materializer& price_materializer::instance(){
+    static price_materializer m;
+    return m;
+  }
+
+  price_materializer::price_materializer(){
+    inventory::add_observer([this](inventory& inv){ enqueue(inv.get_id(), inv.get_price_inputs_version()); });
+  }
+
+  price_materializer::~price_materializer(){
+    {
+      std::lock_guard l(_mutex);
+      _stop = true;
+    }
+
+    _wake.notify_all();
+
+    for (std::thread& t: _threads){
+      t.join();
+    }
+  }
+
+  void price_materializer::enqueue(const doc_id& id, uint32_t version){
+    // Threads are started on first use, not when the module is loaded.
+    std::call_once(_started, [this]{
+      for (size_t i = 0; i != std::max<size_t>(_settings.threads, 1); ++i){
+	_threads.emplace_back([this]{ run(); });
+      }
+    });
+
+    {
+      std::lock_guard l(_mutex);
+      ++_statistics.requested;
+      auto [i, inserted] = _pending.try_emplace(id, pending{partitions::current(), version, clock::now() + _settings.window, 0});
+
+      if (!inserted){
+	++_statistics.coalesced;
+	i->second.version = std::max(i->second.version, version);
+	return;
+      }
+
+      _due.push_back(id);
+    }
+
+    _wake.notify_one();
+  }
+
+  price_materializer::statistics price_materializer::get_statistics(){
+    std::lock_guard l(_mutex);
+    return _statistics;
+  }
+
+  void price_materializer::run(){
+    std::unique_lock l(_mutex);
+
+    for (;;){
+      _wake.wait(l, [this]{ return _stop || !_due.empty(); });
+
+      if (_stop){
+	return;
+      }
+
+      // All entries have the same window, the front one is due first.
+      clock::time_point due = _pending.at(_due.front()).due;
+
+      if (clock::now() < due){
+	_wake.wait_until(l, due, [this]{ return _stop; });
+	continue;
+      }
+
+      doc_id id = _due.front();
+      _due.pop_front();
+      pending p = _pending.at(id);
+      // Changes arriving from now on enqueue the inventory again.
+      _pending.erase(id);
+      ++_statistics.evaluated;
+      l.unlock();
+
+      try{
+	process(id, p);
+      }
+      catch (const std::exception& e){
+	// The prices stay stale until the next change of the inventory.
+	diagnostics::report("materialization of the prices of inventory %s failed: %s", id.to_string().c_str(), e.what());
+	l.lock();
+	++_statistics.failed;
+	continue;
+      }
+
+      l.lock();
+    }
+  }
+
+  void price_materializer::process(const doc_id& id, const pending& p){
+    partitions::connector c(p.database);
+    inventory_p inv = inventory::get(id);
+
+    // The change notified is not saved yet (or the inventory was just created). An inventory removed in the
+    // meantime ends up here too, and is dropped after the retries.
+    if (inv == nullptr || inv->get_price_inputs_version() < p.version){
+      if (p.retries < _settings.max_retries){
+	std::lock_guard l(_mutex);
+	auto [i, inserted] = _pending.try_emplace(id, pending{p.database, p.version, clock::now() + _settings.window, p.retries + 1});
+
+	if (inserted){
+	  _due.push_back(id);
+	  _wake.notify_one();
+	}
+      }
+      else{
+	std::lock_guard l(_mutex);
+	++_statistics.dropped;
+      }
+
+      return;
+    }
+
+    inv->refresh_price();
+  }
+
+} // End namespace zambezi.
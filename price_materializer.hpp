@@ -0,0 +1,100 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_PRICE_MATERIALIZER_HPP
+#define HX2A_ZAMBEZI_PRICE_MATERIALIZER_HPP
+
+#include <deque>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "hx2a/zambezi/ontology.hpp"
+
+namespace zambezi {
+
+  // Asynchronous recalculation of the materialized prices of inventories.
+  //
+  // Every change of an inventory contributing to its price marks its materialized prices stale (see
+  // inventory::get_materialized_price) and enqueues the inventory here. The queue coalesces: an inventory already
+  // waiting is not enqueued again, so a burst of changes on one inventory within the coalescing window triggers a
+  // single evaluation of the pricing policy. Workers then load the inventory with their own connector and refresh
+  // its prices.
+  //
+  // The change which enqueued an inventory might not be saved yet when the worker loads it. The version of the
+  // price inputs seen at enqueue time tells, and the inventory is then retried a few times.
+  class price_materializer
+  {
+  public:
+
+    struct settings
+    {
+      std::chrono::milliseconds window{200};
+      size_t threads = 2;
+      unsigned max_retries = 5;
+    };
+
+    struct statistics
+    {
+      // Changes notified.
+      uint64_t requested = 0;
+      // Changes absorbed by an inventory already waiting.
+      uint64_t coalesced = 0;
+      // Evaluations done.
+      uint64_t evaluated = 0;
+      // Evaluations which threw, the prices then stay stale until the next change of the inventory.
+      uint64_t failed = 0;
+      // Inventories still not saved, or removed, after the retries.
+      uint64_t dropped = 0;
+    };
+
+    static price_materializer& instance();
+
+    // To be called before the first change.
+    void configure(const settings& s){ _settings = s; }
+
+    // The inventory is in the current database of the calling thread (see partitions.hpp).
+    void enqueue(const doc_id& id, uint32_t version);
+
+    statistics get_statistics();
+
+    ~price_materializer();
+
+  private:
+
+    using clock = std::chrono::steady_clock;
+
+    struct pending
+    {
+      std::string database;
+      uint32_t version;
+      clock::time_point due;
+      unsigned retries;
+    };
+
+    price_materializer();
+
+    void run();
+
+    void process(const doc_id& id, const pending& p);
+
+    settings _settings;
+    std::once_flag _started;
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    // Inventories waiting, and the order in which they are due. Both have the same identifiers.
+    std::unordered_map<doc_id, pending> _pending;
+    std::deque<doc_id> _due;
+    statistics _statistics;
+    bool _stop = false;
+  };
+
+} // End namespace zambezi.
+
+#endif
@@ -0,0 +1,275 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_PRICE_SEARCH_HPP
+#define HX2A_ZAMBEZI_PRICE_SEARCH_HPP
+
+#include <vector>
+#include <queue>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <optional>
+#include <algorithm>
+#include <exception>
+#include <cstdint>
+
+namespace zambezi {
+
+  // Top-k search by effective price, with facet counts computed in the same pass.
+  //
+  // The effective price cannot be indexed because it depends on the pricing policy and on the user context, so
+  // every candidate is evaluated. Candidates are processed in batches, each worker keeping a bounded heap of the k
+  // cheapest results and its own facet counts, merged at the end. Large candidate sets are spread across cores.
+  template <typename Id>
+  class price_search
+  {
+  public:
+
+    struct priced
+    {
+      Id id;
+      double price;
+      float rating;
+      uint64_t count;
+    };
+
+    // Bucket i counts the values v such that bounds[i - 1] <= v < bounds[i]. There is one more bucket than bounds,
+    // the first one for values below bounds[0] and the last one for values at or above the last bound.
+    struct facets
+    {
+      std::vector<size_t> price;
+      std::vector<size_t> rating;
+      size_t in_stock = 0;
+      size_t out_of_stock = 0;
+
+      void add(const facets& f){
+	for (size_t i = 0; i != price.size(); ++i){
+	  price[i] += f.price[i];
+	}
+
+	for (size_t i = 0; i != rating.size(); ++i){
+	  rating[i] += f.rating[i];
+	}
+
+	in_stock += f.in_stock;
+	out_of_stock += f.out_of_stock;
+      }
+    };
+
+    struct options
+    {
+      size_t k = 20;
+      bool with_facets = true;
+      // Must be ascending.
+      std::vector<double> price_bounds;
+      std::vector<double> rating_bounds;
+      size_t batch_size = 256;
+      // Below this number of candidates the search runs in the calling thread.
+      size_t parallel_threshold = 2048;
+      // 0 for the hardware concurrency.
+      size_t threads = 0;
+    };
+
+    struct result
+    {
+      // Cheapest first.
+      std::vector<priced> top;
+      facets counts;
+      size_t evaluated = 0;
+    };
+
+    // ThreadInit is called once in each worker before any evaluation, and returns a context kept until the worker
+    // is done (e.g. holding a database connector). Evaluate is called as evaluate(context, id) and returns an
+    // std::optional<priced>, empty when the candidate is to be ignored (e.g. it does not exist anymore).
+    template <typename Evaluate, typename ThreadInit>
+    static result run(const std::vector<Id>& candidates, const options& o, Evaluate&& evaluate, ThreadInit&& thread_init){
+      size_t batch_size = std::max<size_t>(o.batch_size, 1);
+      size_t batches = (candidates.size() + batch_size - 1) / batch_size;
+      size_t threads = o.threads ? o.threads : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+      if (candidates.size() < o.parallel_threshold){
+	threads = 1;
+      }
+
+      threads = std::max<size_t>(std::min(threads, batches), 1);
+
+      shared s{candidates, o, batch_size, batches};
+      std::vector<worker> workers(threads, worker(o));
+
+      auto work = [&](worker& w){
+	try{
+	  auto context = thread_init();
+	  w.run(s, evaluate, context);
+	}
+	catch (...){
+	  std::lock_guard l(s.mutex);
+
+	  if (!s.error){
+	    s.error = std::current_exception();
+	  }
+
+	  s.stop = true;
+	}
+      };
+
+      if (threads == 1){
+	work(workers[0]);
+      }
+      else{
+	std::vector<std::thread> pool;
+	pool.reserve(threads - 1);
+
+	for (size_t i = 1; i != threads; ++i){
+	  pool.emplace_back(work, std::ref(workers[i]));
+	}
+
+	work(workers[0]);
+
+	for (std::thread& t: pool){
+	  t.join();
+	}
+      }
+
+      if (s.error){
+	std::rethrow_exception(s.error);
+      }
+
+      result r;
+      r.counts = empty_facets(o);
+      heap merged;
+
+      for (worker& w: workers){
+	r.evaluated += w.evaluated;
+	r.counts.add(w.counts);
+
+	while (!w.top.empty()){
+	  offer(merged, o.k, w.top.top());
+	  w.top.pop();
+	}
+      }
+
+      r.top.resize(merged.size());
+
+      for (size_t i = merged.size(); i; --i){
+	r.top[i - 1] = merged.top();
+	merged.pop();
+      }
+
+      return r;
+    }
+
+  private:
+
+    // The most expensive on top, so that it is the one evicted.
+    struct most_expensive_first
+    {
+      bool operator()(const priced& l, const priced& r) const {
+	return l.price < r.price || (l.price == r.price && l.id < r.id);
+      }
+    };
+
+    using heap = std::priority_queue<priced, std::vector<priced>, most_expensive_first>;
+
+    struct shared
+    {
+      shared(const std::vector<Id>& c, const options& o, size_t bs, size_t b):
+	candidates(c),
+	opts(o),
+	batch_size(bs),
+	batches(b)
+      {
+      }
+
+      const std::vector<Id>& candidates;
+      const options& opts;
+      size_t batch_size;
+      size_t batches;
+      std::atomic<size_t> next{0};
+      // Set when a worker fails, the others stop.
+      std::atomic<bool> stop{false};
+      std::mutex mutex;
+      std::exception_ptr error;
+    };
+
+    static facets empty_facets(const options& o){
+      facets f;
+
+      if (o.with_facets){
+	f.price.resize(o.price_bounds.size() + 1);
+	f.rating.resize(o.rating_bounds.size() + 1);
+      }
+
+      return f;
+    }
+
+    static size_t bucket(const std::vector<double>& bounds, double v){
+      return std::upper_bound(bounds.cbegin(), bounds.cend(), v) - bounds.cbegin();
+    }
+
+    static void offer(heap& h, size_t k, const priced& p){
+      if (!k){
+	return;
+      }
+
+      if (h.size() < k){
+	h.push(p);
+      }
+      else if (most_expensive_first()(p, h.top())){
+	h.pop();
+	h.push(p);
+      }
+    }
+
+    struct worker
+    {
+      worker(const options& o):
+	counts(empty_facets(o))
+      {
+      }
+
+      template <typename Evaluate, typename Context>
+      void run(shared& s, Evaluate& evaluate, Context& context){
+	const options& o = s.opts;
+
+	while (!s.stop.load(std::memory_order_relaxed)){
+	  size_t b = s.next.fetch_add(1, std::memory_order_relaxed);
+
+	  if (b >= s.batches){
+	    return;
+	  }
+
+	  size_t first = b * s.batch_size;
+	  size_t last = std::min(first + s.batch_size, s.candidates.size());
+
+	  for (size_t i = first; i != last; ++i){
+	    std::optional<priced> p = evaluate(context, s.candidates[i]);
+
+	    if (!p){
+	      continue;
+	    }
+
+	    ++evaluated;
+
+	    if (o.with_facets){
+	      ++counts.price[bucket(o.price_bounds, p->price)];
+	      ++counts.rating[bucket(o.rating_bounds, p->rating)];
+	      ++(p->count ? counts.in_stock : counts.out_of_stock);
+	    }
+
+	    offer(top, o.k, *p);
+	  }
+	}
+      }
+
+      heap top;
+      facets counts;
+      size_t evaluated = 0;
+    };
+  };
+
+} // End namespace zambezi.
+
+#endif
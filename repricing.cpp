@@ -0,0 +1,281 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#include <atomic>
+#include <vector>
+#include <exception>
+
+#include "hx2a/server.hpp"
+#include "hx2a/cursor.hpp"
+
+#include "hx2a/zambezi/repricing.hpp"
+#include "hx2a/zambezi/partitions.hpp"
+#include "hx2a/zambezi/diagnostics.hpp"
+
+using namespace hx2a;
+
+namespace zambezi {
+
+  repricing& repricing::instance(){
+    static repricing r;
+    return r;
+  }
+
+  repricing::~repricing(){
+    if (_thread.joinable()){
+      {
+	std::lock_guard l(_mutex);
+	_stop = true;
+      }
+
+      _wake.notify_one();
+      _thread.join();
+    }
+  }
+
+  void repricing::start(){
+    std::call_once(_started, [this]{
+      // Looking for the tasks left unfinished by a previous run first.
+      _queue.push_back(doc_id());
+      _thread = std::thread([this]{ run(); });
+    });
+  }
+
+  repricing_task_r repricing::enqueue(const pricing_policy_r& pp){
+    start();
+    repricing_task_p t;
+    cursor<repricing_task, "pp"> c(pp->get_id());
+
+    if (c){
+      t = repricing_task::get(c.get_id());
+    }
+
+    if (t != nullptr){
+      t->restart();
+    }
+    else{
+      t = make_ptr<repricing_task>(pp);
+    }
+
+    {
+      std::lock_guard l(_mutex);
+      _queue.push_back(t->get_id());
+    }
+
+    _wake.notify_one();
+    return *t;
+  }
+
+  void repricing::rescan(){
+    db::connector c("hx2a");
+    std::vector<doc_id> unfinished;
+
+    for (cursor<repricing_task> cur; cur; ++cur){
+      repricing_task_p t = repricing_task::get(cur.get_id());
+
+      if (t != nullptr && !t->is_done()){
+	unfinished.push_back(t->get_id());
+      }
+    }
+
+    std::lock_guard l(_mutex);
+    _queue.insert(_queue.end(), unfinished.cbegin(), unfinished.cend());
+  }
+
+  void repricing::run(){
+    using clock = std::chrono::steady_clock;
+
+    for (;;){
+      doc_id task;
+
+      {
+	std::unique_lock l(_mutex);
+
+	if (_queue.empty()){
+	  _wake.wait_for(l, _settings.poll_interval, [this]{ return _stop || !_queue.empty(); });
+	}
+
+	if (_stop){
+	  return;
+	}
+
+	if (!_queue.empty()){
+	  task = _queue.front();
+	  _queue.pop_front();
+	}
+      }
+
+      try{
+	if (task.is_null()){
+	  rescan();
+	  continue;
+	}
+
+	clock::time_point begin = clock::now();
+
+	while (step(task)){
+	  // Throttling, a batch must not take less than its share of the rate.
+	  if (_settings.max_rate > 0){
+	    auto share = std::chrono::duration<double>(_settings.batch_size / _settings.max_rate);
+	    std::this_thread::sleep_until(begin + std::chrono::duration_cast<clock::duration>(share));
+	  }
+
+	  std::lock_guard l(_mutex);
+
+	  if (_stop){
+	    return;
+	  }
+
+	  begin = clock::now();
+	}
+      }
+      catch (const std::exception& e){
+	// The task is left unfinished, the next rescan will resume it from its last saved position, unless the same
+	// batch keeps failing.
+	fail(task, e.what());
+      }
+    }
+  }
+
+  void repricing::fail(const doc_id& task, const char* error){
+    diagnostics::report("repricing task %s failed: %s", task.to_string().c_str(), error);
+
+    if (task.is_null()){
+      return;
+    }
+
+    try{
+      db::connector c("hx2a");
+      repricing_task_p t = repricing_task::get(task);
+
+      if (t == nullptr || t->is_done()){
+	return;
+      }
+
+      if (t->fail(error) >= _settings.max_attempts){
+	t->abandon();
+	diagnostics::report("repricing task %s abandoned after %u attempts", task.to_string().c_str(), _settings.max_attempts);
+      }
+    }
+    catch (const std::exception& e){
+      diagnostics::report("repricing task %s failure not recorded: %s", task.to_string().c_str(), e.what());
+    }
+  }
+
+  bool repricing::step(const doc_id& task){
+    std::vector<std::string> databases = partitions::databases();
+    std::vector<doc_id> ids;
+    doc_id policy;
+    uint32_t partition;
+    doc_id after;
+    uint32_t revision;
+
+    {
+      db::connector c("hx2a");
+      repricing_task_p t = repricing_task::get(task);
+
+      // Not saved yet, or already done by another process. The periodic rescan catches the former.
+      if (t == nullptr || t->is_done()){
+	return false;
+      }
+
+      pricing_policy_p pp = t->get_policy();
+      partition = t->get_partition();
+      after = t->get_after();
+      revision = t->get_revision();
+
+      if (pp == nullptr || partition >= databases.size()){
+	t->finish();
+	return false;
+      }
+
+      policy = pp->get_id();
+    }
+
+    const std::string& database = databases[partition];
+
+    {
+      partitions::connector c(database);
+
+      for (cursor<inventory, "pp"> cur(policy, after); cur && ids.size() != _settings.batch_size; ++cur){
+	ids.push_back(cur.get_id());
+      }
+    }
+
+    if (ids.empty()){
+      db::connector c("hx2a");
+      repricing_task_p t = repricing_task::get(task);
+
+      if (t != nullptr && t->get_revision() == revision && t->get_partition() == partition && t->get_after() == after){
+	if (partition + 1 < databases.size()){
+	  t->next_partition();
+	  return true;
+	}
+
+	t->finish();
+      }
+
+      return t != nullptr && !t->is_done();
+    }
+
+    // Spreading the batch over the threads, each one with its own connector.
+    std::atomic<size_t> next{0};
+    std::atomic<uint64_t> updated{0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto work = [&]{
+      try{
+	partitions::connector c(database);
+
+	for (size_t i = next++; i < ids.size(); i = next++){
+	  inventory_p inv = inventory::get(ids[i]);
+
+	  // Removed in the meantime.
+	  if (inv != nullptr && inv->refresh_price()){
+	    ++updated;
+	  }
+	}
+      }
+      catch (...){
+	std::lock_guard l(error_mutex);
+	error = std::current_exception();
+      }
+    };
+
+    std::vector<std::thread> pool;
+    size_t threads = std::max<size_t>(std::min(_settings.threads, ids.size()), 1);
+
+    for (size_t i = 1; i < threads; ++i){
+      pool.emplace_back(work);
+    }
+
+    work();
+
+    for (std::thread& th: pool){
+      th.join();
+    }
+
+    if (error){
+      std::rethrow_exception(error);
+    }
+
+    db::connector c("hx2a");
+    repricing_task_p t = repricing_task::get(task);
+
+    if (t == nullptr){
+      return false;
+    }
+
+    // Restarted by a new change of the policy while the batch was processed.
+    if (t->get_revision() != revision || t->get_partition() != partition || t->get_after() != after){
+      return true;
+    }
+
+    t->advance(ids.back(), ids.size(), updated);
+    return true;
+  }
+
+} // End namespace zambezi.
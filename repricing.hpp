@@ -0,0 +1,203 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_REPRICING_HPP
+#define HX2A_ZAMBEZI_REPRICING_HPP
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+
+#include "hx2a/zambezi/ontology.hpp"
+
+namespace zambezi {
+
+  class repricing_task;
+  using repricing_task_p = ptr<repricing_task>;
+  using repricing_task_r = rfr<repricing_task>;
+
+  // Progress of the offline refresh of the inventories depending on a pricing policy, after a change of its
+  // source. There is at most one task per policy, a new change restarts it from the beginning.
+  //
+  // Inventories are visited database after database (see partitions.hpp), in identifier order, and the position
+  // reached is saved after every batch, so that the task resumes where it stopped after a crash. The batch in progress at the time of the crash is
+  // processed again, which is harmless as refreshing an inventory is idempotent.
+  class repricing_task: public root<>
+  {
+    HX2A_ROOT(repricing_task, "ecom:repricing", 1, root);
+
+  public:
+
+    // Reserved constructor.
+    repricing_task(reserved_t, const doc_id& id):
+      root(reserved, id),
+      _policy(*this),
+      _revision(*this),
+      _partition(*this),
+      _after(*this),
+      _processed(*this),
+      _updated(*this),
+      _done(*this),
+      _failures(*this),
+      _error(*this),
+      _abandoned(*this)
+    {
+    }
+
+    repricing_task(const pricing_policy_r& pp):
+      root(standard),
+      _policy(*this, &pp),
+      _revision(*this, pp->get_revision()),
+      _partition(*this, 0),
+      _after(*this),
+      _processed(*this, 0),
+      _updated(*this, 0),
+      _done(*this, false),
+      _failures(*this, 0),
+      _error(*this),
+      _abandoned(*this, false)
+    {
+    }
+
+    pricing_policy_p get_policy() const { return _policy; }
+    uint32_t get_revision() const { return _revision; }
+    // Index of the database in partitions::databases().
+    uint32_t get_partition() const { return _partition; }
+    doc_id get_after() const { return _after; }
+    uint64_t get_processed() const { return _processed; }
+    uint64_t get_updated() const { return _updated; }
+    bool is_done() const { return _done; }
+    // Consecutive failures of the batch at the current position, and the message of the last one.
+    uint32_t get_failures() const { return _failures; }
+    const string& get_error() const { return _error; }
+    // Done without having refreshed all the inventories, after too many failures of the same batch.
+    bool is_abandoned() const { return _abandoned; }
+
+    // Starts again from the first inventory, for the current revision of the policy.
+    void restart(){
+      pricing_policy_p pp = _policy;
+      _revision = pp != nullptr ? pp->get_revision() : 0;
+      _partition = 0;
+      _after = doc_id();
+      _processed = 0;
+      _updated = 0;
+      _done = false;
+      _failures = 0;
+      _error = string();
+      _abandoned = false;
+    }
+
+    void advance(const doc_id& last, uint64_t processed, uint64_t updated){
+      _after = last;
+      _processed = _processed + processed;
+      _updated = _updated + updated;
+      _failures = 0;
+    }
+
+    // Moves to the first inventory of the next database.
+    void next_partition(){
+      _partition = _partition + 1;
+      _after = doc_id();
+    }
+
+    void finish(){ _done = true; }
+
+    // Returns the number of consecutive failures.
+    uint32_t fail(const string& error){
+      _failures = _failures + 1;
+      _error = error;
+      return _failures;
+    }
+
+    void abandon(){
+      _abandoned = true;
+      _done = true;
+    }
+
+  private:
+    // Weak link, a task whose policy is removed just finishes.
+    weak_link<pricing_policy, "pp"> _policy;
+    // Revision of the policy the task was started for.
+    slot<uint32_t, "v"> _revision;
+    slot<uint32_t, "dp"> _partition;
+    // Identifier of the last inventory processed in the database, null before its first batch.
+    slot<doc_id, "a"> _after;
+    slot<uint64_t, "n"> _processed;
+    // Number of inventories whose materialized price actually changed.
+    slot<uint64_t, "u"> _updated;
+    slot<bool, "d"> _done;
+    slot<uint32_t, "f"> _failures;
+    slot<string, "e"> _error;
+    slot<bool, "x"> _abandoned;
+  };
+
+  // Process-wide background runner of the repricing tasks. The tasks, like the policies, are in the shared
+  // database.
+  //
+  // A single thread runs the tasks one after the other. Each batch of inventories is refreshed by several threads,
+  // each with its own connector, and the task's progress is saved once the batch is done. The rate is capped to
+  // leave database capacity to the online traffic.
+  //
+  // Unfinished tasks are looked for when the runner starts, and periodically afterwards, which covers the
+  // restart after a crash, tasks enqueued by other processes, and tasks notified before they were saved. Failures
+  // are reported (see diagnostics.hpp) and recorded in the task, which is abandoned when the same batch keeps failing.
+  class repricing
+  {
+  public:
+
+    struct settings
+    {
+      size_t batch_size = 200;
+      size_t threads = 4;
+      // Inventories per second, 0 for no limit.
+      double max_rate = 2000;
+      std::chrono::seconds poll_interval{30};
+      // Failures of the same batch after which the task is abandoned. A new change of the policy starts it again.
+      uint32_t max_attempts = 5;
+    };
+
+    static repricing& instance();
+
+    // To be called before start.
+    void configure(const settings& s){ _settings = s; }
+
+    // Starts the background thread. Can be called any number of times. To be called when the module is initialized
+    // (in every process of the Web server), so that unfinished tasks are resumed after a restart. Enqueuing calls it
+    // as well.
+    void start();
+
+    // Creates the task of the policy, or restarts it, and wakes up the runner. Must be called with a connector.
+    repricing_task_r enqueue(const pricing_policy_r& pp);
+
+    ~repricing();
+
+  private:
+
+    repricing() = default;
+
+    void run();
+
+    void rescan();
+
+    // Processes the next batch of a task. Returns false when the task is finished.
+    bool step(const doc_id& task);
+
+    // Records the failure in the task, and abandons it after too many.
+    void fail(const doc_id& task, const char* error);
+
+    settings _settings;
+    std::once_flag _started;
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::deque<doc_id> _queue;
+    bool _stop = false;
+  };
+
+} // End namespace zambezi.
+
+#endif
@@ -8,10 +8,34 @@
 // curl http://localhost:8080/service_name -d '{..JSON payload...}'
 // ...JSON response...
 
+#include <atomic>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <chrono>
+
 #include "hx2a/server.hpp"
+#include "hx2a/cursor.hpp"
 
 #include "hx2a/zambezi/ontology.hpp"
 #include "hx2a/zambezi/payloads.hpp"
+#include "hx2a/zambezi/json_stream.hpp"
+#include "hx2a/zambezi/inventory_index.hpp"
+#include "hx2a/zambezi/price_search.hpp"
+#include "hx2a/zambezi/repricing.hpp"
+#include "hx2a/zambezi/async_service.hpp"
+#include "hx2a/zambezi/cart_buffer.hpp"
+#include "hx2a/zambezi/cart_lifecycle.hpp"
+#include "hx2a/zambezi/stock_feed.hpp"
+#include "hx2a/zambezi/conditional_get.hpp"
+#include "hx2a/zambezi/category_tree.hpp"
+#include "hx2a/zambezi/category_counts.hpp"
+#include "hx2a/zambezi/cart_pricing.hpp"
+#include "hx2a/zambezi/trace.hpp"
+#include "hx2a/zambezi/partitions.hpp"
+#include "hx2a/zambezi/administrators.hpp"
+#include "hx2a/zambezi/diagnostics.hpp"
 #include "hx2a/basic_service.hpp"
 #include "hx2a/services/query_empty.hpp"
 #include "hx2a/services/query_id.hpp"
@@ -25,8 +49,8 @@ namespace zambezi {
 
   class product_category_create: public basic_service<"product_category_create", query_id>
   {
-    reply_p call(http_request&, const session_info*, const organization_p&, const user_p&, const rfr<query_id>& q) override {
-      db::connector c("hx2a");
+    reply_p call(http_request&, const session_info*, const organization_p& tenant, const user_p&, const rfr<query_id>& q) override {
+      partitions::connector c(tenant);
 
       if (q->get_id().is_null()){
         product_category_r p = make_rfr<product_category>();
@@ -44,10 +68,143 @@ namespace zambezi {
     }
   } _product_category_create;
 
+  namespace {
+
+    void write_ids(http_request& req, const std::vector<doc_id>& ids){
+      json_stream out([&req](std::string_view v){ req.write(v); });
+      out.begin_object().key("ids").begin_array();
+
+      for (const doc_id& id: ids){
+        out.value(id.to_string());
+      }
+
+      out.end_array().end_object();
+      out.flush();
+    }
+
+    // Removes the documents of a batch which failed, saved or not, so that a batch is created entirely or not at
+    // all. A failure of the removal is reported, the request failing anyway.
+    template <typename T>
+    void roll_back(const organization_p& tenant, const std::vector<doc_id>& ids, const char* what){
+      try{
+        partitions::connector c(tenant);
+        T::roll_back(ids);
+        c.close();
+      }
+      catch (const std::exception& x){
+        diagnostics::report("%zu %s of a failed batch not rolled back: %s", ids.size(), what, x.what());
+      }
+    }
+
+  }
+
+  // Creates several categories in a single call and connector, at most max_entries. An entry can have for parent a
+  // category created by an earlier entry, so that nested trees are created at once. All the entries are checked
+  // before anything is created: if a parent does not exist, or a local parent is not an earlier entry, nothing is
+  // created. The documents are then saved when the connector closes, one after the other. If a save fails, the
+  // categories already saved are removed with another connector, and the request fails without reply: the batch
+  // is created entirely or not at all, unless the database fails the removal too, which is reported (see
+  // diagnostics.hpp). The reply, sent once they are all saved, has the identifiers in the order of the entries.
+  // The category tree publishes the whole batch at once, its publications being debounced (see
+  // category_tree.hpp). Measured against single creations by tools/create_many_bench.cpp.
+  class product_category_create_many: public basic_service<"product_category_create_many", category_create_many_payload>
+  {
+    static constexpr size_t max_entries = 1000;
+
+    reply_p call(http_request& req, const session_info*, const organization_p& tenant, const user_p&, const rfr<category_create_many_payload>& q) override {
+      if (q->categories.size() > max_entries){
+        return {};
+      }
+
+      std::vector<doc_id> ids;
+
+      try{
+        partitions::connector c(tenant);
+        std::vector<product_category_p> parents;
+        parents.reserve(q->categories.size());
+
+        for (auto i = q->categories.cbegin(); i != q->categories.cend(); ++i){
+          const category_create_entry_p& e = *i;
+          uint32_t local = e->local_parent;
+          product_category_p parent;
+
+          if (local){
+            if (local > parents.size() || !e->parent.get().is_null()){
+              return {};
+            }
+          }
+          else if (!e->parent.get().is_null()){
+            parent = product_category::get(e->parent);
+
+            if (parent == nullptr){
+              return {};
+            }
+          }
+
+          parents.push_back(parent);
+        }
+
+        std::vector<product_category_p> created;
+        created.reserve(parents.size());
+        ids.reserve(parents.size());
+        size_t position = 0;
+
+        for (auto i = q->categories.cbegin(); i != q->categories.cend(); ++i, ++position){
+          uint32_t local = (*i)->local_parent;
+          product_category_p parent = local ? created[local - 1] : parents[position];
+          created.push_back(parent != nullptr ? make_ptr<product_category>(*parent) : make_ptr<product_category>());
+          ids.push_back(created.back()->get_id());
+        }
+
+        c.close();
+      }
+      catch (const std::exception&){
+        roll_back<product_category>(tenant, ids, "categories");
+        throw;
+      }
+
+      write_ids(req, ids);
+      return {};
+    }
+  } _product_category_create_many;
+
+  // Moves a category, with its subtree, under another parent. Moving a category into its own subtree is refused.
+  class product_category_move: public basic_service<"product_category_move", category_move_payload>
+  {
+    reply_p call(http_request&, const session_info*, const organization_p& tenant, const user_p&, const rfr<category_move_payload>& q) override {
+      partitions::connector c(tenant);
+      product_category_p cat = product_category::get(q->category);
+
+      if (cat == nullptr){
+        return {};
+      }
+
+      product_category_p parent;
+
+      if (!q->parent.get().is_null()){
+        parent = product_category::get(q->parent);
+
+        if (parent == nullptr){
+          return {};
+        }
+
+        // Following the parents in the database, the category tree may not know the latest moves.
+        for (product_category_p a = parent; a != nullptr; a = a->get_parent()){
+          if (a->get_id() == cat->get_id()){
+            return {};
+          }
+        }
+      }
+
+      cat->set_parent(parent);
+      return make_ptr<reply_id>(cat->get_id());
+    }
+  } _product_category_move;
+
   class product_create: public basic_service<"product_create", query_id>
   {
-    reply_p call(http_request&, const session_info*, const organization_p&, const user_p&, const rfr<query_id>& q) override {
-      db::connector c("hx2a");
+    reply_p call(http_request&, const session_info*, const organization_p& tenant, const user_p&, const rfr<query_id>& q) override {
+      partitions::connector c(tenant);
 
       if (q->get_id().is_null()){
         product_r p = make_rfr<product>();
@@ -65,29 +222,1125 @@ namespace zambezi {
     }
   } _product_create;
 
-  // Pricing policy-related services.
+  // Creates several products in a single call and connector, at most max_entries. All the categories are checked
+  // before anything is created: if one does not exist, nothing is created. As with product_category_create_many,
+  // the documents are saved one after the other when the connector closes, the products already saved are removed
+  // if a save fails, and the reply, with the identifiers in the order of the entries, is only sent once they are
+  // all saved. The product counts of the categories are summed over the batch and written once per window, after
+  // the save (see category_counts.hpp).
+  class product_create_many: public basic_service<"product_create_many", product_create_many_payload>
+  {
+    static constexpr size_t max_entries = 1000;
+
+    reply_p call(http_request& req, const session_info*, const organization_p& tenant, const user_p&, const rfr<product_create_many_payload>& q) override {
+      if (q->products.size() > max_entries){
+        return {};
+      }
+
+      std::vector<doc_id> ids;
+
+      try{
+        partitions::connector c(tenant);
+        // Most products of a batch share a few categories, each one is read once.
+        std::unordered_map<doc_id, product_category_p> categories;
+
+        for (auto i = q->products.cbegin(); i != q->products.cend(); ++i){
+          doc_id id = (*i)->category;
+
+          if (id.is_null() || categories.count(id)){
+            continue;
+          }
+
+          product_category_p cat = product_category::get(id);
+
+          if (cat == nullptr){
+            return {};
+          }
+
+          categories.emplace(id, cat);
+        }
+
+        ids.reserve(q->products.size());
+
+        for (auto i = q->products.cbegin(); i != q->products.cend(); ++i){
+          doc_id id = (*i)->category;
+          product_r p = id.is_null() ? make_rfr<product>() : make_rfr<product>(*categories[id]);
+          ids.push_back(p->get_id());
+        }
+
+        c.close();
+      }
+      catch (const std::exception&){
+        roll_back<product>(tenant, ids, "products");
+        throw;
+      }
+
+      write_ids(req, ids);
+      return {};
+    }
+  } _product_create_many;
+
+  // Moves a product to another category.
+  class product_move: public basic_service<"product_move", product_move_payload>
+  {
+    reply_p call(http_request&, const session_info*, const organization_p& tenant, const user_p&, const rfr<product_move_payload>& q) override {
+      partitions::connector c(tenant);
+      product_p p = product::get(q->product);
+      product_category_p cat = product_category::get(q->category);
+
+      if (p == nullptr || cat == nullptr){
+        return {};
+      }
+
+      p->set_category(*cat);
+      return make_ptr<reply_id>(p->get_id());
+    }
+  } _product_move;
+
+  // Not the vanilla remove service, the product counts of the categories must follow.
+  class product_remove: public basic_service<"product_remove", query_id>
+  {
+    reply_p call(http_request&, const session_info*, const organization_p& tenant, const user_p&, const rfr<query_id>& q) override {
+      partitions::connector c(tenant);
+      product_p p = product::get(q->get_id());
+
+      if (p == nullptr){
+        return {};
+      }
+
+      doc_id id = p->get_id();
+      p->remove();
+      return make_ptr<reply_id>(id);
+    }
+  } _product_remove;
+
+  // Not the vanilla remove service either, the product counts of the ancestors and the category tree must follow.
+  class product_category_remove: public basic_service<"product_category_remove", query_id>
+  {
+    reply_p call(http_request&, const session_info*, const organization_p& tenant, const user_p&, const rfr<query_id>& q) override {
+      partitions::connector c(tenant);
+      product_category_p pc = product_category::get(q->get_id());
+
+      if (pc == nullptr){
+        return {};
+      }
+
+      doc_id id = pc->get_id();
+      pc->remove();
+      return make_ptr<reply_id>(id);
+    }
+  } _product_category_remove;
+
+  // The sub-categories of a category, or the roots when the identifier is null, with their product counts, for
+  // menus. The counts are read from the categories, nothing is counted.
+  class product_category_menu: public basic_service<"product_category_menu", query_id>
+  {
+    reply_p call(http_request& req, const session_info*, const organization_p& tenant, const user_p&, const rfr<query_id>& q) override {
+      trace::request tr(req, "product_category_menu");
+      trace::connector c(tenant);
+      category_tree::snapshot_p tree = category_tree::instance().get();
+      std::vector<doc_id> children;
+
+      if (q->get_id().is_null()){
+        std::span<const doc_id> roots = tree->get_roots(partitions::database(tenant));
+        children.assign(roots.begin(), roots.end());
+      }
+      else if (tree->contains(q->get_id())){
+        std::span<const doc_id> known = tree->get_children(q->get_id());
+        children.assign(known.begin(), known.end());
+      }
+      else{
+        children = product_category::get_children_ids(q->get_id());
+      }
+
+      json_stream out([&req](std::string_view v){ req.write(v); });
+      out.begin_object().key("categories").begin_array();
+
+      for (const doc_id& id: children){
+        product_category_p pc = trace::get<product_category>(id);
+
+        if (pc != nullptr){
+          out.begin_object()
+            .key("id").value(id.to_string())
+            .key("direct").value(pc->get_direct_product_count())
+            .key("subtree").value(pc->get_subtree_product_count())
+            .end_object();
+        }
+      }
+
+      out.end_array().end_object();
+      out.flush();
+      return {};
+    }
+  } _product_category_menu;
+
+  // Lists the products of a category and of all its sub-categories, in identifier order, one page at a time.
+  // Pagination is by keyset: the reply carries the identifier of the last product returned, which is supplied
+  // back as "after" to get the next page. Nothing is skipped, and at most one page worth of identifiers is read
+  // per category in the subtree, so the cost grows with the page size times the number of categories in the
+  // subtree, and not with the number of products. Only the products of the page are loaded.
+  // The page is loaded entirely before the reply is streamed, no reply element is built, and a failure to load
+  // it leaves no partial reply.
+  class product_list: public basic_service<"product_list", product_list_payload>
+  {
+    static constexpr size_t default_page_size = 20;
+    static constexpr size_t max_page_size = 200;
+
+    reply_p call(http_request& req, const session_info*, const organization_p& tenant, const user_p&, const rfr<product_list_payload>& q) override {
+      trace::request tr(req, "product_list");
+      trace::connector c(tenant);
+
+      product_category_p cat = trace::get<product_category>(q->category);
+
+      if (cat == nullptr){
+        return {};
+      }
+
+      uint32_t requested = q->limit;
+      size_t limit = requested ? std::min<size_t>(requested, max_page_size) : default_page_size;
+
+      std::vector<doc_id> categories = product_category::get_subtree_ids(cat->get_id());
+
+      // Each category contributes at most limit + 1 identifiers following the keyset. The page is made of the
+      // limit smallest ones of their union, the extra one tells whether there is a next page. A product belongs
+      // to a single category, so there are no duplicates.
+      std::vector<doc_id> ids;
+
+      for (const doc_id& cid: categories){
+        std::vector<doc_id> page = product::get_ids_in_category(cid, q->after, limit + 1);
+        ids.insert(ids.end(), page.cbegin(), page.cend());
+      }
+
+      bool more = ids.size() > limit;
+
+      if (more){
+        std::nth_element(ids.begin(), ids.begin() + limit, ids.end());
+        ids.resize(limit);
+      }
+
+      std::sort(ids.begin(), ids.end());
+
+      bool with_inventory = q->with_inventory;
+      uint32_t currency_code = q->currency_code;
+
+      struct row
+      {
+        doc_id id;
+        doc_id category;
+        bool with_inventory;
+        count_type count;
+        double price;
+      };
+
+      std::vector<row> rows;
+      rows.reserve(ids.size());
+
+      for (const doc_id& id: ids){
+        product_p p = trace::get<product>(id);
+
+        // Removed in the meantime.
+        if (p == nullptr){
+          continue;
+        }
+
+        row r{id, p->get_category()->get_id(), false, 0, 0};
+
+        if (with_inventory){
+          inventory_p inv = inventory::find(*p);
+
+          if (inv != nullptr){
+            currency::code cc = currency_code ? static_cast<currency::code>(currency_code) : inv->get_reference_currency();
+            r.with_inventory = true;
+            r.count = inv->get_count();
+            r.price = inv->calculate_price(1, cc);
+          }
+        }
+
+        rows.push_back(r);
+      }
+
+      json_stream out([&req](std::string_view s){ req.write(s); });
+      out.begin_object().key("products").begin_array();
+
+      for (const row& r: rows){
+        out.begin_object()
+          .key("id").value(r.id.to_string())
+          .key("category").value(r.category.to_string());
+
+        if (with_inventory){
+          if (!r.with_inventory){
+            out.key("count").null().key("price").null();
+          }
+          else{
+            out
+              .key("count").value(r.count)
+              .key("price").value(r.price);
+          }
+        }
+
+        out.end_object();
+      }
+
+      out.end_array().key("next");
+
+      // The keyset of the next page is the last identifier of this one.
+      if (more){
+        out.value(ids.back().to_string());
+      }
+      else{
+        out.null();
+      }
+
+      out.end_object();
+      out.flush();
+      // The reply has been entirely written.
+      return {};
+    }
+  } _product_list;
+
+  // Searches the in-memory inventory index, either for all the inventories in a box (price range, minimum
+  // rating, minimum count), or for the ones closest to a target price and rating inside that box.
+  // Prices are the ones of a single item without user context. The database is not read.
+  class inventory_search: public basic_service<"inventory_search", inventory_search_payload>
+  {
+    static constexpr size_t max_results = 1000;
+
+    reply_p call(http_request& req, const session_info*, const organization_p& tenant, const user_p&, const rfr<inventory_search_payload>& q) override {
+      partitions::connector c(tenant);
+
+      uint32_t currency_code = q->currency_code;
+      currency::code cc = static_cast<currency::code>(currency_code);
+      double max_price = q->max_price;
+      inventory_index::box b = inventory_index::make_box(max_price > 0 ? max_price : std::numeric_limits<double>::infinity(), q->min_rating, q->min_count);
+      b.min[inventory_index::price_dimension] = q->min_price;
+
+      uint32_t requested = q->limit;
+      size_t limit = requested ? std::min<size_t>(requested, max_results) : max_results;
+      std::vector<doc_id> ids;
+
+      if (q->nearest){
+        inventory_index::coordinates target{q->price, q->rating, 0};
+        inventory_index::coordinates weights{1, q->rating_weight, 0};
+        ids = inventory_index::instance().nearest(partitions::database(tenant), cc, target, weights, limit, b);
+      }
+      else{
+        ids = inventory_index::instance().range(partitions::database(tenant), cc, b);
+
+        if (ids.size() > limit){
+          ids.resize(limit);
+        }
+      }
+
+      json_stream out([&req](std::string_view s){ req.write(s); });
+      out.begin_object().key("inventories").begin_array();
+
+      for (const doc_id& id: ids){
+        out.value(id.to_string());
+      }
+
+      out.end_array().end_object();
+      out.flush();
+      return {};
+    }
+  } _inventory_search;
+
+  // Returns the k cheapest inventories of the products in a category subtree, by effective price for the user
+  // calling, with optional facet counts (price buckets, rating buckets, in stock or not) computed in the same pass.
+  // Large categories are evaluated in parallel. Every product is priced, up to a maximum per request, beyond which
+  // the reply is marked truncated.
+  class inventory_top: public basic_service<"inventory_top", inventory_top_payload>
+  {
+    using search = price_search<doc_id>;
+
+    static constexpr size_t default_k = 20;
+    static constexpr size_t max_k = 200;
+    static constexpr size_t max_price_buckets = 100;
+    // Products evaluated at most per request, the reply tells when the subtree has more.
+    static constexpr size_t max_candidates = 100000;
+
+    // Every worker thread has its own connector, and its own copy of the user document.
+    struct worker_context
+    {
+      std::unique_ptr<partitions::connector> connector;
+      user_p u;
+    };
+
+    reply_p call(http_request& req, const session_info*, const organization_p& tenant, const user_p& u, const rfr<inventory_top_payload>& q) override {
+      partitions::connector c(tenant);
+      product_category_p cat = product_category::get(q->category);
+
+      if (cat == nullptr){
+        return {};
+      }
+
+      std::vector<doc_id> categories = product_category::get_subtree_ids(cat->get_id());
+
+      std::vector<doc_id> candidates;
+      bool truncated = false;
+
+      for (const doc_id& cid: categories){
+        // One more than the room left tells whether the subtree has more.
+        std::vector<doc_id> ids = product::get_ids_in_category(cid, doc_id(), max_candidates - candidates.size() + 1);
+
+        if (candidates.size() + ids.size() > max_candidates){
+          ids.resize(max_candidates - candidates.size());
+          truncated = true;
+        }
+
+        candidates.insert(candidates.end(), ids.cbegin(), ids.cend());
+
+        if (truncated){
+          break;
+        }
+      }
+
+      search::options o;
+      uint32_t k = q->k;
+      o.k = k ? std::min<size_t>(k, max_k) : default_k;
+      o.with_facets = q->with_facets;
+
+      if (o.with_facets){
+        double step = q->price_step;
+        uint32_t buckets = q->price_buckets;
+
+        if (step > 0){
+          for (size_t i = 1; i < std::min<size_t>(buckets, max_price_buckets); ++i){
+            o.price_bounds.push_back(i * step);
+          }
+        }
+
+        o.rating_bounds = {1, 2, 3, 4, 5};
+      }
+
+      uint32_t currency_code = q->currency_code;
+      currency::code cc = static_cast<currency::code>(currency_code);
+      doc_id uid = u != nullptr ? u->get_id() : doc_id();
+
+      search::result r = search::run(
+        candidates,
+        o,
+        [cc](worker_context& ctx, const doc_id& id) -> std::optional<search::priced> {
+          product_p p = product::get(id);
+
+          if (p == nullptr){
+            return {};
+          }
+
+          inventory_p inv = inventory::find(*p);
+
+          if (inv == nullptr){
+            return {};
+          }
+
+          return search::priced{inv->get_id(), inv->calculate_price(1, cc, ctx.u), inv->get_rating(), inv->get_count()};
+        },
+        [&uid, &database = partitions::current()](){
+          worker_context ctx{std::make_unique<partitions::connector>(database), {}};
+
+          if (!uid.is_null()){
+            ctx.u = user::get(uid);
+          }
+
+          return ctx;
+        });
+
+      json_stream out([&req](std::string_view s){ req.write(s); });
+      out.begin_object().key("inventories").begin_array();
+
+      for (const search::priced& p: r.top){
+        out.begin_object()
+          .key("id").value(p.id.to_string())
+          .key("price").value(p.price)
+          .key("rating").value(static_cast<double>(p.rating))
+          .key("count").value(p.count)
+          .end_object();
+      }
+
+      out.end_array();
+
+      if (o.with_facets){
+        out.key("facets").begin_object().key("price").begin_array();
+
+        for (size_t n: r.counts.price){
+          out.value(static_cast<uint64_t>(n));
+        }
+
+        out.end_array().key("rating").begin_array();
+
+        for (size_t n: r.counts.rating){
+          out.value(static_cast<uint64_t>(n));
+        }
+
+        out.end_array()
+          .key("in_stock").value(static_cast<uint64_t>(r.counts.in_stock))
+          .key("out_of_stock").value(static_cast<uint64_t>(r.counts.out_of_stock))
+          .end_object();
+      }
+
+      out
+        .key("evaluated").value(static_cast<uint64_t>(r.evaluated))
+        .key("truncated").value(truncated)
+        .end_object();
+      out.flush();
+      return {};
+    }
+  } _inventory_top;
+
+  // Cart of the user logged in, with the availability and the price of every line.
+  //
+  // Asynchronous: the cart is read first, then all the inventories are read and priced concurrently, instead of
+  // one database round trip after the other.
+  class cart_summary: public async::async_service<"cart_summary", query_empty>
+  {
+    struct line_info
+    {
+      // Empty at top level.
+      string folder;
+      doc_id item;
+      uint32_t count;
+    };
+
+    struct inventory_info
+    {
+      bool found;
+      count_type available;
+      bool overdraft;
+      double price;
+    };
+
+    async::task<reply_p> co_call(http_request& req, const session_info*, const organization_p& tenant, const user_p& u, const rfr<query_empty>&) override {
+      if (u == nullptr){
+        co_return reply_p();
+      }
+
+      doc_id uid = u->get_id();
+      std::string database = partitions::database(tenant);
+
+      std::vector<line_info> lines = co_await async::offload([uid, &database]{
+        partitions::connector c(database);
+        std::vector<line_info> r;
+        persona_p p = persona::find(uid);
+
+        if (p == nullptr){
+          return r;
+        }
+
+        persona::mycart_r cart = p->get_cart();
+
+        std::for_each(cart->lines_cbegin(), cart->lines_cend(), [&r](const auto& l){ r.push_back(line_info{{}, l->item()->get_id(), l->count()}); });
+        std::for_each(cart->folders_cbegin(), cart->folders_cend(), [&r](const auto& f){
+          std::for_each(f->lines_cbegin(), f->lines_cend(), [&](const auto& l){ r.push_back(line_info{f->get_name(), l->item()->get_id(), l->count()}); });
+        });
+
+        // Counts not written yet override the stored ones.
+        for (const cart_buffer::line_update& u: cart_buffer::instance().pending(p->get_id())){
+          auto i = std::find_if(r.begin(), r.end(), [&u](const line_info& l){ return l.folder == u.folder && l.item == u.item; });
+
+          if (i == r.end()){
+            if (u.count){
+              r.push_back(line_info{u.folder, u.item, u.count});
+            }
+          }
+          else if (u.count){
+            i->count = u.count;
+          }
+          else{
+            r.erase(i);
+          }
+        }
+
+        return r;
+      });
+
+      std::vector<async::task<inventory_info>> pricing;
+      pricing.reserve(lines.size());
+
+      for (const line_info& l: lines){
+        pricing.push_back(async::get<inventory>(database, l.item, [uid, count = l.count](inventory_p inv){
+          if (inv == nullptr){
+            return inventory_info{false, 0, false, 0};
+          }
+
+          user_p pu = uid.is_null() ? user_p() : user::get(uid);
+          return inventory_info{true, inv->get_count(), inv->get_overdraft(), inv->calculate_price(count, inv->get_reference_currency(), pu)};
+        }));
+      }
+
+      std::vector<inventory_info> infos = co_await async::when_all(std::move(pricing));
+
+      json_stream out([&req](std::string_view s){ req.write(s); });
+      out.begin_object().key("lines").begin_array();
+
+      for (size_t i = 0; i != lines.size(); ++i){
+        const line_info& l = lines[i];
+        const inventory_info& inv = infos[i];
+        out.begin_object()
+          .key("folder").value(std::string_view(l.folder))
+          .key("item").value(l.item.to_string())
+          .key("count").value(static_cast<uint64_t>(l.count));
+
+        if (inv.found){
+          out
+            .key("available").value(inv.available)
+            .key("overdraft").value(inv.overdraft)
+            .key("price").value(inv.price);
+        }
+
+        out.end_object();
+      }
+
+      out.end_array().end_object();
+      out.flush();
+      co_return reply_p();
+    }
+  } _cart_summary;
+
+  // Amounts of the cart of the user logged in, per folder and overall, for the user (see cart_pricing.hpp). The
+  // buffered counts are written first.
+  class cart_total: public basic_service<"cart_total", cart_total_payload>
+  {
+    reply_p call(http_request& req, const session_info*, const organization_p& tenant, const user_p& u, const rfr<cart_total_payload>& q) override {
+      // The amounts are summed in one currency, the reference currencies of the inventories can differ.
+      if (u == nullptr || !q->currency_code){
+        return {};
+      }
+
+      doc_id uid = u->get_id();
+      doc_id pid;
+
+      {
+        partitions::connector c(tenant);
+        persona_p p = persona::find(uid);
+
+        if (p == nullptr){
+          return {};
+        }
+
+        pid = p->get_id();
+      }
+
+      cart_buffer::instance().flush(pid);
+
+      trace::request tr(req, "cart_total");
+      trace::connector c(tenant);
+      persona_p p = trace::get<persona>(pid);
+
+      if (p == nullptr){
+        return {};
+      }
+
+      currency::code currency_code = static_cast<currency::code>(static_cast<uint32_t>(q->currency_code));
+      hx2a::zambezi::cart_totals t = [&]{
+        // The walk of the lines and their pricing. The items of the lines are not traced one by one, see trace.hpp.
+        trace::span walk("walk", "zambezi::persona", "cart");
+
+        return p->get_cart()->cart_total(currency_code, [&](const std::vector<hx2a::zambezi::line_to_price>& lines){
+          return cart_pricing::instance().price(lines, currency_code, uid);
+        });
+      }();
+
+      json_stream out([&req](std::string_view s){ req.write(s); });
+      out.begin_object()
+        .key("total").value(t.total.get_amount())
+        .key("top_level").value(t.top_level.get_amount())
+        .key("unpriced").value(static_cast<uint64_t>(t.unpriced))
+        .key("folders").begin_array();
+
+      for (const auto& [name, amount]: t.folders){
+        out.begin_object()
+          .key("name").value(std::string_view(name))
+          .key("total").value(amount.get_amount())
+          .end_object();
+      }
+
+      out.end_array().end_object();
+      out.flush();
+      return {};
+    }
+  } _cart_total;
+
+  // Next batch of stock count changes following the sequence given, from the change feed of the process (see
+  // stock_feed.hpp). Consumers keep the position returned for every feed name, and long poll by giving a wait.
+  // Administrative (see administrators.hpp). An administrator of a tenant only receives the events of the database
+  // of the tenant (see partitions.hpp), which it shares with the other tenants of its partition. At most
+  // max_waiters requests wait at once, the others answer right away.
+  class stock_changes: public basic_service<"stock_changes", stock_changes_payload>
+  {
+    static constexpr uint32_t max_waiters = 8;
+
+    inline static std::atomic<uint32_t> waiters{0};
+
+    reply_p call(http_request& req, const session_info*, const organization_p& tenant, const user_p& u, const rfr<stock_changes_payload>& q) override {
+      if (!administrators::contains(u)){
+        return {};
+      }
+
+      size_t limit = q->limit ? std::min<size_t>(q->limit, 10000) : 1000;
+      std::chrono::milliseconds wait(std::min<uint32_t>(q->wait, 30000));
+
+      if (waiters.fetch_add(1) >= max_waiters){
+        wait = {};
+      }
+
+      std::vector<stock_delta> events;
+
+      try{
+        events = stock_feed::instance().read(q->after, limit, wait);
+      }
+      catch (...){
+        waiters.fetch_sub(1);
+        throw;
+      }
+
+      waiters.fetch_sub(1);
+      // Where the next request starts, past the events of the other databases too.
+      uint64_t position = events.empty() ? q->after.get() : events.back().sequence;
+
+      if (tenant != nullptr){
+        const std::string& database = partitions::database(tenant);
+        std::erase_if(events, [&database](const stock_delta& d){ return d.database != database; });
+      }
+
+      json_stream out([&req](std::string_view s){ req.write(s); });
+      out.begin_object()
+        .key("feed").value(stock_feed::instance().name())
+        .key("last").value(stock_feed::instance().last_sequence())
+        .key("position").value(position)
+        .key("events").begin_array();
+
+      for (const stock_delta& d: events){
+        out.begin_object()
+          .key("sequence").value(d.sequence)
+          .key("inventory").value(d.inventory.to_string());
+
+        if (!d.physical_inventory.is_null()){
+          out.key("physical_inventory").value(d.physical_inventory.to_string());
+        }
+
+        out
+          .key("old").value(d.old_count)
+          .key("new").value(d.new_count)
+          .key("inputs_version").value(static_cast<uint64_t>(d.inputs_version))
+          .end_object();
+      }
+
+      out.end_array().end_object();
+      out.flush();
+      return {};
+    }
+  } _stock_changes;
+
+  // Pricing policy-related services. Policies are shared by the tenants, they stay in the shared database, like
+  // the repricing tasks (see partitions.hpp).
   
   class pricing_policy_create: public basic_service<"pricing_policy_create", pricing_policy_payload>
   {
     reply_p call(http_request&, const session_info*, const organization_p&, const user_p&, const rfr<pricing_policy_payload>& q) override {
+      // The source is copied once, into the policy.
       db::connector c("hx2a");
-      return make_ptr<reply_id>(make_ptr<pricing_policy>(q->source)->get_id());
+      pricing_policy_r pp = make_rfr<pricing_policy>(q->source.get());
+      pp->tabulate(inventory::get_materialized_currencies());
+      return make_ptr<reply_id>(pp->get_id());
     }
   } _pricing_policy_create;
 
-  // Vanilla service using concise template.
-  basic_get_service<"pricing_policy_get", pricing_policy, "hx2a"> _pricing_policy_get;
+  // The identifier, the source and the revision of a policy.
+  struct pricing_policy_writer
+  {
+    void operator()(json_stream& out, const pricing_policy& pp) const {
+      out.begin_object()
+        .key("id").value(pp.get_id().to_string())
+        .key("source").value(std::string_view(pp.get_source()))
+        .key("revision").value(static_cast<uint64_t>(pp.get_revision()))
+        .end_object();
+    }
+  };
+
+  // Answers If-None-Match with 304 when the revision of the policy did not change.
+  using pricing_policy_get = conditional_get_service<"pricing_policy_get", pricing_policy, "hx2a", pricing_policy_writer>;
 
+  pricing_policy_get _pricing_policy_get;
+
+  // Updates the source of the policy in place, which bumps its revision, and enqueues the offline refresh of the
+  // inventories depending on it. The identifier returned is the policy's, as for the other policy services. The
+  // progress of the refresh can be followed with repricing_task_find.
   class pricing_policy_update: public basic_service<"pricing_policy_update", pricing_policy_with_id_payload>
   {
     reply_p call(http_request&, const session_info*, const organization_p&, const user_p&, const rfr<pricing_policy_with_id_payload>& q) override {
       db::connector c("hx2a");
-      return make_ptr<reply_id>(make_ptr<pricing_policy>(q->source)->get_id());
+      pricing_policy_p pp = pricing_policy::get(q->get_id());
+
+      if (pp == nullptr){
+        return {};
+      }
+
+      pp->set_source(q->source.get());
+      // Once per revision, before the inventories read it.
+      pp->tabulate(inventory::get_materialized_currencies());
+      pricing_policy_get::forget(pp->get_id());
+      repricing::instance().enqueue(*pp);
+      return make_ptr<reply_id>(pp->get_id());
     }
   } _pricing_policy_update;
 
+  // Merges a version of the cart of the user logged in, edited on another device, into the stored one.
+  //
+  // Merges are commutative and idempotent (see merge mode in cart.hpp), so devices can send their versions in any
+  // order, and resend them, and the carts converge. Merges of the same cart in this process are serialized.
+  class cart_merge: public basic_service<"cart_merge", cart_merge_payload>
+  {
+    reply_p call(http_request&, const session_info*, const organization_p& tenant, const user_p& u, const rfr<cart_merge_payload>& q) override {
+      if (u == nullptr || q->cart.get() == nullptr){
+        return {};
+      }
+
+      doc_id pid;
+
+      {
+        partitions::connector c(tenant);
+        persona_p p = persona::find(u->get_id());
+
+        if (p == nullptr){
+          return {};
+        }
+
+        pid = p->get_id();
+      }
+
+      // Buffered counts go first, and the persona is read again under the lock, so that a concurrent write is not
+      // overwritten.
+      cart_buffer::instance().flush(pid);
+      std::lock_guard l(cart_buffer::lock(pid));
+      partitions::connector c(tenant);
+      persona_p p = persona::get(pid);
+
+      if (p == nullptr){
+        return {};
+      }
+
+      p->merge_cart(*q->cart);
+      return make_ptr<reply_id>(pid);
+    }
+  } _cart_merge;
+
+  // Adds the cart a guest filled before logging in to the cart of the user logged in, in a single write.
+  class cart_merge_guest: public basic_service<"cart_merge_guest", cart_guest_merge_payload>
+  {
+    reply_p call(http_request&, const session_info*, const organization_p& tenant, const user_p& u, const rfr<cart_guest_merge_payload>& q) override {
+      if (u == nullptr || q->cart.get() == nullptr){
+        return {};
+      }
+
+      const string& name = q->policy.get();
+      hx2a::zambezi::merge_policy policy = hx2a::zambezi::merge_policy::sum;
+
+      if (name == "max"){
+        policy = hx2a::zambezi::merge_policy::max;
+      }
+      else if (name == "keep"){
+        policy = hx2a::zambezi::merge_policy::keep;
+      }
+      else if (!name.empty() && name != "sum"){
+        return {};
+      }
+
+      doc_id pid;
+
+      {
+        partitions::connector c(tenant);
+        persona_p p = persona::find(u->get_id());
+
+        if (p == nullptr){
+          return {};
+        }
+
+        pid = p->get_id();
+      }
+
+      cart_buffer::instance().flush(pid);
+      std::lock_guard l(cart_buffer::lock(pid));
+      partitions::connector c(tenant);
+      persona_p p = persona::get(pid);
+
+      if (p == nullptr){
+        return {};
+      }
+
+      p->merge_guest_cart(*q->cart, policy);
+      return make_ptr<reply_id>(pid);
+    }
+  } _cart_merge_guest;
+
+  // Not the vanilla get service, bound to one database at compile time: the persona is read in the database of
+  // the tenant (see partitions.hpp). The reply has the user, the time of the last activity on the cart, and the
+  // lines of the cart, the buffered counts being written first. The cart is read through get_cart, which restores
+  // a compacted one (see cart_lifecycle.hpp), the persona is therefore written under its lock.
+  class persona_get: public basic_service<"persona_get", query_id>
+  {
+    reply_p call(http_request& req, const session_info*, const organization_p& tenant, const user_p&, const rfr<query_id>& q) override {
+      doc_id pid = q->get_id();
+      cart_buffer::instance().flush(pid);
+      std::lock_guard l(cart_buffer::lock(pid));
+      partitions::connector c(tenant);
+      persona_p p = persona::get(pid);
+
+      if (p == nullptr){
+        return {};
+      }
+
+      persona::mycart_r cart = p->get_cart();
+      json_stream out([&req](std::string_view s){ req.write(s); });
+      out.begin_object()
+        .key("id").value(p->get_id().to_string())
+        .key("user").value(p->get_user()->get_id().to_string())
+        .key("cart_activity").value(p->get_cart_activity())
+        .key("lines").begin_array();
+
+      auto line = [&out](std::string_view folder, const auto& l){
+        out.begin_object()
+          .key("folder").value(folder)
+          .key("item").value(l->item()->get_id().to_string())
+          .key("count").value(static_cast<uint64_t>(l->count()))
+          .end_object();
+      };
+
+      std::for_each(cart->lines_cbegin(), cart->lines_cend(), [&](const auto& l){ line({}, l); });
+      std::for_each(cart->folders_cbegin(), cart->folders_cend(), [&](const auto& f){
+        std::for_each(f->lines_cbegin(), f->lines_cend(), [&](const auto& l){ line(f->get_name(), l); });
+      });
+
+      out.end_array().end_object();
+      out.flush();
+      return {};
+    }
+  } _persona_get;
+
+  // Sets the count of an item in the cart of the user logged in, at top level or in a folder. A count of 0
+  // removes the line.
+  //
+  // Buffered updates are written after a short window, later ones for the same line replacing earlier ones (see
+  // cart_buffer.hpp).
+  class cart_update_item_count: public basic_service<"cart_update_item_count", cart_item_count_payload>
+  {
+    reply_p call(http_request&, const session_info*, const organization_p& tenant, const user_p& u, const rfr<cart_item_count_payload>& q) override {
+      if (u == nullptr){
+        return {};
+      }
+
+      doc_id pid;
+
+      {
+        partitions::connector c(tenant);
+        persona_p p = persona::find(u->get_id());
+
+        if (p == nullptr || inventory::get(q->item) == nullptr){
+          return {};
+        }
+
+        pid = p->get_id();
+      }
+
+      std::string folder = q->folder.get();
+
+      if (q->buffered){
+        cart_buffer::instance().update_item_count(partitions::database(tenant), pid, folder, q->item, q->count);
+        return make_ptr<reply_id>(pid);
+      }
+
+      // Unbuffered updates of the same persona are not written before the buffered ones.
+      cart_buffer::instance().flush(pid);
+      std::lock_guard l(cart_buffer::lock(pid));
+      partitions::connector c(tenant);
+      persona_p p = persona::get(pid);
+      inventory_p inv = inventory::get(q->item);
+
+      if (p == nullptr || inv == nullptr){
+        return {};
+      }
+
+      persona::mycart_r cart = p->edit_cart();
+
+      if (folder.empty()){
+        cart->update_item_count(*inv, q->count);
+        return make_ptr<reply_id>(pid);
+      }
+
+      auto f = cart->find_folder(folder);
+
+      if (f == nullptr){
+        if (!q->count){
+          return make_ptr<reply_id>(pid);
+        }
+
+        cart->add_folder(folder);
+        f = cart->find_folder(folder);
+      }
+
+      f->update_item_count(*inv, q->count);
+      return make_ptr<reply_id>(pid);
+    }
+  } _cart_update_item_count;
+
+  // Writes the buffered counts of the cart of the user logged in. To be called before a checkout.
+  class cart_flush: public basic_service<"cart_flush", query_empty>
+  {
+    reply_p call(http_request&, const session_info*, const organization_p& tenant, const user_p& u, const rfr<query_empty>&) override {
+      if (u == nullptr){
+        return {};
+      }
+
+      doc_id pid;
+
+      {
+        partitions::connector c(tenant);
+        persona_p p = persona::find(u->get_id());
+
+        if (p == nullptr){
+          return {};
+        }
+
+        pid = p->get_id();
+      }
+
+      cart_buffer::instance().flush(pid);
+      return make_ptr<reply_id>(pid);
+    }
+  } _cart_flush;
+
+  // Counters of the cart write-behind buffer, and the write amplification it saves.
+  class cart_buffer_statistics: public basic_service<"cart_buffer_statistics", query_empty>
+  {
+    reply_p call(http_request& req, const session_info*, const organization_p&, const user_p&, const rfr<query_empty>&) override {
+      cart_buffer::statistics s = cart_buffer::instance().get_statistics();
+      json_stream out([&req](std::string_view v){ req.write(v); });
+      out.begin_object()
+        .key("updates").value(s.updates)
+        .key("replaced").value(s.replaced)
+        .key("writes").value(s.writes)
+        .key("lines_written").value(s.lines_written)
+        .key("failed").value(s.failed)
+        .key("write_amplification_saved").value(s.write_amplification_saved())
+        .end_object();
+      out.flush();
+      return {};
+    }
+  } _cart_buffer_statistics;
+
+  namespace {
+
+    void write_cart_lifecycle_statistics(http_request& req, const cart_lifecycle::statistics& s){
+      json_stream out([&req](std::string_view v){ req.write(v); });
+      out.begin_object()
+        .key("passes").value(s.passes)
+        .key("scanned").value(s.scanned)
+        .key("compacted").value(s.compacted)
+        .key("kept_for_snapshots").value(s.kept_for_snapshots)
+        .key("kept_for_process").value(s.kept_for_process)
+        .key("snapshots_dropped").value(s.snapshots_dropped)
+        .key("lines_compacted").value(s.lines_compacted)
+        .key("rehydrated").value(s.rehydrated)
+        .key("bytes_before").value(s.bytes_before)
+        .key("bytes_after").value(s.bytes_after)
+        .key("bytes_reclaimed").value(s.bytes_reclaimed())
+        .end_object();
+      out.flush();
+    }
+
+  }
+
+  // Runs a compaction pass of the abandoned carts right away. Administrative (see administrators.hpp).
+  class cart_lifecycle_run: public basic_service<"cart_lifecycle_run", query_empty>
+  {
+    reply_p call(http_request& req, const session_info*, const organization_p&, const user_p& u, const rfr<query_empty>&) override {
+      if (!administrators::contains(u)){
+        return {};
+      }
+
+      // No connector here, the pass opens its own ones.
+      write_cart_lifecycle_statistics(req, cart_lifecycle::instance().run());
+      return {};
+    }
+  } _cart_lifecycle_run;
+
+  class cart_lifecycle_statistics: public basic_service<"cart_lifecycle_statistics", query_empty>
+  {
+    reply_p call(http_request& req, const session_info*, const organization_p&, const user_p&, const rfr<query_empty>&) override {
+      write_cart_lifecycle_statistics(req, cart_lifecycle::instance().get_statistics());
+      return {};
+    }
+  } _cart_lifecycle_statistics;
+
+  // Rebuilds the product counts of all the categories. Administrative (see administrators.hpp), to be run when the
+  // catalog is quiet.
+  class category_counts_repair_service: public basic_service<"category_counts_repair", query_empty>
+  {
+    reply_p call(http_request& req, const session_info*, const organization_p&, const user_p& u, const rfr<query_empty>&) override {
+      if (!administrators::contains(u)){
+        return {};
+      }
+
+      // No connector here, the repair opens its own ones.
+      category_counts_repair::statistics s = category_counts_repair::run();
+      json_stream out([&req](std::string_view v){ req.write(v); });
+      out.begin_object()
+        .key("categories").value(s.categories)
+        .key("products").value(s.products)
+        .key("fixed").value(s.fixed)
+        .end_object();
+      out.flush();
+      return {};
+    }
+  } _category_counts_repair;
+
+  // Converts the reference prices of the inventories saved as money elements. Administrative (see
+  // administrators.hpp), run once after an upgrade.
+  class inventory_reference_price_migration: public basic_service<"inventory_reference_price_migration", query_empty>
+  {
+    reply_p call(http_request& req, const session_info*, const organization_p&, const user_p& u, const rfr<query_empty>&) override {
+      if (!administrators::contains(u)){
+        return {};
+      }
+
+      // No connector here, the migration opens its own ones.
+      uint64_t migrated = inventory::migrate_reference_prices();
+      json_stream out([&req](std::string_view v){ req.write(v); });
+      out.begin_object()
+        .key("migrated").value(migrated)
+        .end_object();
+      out.flush();
+      return {};
+    }
+  } _inventory_reference_price_migration;
+
   // Vanilla service using concise template.
-  basic_remove_service<"pricing_policy_remove", pricing_policy, "hx2a"> _pricing_policy_remove;
+  basic_get_service<"repricing_task_get", repricing_task, "hx2a"> _repricing_task_get;
+
+  // Identifier of the repricing task of a policy, to follow the refresh started by pricing_policy_update.
+  class repricing_task_find: public basic_service<"repricing_task_find", query_id>
+  {
+    reply_p call(http_request&, const session_info*, const organization_p&, const user_p&, const rfr<query_id>& q) override {
+      db::connector c("hx2a");
+      cursor<repricing_task, "pp"> t(q->get_id());
+
+      if (!t){
+        return {};
+      }
+
+      return make_ptr<reply_id>(t.get_id());
+    }
+  } _repricing_task_find;
+
+  // The generic removal, the revision remembered by pricing_policy_get being forgotten.
+  class pricing_policy_remove: public basic_remove_service<"pricing_policy_remove", pricing_policy, "hx2a">
+  {
+    using base = basic_remove_service<"pricing_policy_remove", pricing_policy, "hx2a">;
+
+    reply_p call(http_request& req, const session_info* si, const organization_p& o, const user_p& u, const rfr<query_id>& q) override {
+      reply_p r = base::call(req, si, o, u, q);
+      pricing_policy_get::forget(q->get_id());
+      return r;
+    }
+  } _pricing_policy_remove;
 
 } // End namespace zambezi.
 
@@ -0,0 +1,407 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#include "hx2a/zambezi/stock_feed.hpp"
+#include "hx2a/zambezi/partitions.hpp"
+
+using namespace hx2a;
+
+namespace zambezi {
+
+  namespace {
+
+    // Observing inventories from the start, so that no change is missed.
+    [[maybe_unused]] stock_feed& registration = stock_feed::instance();
+
+    // Sequence, inventory, physical inventory (empty when null), old count, new count, inputs version and
+    // database, separated by tabs. Lines written before the database was recorded have the first six.
+    std::string format(const stock_delta& d){
+      std::string line = std::to_string(d.sequence);
+      line += '\t';
+      line += d.inventory.to_string();
+      line += '\t';
+
+      if (!d.physical_inventory.is_null()){
+	line += d.physical_inventory.to_string();
+      }
+
+      line += '\t';
+      line += std::to_string(d.old_count);
+      line += '\t';
+      line += std::to_string(d.new_count);
+      line += '\t';
+      line += std::to_string(d.inputs_version);
+      line += '\t';
+      line += d.database;
+      line += '\n';
+      return line;
+    }
+
+    bool parse(std::string_view line, stock_delta& d){
+      std::string_view fields[7];
+      size_t n = 0;
+
+      while (n != 7){
+	size_t t = line.find('\t');
+	fields[n++] = line.substr(0, t);
+
+	if (t == std::string_view::npos){
+	  break;
+	}
+
+	line.remove_prefix(t + 1);
+      }
+
+      if (n < 6 || fields[0].empty() || fields[1].empty()){
+	return false;
+      }
+
+      auto number = [](std::string_view f){ return std::strtoull(std::string(f).c_str(), nullptr, 10); };
+      d.sequence = number(fields[0]);
+      d.inventory = doc_id(std::string(fields[1]));
+      d.physical_inventory = fields[2].empty() ? doc_id() : doc_id(std::string(fields[2]));
+      d.old_count = number(fields[3]);
+      d.new_count = number(fields[4]);
+      d.inputs_version = static_cast<uint32_t>(number(fields[5]));
+      d.database = n == 7 ? std::string(fields[6]) : std::string();
+      return true;
+    }
+
+  }
+
+  file_stock_sink::file_stock_sink(const std::string& path, bool sync):
+    _sync(sync)
+  {
+    for (unsigned n = 0; _lock < 0; ++n){
+      if (n == 1024){
+	throw std::runtime_error("no stock feed log is free");
+      }
+
+      _path = path + '.' + std::to_string(n);
+      int fd = ::open((_path + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+      if (fd < 0){
+	throw std::runtime_error("cannot open the stock feed log lock " + _path + ".lock");
+      }
+
+      // Held by a running process. The lock goes away with the process.
+      if (::flock(fd, LOCK_EX | LOCK_NB)){
+	::close(fd);
+	continue;
+      }
+
+      _lock = fd;
+      char host[256] = {};
+      ::gethostname(host, sizeof(host) - 1);
+      _name = std::string(host) + '/' + std::to_string(n);
+    }
+
+    // Indexing the events present, and dropping a last line left incomplete by a crash.
+    if (std::FILE* in = std::fopen(_path.c_str(), "r")){
+      char buffer[512];
+      long offset = 0;
+
+      while (std::fgets(buffer, sizeof(buffer), in)){
+	std::string_view line(buffer);
+	stock_delta d;
+
+	if (line.empty() || line.back() != '\n' || !parse(line.substr(0, line.size() - 1), d)){
+	  break;
+	}
+
+	if (d.sequence % index_step == 1 || _index.empty()){
+	  _index.emplace_back(d.sequence, offset);
+	}
+
+	_last = d.sequence;
+	offset += static_cast<long>(line.size());
+      }
+
+      std::fclose(in);
+
+      if (::truncate(_path.c_str(), offset)){
+	::close(_lock);
+	throw std::runtime_error("cannot open the stock feed log");
+      }
+
+      _size = offset;
+    }
+
+    _file = std::fopen(_path.c_str(), "a");
+
+    if (!_file){
+      ::close(_lock);
+      throw std::runtime_error("cannot open the stock feed log");
+    }
+  }
+
+  file_stock_sink::~file_stock_sink(){
+    std::fclose(_file);
+    ::close(_lock);
+  }
+
+  uint64_t file_stock_sink::last_sequence(){
+    std::lock_guard l(_mutex);
+    return _last;
+  }
+
+  void file_stock_sink::write(const std::vector<stock_delta>& batch){
+    std::string text;
+
+    for (const stock_delta& d: batch){
+      text += format(d);
+    }
+
+    std::lock_guard l(_mutex);
+
+    if (std::fwrite(text.data(), 1, text.size(), _file) != text.size() || std::fflush(_file) || (_sync && ::fsync(::fileno(_file)))){
+      throw std::runtime_error("cannot write the stock feed log");
+    }
+
+    long offset = _size;
+
+    for (const stock_delta& d: batch){
+      if (d.sequence % index_step == 1 || _index.empty()){
+	_index.emplace_back(d.sequence, offset);
+      }
+
+      offset += static_cast<long>(format(d).size());
+    }
+
+    _size = offset;
+    _last = batch.empty() ? _last : batch.back().sequence;
+  }
+
+  void file_stock_sink::read(uint64_t after, size_t max, std::vector<stock_delta>& out){
+    long offset;
+
+    {
+      std::lock_guard l(_mutex);
+
+      if (after >= _last || !max){
+	return;
+      }
+
+      // The closest indexed event at or before the first one wanted.
+      auto i = std::upper_bound(_index.cbegin(), _index.cend(), after + 1, [](uint64_t s, const std::pair<uint64_t, long>& e){ return s < e.first; });
+      offset = i == _index.cbegin() ? 0 : std::prev(i)->second;
+    }
+
+    std::FILE* in = std::fopen(_path.c_str(), "r");
+
+    if (!in){
+      return;
+    }
+
+    char buffer[512];
+    std::fseek(in, offset, SEEK_SET);
+
+    while (max && std::fgets(buffer, sizeof(buffer), in)){
+      std::string_view line(buffer);
+      stock_delta d;
+
+      if (line.empty() || line.back() != '\n' || !parse(line.substr(0, line.size() - 1), d)){
+	break;
+      }
+
+      if (d.sequence > after){
+	out.push_back(d);
+	--max;
+      }
+    }
+
+    std::fclose(in);
+  }
+
+  stock_feed& stock_feed::instance(){
+    static stock_feed f;
+    return f;
+  }
+
+  stock_feed::stock_feed(){
+    inventory::add_stock_observer([this](inventory& inv, const doc_id& pi, count_type old_count, count_type new_count){
+      partitions::after_commit([this, database = partitions::current(), id = inv.get_id(), pi, old_count, new_count, version = inv.get_price_inputs_version()]{
+	publish(database, id, pi, old_count, new_count, version);
+      });
+    });
+  }
+
+  stock_feed::~stock_feed(){
+    {
+      std::lock_guard l(_mutex);
+      _stop = true;
+    }
+
+    _wake_flusher.notify_all();
+    _published.notify_all();
+
+    if (_flusher.joinable()){
+      _flusher.join();
+    }
+  }
+
+  void stock_feed::configure(const settings& s, std::unique_ptr<stock_sink> sink){
+    _settings = s;
+    _sink = std::move(sink);
+  }
+
+  // The ring is allocated and the flusher started on first use, not when the module is loaded.
+  void stock_feed::start(){
+    std::call_once(_started, [this]{
+      std::lock_guard l(_mutex);
+      _ring.resize(std::max<size_t>(_settings.capacity, 1));
+
+      if (_sink){
+	// Numbering goes on after the events of the previous runs.
+	_last = _persisted = _sink->last_sequence();
+	_flusher = std::thread([this]{ run(); });
+      }
+    });
+  }
+
+  void stock_feed::publish(const std::string& database, const doc_id& inventory, const doc_id& physical_inventory, count_type old_count, count_type new_count, uint32_t inputs_version){
+    start();
+    bool flush;
+
+    {
+      std::lock_guard l(_mutex);
+      uint64_t sequence = ++_last;
+      _ring[sequence % _ring.size()] = stock_delta{sequence, inventory, physical_inventory, old_count, new_count, inputs_version, database};
+      ++_statistics.published;
+
+      if (!_sink && _last > _ring.size()){
+	++_statistics.lost;
+      }
+
+      flush = _sink && _last - _persisted >= _settings.batch_size;
+    }
+
+    _published.notify_all();
+
+    if (flush){
+      _wake_flusher.notify_one();
+    }
+  }
+
+  std::vector<stock_delta> stock_feed::read(uint64_t after, size_t max, std::chrono::milliseconds wait){
+    start();
+    std::vector<stock_delta> r;
+    std::unique_lock l(_mutex);
+
+    if (wait.count()){
+      _published.wait_for(l, wait, [this, after]{ return _stop || _last > after; });
+    }
+
+    if (!max || after >= _last){
+      return r;
+    }
+
+    if (after + 1 < oldest()){
+      if (_sink && after < _persisted){
+	++_statistics.sink_reads;
+	l.unlock();
+	_sink->read(after, max, r);
+
+	if (!r.empty()){
+	  return r;
+	}
+
+	l.lock();
+      }
+
+      after = std::max(after, oldest() - 1);
+    }
+
+    for (uint64_t s = after + 1; s <= _last && r.size() != max; ++s){
+      r.push_back(_ring[s % _ring.size()]);
+    }
+
+    return r;
+  }
+
+  uint64_t stock_feed::last_sequence(){
+    std::lock_guard l(_mutex);
+    return _last;
+  }
+
+  std::string stock_feed::name(){
+    start();
+    return _sink ? _sink->name() : std::string();
+  }
+
+  stock_feed::statistics stock_feed::get_statistics(){
+    std::lock_guard l(_mutex);
+    return _statistics;
+  }
+
+  void stock_feed::run(){
+    std::unique_lock l(_mutex);
+
+    for (;;){
+      _wake_flusher.wait_for(l, _settings.flush_interval, [this]{ return _stop || _last - _persisted >= _settings.batch_size; });
+
+      // The flusher fell behind the ring.
+      if (_persisted + 1 < oldest()){
+	_statistics.lost += oldest() - 1 - _persisted;
+	_persisted = oldest() - 1;
+      }
+
+      if (_persisted == _last){
+	if (_stop){
+	  return;
+	}
+
+	continue;
+      }
+
+      std::vector<stock_delta> batch;
+      batch.reserve(std::min<uint64_t>(_last - _persisted, _settings.batch_size));
+
+      for (uint64_t s = _persisted + 1; s <= _last && batch.size() != std::max<size_t>(_settings.batch_size, 1); ++s){
+	batch.push_back(_ring[s % _ring.size()]);
+      }
+
+      l.unlock();
+      bool written = true;
+
+      try{
+	_sink->write(batch);
+      }
+      catch (const std::exception&){
+	// Retried at the next round.
+	written = false;
+      }
+
+      l.lock();
+
+      if (written){
+	_persisted = batch.back().sequence;
+	_statistics.persisted += batch.size();
+      }
+      else if (_stop){
+	return;
+      }
+    }
+  }
+
+  std::vector<stock_delta> stock_feed::cursor::next(size_t max, std::chrono::milliseconds wait){
+    std::vector<stock_delta> r = stock_feed::instance().read(_after, max, wait);
+
+    if (!r.empty()){
+      _after = r.back().sequence;
+    }
+
+    return r;
+  }
+
+} // End namespace zambezi.
@@ -0,0 +1,207 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_STOCK_FEED_HPP
+#define HX2A_ZAMBEZI_STOCK_FEED_HPP
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include <utility>
+#include <condition_variable>
+
+#include "hx2a/zambezi/ontology.hpp"
+
+namespace zambezi {
+
+  // Change feed of the stock counts of inventories, for consumers such as search indexes, recommendation engines
+  // and caches, which otherwise poll the inventories.
+  //
+  // Every change of the count of a physical inventory publishes two compact events: one for the physical
+  // inventory, and one for the count of its inventory, which is derived. Adding a physical inventory to an
+  // inventory, and removing or disconnecting one, publish them too. Events are numbered without gaps and kept in
+  // an in-process ring buffer. A sink, when configured, makes them durable: a background thread writes them in
+  // batches, and consumers which fell behind the ring read from it.
+  //
+  // Events are published once the connector of the change has saved the documents (see
+  // partitions::after_commit), changes which fail to be saved have none.
+  //
+  // Each process has its own feed, numbered on its own. The name of the feed, given with the events, tells the
+  // consumers which numbering a position belongs to. The file sink takes a file of its own per process.
+  struct stock_delta
+  {
+    // Position in the feed, starting at 1.
+    uint64_t sequence;
+    doc_id inventory;
+    // Null for the count of the inventory itself, the sum of the counts of its physical inventories.
+    doc_id physical_inventory;
+    count_type old_count;
+    count_type new_count;
+    // Version of the inputs of the price and of the availability of the inventory after the change (see
+    // inventory::get_price_inputs_version), not the revision of the document.
+    uint32_t inputs_version;
+    // Of the inventory (see partitions.hpp), for the consumers of a tenant. Empty for the events stored before it
+    // was recorded.
+    std::string database;
+  };
+
+  // Durable storage of the events, written in batches in sequence order.
+  class stock_sink
+  {
+  public:
+
+    virtual ~stock_sink() = default;
+
+    // The sequence of the last event stored, 0 if there is none. Called once, before any write.
+    virtual uint64_t last_sequence() = 0;
+
+    virtual void write(const std::vector<stock_delta>& batch) = 0;
+
+    // Appends to out the events following the sequence after, max at most.
+    virtual void read(uint64_t after, size_t max, std::vector<stock_delta>& out) = 0;
+
+    // Name of the numbering of the events stored, unique among the processes sharing the storage.
+    virtual std::string name() const = 0;
+  };
+
+  // Local file log, one line of text per event. An event partially written by a crash is discarded when the file is
+  // opened again.
+  //
+  // Every process takes its own file, the first of <path>.0, .1 etc. no other process holds (the lock is on the
+  // file next to it, ending in .lock). A process restarting takes one left by a stopped process, and goes on with
+  // its numbering.
+  class file_stock_sink: public stock_sink
+  {
+  public:
+
+    // When sync is true, every batch is synced to the disk.
+    file_stock_sink(const std::string& path, bool sync = false);
+
+    ~file_stock_sink();
+
+    uint64_t last_sequence() override;
+
+    void write(const std::vector<stock_delta>& batch) override;
+
+    void read(uint64_t after, size_t max, std::vector<stock_delta>& out) override;
+
+    // The host and the number of the file taken.
+    std::string name() const override { return _name; }
+
+  private:
+
+    // One event in index_step is indexed with its offset, reads start from the closest one.
+    static constexpr uint64_t index_step = 256;
+
+    std::string _path;
+    std::string _name;
+    bool _sync;
+    int _lock = -1;
+    std::FILE* _file = nullptr;
+    std::mutex _mutex;
+    std::vector<std::pair<uint64_t, long>> _index;
+    uint64_t _last = 0;
+    long _size = 0;
+  };
+
+  class stock_feed
+  {
+  public:
+
+    struct settings
+    {
+      // Number of events kept in memory.
+      size_t capacity = 65536;
+      // Events are written to the sink at least this often, and as soon as a batch is full.
+      std::chrono::milliseconds flush_interval{100};
+      size_t batch_size = 1024;
+    };
+
+    struct statistics
+    {
+      uint64_t published = 0;
+      uint64_t persisted = 0;
+      // Reads served by the sink, the consumer having fallen behind the ring.
+      uint64_t sink_reads = 0;
+      // Events overwritten in the ring before being persisted, or at all when there is no sink.
+      uint64_t lost = 0;
+    };
+
+    // Consumer position in the feed.
+    class cursor
+    {
+    public:
+
+      explicit cursor(uint64_t after = 0):
+	_after(after)
+      {
+      }
+
+      // The next events, at most max, waiting up to wait for the first one. The position moves past them.
+      std::vector<stock_delta> next(size_t max, std::chrono::milliseconds wait = {});
+
+      // The sequence of the last event delivered, to be saved by consumers which resume after a restart.
+      uint64_t position() const { return _after; }
+
+    private:
+      uint64_t _after;
+    };
+
+    static stock_feed& instance();
+
+    // To be called before the first change. Without sink the events are only kept in memory.
+    void configure(const settings& s, std::unique_ptr<stock_sink> sink = {});
+
+    void publish(const std::string& database, const doc_id& inventory, const doc_id& physical_inventory, count_type old_count, count_type new_count, uint32_t inputs_version);
+
+    // The events following the sequence after, at most max, waiting up to wait for the first one. A consumer
+    // which fell behind both the ring and the sink gets the oldest events available, and sees the gap in the
+    // sequences.
+    std::vector<stock_delta> read(uint64_t after, size_t max, std::chrono::milliseconds wait = {});
+
+    // The sequence of the last event published.
+    uint64_t last_sequence();
+
+    // The name of the numbering of the events, the one of the sink. Empty without sink, the numbering then starts
+    // again with the process.
+    std::string name();
+
+    statistics get_statistics();
+
+    ~stock_feed();
+
+  private:
+
+    stock_feed();
+
+    void start();
+
+    void run();
+
+    // Requires the lock.
+    uint64_t oldest() const { return _last >= _ring.size() ? _last - _ring.size() + 1 : 1; }
+
+    settings _settings;
+    std::unique_ptr<stock_sink> _sink;
+    std::once_flag _started;
+    std::thread _flusher;
+    std::mutex _mutex;
+    std::condition_variable _published;
+    std::condition_variable _wake_flusher;
+    // Event n is at n % size.
+    std::vector<stock_delta> _ring;
+    uint64_t _last = 0;
+    uint64_t _persisted = 0;
+    statistics _statistics;
+    bool _stop = false;
+  };
+
+} // End namespace zambezi.
+
+#endif
@@ -0,0 +1,238 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+// Convergence check of the merge mode of the carts (see cart.hpp).
+//
+// Every thread is a replica (a device of the shopper) editing its own version of a cart: it adds and removes
+// items at top level and in folders, adds and removes folders, and now and then merges its version with the one of
+// the server, the server taking it under a lock. At the end every version is merged into the server, and the
+// server into every version. All the versions must then be identical, and the count of every line at top level
+// must be the sum of the changes all the replicas made to it.
+//
+// Replicas only remove what they see, like a user interface would, so that every change made is recorded by the
+// counters. Removing a line on one replica while another still has it in an older version is what the tombstones
+// are for: without them, such lines come back.
+//
+// Usage:
+//   cart_convergence [--replicas 8] [--operations 2000] [--items 20] [--sync 50] [--seed 1] [--database zambezi_convergence]
+//
+// Built with the module and the framework. The carts stay in memory. The items are saved in the given database, a
+// scratch one, because lines removed on a replica and counting again after a merge are restored from their item.
+
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <string_view>
+
+#include "hx2a/root.hpp"
+#include "hx2a/server.hpp"
+
+#include "hx2a/zambezi/cart.hpp"
+
+using namespace hx2a;
+
+namespace {
+
+  class item: public root<>
+  {
+    HX2A_ROOT(item, "zambezi:convergence_item", 1, root);
+
+  public:
+
+    // Reserved constructor.
+    item(reserved_t, const doc_id& id):
+      root(reserved, id)
+    {
+    }
+
+    item():
+      root(standard)
+    {
+    }
+  };
+
+  using item_r = rfr<item>;
+
+  using test_cart = hx2a::zambezi::cart<item, "zambezi:convergence_cart", "zambezi:convergence_line", "zambezi:convergence_folder">;
+
+  struct options
+  {
+    size_t replicas = 8;
+    size_t operations = 2000;
+    size_t items = 20;
+    size_t sync = 50;
+    unsigned seed = 1;
+    std::string database = "zambezi_convergence";
+  };
+
+  bool parse(int argc, char** argv, options& o){
+    for (int i = 1; i < argc; ++i){
+      std::string_view a = argv[i];
+
+      if (i + 1 == argc){
+	return false;
+      }
+
+      if (a == "--database"){
+	o.database = argv[++i];
+	continue;
+      }
+
+      unsigned long long v = std::strtoull(argv[++i], nullptr, 10);
+
+      if (a == "--replicas") o.replicas = std::max<unsigned long long>(v, 1);
+      else if (a == "--operations") o.operations = v;
+      else if (a == "--items") o.items = std::max<unsigned long long>(v, 1);
+      else if (a == "--sync") o.sync = std::max<unsigned long long>(v, 1);
+      else if (a == "--seed") o.seed = static_cast<unsigned>(v);
+      else return false;
+    }
+
+    return true;
+  }
+
+  // What a version shows: the counts per folder (empty at top level) and item.
+  std::map<std::pair<std::string, std::string>, uint32_t> contents(const test_cart& c){
+    std::map<std::pair<std::string, std::string>, uint32_t> r;
+    std::for_each(c.lines_cbegin(), c.lines_cend(), [&r](const test_cart::line_p& l){ r[{std::string(), l->item()->get_id().to_string()}] = l->count(); });
+    std::for_each(c.folders_cbegin(), c.folders_cend(), [&r](const test_cart::folder_p& f){
+      // An empty folder shows too.
+      r[{f->get_name(), std::string()}] = 0;
+      std::for_each(f->lines_cbegin(), f->lines_cend(), [&](const test_cart::line_p& l){ r[{f->get_name(), l->item()->get_id().to_string()}] = l->count(); });
+    });
+
+    return r;
+  }
+
+  uint32_t count_of(test_cart& c, const item_r& i){
+    test_cart::line_p l = c.find_item(i);
+    return l ? l->count() : 0;
+  }
+
+} // End of anonymous namespace.
+
+int main(int argc, char** argv){
+  options o;
+
+  if (!parse(argc, argv, o)){
+    std::fprintf(stderr, "usage: cart_convergence [--replicas n] [--operations n] [--items n] [--sync n] [--seed n] [--database name]\n");
+    return 2;
+  }
+
+  std::vector<item_r> items;
+
+  {
+    db::connector c(o.database);
+
+    for (size_t i = 0; i != o.items; ++i){
+      items.push_back(make_rfr<item>());
+    }
+  }
+
+  const std::vector<std::string> folder_names = {"gifts", "later", "party"};
+  test_cart server;
+  std::mutex server_mutex;
+  std::vector<test_cart> versions(o.replicas);
+  // Changes made at top level, per replica and item.
+  std::vector<std::vector<int64_t>> changes(o.replicas, std::vector<int64_t>(o.items, 0));
+  std::vector<std::thread> threads;
+
+  for (size_t r = 0; r != o.replicas; ++r){
+    threads.emplace_back([&, r]{
+      std::mt19937 random(o.seed * 7919 + static_cast<unsigned>(r));
+      std::string replica = "replica" + std::to_string(r);
+      test_cart& mine = versions[r];
+      // For the items of the lines coming back.
+      db::connector c(o.database);
+
+      for (size_t n = 0; n != o.operations; ++n){
+	size_t i = random() % items.size();
+	const std::string& name = folder_names[random() % folder_names.size()];
+
+	switch (random() % 10){
+	case 0:
+	  mine.add_folder(replica, name);
+	  break;
+	case 1:
+	  mine.remove_folder(name);
+	  break;
+	case 2:
+	  if (test_cart::folder_p f = mine.find_folder(name)){
+	    f->add_item(replica, items[i], static_cast<int64_t>(random() % 3) - 1);
+	  }
+	  break;
+	case 3:
+	case 4:
+	case 5:{
+	  int64_t delta = 1 + random() % 3;
+	  mine.add_item(replica, items[i], delta);
+	  changes[r][i] += delta;
+	  break;
+	}
+	default:{
+	  int64_t delta = -static_cast<int64_t>(std::min<uint32_t>(count_of(mine, items[i]), 1 + random() % 3));
+	  mine.add_item(replica, items[i], delta);
+	  changes[r][i] += delta;
+	  break;
+	}
+	}
+
+	if (!(n % o.sync)){
+	  std::lock_guard l(server_mutex);
+	  server.merge(mine);
+	  mine.merge(server);
+	}
+      }
+    });
+  }
+
+  for (std::thread& t: threads){
+    t.join();
+  }
+
+  db::connector c(o.database);
+
+  for (test_cart& v: versions){
+    server.merge(v);
+  }
+
+  for (test_cart& v: versions){
+    v.merge(server);
+  }
+
+  auto expected = contents(server);
+  bool ok = true;
+
+  for (size_t r = 0; r != o.replicas; ++r){
+    if (contents(versions[r]) != expected){
+      std::printf("replica %zu did not converge\n", r);
+      ok = false;
+    }
+  }
+
+  for (size_t i = 0; i != o.items; ++i){
+    int64_t total = 0;
+
+    for (size_t r = 0; r != o.replicas; ++r){
+      total += changes[r][i];
+    }
+
+    uint32_t count = count_of(server, items[i]);
+
+    if (count != static_cast<uint64_t>(std::max<int64_t>(total, 0))){
+      std::printf("item %zu: count %u, changes %lld\n", i, count, static_cast<long long>(total));
+      ok = false;
+    }
+  }
+
+  std::printf("%zu replicas, %zu operations each, %zu lines and folders: %s\n", o.replicas, o.operations, expected.size(), ok ? "converged" : "FAILED");
+  return ok ? 0 : 1;
+}
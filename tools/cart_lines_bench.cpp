@@ -0,0 +1,189 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+// Benchmark of the container policies of the cart lines (see list_lines and vector_lines in cart.hpp).
+//
+// The same cart, with the same lines, is built with both policies. The iterations (counting the items), the
+// lookups (finding the line of an item) and the updates of counts are then timed on each, and the time per
+// operation is reported.
+//
+// Usage:
+//   cart_lines_bench [--lines 100] [--operations 100000] [--seed 1] [--database zambezi_bench]
+//
+// Built with the module and the framework. The carts stay in memory. The items are saved in the given database, a
+// scratch one.
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <string_view>
+
+#include "hx2a/root.hpp"
+#include "hx2a/server.hpp"
+
+#include "hx2a/zambezi/cart.hpp"
+
+using namespace hx2a;
+
+namespace {
+
+  using clock = std::chrono::steady_clock;
+
+  class item: public root<>
+  {
+    HX2A_ROOT(item, "zambezi:bench_item", 1, root);
+
+  public:
+
+    // Reserved constructor.
+    item(reserved_t, const doc_id& id):
+      root(reserved, id)
+    {
+    }
+
+    item():
+      root(standard)
+    {
+    }
+  };
+
+  using item_r = rfr<item>;
+
+  template <typename LinesPolicy>
+  using bench_cart = hx2a::zambezi::cart<
+    item,
+    "zambezi:bench_cart",
+    "zambezi:bench_line",
+    "zambezi:bench_folder",
+    hx2a::zambezi::DefaultCartLinesTag,
+    hx2a::zambezi::DefaultFoldersTag,
+    hx2a::zambezi::DefaultItemTag,
+    hx2a::zambezi::DefaultCountTag,
+    hx2a::zambezi::DefaultFolderNameTag,
+    LinesPolicy
+    >;
+
+  struct options
+  {
+    size_t lines = 100;
+    size_t operations = 100000;
+    unsigned seed = 1;
+    std::string database = "zambezi_bench";
+  };
+
+  bool parse(int argc, char** argv, options& o){
+    for (int i = 1; i < argc; ++i){
+      std::string_view a = argv[i];
+
+      if (i + 1 == argc){
+	return false;
+      }
+
+      if (a == "--database"){
+	o.database = argv[++i];
+	continue;
+      }
+
+      unsigned long long v = std::strtoull(argv[++i], nullptr, 10);
+
+      if (a == "--lines") o.lines = std::max<unsigned long long>(v, 1);
+      else if (a == "--operations") o.operations = std::max<unsigned long long>(v, 1);
+      else if (a == "--seed") o.seed = static_cast<unsigned>(v);
+      else return false;
+    }
+
+    return true;
+  }
+
+  template <typename F>
+  double seconds(F&& f){
+    clock::time_point start = clock::now();
+    f();
+    return std::chrono::duration<double>(clock::now() - start).count();
+  }
+
+  struct timings
+  {
+    double iterate;
+    double find;
+    double update;
+    // Compared between the policies, and keeps the loops from being optimized away.
+    uint64_t checksum = 0;
+  };
+
+  template <typename LinesPolicy>
+  timings run(const options& o, const std::vector<item_r>& items){
+    bench_cart<LinesPolicy> c;
+
+    for (const item_r& i: items){
+      c.add_item(i);
+    }
+
+    std::mt19937 random(o.seed);
+    std::vector<size_t> picks(o.operations);
+    std::generate(picks.begin(), picks.end(), [&]{ return random() % items.size(); });
+    timings t;
+
+    // Every iteration walks all the lines, there are as many line visits as in the lookups.
+    size_t passes = std::max<size_t>(o.operations / items.size(), 1);
+
+    t.iterate = seconds([&]{
+      for (size_t n = 0; n != passes; ++n){
+	t.checksum += c.items_count();
+      }
+    }) / static_cast<double>(passes);
+
+    t.find = seconds([&]{
+      for (size_t p: picks){
+	t.checksum += c.find_item(items[p])->count();
+      }
+    }) / static_cast<double>(o.operations);
+
+    t.update = seconds([&]{
+      for (size_t p: picks){
+	c.update_item_count(items[p], 1 + p % 7);
+      }
+    }) / static_cast<double>(o.operations);
+
+    t.checksum += c.items_count();
+    return t;
+  }
+
+} // End of anonymous namespace.
+
+int main(int argc, char** argv){
+  options o;
+
+  if (!parse(argc, argv, o)){
+    std::fprintf(stderr, "usage: cart_lines_bench [--lines n] [--operations n] [--seed n] [--database name]\n");
+    return 2;
+  }
+
+  db::connector c(o.database);
+  std::vector<item_r> items;
+
+  for (size_t i = 0; i != o.lines; ++i){
+    items.push_back(make_rfr<item>());
+  }
+
+  timings list = run<hx2a::zambezi::list_lines>(o, items);
+  timings vector = run<hx2a::zambezi::vector_lines>(o, items);
+
+  if (list.checksum != vector.checksum){
+    std::printf("the policies disagree\n");
+    return 1;
+  }
+
+  std::printf("%zu lines\n", o.lines);
+  std::printf("%-10s %15s %15s %9s\n", "operation", "list", "vector", "speedup");
+  std::printf("%-10s %12.3f us %12.3f us %8.1fx\n", "iterate", list.iterate * 1e6, vector.iterate * 1e6, list.iterate / vector.iterate);
+  std::printf("%-10s %12.3f us %12.3f us %8.1fx\n", "find", list.find * 1e6, vector.find * 1e6, list.find / vector.find);
+  std::printf("%-10s %12.3f us %12.3f us %8.1fx\n", "update", list.update * 1e6, vector.update * 1e6, list.update / vector.update);
+  return 0;
+}
@@ -0,0 +1,133 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+// Benchmark of the bulk creation of products (see product_create_many in services.cpp) against single creations
+// (see product_create).
+//
+// The same number of products is created in one category of a scratch database, first one per connector, as
+// product_create does, then in batches of at most the limit of product_create_many, one connector per batch. The
+// time per product and the number of products per second are reported for both. The parsing of the payloads is
+// left out, payload_bench and replay measure it through the server.
+//
+// Usage:
+//   create_many_bench [--products 10000] [--batch 1000] [--database zambezi_bench]
+//
+// Built with the module and the framework.
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <string_view>
+
+#include "hx2a/root.hpp"
+#include "hx2a/server.hpp"
+
+#include "hx2a/zambezi/ontology.hpp"
+#include "hx2a/zambezi/partitions.hpp"
+
+using namespace hx2a;
+
+namespace {
+
+  using clock = std::chrono::steady_clock;
+
+  namespace partitions = ::zambezi::partitions;
+
+  using ::zambezi::product;
+  using ::zambezi::product_category;
+  using ::zambezi::product_category_p;
+
+  // The limit of product_create_many.
+  constexpr size_t max_batch = 1000;
+
+  struct options
+  {
+    size_t products = 10000;
+    size_t batch = max_batch;
+    std::string database = "zambezi_bench";
+  };
+
+  bool parse(int argc, char** argv, options& o){
+    for (int i = 1; i < argc; ++i){
+      std::string_view a = argv[i];
+
+      if (i + 1 == argc){
+	return false;
+      }
+
+      if (a == "--database"){
+	o.database = argv[++i];
+	continue;
+      }
+
+      unsigned long long v = std::strtoull(argv[++i], nullptr, 10);
+
+      if (a == "--products") o.products = std::max<unsigned long long>(v, 1);
+      else if (a == "--batch") o.batch = std::clamp<unsigned long long>(v, 1, max_batch);
+      else return false;
+    }
+
+    return true;
+  }
+
+  template <typename F>
+  double seconds(F&& f){
+    clock::time_point start = clock::now();
+    f();
+    return std::chrono::duration<double>(clock::now() - start).count();
+  }
+
+  // Creates count products in the category with one connector, as the services do.
+  void create(const options& o, const doc_id& category, size_t count){
+    partitions::connector c(o.database);
+    product_category_p cat = product_category::get(category);
+
+    for (size_t i = 0; i != count; ++i){
+      make_rfr<product>(*cat);
+    }
+
+    c.close();
+  }
+
+} // End of anonymous namespace.
+
+int main(int argc, char** argv){
+  options o;
+
+  if (!parse(argc, argv, o)){
+    std::fprintf(stderr, "usage: create_many_bench [--products n] [--batch n] [--database name]\n");
+    return 2;
+  }
+
+  doc_id category;
+
+  {
+    partitions::connector c(o.database);
+    category = make_rfr<product_category>()->get_id();
+  }
+
+  double single = seconds([&]{
+    for (size_t i = 0; i != o.products; ++i){
+      create(o, category, 1);
+    }
+  });
+
+  double bulk = seconds([&]{
+    for (size_t done = 0; done != o.products; done += std::min(o.batch, o.products - done)){
+      create(o, category, std::min(o.batch, o.products - done));
+    }
+  });
+
+  double n = static_cast<double>(o.products);
+  std::printf("%zu products, batches of %zu\n", o.products, o.batch);
+  std::printf("%-8s %15s %15s\n", "creation", "per product", "products/s");
+  std::printf("%-8s %12.3f us %15.0f\n", "single", single / n * 1e6, n / single);
+  std::printf("%-8s %12.3f us %15.0f\n", "bulk", bulk / n * 1e6, n / bulk);
+  std::printf("speedup %.1fx\n", single / bulk);
+  return 0;
+}
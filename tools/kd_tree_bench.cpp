@@ -0,0 +1,251 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+// Benchmark of the tree of the inventory index (see kd_tree.hpp and inventory_index.hpp) against a linear scan of
+// the same points, which is what answering the queries without the index costs at best.
+//
+// Points are random (price, rating, count) triples. For each query kind, the same queries are run against the tree
+// and against the scan, their results are compared, and the time per query is reported. Updates are then mixed in,
+// to measure the overflow and the tombstones between two rebuilds of the tree.
+//
+// Usage:
+//   kd_tree_bench [--points 100000] [--queries 2000] [--k 20] [--updates 10000] [--seed 1]
+//
+// Standalone, built with: g++ -std=c++20 -O2 -I<include root> kd_tree_bench.cpp
+
+#include <map>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <string_view>
+
+#include "hx2a/zambezi/kd_tree.hpp"
+
+namespace {
+
+  using clock = std::chrono::steady_clock;
+  using tree = zambezi::kd_tree<uint64_t, 3>;
+
+  struct options
+  {
+    size_t points = 100000;
+    size_t queries = 2000;
+    size_t k = 20;
+    size_t updates = 10000;
+    unsigned seed = 1;
+  };
+
+  struct generator
+  {
+    explicit generator(unsigned seed):
+      random(seed)
+    {
+    }
+
+    tree::coordinates point(){
+      return {price(random), std::round(rating(random) * 10) / 10, std::floor(count(random))};
+    }
+
+    tree::box box(){
+      tree::box b;
+      double from = price(random);
+      b.min[0] = from;
+      b.max[0] = from + width(random);
+      b.min[1] = std::floor(rating(random));
+      b.min[2] = 1;
+      return b;
+    }
+
+    std::mt19937_64 random;
+    std::uniform_real_distribution<double> price{0, 1000};
+    std::uniform_real_distribution<double> width{5, 100};
+    std::uniform_real_distribution<double> rating{0, 5};
+    std::exponential_distribution<double> count{0.05};
+  };
+
+  // What the index replaces.
+  struct scan
+  {
+    std::map<uint64_t, tree::coordinates> points;
+
+    size_t range(const tree::box& b) const {
+      size_t n = 0;
+
+      for (const auto& [id, c]: points){
+	n += b.contains(c);
+      }
+
+      return n;
+    }
+
+    std::vector<double> nearest(const tree::coordinates& t, const tree::coordinates& w, size_t k, const tree::box& b) const {
+      std::vector<double> d;
+
+      for (const auto& [id, c]: points){
+	if (b.contains(c)){
+	  d.push_back(distance(t, w, c));
+	}
+      }
+
+      std::sort(d.begin(), d.end());
+      d.resize(std::min(d.size(), k));
+      return d;
+    }
+
+    static double distance(const tree::coordinates& t, const tree::coordinates& w, const tree::coordinates& c){
+      double r = 0;
+
+      for (size_t i = 0; i != 3; ++i){
+	r += w[i] * (c[i] - t[i]) * (c[i] - t[i]);
+      }
+
+      return r;
+    }
+  };
+
+  template <typename F>
+  double seconds(F&& f){
+    clock::time_point start = clock::now();
+    f();
+    return std::chrono::duration<double>(clock::now() - start).count();
+  }
+
+  bool parse(int argc, char** argv, options& o){
+    for (int i = 1; i < argc; ++i){
+      std::string_view a = argv[i];
+
+      if (i + 1 == argc){
+	return false;
+      }
+
+      unsigned long long v = std::strtoull(argv[++i], nullptr, 10);
+
+      if (a == "--points") o.points = v;
+      else if (a == "--queries") o.queries = std::max<unsigned long long>(v, 1);
+      else if (a == "--k") o.k = v;
+      else if (a == "--updates") o.updates = v;
+      else if (a == "--seed") o.seed = static_cast<unsigned>(v);
+      else return false;
+    }
+
+    return true;
+  }
+
+  // Runs the queries against both, returns false at the first difference.
+  bool compare(const char* title, const options& o, generator& g, const tree& t, const scan& s){
+    std::vector<tree::box> boxes;
+    std::vector<tree::coordinates> targets;
+
+    for (size_t i = 0; i != o.queries; ++i){
+      boxes.push_back(g.box());
+      targets.push_back(g.point());
+    }
+
+    tree::coordinates weights{1, 100, 0};
+    std::vector<size_t> tree_counts;
+    std::vector<size_t> scan_counts;
+    std::vector<std::vector<double>> tree_nearest;
+    std::vector<std::vector<double>> scan_nearest;
+
+    double tree_range = seconds([&]{
+      for (const tree::box& b: boxes){
+	size_t n = 0;
+	t.range(b, [&n](uint64_t, const tree::coordinates&){ ++n; });
+	tree_counts.push_back(n);
+      }
+    });
+
+    double scan_range = seconds([&]{
+      for (const tree::box& b: boxes){
+	scan_counts.push_back(s.range(b));
+      }
+    });
+
+    double tree_knn = seconds([&]{
+      for (size_t i = 0; i != o.queries; ++i){
+	std::vector<double> d;
+
+	for (const tree::point& p: t.nearest(targets[i], weights, o.k, boxes[i])){
+	  d.push_back(scan::distance(targets[i], weights, p.c));
+	}
+
+	tree_nearest.push_back(std::move(d));
+      }
+    });
+
+    double scan_knn = seconds([&]{
+      for (size_t i = 0; i != o.queries; ++i){
+	scan_nearest.push_back(s.nearest(targets[i], weights, o.k, boxes[i]));
+      }
+    });
+
+    if (tree_counts != scan_counts || tree_nearest != scan_nearest){
+      std::printf("%s: the tree and the scan disagree\n", title);
+      return false;
+    }
+
+    double q = static_cast<double>(o.queries);
+    std::printf("%-16s %-8s %12.1f us %12.1f us %8.1fx\n", title, "range", tree_range / q * 1e6, scan_range / q * 1e6, scan_range / tree_range);
+    std::printf("%-16s %-8s %12.1f us %12.1f us %8.1fx\n", title, "nearest", tree_knn / q * 1e6, scan_knn / q * 1e6, scan_knn / tree_knn);
+    return true;
+  }
+
+} // End of anonymous namespace.
+
+int main(int argc, char** argv){
+  options o;
+
+  if (!parse(argc, argv, o)){
+    std::fprintf(stderr, "usage: kd_tree_bench [--points n] [--queries n] [--k n] [--updates n] [--seed n]\n");
+    return 2;
+  }
+
+  generator g(o.seed);
+  tree t;
+  scan s;
+  std::vector<tree::point> points;
+
+  for (uint64_t id = 0; id != o.points; ++id){
+    tree::coordinates c = g.point();
+    points.push_back(tree::point{id, c});
+    s.points.emplace(id, c);
+  }
+
+  double build = seconds([&]{ t.assign(std::move(points)); });
+  std::printf("%zu points, built in %.1f ms\n", o.points, build * 1e3);
+  std::printf("%-16s %-8s %15s %15s %9s\n", "", "query", "tree", "scan", "speedup");
+
+  if (!compare("built", o, g, t, s)){
+    return 1;
+  }
+
+  // Prices changed, inventories created and removed, as the observers of the index report them.
+  std::uniform_int_distribution<uint64_t> ids(0, o.points + o.points / 10);
+  std::uniform_int_distribution<int> kind(0, 9);
+
+  double update = seconds([&]{
+    for (size_t i = 0; i != o.updates; ++i){
+      uint64_t id = ids(g.random);
+
+      if (!kind(g.random)){
+	t.erase(id);
+	s.points.erase(id);
+      }
+      else{
+	tree::coordinates c = g.point();
+	t.insert_or_update(id, c);
+	s.points[id] = c;
+      }
+    }
+  });
+
+  std::printf("%zu updates in %.1f ms\n", o.updates, update * 1e3);
+  return compare("after updates", o, g, t, s) ? 0 : 1;
+}
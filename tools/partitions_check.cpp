@@ -0,0 +1,158 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+// Example multi-partition setup (see partitions.hpp), run against in-memory databases.
+//
+// The partitions are configured with the given number of partitions and one dedicated tenant. The logical names
+// of the databases are printed first, they are the ones the configuration file maps, each to an in-memory database
+// for a local run. Tenants are then created in the shared database, and the number of tenants routed to every
+// database is reported, to see the spread of the hash. Last, a document is created in the database of every
+// tenant, and the check fails if a database does not hold exactly the documents of its tenants.
+//
+// Usage:
+//   partitions_check [--partitions 4] [--tenants 100]
+//
+// Built with the module and the framework.
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <string_view>
+
+#include "hx2a/root.hpp"
+#include "hx2a/cursor.hpp"
+#include "hx2a/server.hpp"
+
+#include "hx2a/zambezi/partitions.hpp"
+
+using namespace hx2a;
+
+namespace {
+
+  namespace partitions = zambezi::partitions;
+
+  // Stands for an organization, and for a document of a tenant.
+  class record: public root<>
+  {
+    HX2A_ROOT(record, "zambezi:partitions_record", 1, root);
+
+  public:
+
+    // Reserved constructor.
+    record(reserved_t, const doc_id& id):
+      root(reserved, id)
+    {
+    }
+
+    record():
+      root(standard)
+    {
+    }
+  };
+
+  using record_r = rfr<record>;
+
+  struct options
+  {
+    uint32_t partitions = 4;
+    size_t tenants = 100;
+  };
+
+  bool parse(int argc, char** argv, options& o){
+    for (int i = 1; i < argc; ++i){
+      std::string_view a = argv[i];
+
+      if (i + 1 == argc){
+	return false;
+      }
+
+      unsigned long long v = std::strtoull(argv[++i], nullptr, 10);
+
+      if (a == "--partitions") o.partitions = static_cast<uint32_t>(std::max<unsigned long long>(v, 1));
+      else if (a == "--tenants") o.tenants = std::max<unsigned long long>(v, 1);
+      else return false;
+    }
+
+    return true;
+  }
+
+} // End of anonymous namespace.
+
+int main(int argc, char** argv){
+  options o;
+
+  if (!parse(argc, argv, o)){
+    std::fprintf(stderr, "usage: partitions_check [--partitions n] [--tenants n]\n");
+    return 2;
+  }
+
+  std::vector<doc_id> tenants;
+
+  {
+    db::connector c("hx2a");
+
+    for (size_t i = 0; i != o.tenants; ++i){
+      tenants.push_back(make_rfr<record>()->get_id());
+    }
+  }
+
+  partitions::settings s;
+  s.partitions = o.partitions;
+  // The first tenant is a large one, with a database of its own.
+  s.dedicated.emplace(tenants.front(), "hx2a_dedicated");
+  partitions::configure(s);
+
+  std::printf("databases:");
+
+  for (const std::string& d: partitions::databases()){
+    std::printf(" %s", d.c_str());
+  }
+
+  std::printf("\n");
+
+  // Documents created per database.
+  std::map<std::string, std::vector<doc_id>> expected;
+
+  for (const doc_id& t: tenants){
+    const std::string& d = partitions::database(t);
+    partitions::connector c(d);
+    expected[d].push_back(make_rfr<record>()->get_id());
+  }
+
+  bool ok = true;
+
+  for (const std::string& d: partitions::databases()){
+    std::vector<doc_id> found;
+
+    {
+      partitions::connector c(d);
+
+      for (cursor<record> cur; cur; ++cur){
+	found.push_back(cur.get_id());
+      }
+    }
+
+    std::vector<doc_id>& e = expected[d];
+    std::printf("%-16s %6zu tenants\n", d.c_str(), e.size());
+
+    // The shared database also holds the tenants themselves.
+    if (d == s.database){
+      e.insert(e.end(), tenants.cbegin(), tenants.cend());
+    }
+
+    std::sort(found.begin(), found.end());
+    std::sort(e.begin(), e.end());
+
+    if (found != e){
+      std::printf("%s does not hold the documents of its tenants only\n", d.c_str());
+      ok = false;
+    }
+  }
+
+  return ok ? 0 : 1;
+}
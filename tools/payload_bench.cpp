@@ -0,0 +1,175 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+// Parsing benchmark of the payloads of the services (see payloads.hpp).
+//
+// The payloads are parsed by the framework before the services are called, so their cost is measured through the
+// server: this program writes a request log with a payload of every type of payloads.hpp, sized by the options,
+// for replay (see replay.cpp) to send in a loop. Comparing the latencies per service of two logs of different
+// sizes gives the cost of parsing per byte, or per entry of the lists:
+//
+//   payload_bench --source-bytes 1024 --entries 10 > small.log
+//   payload_bench --source-bytes 1048576 --entries 1000 > large.log
+//   replay --log small.log --session ...
+//   replay --log large.log --session ...
+//
+// Payloads naming documents (a category and another one to move it under, a product, an inventory, a policy) are
+// only written when their identifiers are given, those of a database seeded beforehand, e.g. by the products
+// scenario of replay. The session has to be the one of a user allowed to call all the services. The entries are at
+// most 1000, the limit of the batch creations, which have no reply beyond.
+//
+// Usage:
+//   payload_bench [--source-bytes 65536] [--entries 1000] [--category id] [--parent id] [--product id] [--item id] [--policy id]
+
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <iostream>
+#include <string_view>
+
+namespace {
+
+  // The limit of product_category_create_many and product_create_many.
+  constexpr size_t max_entries = 1000;
+
+  struct options
+  {
+    size_t source_bytes = 65536;
+    size_t entries = 1000;
+    std::string category;
+    std::string parent;
+    std::string product;
+    std::string item;
+    std::string policy;
+  };
+
+  bool parse(int argc, char** argv, options& o){
+    for (int i = 1; i < argc; ++i){
+      std::string_view a = argv[i];
+
+      if (i + 1 == argc){
+	return false;
+      }
+
+      std::string v = argv[++i];
+
+      if (a == "--source-bytes") o.source_bytes = std::strtoull(v.c_str(), nullptr, 10);
+      else if (a == "--entries") o.entries = std::min<unsigned long long>(std::strtoull(v.c_str(), nullptr, 10), max_entries);
+      else if (a == "--category") o.category = v;
+      else if (a == "--parent") o.parent = v;
+      else if (a == "--product") o.product = v;
+      else if (a == "--item") o.item = v;
+      else if (a == "--policy") o.policy = v;
+      else return false;
+    }
+
+    return true;
+  }
+
+  std::string quote(std::string_view v){
+    std::string r = "\"";
+
+    for (char c: v){
+      if (c == '"' || c == '\\'){
+	r += '\\';
+      }
+      else if (c == '\n'){
+	r += "\\n";
+	continue;
+      }
+
+      r += c;
+    }
+
+    return r + '"';
+  }
+
+  // A policy of the given size: the pricing, then comments, some of them not ASCII, as in real sources.
+  std::string source(size_t bytes){
+    std::string r = "switch (currency){ case 978: price * 0.9; break; default: price; }\n";
+
+    for (size_t n = 0; r.size() < bytes; ++n){
+      r += n % 4 ? "// Remise accordée aux clients fidèles, révisée chaque trimestre.\n" : "// Discount granted to loyal customers, revised every quarter.\n";
+    }
+
+    return r;
+  }
+
+  std::string cart(const options& o){
+    std::string r = "{\"n\":[";
+
+    for (size_t i = 0; i != o.entries; ++i){
+      r += i ? "," : "";
+      r += "{\"i\":" + quote(o.item) + ",\"c\":" + std::to_string(1 + i % 5) + "}";
+    }
+
+    return r + "]}";
+  }
+
+  void line(std::string_view service, const std::string& payload){
+    std::cout << "{\"service\":" << quote(service) << ",\"payload\":" << payload << "}\n";
+  }
+
+} // End of anonymous namespace.
+
+int main(int argc, char** argv){
+  options o;
+
+  if (!parse(argc, argv, o)){
+    std::fprintf(stderr, "usage: payload_bench [--source-bytes n] [--entries n] [--category id] [--parent id] [--product id] [--item id] [--policy id]\n");
+    return 2;
+  }
+
+  std::string s = quote(source(o.source_bytes));
+  line("pricing_policy_create", "{\"source\":" + s + "}");
+
+  if (!o.policy.empty()){
+    line("pricing_policy_update", "{\"id\":" + quote(o.policy) + ",\"source\":" + s + "}");
+  }
+
+  // Every entry but the first is under an earlier one.
+  std::string categories = "{\"categories\":[{}";
+
+  for (size_t i = 1; i < o.entries; ++i){
+    categories += ",{\"local\":" + std::to_string((i + 1) / 2) + "}";
+  }
+
+  line("product_category_create_many", categories + "]}");
+  line("inventory_search", "{\"currency\":978,\"min_price\":10,\"max_price\":500,\"min_rating\":3,\"min_count\":1,\"limit\":50,"
+       "\"nearest\":true,\"price\":100,\"rating\":4.5,\"rating_weight\":10}");
+  line("stock_changes", "{\"after\":0,\"limit\":1000,\"wait\":0}");
+  line("cart_total", "{\"currency\":978}");
+
+  if (!o.category.empty()){
+    std::string c = quote(o.category);
+    std::string products = "{\"products\":[";
+
+    for (size_t i = 0; i != o.entries; ++i){
+      products += (i ? ",{\"category\":" : "{\"category\":") + c + "}";
+    }
+
+    line("product_create_many", products + "]}");
+    line("product_list", "{\"category\":" + c + ",\"limit\":100,\"inventory\":true,\"currency\":978}");
+    line("inventory_top", "{\"category\":" + c + ",\"currency\":978,\"k\":20,\"facets\":true,\"price_step\":10,\"price_buckets\":20}");
+
+    // Moved again and again under the same parent.
+    if (!o.parent.empty()){
+      line("product_category_move", "{\"category\":" + c + ",\"parent\":" + quote(o.parent) + "}");
+    }
+
+    if (!o.product.empty()){
+      line("product_move", "{\"product\":" + quote(o.product) + ",\"category\":" + c + "}");
+    }
+  }
+
+  if (!o.item.empty()){
+    line("cart_update_item_count", "{\"folder\":\"\",\"item\":" + quote(o.item) + ",\"count\":2,\"buffered\":true}");
+    line("cart_merge", "{\"cart\":" + cart(o) + "}");
+    line("cart_merge_guest", "{\"cart\":" + cart(o) + ",\"policy\":\"max\"}");
+  }
+
+  return 0;
+}
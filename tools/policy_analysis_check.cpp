@@ -0,0 +1,188 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+// Checks of the analysis of the pricing policy sources (see pricing_policy::get_variables and
+// pricing_policy::tabulate).
+//
+// The variables found in the example policies of pricing_policy, and in sources trying to escape the analysis
+// (computed properties, this, eval, template literals, constructors), are compared with the expected ones. A
+// source reaching anything else than its variables must be reported as reading other_read, so that it is neither
+// memoized nor tabulated. The policies are then created in a scratch database and tabulated, and the prices in
+// the tables are compared with the ones expected, for a range of counts, currencies and prices. The sources which
+// cannot be tabulated must have no price in their table.
+//
+// Usage:
+//   policy_analysis_check [--database zambezi_bench]
+//
+// Built with the module and the framework. Prints the failed checks, and fails if there is any.
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <optional>
+#include <functional>
+#include <string_view>
+
+#include "hx2a/root.hpp"
+#include "hx2a/server.hpp"
+
+#include "hx2a/zambezi/ontology.hpp"
+
+using namespace hx2a;
+
+namespace {
+
+  using ::zambezi::pricing_policy;
+
+  constexpr unsigned count_read = pricing_policy::count_read;
+  constexpr unsigned currency_read = pricing_policy::currency_read;
+  constexpr unsigned price_read = pricing_policy::price_read;
+  constexpr unsigned rating_read = pricing_policy::rating_read;
+  constexpr unsigned user_country_read = pricing_policy::user_country_read;
+  constexpr unsigned other_read = pricing_policy::other_read;
+
+  // Expected price for a count, a currency and a reference price, none when the source cannot be tabulated.
+  using reference = std::function<double(unsigned count, uint32_t currency, double price)>;
+
+  struct check
+  {
+    std::string_view name;
+    std::string source;
+    unsigned variables;
+    reference tabulated;
+  };
+
+  const std::vector<check>& checks(){
+    static const std::vector<check> c = {
+      // The examples of pricing_policy.
+      {"reference", "price", price_read, [](unsigned, uint32_t, double p){ return p; }},
+      {"sale", "count < 10 ? price / 2 : price", count_read | price_read, [](unsigned c, uint32_t, double p){ return c < 10 ? p / 2 : p; }},
+      {"overcharge", "count < 10 ? 2 * price : price", count_read | price_read, [](unsigned c, uint32_t, double p){ return c < 10 ? 2 * p : p; }},
+      {"market", "rating < 2 ? price : price * 1.5 * (rating - 2) / 3", rating_read | price_read, nullptr},
+      {"one currency", "currency == 840 ? price * 0.85 : price", currency_read | price_read,
+       [](unsigned, uint32_t cc, double p){ return cc == 840 ? p * 0.85 : p; }},
+      {"currencies",
+       "switch(currency){"
+       "case 124:"
+       "case 840:"
+	 "price * 0.85;"
+	 "break;"
+       "case 978:"
+	 "price * 0.9;"
+	 "break;"
+       "default:"
+	 "price;"
+       "}",
+       currency_read | price_read,
+       [](unsigned, uint32_t cc, double p){ return cc == 124 || cc == 840 ? p * 0.85 : cc == 978 ? p * 0.9 : p; }},
+      {"region", "user_country == 'FR' ? price * 0.9 : price", user_country_read | price_read, nullptr},
+
+      // Sources the analysis must see through.
+      {"comment", "// count\nprice", price_read, [](unsigned, uint32_t, double p){ return p; }},
+      {"string", "'count' ? price : 0", price_read, nullptr},
+      {"pure math", "Math.max(price - count, 0)", count_read | price_read, nullptr},
+      {"count times price", "count * price", count_read | price_read, nullptr},
+      {"square", "price * price", price_read, nullptr},
+
+      // Sources escaping the analysis, which must read other_read.
+      {"random", "Math.random() * price", price_read | other_read, nullptr},
+      {"clock", "Date.now() % 2 ? price : 0", price_read | other_read, nullptr},
+      {"this", "this.price", other_read, nullptr},
+      {"this bracket", "this['pri' + 'ce']", other_read, nullptr},
+      {"eval", "eval('pri' + 'ce')", other_read, nullptr},
+      {"bracket random", "Math['random']() * price", price_read | other_read, nullptr},
+      {"bracket constructor", "price['constructor']['constructor']('return Date.now()')()", price_read | other_read, nullptr},
+      {"constructor", "price.constructor.constructor('return Math.random()')()", price_read | other_read, nullptr},
+      {"template", "`${Date.now()}` ? price : 0", price_read | other_read, nullptr},
+      {"global", "globalThis.price", other_read, nullptr}
+    };
+
+    return c;
+  }
+
+  bool parse(int argc, char** argv, std::string& database){
+    for (int i = 1; i < argc; ++i){
+      std::string_view a = argv[i];
+
+      if (i + 1 == argc || a != "--database"){
+	return false;
+      }
+
+      database = argv[++i];
+    }
+
+    return true;
+  }
+
+  bool close_enough(double x, double y){
+    return std::fabs(x - y) <= 1e-9 * std::max(1.0, std::fabs(y));
+  }
+
+} // End of anonymous namespace.
+
+int main(int argc, char** argv){
+  std::string database = "zambezi_bench";
+
+  if (!parse(argc, argv, database)){
+    std::fprintf(stderr, "usage: policy_analysis_check [--database name]\n");
+    return 2;
+  }
+
+  static const uint32_t currencies[] = {124, 840, 978, 826};
+  static const double prices[] = {0, 3.5, 100};
+  size_t done = 0;
+  size_t failed = 0;
+
+  for (const check& c: checks()){
+    unsigned v = pricing_policy::get_variables(c.source);
+    ++done;
+
+    if (v != c.variables){
+      std::printf("%-20s reads 0x%x, expected 0x%x\n", std::string(c.name).c_str(), v, c.variables);
+      ++failed;
+    }
+  }
+
+  db::connector cn(database);
+  std::vector<currency::code> codes;
+
+  for (uint32_t cc: currencies){
+    codes.push_back(static_cast<currency::code>(cc));
+  }
+
+  for (const check& c: checks()){
+    rfr<pricing_policy> pp = make_rfr<pricing_policy>(c.source);
+    pp->tabulate(codes);
+    bool ok = true;
+
+    for (unsigned count = 1; count <= 25 && ok; ++count){
+      for (uint32_t cc: currencies){
+	for (double p: prices){
+	  std::optional<double> t = pp->get_tabulated_price(count, static_cast<currency::code>(cc), p);
+
+	  if (c.tabulated ? !t || !close_enough(*t, c.tabulated(count, cc, p)) : t.has_value()){
+	    std::printf("%-20s tabulated %s at count %u, currency %u, price %g\n",
+			std::string(c.name).c_str(), t ? std::to_string(*t).c_str() : "nothing", count, cc, p);
+	    ok = false;
+	    break;
+	  }
+	}
+
+	if (!ok){
+	  break;
+	}
+      }
+    }
+
+    ++done;
+    failed += !ok;
+    // Scratch documents.
+    pp->unpublish();
+  }
+
+  std::printf("%zu checks, %zu failed\n", done, failed);
+  return failed ? 1 : 0;
+}
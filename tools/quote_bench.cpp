@@ -0,0 +1,185 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+// Benchmark of the quote cache (see inventory::set_quote_cache_capacity).
+//
+// Inventories sharing one pure pricing policy are created in a scratch database. As many threads as requested then
+// quote them, with the cache off and then on, every thread with its own connector and a spread of requested counts
+// seen again and again, as on a catalog page. The number of quotes per second per core is reported for both runs,
+// with the hits and misses of the cache.
+//
+// The JavaScript contexts themselves are not pooled, the framework owns them (see slot_js). The cache is what the
+// module can do on its side: it skips running the policy for the inputs already seen.
+//
+// Usage:
+//   quote_bench [--inventories 1000] [--quotes 100000] [--counts 20] [--threads 0] [--seed 1] [--database zambezi_bench]
+//
+// The quotes are per thread. No threads means as many as cores. Built with the module and the framework.
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <string_view>
+
+#include "hx2a/root.hpp"
+#include "hx2a/server.hpp"
+
+#include "hx2a/zambezi/ontology.hpp"
+
+using namespace hx2a;
+
+namespace {
+
+  using clock = std::chrono::steady_clock;
+
+  using ::zambezi::product_category;
+  using ::zambezi::product;
+  using ::zambezi::inventoried_product;
+  using ::zambezi::inventory;
+  using ::zambezi::inventory_p;
+  using ::zambezi::pricing_policy;
+
+  // The sale example of pricing_policy, a pure one.
+  constexpr const char* source = "count < 10 ? price / 2 : price";
+
+  // Euro.
+  constexpr currency::code quote_currency = static_cast<currency::code>(978);
+
+  struct options
+  {
+    size_t inventories = 1000;
+    size_t quotes = 100000;
+    unsigned counts = 20;
+    size_t threads = 0;
+    unsigned seed = 1;
+    std::string database = "zambezi_bench";
+  };
+
+  bool parse(int argc, char** argv, options& o){
+    for (int i = 1; i < argc; ++i){
+      std::string_view a = argv[i];
+
+      if (i + 1 == argc){
+	return false;
+      }
+
+      if (a == "--database"){
+	o.database = argv[++i];
+	continue;
+      }
+
+      unsigned long long v = std::strtoull(argv[++i], nullptr, 10);
+
+      if (a == "--inventories") o.inventories = std::max<unsigned long long>(v, 1);
+      else if (a == "--quotes") o.quotes = std::max<unsigned long long>(v, 1);
+      else if (a == "--counts") o.counts = static_cast<unsigned>(std::max<unsigned long long>(v, 1));
+      else if (a == "--threads") o.threads = v;
+      else if (a == "--seed") o.seed = static_cast<unsigned>(v);
+      else return false;
+    }
+
+    return true;
+  }
+
+  struct result
+  {
+    // Per second and per core.
+    double quotes;
+    inventory::quote_cache_statistics cache;
+    // Compared between the runs, and keeps the loops from being optimized away.
+    double checksum = 0;
+  };
+
+  result run(const options& o, size_t threads, const std::vector<doc_id>& ids, size_t capacity){
+    inventory::set_quote_cache_capacity(capacity);
+    inventory::quote_cache_statistics before = inventory::get_quote_cache_statistics();
+    std::vector<double> checksums(threads, 0);
+    std::vector<std::thread> workers;
+    clock::time_point start = clock::now();
+
+    for (size_t t = 0; t != threads; ++t){
+      workers.emplace_back([&, t]{
+	db::connector c(o.database);
+	std::vector<inventory_p> invs;
+	invs.reserve(ids.size());
+
+	for (const doc_id& id: ids){
+	  invs.push_back(inventory::get(id));
+	}
+
+	std::mt19937 random(o.seed + static_cast<unsigned>(t));
+	double sum = 0;
+
+	for (size_t q = 0; q != o.quotes; ++q){
+	  sum += invs[random() % invs.size()]->calculate_price(1 + random() % o.counts, quote_currency, nullptr);
+	}
+
+	checksums[t] = sum;
+      });
+    }
+
+    for (std::thread& w: workers){
+      w.join();
+    }
+
+    double elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    inventory::quote_cache_statistics after = inventory::get_quote_cache_statistics();
+    result r;
+    r.quotes = static_cast<double>(o.quotes) / elapsed;
+    r.cache = {after.hits - before.hits, after.misses - before.misses, after.recycles - before.recycles};
+
+    for (double s: checksums){
+      r.checksum += s;
+    }
+
+    return r;
+  }
+
+} // End of anonymous namespace.
+
+int main(int argc, char** argv){
+  options o;
+
+  if (!parse(argc, argv, o)){
+    std::fprintf(stderr, "usage: quote_bench [--inventories n] [--quotes n] [--counts n] [--threads n] [--seed n] [--database name]\n");
+    return 2;
+  }
+
+  size_t threads = o.threads ? o.threads : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  std::vector<doc_id> ids;
+
+  {
+    db::connector c(o.database);
+    rfr<pricing_policy> pp = make_rfr<pricing_policy>(source);
+    rfr<product_category> cat = make_rfr<product_category>();
+
+    for (size_t i = 0; i != o.inventories; ++i){
+      rfr<inventory> inv = make_rfr<inventory>(make_rfr<inventoried_product>(make_rfr<product>(cat)), quote_currency, 10.0 + static_cast<double>(i % 100));
+      inv->set_pricing_policy(pp);
+      ids.push_back(inv->get_id());
+    }
+  }
+
+  result off = run(o, threads, ids, 0);
+  // Room for all the distinct inputs, nothing is recycled.
+  result on = run(o, threads, ids, o.inventories * o.counts);
+
+  if (off.checksum != on.checksum){
+    std::printf("the runs disagree\n");
+    return 1;
+  }
+
+  std::printf("%zu inventories, %u counts, %zu threads\n", o.inventories, o.counts, threads);
+  std::printf("%-6s %18s %12s %12s\n", "cache", "quotes/s/core", "hits", "misses");
+  std::printf("%-6s %18.0f %12llu %12llu\n", "off", off.quotes, (unsigned long long)off.cache.hits, (unsigned long long)off.cache.misses);
+  std::printf("%-6s %18.0f %12llu %12llu\n", "on", on.quotes, (unsigned long long)on.cache.hits, (unsigned long long)on.cache.misses);
+  std::printf("speedup %.1fx\n", on.quotes / off.quotes);
+  return 0;
+}
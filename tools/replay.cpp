@@ -0,0 +1,737 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+// Traffic replay and load generation against the services of the module.
+//
+// Replays a recorded request log, or runs a seed scenario, against a web server hosting the module, and reports
+// the throughput and the latency percentiles per service.
+//
+// The log has one JSON object per line: {"service": "...", "payload": {...}, "session": "..."}. The payload is sent
+// as the body of a POST to the prefix followed by the service name, and the session, if any, as the Cookie header.
+//
+// Seed scenarios, run by every virtual user in a loop:
+// - categories: creates a root category and a sub-category.
+// - products: creates a category and five products in it.
+// - pricing: creates a pricing policy, gets it, updates it and removes it.
+// - cart: gets the cart summary of the user of the session, which has to be given and to have a cart with lines.
+//   Run against a server with the pool of the asynchronous services (see async_service.hpp) sized to 0, then to
+//   its usual size, it compares the synchronous path with the overlapped one.
+// Identifiers are taken from the "id" member of the replies.
+//
+// Usage:
+//   replay [--host 127.0.0.1] [--port 8080] [--prefix /] (--log file | --scenario name)
+//          [--concurrency 8] [--rate 0] [--ramp 0] [--duration 30] [--requests 0] [--session cookie]...
+//
+// The rate is in requests per second for all the virtual users together, 0 for as fast as possible. It is reached
+// linearly over the ramp, in seconds. The run stops after the duration, in seconds, or after the given number of
+// requests, whichever comes first. A log is replayed in a loop.
+//
+// Failed requests are counted per service, apart from the latencies and the rates, which are those of the
+// successful ones. A virtual user which cannot connect waits before trying again, up to a second.
+//
+// The session can be given several times, the virtual users then take them in turn. With sessions of users of
+// different organizations, the load is spread over the tenants, and over their databases when the server
+// partitions them (see partitions.hpp). A log line carrying its own session keeps it.
+//
+// Pointing it at a server configured with in-memory databases keeps runs independent from each other.
+
+#include <map>
+#include <mutex>
+#include <cmath>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <algorithm>
+#include <functional>
+#include <string_view>
+
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+namespace {
+
+  using clock = std::chrono::steady_clock;
+
+  struct options
+  {
+    std::string host = "127.0.0.1";
+    std::string port = "8080";
+    std::string prefix = "/";
+    std::string log;
+    std::string scenario;
+    std::vector<std::string> sessions;
+    size_t concurrency = 8;
+    double rate = 0;
+    double ramp = 0;
+    double duration = 30;
+    uint64_t requests = 0;
+  };
+
+  // Minimal JSON scanning, enough to pick members out of log lines and replies.
+
+  // Skips a value starting at i, returns the index past it.
+  size_t skip_value(std::string_view s, size_t i){
+    if (i >= s.size()){
+      return i;
+    }
+
+    if (s[i] == '"'){
+      for (++i; i < s.size() && s[i] != '"'; ++i){
+	if (s[i] == '\\'){
+	  ++i;
+	}
+      }
+
+      return i + 1;
+    }
+
+    if (s[i] == '{' || s[i] == '['){
+      size_t depth = 0;
+
+      for (; i < s.size(); ++i){
+	if (s[i] == '"'){
+	  i = skip_value(s, i) - 1;
+	}
+	else if (s[i] == '{' || s[i] == '['){
+	  ++depth;
+	}
+	else if ((s[i] == '}' || s[i] == ']') && !--depth){
+	  return i + 1;
+	}
+      }
+
+      return i;
+    }
+
+    while (i < s.size() && s[i] != ',' && s[i] != '}' && s[i] != ']'){
+      ++i;
+    }
+
+    return i;
+  }
+
+  size_t skip_blanks(std::string_view s, size_t i){
+    while (i < s.size() && std::strchr(" \t\r\n", s[i])){
+      ++i;
+    }
+
+    return i;
+  }
+
+  // The raw text of a member of the top-level object.
+  std::optional<std::string_view> member(std::string_view s, std::string_view name){
+    size_t i = skip_blanks(s, 0);
+
+    if (i >= s.size() || s[i] != '{'){
+      return {};
+    }
+
+    ++i;
+
+    for (;;){
+      i = skip_blanks(s, i);
+
+      if (i >= s.size() || s[i] != '"'){
+	return {};
+      }
+
+      size_t e = skip_value(s, i);
+      std::string_view key = s.substr(i + 1, e - i - 2);
+      i = skip_blanks(s, e);
+
+      if (i >= s.size() || s[i] != ':'){
+	return {};
+      }
+
+      i = skip_blanks(s, i + 1);
+      e = skip_value(s, i);
+
+      if (key == name){
+	return s.substr(i, e - i);
+      }
+
+      i = skip_blanks(s, e);
+
+      if (i >= s.size() || s[i] != ','){
+	return {};
+      }
+
+      ++i;
+    }
+  }
+
+  std::string unquote(std::string_view v){
+    std::string r;
+
+    if (v.size() < 2 || v.front() != '"'){
+      return std::string(v);
+    }
+
+    for (size_t i = 1; i + 1 < v.size(); ++i){
+      if (v[i] == '\\' && i + 2 < v.size()){
+	++i;
+      }
+
+      r += v[i];
+    }
+
+    return r;
+  }
+
+  std::string quote(std::string_view v){
+    std::string r = "\"";
+
+    for (char c: v){
+      if (c == '"' || c == '\\'){
+	r += '\\';
+      }
+
+      r += c;
+    }
+
+    return r + '"';
+  }
+
+  // HTTP/1.1 client on a keep-alive connection, reconnecting when needed.
+  class client
+  {
+  public:
+
+    client(const options& o):
+      _o(o)
+    {
+    }
+
+    ~client(){ disconnect(); }
+
+    struct response
+    {
+      int status = 0;
+      std::string body;
+    };
+
+    // Status 0 on a connection error.
+    response post(std::string_view service, std::string_view body, std::string_view session){
+      std::string request = "POST " + _o.prefix + std::string(service) + " HTTP/1.1\r\nHost: " + _o.host + "\r\n"
+	"Content-Type: application/json\r\nContent-Length: " + std::to_string(body.size()) + "\r\n";
+
+      if (!session.empty()){
+	request += "Cookie: " + std::string(session) + "\r\n";
+      }
+
+      request += "\r\n";
+      request += body;
+
+      // A kept-alive connection closed by the server is only noticed when used, it is retried once.
+      for (int attempt = 0; attempt != 2; ++attempt){
+	if (_fd < 0 && !connect()){
+	  return {};
+	}
+
+	response r;
+
+	if (send(request) && receive(r)){
+	  return r;
+	}
+
+	disconnect();
+      }
+
+      return {};
+    }
+
+  private:
+
+    bool connect(){
+      addrinfo hints{};
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      addrinfo* ai = nullptr;
+
+      if (::getaddrinfo(_o.host.c_str(), _o.port.c_str(), &hints, &ai)){
+	return false;
+      }
+
+      for (addrinfo* a = ai; a; a = a->ai_next){
+	_fd = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+
+	if (_fd >= 0 && !::connect(_fd, a->ai_addr, a->ai_addrlen)){
+	  int one = 1;
+	  ::setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	  break;
+	}
+
+	disconnect();
+      }
+
+      ::freeaddrinfo(ai);
+      _buffer.clear();
+      return _fd >= 0;
+    }
+
+    void disconnect(){
+      if (_fd >= 0){
+	::close(_fd);
+	_fd = -1;
+      }
+    }
+
+    bool send(std::string_view data){
+      while (!data.empty()){
+	ssize_t n = ::send(_fd, data.data(), data.size(), MSG_NOSIGNAL);
+
+	if (n <= 0){
+	  return false;
+	}
+
+	data.remove_prefix(n);
+      }
+
+      return true;
+    }
+
+    // Reads more data into the buffer.
+    bool fill(){
+      char b[16384];
+      ssize_t n = ::recv(_fd, b, sizeof(b), 0);
+
+      if (n <= 0){
+	return false;
+      }
+
+      _buffer.append(b, n);
+      return true;
+    }
+
+    // Everything up to the delimiter, which is consumed.
+    bool read_until(std::string_view delimiter, std::string& out){
+      size_t p;
+
+      while ((p = _buffer.find(delimiter)) == std::string::npos){
+	if (!fill()){
+	  return false;
+	}
+      }
+
+      out = _buffer.substr(0, p);
+      _buffer.erase(0, p + delimiter.size());
+      return true;
+    }
+
+    bool read_bytes(size_t n, std::string& out){
+      while (_buffer.size() < n){
+	if (!fill()){
+	  return false;
+	}
+      }
+
+      out.append(_buffer, 0, n);
+      _buffer.erase(0, n);
+      return true;
+    }
+
+    bool receive(response& r){
+      std::string head;
+
+      if (!read_until("\r\n\r\n", head)){
+	return false;
+      }
+
+      if (head.size() < 12 || head.compare(0, 5, "HTTP/")){
+	return false;
+      }
+
+      r.status = std::atoi(head.c_str() + 9);
+      std::string lower = head;
+      std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c){ return std::tolower(c); });
+      bool close = lower.find("\r\nconnection: close") != std::string::npos;
+
+      if (lower.find("\r\ntransfer-encoding: chunked") != std::string::npos){
+	for (;;){
+	  std::string size;
+
+	  if (!read_until("\r\n", size)){
+	    return false;
+	  }
+
+	  size_t n = std::strtoul(size.c_str(), nullptr, 16);
+	  std::string crlf;
+
+	  if (!n){
+	    // Trailers are not expected.
+	    return read_until("\r\n", crlf);
+	  }
+
+	  if (!read_bytes(n, r.body) || !read_until("\r\n", crlf)){
+	    return false;
+	  }
+	}
+      }
+
+      size_t cl = lower.find("\r\ncontent-length:");
+
+      if (cl != std::string::npos){
+	if (!read_bytes(std::strtoul(lower.c_str() + cl + 17, nullptr, 10), r.body)){
+	  return false;
+	}
+      }
+      else if (r.status != 204 && r.status != 304){
+	// Delimited by the end of the connection.
+	while (fill()){
+	}
+
+	r.body = std::move(_buffer);
+	_buffer.clear();
+	close = true;
+      }
+
+      if (close){
+	disconnect();
+      }
+
+      return true;
+    }
+
+    const options& _o;
+    int _fd = -1;
+    std::string _buffer;
+  };
+
+  // Latencies per service, one recorder per virtual user, merged at the end. Failed requests are only counted,
+  // their latencies, those of an error answered early or of a connection refused, would skew the percentiles.
+  struct recorder
+  {
+    struct series
+    {
+      std::vector<double> latencies;
+      uint64_t errors = 0;
+    };
+
+    void add(const std::string& service, double seconds, bool ok){
+      series& s = per_service[service];
+
+      if (ok){
+	s.latencies.push_back(seconds);
+      }
+      else{
+	++s.errors;
+      }
+    }
+
+    void merge(recorder& r){
+      for (auto& [name, s]: r.per_service){
+	series& m = per_service[name];
+	m.latencies.insert(m.latencies.end(), s.latencies.begin(), s.latencies.end());
+	m.errors += s.errors;
+      }
+    }
+
+    std::map<std::string, series> per_service;
+  };
+
+  // Spreads the requests of all the virtual users over time, following the rate and the ramp.
+  class pacer
+  {
+  public:
+
+    pacer(const options& o):
+      _o(o),
+      _start(clock::now())
+    {
+    }
+
+    // False when the run is over. Otherwise waits for the time slot of the next request.
+    bool next(){
+      uint64_t i = _issued.fetch_add(1);
+
+      if (_o.requests && i >= _o.requests){
+	return false;
+      }
+
+      if (_o.rate > 0){
+	// Request i is due when the integral of the rate reaches i: quadratic over the ramp, linear afterwards.
+	double ramp_requests = _o.rate * _o.ramp / 2;
+	double t = i < ramp_requests ? std::sqrt(2 * _o.ramp * i / _o.rate) : _o.ramp + (i - ramp_requests) / _o.rate;
+	std::this_thread::sleep_until(_start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(t)));
+      }
+
+      return elapsed() < _o.duration;
+    }
+
+    double elapsed() const { return std::chrono::duration<double>(clock::now() - _start).count(); }
+
+  private:
+    const options& _o;
+    clock::time_point _start;
+    std::atomic<uint64_t> _issued{0};
+  };
+
+  struct request
+  {
+    std::string service;
+    std::string payload;
+    std::string session;
+  };
+
+  // A virtual user: a client, its recorder, and the shared pacer.
+  class user
+  {
+  public:
+
+    user(const options& o, pacer& p, std::string session):
+      _client(o),
+      _pacer(p),
+      _session(std::move(session))
+    {
+    }
+
+    // The reply body, or nothing when the run is over or the request failed.
+    std::optional<std::string> call(const std::string& service, const std::string& payload, const std::string& session = {}){
+      if (!_pacer.next()){
+	_over = true;
+	return {};
+      }
+
+      clock::time_point start = clock::now();
+      client::response r = _client.post(service, payload, session.empty() ? _session : session);
+      bool ok = r.status >= 200 && r.status < 400;
+      stats.add(service, std::chrono::duration<double>(clock::now() - start).count(), ok);
+
+      // The server is down or refusing connections: waiting longer and longer, instead of spinning on it.
+      if (!r.status){
+	std::this_thread::sleep_for(_backoff);
+	_backoff = std::min(_backoff * 2, max_backoff);
+      }
+      else{
+	_backoff = min_backoff;
+      }
+
+      if (!ok){
+	return {};
+      }
+
+      return std::move(r.body);
+    }
+
+    bool over() const { return _over; }
+
+    recorder stats;
+
+  private:
+    static constexpr std::chrono::milliseconds min_backoff{10};
+    static constexpr std::chrono::milliseconds max_backoff{1000};
+
+    client _client;
+    pacer& _pacer;
+    std::string _session;
+    std::chrono::milliseconds _backoff = min_backoff;
+    bool _over = false;
+  };
+
+  std::string id_of(const std::optional<std::string>& reply){
+    if (!reply){
+      return {};
+    }
+
+    std::optional<std::string_view> id = member(*reply, "id");
+    return id ? unquote(*id) : std::string();
+  }
+
+  std::string id_payload(const std::string& id){
+    return id.empty() ? "{}" : "{\"id\":" + quote(id) + "}";
+  }
+
+  using scenario = std::function<void(user&)>;
+
+  std::map<std::string, scenario> scenarios(){
+    return {
+      {"categories", [](user& u){
+	std::string root = id_of(u.call("product_category_create", "{}"));
+
+	if (!root.empty()){
+	  u.call("product_category_create", id_payload(root));
+	}
+      }},
+      {"products", [](user& u){
+	std::string category = id_of(u.call("product_category_create", "{}"));
+
+	for (int i = 0; i != 5 && !category.empty(); ++i){
+	  u.call("product_create", id_payload(category));
+	}
+      }},
+      {"pricing", [](user& u){
+	static const std::string source = "switch (currency){ case 978: price * 0.9; break; default: price; }";
+	std::string id = id_of(u.call("pricing_policy_create", "{\"source\":" + quote(source) + "}"));
+
+	if (id.empty()){
+	  return;
+	}
+
+	u.call("pricing_policy_get", id_payload(id));
+	u.call("pricing_policy_update", "{\"id\":" + quote(id) + ",\"source\":" + quote(source + " ") + "}");
+	u.call("pricing_policy_remove", id_payload(id));
+      }},
+      {"cart", [](user& u){
+	u.call("cart_summary", "{}");
+      }}
+    };
+  }
+
+  std::vector<request> load_log(const std::string& path){
+    std::vector<request> r;
+    std::ifstream in(path);
+    std::string line;
+
+    while (std::getline(in, line)){
+      std::optional<std::string_view> service = member(line, "service");
+
+      if (!service){
+	continue;
+      }
+
+      std::optional<std::string_view> payload = member(line, "payload");
+      std::optional<std::string_view> session = member(line, "session");
+      r.push_back(request{unquote(*service), payload ? std::string(*payload) : "{}", session ? unquote(*session) : std::string()});
+    }
+
+    return r;
+  }
+
+  double percentile(const std::vector<double>& sorted, double p){
+    if (sorted.empty()){
+      return 0;
+    }
+
+    size_t i = static_cast<size_t>(std::ceil(p * sorted.size()));
+    return sorted[std::min(i ? i - 1 : 0, sorted.size() - 1)];
+  }
+
+  void report(recorder& all, double seconds){
+    std::printf("%-28s %10s %8s %10s %10s %10s %10s\n", "service", "requests", "errors", "req/s", "p50 ms", "p99 ms", "p999 ms");
+    uint64_t total = 0;
+
+    uint64_t errors = 0;
+
+    // The rates and the percentiles are those of the successful requests.
+    for (auto& [name, s]: all.per_service){
+      std::sort(s.latencies.begin(), s.latencies.end());
+      total += s.latencies.size();
+      errors += s.errors;
+      std::printf("%-28s %10llu %8llu %10.1f %10.3f %10.3f %10.3f\n", name.c_str(), static_cast<unsigned long long>(s.latencies.size() + s.errors), static_cast<unsigned long long>(s.errors),
+		  s.latencies.size() / seconds, percentile(s.latencies, 0.5) * 1e3, percentile(s.latencies, 0.99) * 1e3, percentile(s.latencies, 0.999) * 1e3);
+    }
+
+    std::printf("%llu requests in %.1f s, %.1f req/s, %llu errors\n", static_cast<unsigned long long>(total), seconds, total / seconds, static_cast<unsigned long long>(errors));
+  }
+
+  bool parse(int argc, char** argv, options& o){
+    for (int i = 1; i < argc; ++i){
+      std::string_view a = argv[i];
+
+      if (i + 1 == argc){
+	return false;
+      }
+
+      std::string v = argv[++i];
+
+      if (a == "--host") o.host = v;
+      else if (a == "--port") o.port = v;
+      else if (a == "--prefix") o.prefix = v;
+      else if (a == "--log") o.log = v;
+      else if (a == "--scenario") o.scenario = v;
+      else if (a == "--session") o.sessions.push_back(v);
+      else if (a == "--concurrency") o.concurrency = std::max<size_t>(std::strtoul(v.c_str(), nullptr, 10), 1);
+      else if (a == "--rate") o.rate = std::atof(v.c_str());
+      else if (a == "--ramp") o.ramp = std::atof(v.c_str());
+      else if (a == "--duration") o.duration = std::atof(v.c_str());
+      else if (a == "--requests") o.requests = std::strtoull(v.c_str(), nullptr, 10);
+      else return false;
+    }
+
+    return o.log.empty() != o.scenario.empty();
+  }
+
+} // End of anonymous namespace.
+
+int main(int argc, char** argv){
+  options o;
+
+  if (!parse(argc, argv, o)){
+    std::cerr << "usage: replay [--host h] [--port p] [--prefix /] (--log file | --scenario categories|products|pricing|cart) "
+      "[--concurrency n] [--rate r] [--ramp s] [--duration s] [--requests n] [--session cookie]...\n";
+    return 2;
+  }
+
+  std::vector<request> log;
+  scenario run;
+
+  if (!o.log.empty()){
+    log = load_log(o.log);
+
+    if (log.empty()){
+      std::cerr << "no request in " << o.log << '\n';
+      return 1;
+    }
+  }
+  else{
+    auto all = scenarios();
+    auto i = all.find(o.scenario);
+
+    if (i == all.end()){
+      std::cerr << "unknown scenario " << o.scenario << '\n';
+      return 2;
+    }
+
+    run = i->second;
+  }
+
+  pacer p(o);
+  std::atomic<size_t> next_line{0};
+  std::vector<std::unique_ptr<user>> users;
+  std::vector<std::thread> threads;
+
+  for (size_t i = 0; i != o.concurrency; ++i){
+    users.push_back(std::make_unique<user>(o, p, o.sessions.empty() ? std::string() : o.sessions[i % o.sessions.size()]));
+  }
+
+  for (auto& u: users){
+    threads.emplace_back([&, u = u.get()]{
+      while (!u->over()){
+	if (run){
+	  run(*u);
+	}
+	else{
+	  const request& r = log[next_line.fetch_add(1) % log.size()];
+	  u->call(r.service, r.payload, r.session);
+	}
+      }
+    });
+  }
+
+  for (std::thread& t: threads){
+    t.join();
+  }
+
+  double seconds = std::max(p.elapsed(), 1e-9);
+  recorder all;
+
+  for (auto& u: users){
+    all.merge(u->stats);
+  }
+
+  report(all, seconds);
+  return 0;
+}
@@ -0,0 +1,285 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <tuple>
+#include <fstream>
+#include <exception>
+#include <filesystem>
+
+#include "hx2a/zambezi/trace.hpp"
+#include "hx2a/zambezi/json_stream.hpp"
+
+namespace zambezi::trace {
+
+  using clock = std::chrono::steady_clock;
+
+  struct event
+  {
+    const char* category;
+    std::string type;
+    std::string field;
+    std::string id;
+    std::source_location where;
+    clock::time_point begin;
+    clock::time_point end;
+    // Index of the enclosing event, -1 for the request itself.
+    int64_t parent;
+    bool repeated = false;
+  };
+
+  struct state
+  {
+    std::string service;
+    std::string id;
+    std::string file;
+    clock::time_point begin;
+    std::vector<event> events;
+    // Events not ended yet, innermost last.
+    std::vector<int64_t> open;
+    uint64_t dropped = 0;
+  };
+
+  namespace {
+
+    settings& current_settings(){
+      static settings s;
+      return s;
+    }
+
+    thread_local state* current = nullptr;
+
+    std::atomic<uint64_t> traces{0};
+
+    // Traces written in the current window.
+    std::mutex window_mutex;
+    clock::time_point window_begin;
+    size_t window_traces = 0;
+
+    bool within_cap(){
+      const settings& s = current_settings();
+      std::lock_guard l(window_mutex);
+      clock::time_point now = clock::now();
+
+      if (now - window_begin >= s.window){
+	window_begin = now;
+	window_traces = 0;
+      }
+
+      if (window_traces >= s.max_traces){
+	return false;
+      }
+
+      ++window_traces;
+      return true;
+    }
+
+    bool sampled(){
+      double rate = current_settings().sample_rate;
+
+      if (rate <= 0){
+	return false;
+      }
+
+      thread_local std::minstd_rand random(std::random_device{}());
+      return std::uniform_real_distribution<double>(0, 1)(random) < rate;
+    }
+
+    std::string site(const std::source_location& where){
+      std::string r = where.file_name();
+      r += ':';
+      r += std::to_string(where.line());
+      r += ' ';
+      r += where.function_name();
+      return r;
+    }
+
+    std::string name(const event& e){
+      std::string r = e.type;
+
+      if (!e.field.empty()){
+	r += '.';
+	r += e.field;
+      }
+
+      return r;
+    }
+
+    uint64_t microseconds(clock::time_point origin, clock::time_point t){
+      return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(t - origin).count());
+    }
+
+    void write(state& s){
+      clock::time_point end = clock::now();
+
+      // Repeated loads of a type from a call site under one parent.
+      using group = std::tuple<int64_t, std::string, uint32_t, std::string>;
+      std::map<group, std::vector<size_t>> groups;
+
+      for (size_t i = 0; i != s.events.size(); ++i){
+	const event& e = s.events[i];
+
+	if (std::string_view(e.category) == "load"){
+	  groups[group{e.parent, e.where.file_name(), e.where.line(), e.type}].push_back(i);
+	}
+      }
+
+      std::string text;
+      json_stream out([&text](std::string_view v){ text += v; });
+      out.begin_object().key("traceEvents").begin_array();
+
+      out.begin_object()
+	.key("name").value("process_name")
+	.key("ph").value("M")
+	.key("pid").value(uint64_t(1))
+	.key("args").begin_object().key("name").value(std::string_view(s.service)).end_object()
+	.end_object();
+
+      out.begin_object()
+	.key("name").value(std::string_view(s.service))
+	.key("cat").value("request")
+	.key("ph").value("X")
+	.key("ts").value(uint64_t(0))
+	.key("dur").value(microseconds(s.begin, end))
+	.key("pid").value(uint64_t(1))
+	.key("tid").value(uint64_t(1))
+	.key("args").begin_object().key("dropped").value(s.dropped).end_object()
+	.end_object();
+
+      for (const auto& [g, members]: groups){
+	if (members.size() < current_settings().repeat_threshold){
+	  continue;
+	}
+
+	for (size_t i: members){
+	  s.events[i].repeated = true;
+	}
+
+	const event& first = s.events[members.front()];
+	int64_t parent = std::get<0>(g);
+	std::string summary = "N+1: " + std::to_string(members.size()) + " loads of " + first.type;
+
+	out.begin_object()
+	  .key("name").value(std::string_view(summary))
+	  .key("cat").value("n+1")
+	  .key("ph").value("i")
+	  .key("s").value("t")
+	  .key("ts").value(microseconds(s.begin, first.begin))
+	  .key("pid").value(uint64_t(1))
+	  .key("tid").value(uint64_t(1))
+	  .key("args").begin_object()
+	  .key("site").value(std::string_view(site(first.where)))
+	  .key("under").value(std::string_view(parent < 0 ? s.service : name(s.events[parent])))
+	  .end_object()
+	  .end_object();
+      }
+
+      for (const event& e: s.events){
+	out.begin_object()
+	  .key("name").value(std::string_view(name(e)))
+	  .key("cat").value(e.category)
+	  .key("ph").value("X")
+	  .key("ts").value(microseconds(s.begin, e.begin))
+	  .key("dur").value(microseconds(e.begin, e.end))
+	  .key("pid").value(uint64_t(1))
+	  .key("tid").value(uint64_t(1))
+	  .key("args").begin_object()
+	  .key("site").value(std::string_view(site(e.where)))
+	  .key("id").value(std::string_view(e.id))
+	  .key("repeated").value(e.repeated)
+	  .end_object()
+	  .end_object();
+      }
+
+      out.end_array().key("displayTimeUnit").value("ms").end_object();
+      out.flush();
+
+      std::error_code ec;
+      std::filesystem::create_directories(current_settings().directory, ec);
+      std::ofstream(s.file) << text;
+    }
+
+  }
+
+  void configure(const settings& s){
+    current_settings() = s;
+  }
+
+  request::request(std::string_view service, bool forced){
+    if (!(forced && current_settings().allow_header) && !sampled()){
+      return;
+    }
+
+    if (!within_cap()){
+      return;
+    }
+
+    _state = std::make_unique<state>();
+    _state->service = service;
+    _state->id = std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count()) + '-' +
+      std::to_string(traces.fetch_add(1));
+    _state->file = current_settings().directory + '/' + std::string(service) + '-' + _state->id + ".json";
+    _state->begin = clock::now();
+    _previous = current;
+    current = _state.get();
+  }
+
+  request::~request(){
+    if (!_state){
+      return;
+    }
+
+    current = _previous;
+
+    try{
+      write(*_state);
+    }
+    catch (const std::exception&){
+      // A trace is not worth failing the request.
+    }
+  }
+
+  const std::string& request::id() const {
+    return _state->id;
+  }
+
+  span::span(const char* category, std::string_view type, std::string_view field, std::source_location where):
+    _state(current)
+  {
+    if (!_state){
+      return;
+    }
+
+    if (_state->events.size() >= current_settings().max_events){
+      ++_state->dropped;
+      _state = nullptr;
+      return;
+    }
+
+    _event = _state->events.size();
+    int64_t parent = _state->open.empty() ? -1 : _state->open.back();
+    _state->events.push_back(event{category, std::string(type), std::string(field), {}, where, clock::now(), {}, parent});
+    _state->open.push_back(static_cast<int64_t>(_event));
+  }
+
+  span::~span(){
+    if (!_state){
+      return;
+    }
+
+    _state->events[_event].end = clock::now();
+    _state->open.pop_back();
+  }
+
+  void span::set_id(const doc_id& id){
+    if (_state){
+      _state->events[_event].id = id.to_string();
+    }
+  }
+
+} // End namespace zambezi::trace.
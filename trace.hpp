@@ -0,0 +1,171 @@
+//
+// Copyright Metaspex - 2022
+// mailto:admin@metaspex.com
+//
+
+#ifndef HX2A_ZAMBEZI_TRACE_HPP
+#define HX2A_ZAMBEZI_TRACE_HPP
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <source_location>
+
+#include "hx2a/server.hpp"
+
+#include "hx2a/zambezi/partitions.hpp"
+
+using namespace hx2a;
+
+namespace zambezi::trace {
+
+  // Document access tracing, to find out which loads a slow service does, and from where.
+  //
+  // A traced request records every document load, index read, link or list walk and save done through the
+  // functions below, with its call site, the link field involved, the document identifier and the timing. When the
+  // request ends the trace is written as a Chrome trace-event JSON file (to be opened with chrome://tracing or
+  // Perfetto), where accesses nest under the ones which caused them. Loads of the same document type from the
+  // same call site under the same parent, repeated at least repeat_threshold times, are the signature of a load
+  // in a loop (N+1). They are flagged, and summarized by an instant event.
+  //
+  // A request is traced when it is sampled, or when it carries the X-Zambezi-Trace: 1 header and the settings
+  // allow it, which they do not by default: any client can send the header. The reply then carries the identifier
+  // of the trace in the same header, the trace file being named after the service and the identifier in the
+  // directory of the settings. At most max_traces traces are written per window, the requests asking for more, or
+  // sampled beyond, are not traced. Outside of a traced request, the functions below cost a thread-local read.
+  // Tracing follows the thread of the request, work offloaded to other threads is not traced.
+  //
+  // Only the accesses done through the functions below, or inside a span, are recorded. Links dereferenced
+  // directly, and the lists walked through their iterators (own_list, weak_link_list, for instance the items of the
+  // cart lines), load documents the framework gives no hook for. Such walks are to be put inside a span of category
+  // "walk", which then holds their time, without the documents they load.
+  struct settings
+  {
+    // Fraction of the requests traced without being asked.
+    double sample_rate = 0;
+    // Whether the requests can ask for a trace with the header.
+    bool allow_header = false;
+    size_t max_traces = 60;
+    std::chrono::seconds window{60};
+    std::string directory = "zambezi_traces";
+    size_t repeat_threshold = 10;
+    // Accesses recorded per request, the following ones are counted only.
+    size_t max_events = 100000;
+  };
+
+  // To be called before the first request.
+  void configure(const settings& s);
+
+  struct state;
+
+  // Traces the service request of the calling thread, if asked or sampled, until its destruction. To be declared
+  // first in the service, before the connector.
+  class request
+  {
+  public:
+
+    template <typename HttpRequest>
+    request(HttpRequest& req, std::string_view service):
+      request(service, req.get_header("X-Zambezi-Trace") == "1")
+    {
+      if (_state){
+	req.set_header("X-Zambezi-Trace", id());
+      }
+    }
+
+    request(const request&) = delete;
+    request& operator=(const request&) = delete;
+
+    ~request();
+
+  private:
+
+    request(std::string_view service, bool forced);
+
+    const std::string& id() const;
+
+    std::unique_ptr<state> _state;
+    state* _previous = nullptr;
+  };
+
+  // Records an access for its lifetime. Category is one of "load", "index", "walk" or "save". Type is the
+  // document type, field the link or list followed, if any.
+  class span
+  {
+  public:
+
+    span(const char* category, std::string_view type, std::string_view field = {}, std::source_location where = std::source_location::current());
+
+    span(const span&) = delete;
+    span& operator=(const span&) = delete;
+
+    ~span();
+
+    // The identifier of the document accessed, when known.
+    void set_id(const doc_id& id);
+
+  private:
+    state* _state;
+    size_t _event;
+  };
+
+  // Readable name of a type, for the traces.
+  template <typename T>
+  std::string_view type_name(){
+    std::string_view f = std::source_location::current().function_name();
+
+    static const std::string name = [f]{
+      size_t b = f.find("T = ");
+
+      if (b == std::string_view::npos){
+	return std::string(f);
+      }
+
+      b += 4;
+      return std::string(f.substr(b, f.find_first_of(";]", b) - b));
+    }();
+
+    return name;
+  }
+
+  // Loads a document, recording it.
+  template <typename T>
+  ptr<T> get(const doc_id& id, std::string_view field = {}, std::source_location where = std::source_location::current()){
+    span s("load", type_name<T>(), field, where);
+    s.set_id(id);
+    return T::get(id);
+  }
+
+  // Connector recording the save of the documents changed, done when it is destroyed.
+  class connector
+  {
+  public:
+
+    // The database name, or the tenant whose database is opened (see partitions.hpp).
+    template <typename Database>
+    explicit connector(const Database& database, std::source_location where = std::source_location::current()):
+      _where(where)
+    {
+      _connector.emplace(database);
+    }
+
+    connector(const connector&) = delete;
+    connector& operator=(const connector&) = delete;
+
+    ~connector(){
+      span s("save", "connector", {}, _where);
+      _connector.reset();
+    }
+
+  private:
+    std::source_location _where;
+    std::optional<partitions::connector> _connector;
+  };
+
+} // End namespace zambezi::trace.
+
+#endif